@@ -0,0 +1,2968 @@
+/*
+ * fhemu, a cycle-counting 6502/65816 test harness for the LZ4FH code.
+ * Version 1.0, October 2026
+ *
+ * Copyright 2026 by the fhpack contributors.
+ * See the LICENSE.txt file for distribution terms (Apache 2.0).
+ *
+ * Under Linux, you can build it with just:
+ *   g++ -O2 fhemu.cpp -o fhemu
+ */
+
+/*
+This assembles one of the Merlin source files in this directory, loads
+the result into an emulated Apple II memory map, and runs it against a
+set of files, reporting how many CPU cycles each run took.  It's meant
+for validating changes to the 6502 code and for measuring them, not for
+running Apple II software in general, so there's no I/O, no ROM, and no
+interrupts.  Jumping anywhere in the $F800-$FFFF range (e.g. the "bell"
+and "monitor" calls in the failure path) halts the run with an error.
+
+The assembler understands the subset of Merlin syntax used by the LZ4FH
+sources: global and ":local" labels, EQU/=, ORG, DO/ELSE/FIN conditional
+assembly, DFB/DA/DS/HEX/ASC data, and expressions evaluated strictly left
+to right (Merlin has no operator precedence).  An operand of the form
+$0000 (four hex digits) forces absolute addressing even if the value fits
+in the zero page, and $000000 (or an "L" suffix on the mnemonic, as in
+LDAL) forces long addressing.  XC selects the CPU and MX the width of
+immediate operands.  LST, SAV, DSK and TYP are accepted and ignored.
+
+Cycle counts follow the NMOS 6502 datasheet, including the extra cycle
+for indexed reads that cross a page boundary and for taken branches.
+With "-c" the 65C02 opcodes are also available, and the handful of
+instructions whose timing changed on the CMOS part use the new values.
+Sources that use XC twice run on a 65816, which has its own core with
+16-bit registers, a 16MB address space, and the native-mode timing.
+
+Decoders are run with the compressed data at $6000 and the output at
+$2000, passing the addresses through $02FC/$02FE as usual.  Encoders
+are run with the uncompressed data at $2000 and the output at $6000,
+with the input length in $02FA; the encoder leaves the output length
+in $02FA when it returns.  On the 65816, "-b" puts the compressed data
+and the output in other banks, passing them in $02FA/$02FB, and "-o"
+moves the output to another address.
+
+Streaming decoders ("-s") get their input from a simple floppy model
+instead: $02F8 points at a trap address that reads the next sector of
+the file into the buffer at $6000, charging the cycles a real disk would
+take to bring it around.  Each file is also run with the data loaded up
+front, and the report compares that plus the time to read every sector
+back to back against the streamed run.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <string>
+#include <vector>
+#include <map>
+
+enum ProgramMode {
+    MODE_UNKNOWN, MODE_ASSEMBLE, MODE_DECODE, MODE_ENCODE, MODE_STREAM
+};
+
+enum CpuType {
+    CPU_6502, CPU_65C02, CPU_65816
+};
+
+#define MEM_SIZE            65536
+#define CLOCK_HZ            1020484         // NTSC Apple II, long-term average
+#define MAX_CYCLES          200000000ULL    // ~3 minutes of 6502 time
+
+#define PARAM_MORE          0x02f8          // streaming decoder's loader
+#define PARAM_LEN           0x02fa
+#define PARAM_BANKS         0x02fa          // 65816 decoder: src, dst banks
+#define PARAM_SRC           0x02fc
+#define PARAM_DST           0x02fe
+#define HIRES_ADDR          0x2000
+#define DATA_ADDR           0x6000
+#define MAX_DATA_LEN        (0x9600 - DATA_ADDR)    // stay below DOS/ProDOS
+#define MAX_ENC_OUT         (0x2000 + 100)  // worst-case LZ4FH expansion
+#define HALT_ADDR           0xfff0          // RTS from the routine lands here
+#define ROM_ADDR            0xf800
+#define DISK_TRAP_ADDR      0xbf00          // simulated sector reader
+#define MODEL_TOLERANCE     0.5             // -m: percent off before we fail
+
+#define REV_CYCLES          (CLOCK_HZ / 5)  // 300 RPM
+#define SECTORS_PER_TRACK   16
+#define SECTOR_LEN          256
+#define SECTOR_CYCLES       (REV_CYCLES / SECTORS_PER_TRACK)
+#define STEP_CYCLES         (CLOCK_HZ / 40) // step one track and settle
+
+//#define DEBUG_MSGS
+#ifdef DEBUG_MSGS
+# define DBUG(x) printf x
+#else
+# define DBUG(x)
+#endif
+
+
+/*
+ * ==========================================================================
+ *      Instruction set
+ * ==========================================================================
+ */
+
+enum AddrMode {
+    AM_IMP,         // implied
+    AM_ACC,         // accumulator
+    AM_IMM,         // #$nn
+    AM_ZP,          // $nn
+    AM_ZPX,         // $nn,X
+    AM_ZPY,         // $nn,Y
+    AM_ABS,         // $nnnn
+    AM_ABSX,        // $nnnn,X
+    AM_ABSY,        // $nnnn,Y
+    AM_IND,         // ($nnnn)
+    AM_INDX,        // ($nn,X)
+    AM_INDY,        // ($nn),Y
+    AM_ZPI,         // ($nn)        65C02
+    AM_ABSIX,       // ($nnnn,X)    65C02
+    AM_REL,         // branch
+    AM_ABSL,        // $nnnnnn      65816
+    AM_ABSLX,       // $nnnnnn,X    65816
+    AM_DPIL,        // [$nn]        65816
+    AM_DPILY,       // [$nn],Y      65816
+    AM_SR,          // $nn,S        65816
+    AM_SRIY,        // ($nn,S),Y    65816
+    AM_RELL,        // long branch  65816
+    AM_BLK,         // block move   65816
+};
+
+enum Op {
+    OP_ADC, OP_AND, OP_ASL, OP_BCC, OP_BCS, OP_BEQ, OP_BIT, OP_BMI,
+    OP_BNE, OP_BPL, OP_BRA, OP_BRK, OP_BVC, OP_BVS, OP_CLC, OP_CLD,
+    OP_CLI, OP_CLV, OP_CMP, OP_CPX, OP_CPY, OP_DEC, OP_DEX, OP_DEY,
+    OP_EOR, OP_INC, OP_INX, OP_INY, OP_JMP, OP_JSR, OP_LDA, OP_LDX,
+    OP_LDY, OP_LSR, OP_NOP, OP_ORA, OP_PHA, OP_PHP, OP_PHX, OP_PHY,
+    OP_PLA, OP_PLP, OP_PLX, OP_PLY, OP_ROL, OP_ROR, OP_RTI, OP_RTS,
+    OP_SBC, OP_SEC, OP_SED, OP_SEI, OP_STA, OP_STX, OP_STY, OP_STZ,
+    OP_TAX, OP_TAY, OP_TRB, OP_TSB, OP_TSX, OP_TXA, OP_TXS, OP_TYA,
+    OP_BRL, OP_JML, OP_JSL, OP_MVN, OP_MVP, OP_PEA, OP_PHB, OP_PHD,
+    OP_PHK, OP_PLB, OP_PLD, OP_REP, OP_RTL, OP_SEP, OP_TCD, OP_TCS,
+    OP_TDC, OP_TSC, OP_TXY, OP_TYX, OP_XBA, OP_XCE,
+};
+
+#define PX      0x80        // add a cycle if indexing crosses a page
+
+struct OpInfo {
+    const char* mnemonic;
+    Op op;
+    AddrMode mode;
+    uint8_t opcode;
+    uint8_t cycles;         // base count, possibly with PX flag
+    CpuType cpu;            // first CPU that has it
+};
+
+/*
+ * Opcode table.  Where the 65C02 changed the timing of an existing
+ * instruction, there are two entries; the CMOS one comes second and
+ * replaces the NMOS one when "-c" is given.  The 65816 entries at the
+ * end work the same way.  Their counts are for 8-bit registers and a
+ * page-aligned direct page; step816() adds the rest.
+ */
+static const OpInfo gOpTable[] = {
+    { "ADC", OP_ADC, AM_IMM,  0x69, 2,    CPU_6502 },
+    { "ADC", OP_ADC, AM_ZP,   0x65, 3,    CPU_6502 },
+    { "ADC", OP_ADC, AM_ZPX,  0x75, 4,    CPU_6502 },
+    { "ADC", OP_ADC, AM_ABS,  0x6d, 4,    CPU_6502 },
+    { "ADC", OP_ADC, AM_ABSX, 0x7d, 4|PX, CPU_6502 },
+    { "ADC", OP_ADC, AM_ABSY, 0x79, 4|PX, CPU_6502 },
+    { "ADC", OP_ADC, AM_INDX, 0x61, 6,    CPU_6502 },
+    { "ADC", OP_ADC, AM_INDY, 0x71, 5|PX, CPU_6502 },
+    { "ADC", OP_ADC, AM_ZPI,  0x72, 5,    CPU_65C02 },
+    { "AND", OP_AND, AM_IMM,  0x29, 2,    CPU_6502 },
+    { "AND", OP_AND, AM_ZP,   0x25, 3,    CPU_6502 },
+    { "AND", OP_AND, AM_ZPX,  0x35, 4,    CPU_6502 },
+    { "AND", OP_AND, AM_ABS,  0x2d, 4,    CPU_6502 },
+    { "AND", OP_AND, AM_ABSX, 0x3d, 4|PX, CPU_6502 },
+    { "AND", OP_AND, AM_ABSY, 0x39, 4|PX, CPU_6502 },
+    { "AND", OP_AND, AM_INDX, 0x21, 6,    CPU_6502 },
+    { "AND", OP_AND, AM_INDY, 0x31, 5|PX, CPU_6502 },
+    { "AND", OP_AND, AM_ZPI,  0x32, 5,    CPU_65C02 },
+    { "ASL", OP_ASL, AM_ACC,  0x0a, 2,    CPU_6502 },
+    { "ASL", OP_ASL, AM_ZP,   0x06, 5,    CPU_6502 },
+    { "ASL", OP_ASL, AM_ZPX,  0x16, 6,    CPU_6502 },
+    { "ASL", OP_ASL, AM_ABS,  0x0e, 6,    CPU_6502 },
+    { "ASL", OP_ASL, AM_ABSX, 0x1e, 7,    CPU_6502 },
+    { "ASL", OP_ASL, AM_ABSX, 0x1e, 6|PX, CPU_65C02 },
+    { "BCC", OP_BCC, AM_REL,  0x90, 2,    CPU_6502 },
+    { "BCS", OP_BCS, AM_REL,  0xb0, 2,    CPU_6502 },
+    { "BEQ", OP_BEQ, AM_REL,  0xf0, 2,    CPU_6502 },
+    { "BIT", OP_BIT, AM_ZP,   0x24, 3,    CPU_6502 },
+    { "BIT", OP_BIT, AM_ABS,  0x2c, 4,    CPU_6502 },
+    { "BIT", OP_BIT, AM_IMM,  0x89, 2,    CPU_65C02 },
+    { "BIT", OP_BIT, AM_ZPX,  0x34, 4,    CPU_65C02 },
+    { "BIT", OP_BIT, AM_ABSX, 0x3c, 4|PX, CPU_65C02 },
+    { "BMI", OP_BMI, AM_REL,  0x30, 2,    CPU_6502 },
+    { "BNE", OP_BNE, AM_REL,  0xd0, 2,    CPU_6502 },
+    { "BPL", OP_BPL, AM_REL,  0x10, 2,    CPU_6502 },
+    { "BRA", OP_BRA, AM_REL,  0x80, 2,    CPU_65C02 },
+    { "BRK", OP_BRK, AM_IMP,  0x00, 7,    CPU_6502 },
+    { "BVC", OP_BVC, AM_REL,  0x50, 2,    CPU_6502 },
+    { "BVS", OP_BVS, AM_REL,  0x70, 2,    CPU_6502 },
+    { "CLC", OP_CLC, AM_IMP,  0x18, 2,    CPU_6502 },
+    { "CLD", OP_CLD, AM_IMP,  0xd8, 2,    CPU_6502 },
+    { "CLI", OP_CLI, AM_IMP,  0x58, 2,    CPU_6502 },
+    { "CLV", OP_CLV, AM_IMP,  0xb8, 2,    CPU_6502 },
+    { "CMP", OP_CMP, AM_IMM,  0xc9, 2,    CPU_6502 },
+    { "CMP", OP_CMP, AM_ZP,   0xc5, 3,    CPU_6502 },
+    { "CMP", OP_CMP, AM_ZPX,  0xd5, 4,    CPU_6502 },
+    { "CMP", OP_CMP, AM_ABS,  0xcd, 4,    CPU_6502 },
+    { "CMP", OP_CMP, AM_ABSX, 0xdd, 4|PX, CPU_6502 },
+    { "CMP", OP_CMP, AM_ABSY, 0xd9, 4|PX, CPU_6502 },
+    { "CMP", OP_CMP, AM_INDX, 0xc1, 6,    CPU_6502 },
+    { "CMP", OP_CMP, AM_INDY, 0xd1, 5|PX, CPU_6502 },
+    { "CMP", OP_CMP, AM_ZPI,  0xd2, 5,    CPU_65C02 },
+    { "CPX", OP_CPX, AM_IMM,  0xe0, 2,    CPU_6502 },
+    { "CPX", OP_CPX, AM_ZP,   0xe4, 3,    CPU_6502 },
+    { "CPX", OP_CPX, AM_ABS,  0xec, 4,    CPU_6502 },
+    { "CPY", OP_CPY, AM_IMM,  0xc0, 2,    CPU_6502 },
+    { "CPY", OP_CPY, AM_ZP,   0xc4, 3,    CPU_6502 },
+    { "CPY", OP_CPY, AM_ABS,  0xcc, 4,    CPU_6502 },
+    { "DEC", OP_DEC, AM_ACC,  0x3a, 2,    CPU_65C02 },
+    { "DEC", OP_DEC, AM_ZP,   0xc6, 5,    CPU_6502 },
+    { "DEC", OP_DEC, AM_ZPX,  0xd6, 6,    CPU_6502 },
+    { "DEC", OP_DEC, AM_ABS,  0xce, 6,    CPU_6502 },
+    { "DEC", OP_DEC, AM_ABSX, 0xde, 7,    CPU_6502 },
+    { "DEX", OP_DEX, AM_IMP,  0xca, 2,    CPU_6502 },
+    { "DEY", OP_DEY, AM_IMP,  0x88, 2,    CPU_6502 },
+    { "EOR", OP_EOR, AM_IMM,  0x49, 2,    CPU_6502 },
+    { "EOR", OP_EOR, AM_ZP,   0x45, 3,    CPU_6502 },
+    { "EOR", OP_EOR, AM_ZPX,  0x55, 4,    CPU_6502 },
+    { "EOR", OP_EOR, AM_ABS,  0x4d, 4,    CPU_6502 },
+    { "EOR", OP_EOR, AM_ABSX, 0x5d, 4|PX, CPU_6502 },
+    { "EOR", OP_EOR, AM_ABSY, 0x59, 4|PX, CPU_6502 },
+    { "EOR", OP_EOR, AM_INDX, 0x41, 6,    CPU_6502 },
+    { "EOR", OP_EOR, AM_INDY, 0x51, 5|PX, CPU_6502 },
+    { "EOR", OP_EOR, AM_ZPI,  0x52, 5,    CPU_65C02 },
+    { "INC", OP_INC, AM_ACC,  0x1a, 2,    CPU_65C02 },
+    { "INC", OP_INC, AM_ZP,   0xe6, 5,    CPU_6502 },
+    { "INC", OP_INC, AM_ZPX,  0xf6, 6,    CPU_6502 },
+    { "INC", OP_INC, AM_ABS,  0xee, 6,    CPU_6502 },
+    { "INC", OP_INC, AM_ABSX, 0xfe, 7,    CPU_6502 },
+    { "INX", OP_INX, AM_IMP,  0xe8, 2,    CPU_6502 },
+    { "INY", OP_INY, AM_IMP,  0xc8, 2,    CPU_6502 },
+    { "JMP", OP_JMP, AM_ABS,  0x4c, 3,    CPU_6502 },
+    { "JMP", OP_JMP, AM_IND,  0x6c, 5,    CPU_6502 },
+    { "JMP", OP_JMP, AM_IND,  0x6c, 6,    CPU_65C02 },
+    { "JMP", OP_JMP, AM_ABSIX, 0x7c, 6,   CPU_65C02 },
+    { "JSR", OP_JSR, AM_ABS,  0x20, 6,    CPU_6502 },
+    { "LDA", OP_LDA, AM_IMM,  0xa9, 2,    CPU_6502 },
+    { "LDA", OP_LDA, AM_ZP,   0xa5, 3,    CPU_6502 },
+    { "LDA", OP_LDA, AM_ZPX,  0xb5, 4,    CPU_6502 },
+    { "LDA", OP_LDA, AM_ABS,  0xad, 4,    CPU_6502 },
+    { "LDA", OP_LDA, AM_ABSX, 0xbd, 4|PX, CPU_6502 },
+    { "LDA", OP_LDA, AM_ABSY, 0xb9, 4|PX, CPU_6502 },
+    { "LDA", OP_LDA, AM_INDX, 0xa1, 6,    CPU_6502 },
+    { "LDA", OP_LDA, AM_INDY, 0xb1, 5|PX, CPU_6502 },
+    { "LDA", OP_LDA, AM_ZPI,  0xb2, 5,    CPU_65C02 },
+    { "LDX", OP_LDX, AM_IMM,  0xa2, 2,    CPU_6502 },
+    { "LDX", OP_LDX, AM_ZP,   0xa6, 3,    CPU_6502 },
+    { "LDX", OP_LDX, AM_ZPY,  0xb6, 4,    CPU_6502 },
+    { "LDX", OP_LDX, AM_ABS,  0xae, 4,    CPU_6502 },
+    { "LDX", OP_LDX, AM_ABSY, 0xbe, 4|PX, CPU_6502 },
+    { "LDY", OP_LDY, AM_IMM,  0xa0, 2,    CPU_6502 },
+    { "LDY", OP_LDY, AM_ZP,   0xa4, 3,    CPU_6502 },
+    { "LDY", OP_LDY, AM_ZPX,  0xb4, 4,    CPU_6502 },
+    { "LDY", OP_LDY, AM_ABS,  0xac, 4,    CPU_6502 },
+    { "LDY", OP_LDY, AM_ABSX, 0xbc, 4|PX, CPU_6502 },
+    { "LSR", OP_LSR, AM_ACC,  0x4a, 2,    CPU_6502 },
+    { "LSR", OP_LSR, AM_ZP,   0x46, 5,    CPU_6502 },
+    { "LSR", OP_LSR, AM_ZPX,  0x56, 6,    CPU_6502 },
+    { "LSR", OP_LSR, AM_ABS,  0x4e, 6,    CPU_6502 },
+    { "LSR", OP_LSR, AM_ABSX, 0x5e, 7,    CPU_6502 },
+    { "LSR", OP_LSR, AM_ABSX, 0x5e, 6|PX, CPU_65C02 },
+    { "NOP", OP_NOP, AM_IMP,  0xea, 2,    CPU_6502 },
+    { "ORA", OP_ORA, AM_IMM,  0x09, 2,    CPU_6502 },
+    { "ORA", OP_ORA, AM_ZP,   0x05, 3,    CPU_6502 },
+    { "ORA", OP_ORA, AM_ZPX,  0x15, 4,    CPU_6502 },
+    { "ORA", OP_ORA, AM_ABS,  0x0d, 4,    CPU_6502 },
+    { "ORA", OP_ORA, AM_ABSX, 0x1d, 4|PX, CPU_6502 },
+    { "ORA", OP_ORA, AM_ABSY, 0x19, 4|PX, CPU_6502 },
+    { "ORA", OP_ORA, AM_INDX, 0x01, 6,    CPU_6502 },
+    { "ORA", OP_ORA, AM_INDY, 0x11, 5|PX, CPU_6502 },
+    { "ORA", OP_ORA, AM_ZPI,  0x12, 5,    CPU_65C02 },
+    { "PHA", OP_PHA, AM_IMP,  0x48, 3,    CPU_6502 },
+    { "PHP", OP_PHP, AM_IMP,  0x08, 3,    CPU_6502 },
+    { "PHX", OP_PHX, AM_IMP,  0xda, 3,    CPU_65C02 },
+    { "PHY", OP_PHY, AM_IMP,  0x5a, 3,    CPU_65C02 },
+    { "PLA", OP_PLA, AM_IMP,  0x68, 4,    CPU_6502 },
+    { "PLP", OP_PLP, AM_IMP,  0x28, 4,    CPU_6502 },
+    { "PLX", OP_PLX, AM_IMP,  0xfa, 4,    CPU_65C02 },
+    { "PLY", OP_PLY, AM_IMP,  0x7a, 4,    CPU_65C02 },
+    { "ROL", OP_ROL, AM_ACC,  0x2a, 2,    CPU_6502 },
+    { "ROL", OP_ROL, AM_ZP,   0x26, 5,    CPU_6502 },
+    { "ROL", OP_ROL, AM_ZPX,  0x36, 6,    CPU_6502 },
+    { "ROL", OP_ROL, AM_ABS,  0x2e, 6,    CPU_6502 },
+    { "ROL", OP_ROL, AM_ABSX, 0x3e, 7,    CPU_6502 },
+    { "ROL", OP_ROL, AM_ABSX, 0x3e, 6|PX, CPU_65C02 },
+    { "ROR", OP_ROR, AM_ACC,  0x6a, 2,    CPU_6502 },
+    { "ROR", OP_ROR, AM_ZP,   0x66, 5,    CPU_6502 },
+    { "ROR", OP_ROR, AM_ZPX,  0x76, 6,    CPU_6502 },
+    { "ROR", OP_ROR, AM_ABS,  0x6e, 6,    CPU_6502 },
+    { "ROR", OP_ROR, AM_ABSX, 0x7e, 7,    CPU_6502 },
+    { "ROR", OP_ROR, AM_ABSX, 0x7e, 6|PX, CPU_65C02 },
+    { "RTI", OP_RTI, AM_IMP,  0x40, 6,    CPU_6502 },
+    { "RTS", OP_RTS, AM_IMP,  0x60, 6,    CPU_6502 },
+    { "SBC", OP_SBC, AM_IMM,  0xe9, 2,    CPU_6502 },
+    { "SBC", OP_SBC, AM_ZP,   0xe5, 3,    CPU_6502 },
+    { "SBC", OP_SBC, AM_ZPX,  0xf5, 4,    CPU_6502 },
+    { "SBC", OP_SBC, AM_ABS,  0xed, 4,    CPU_6502 },
+    { "SBC", OP_SBC, AM_ABSX, 0xfd, 4|PX, CPU_6502 },
+    { "SBC", OP_SBC, AM_ABSY, 0xf9, 4|PX, CPU_6502 },
+    { "SBC", OP_SBC, AM_INDX, 0xe1, 6,    CPU_6502 },
+    { "SBC", OP_SBC, AM_INDY, 0xf1, 5|PX, CPU_6502 },
+    { "SBC", OP_SBC, AM_ZPI,  0xf2, 5,    CPU_65C02 },
+    { "SEC", OP_SEC, AM_IMP,  0x38, 2,    CPU_6502 },
+    { "SED", OP_SED, AM_IMP,  0xf8, 2,    CPU_6502 },
+    { "SEI", OP_SEI, AM_IMP,  0x78, 2,    CPU_6502 },
+    { "STA", OP_STA, AM_ZP,   0x85, 3,    CPU_6502 },
+    { "STA", OP_STA, AM_ZPX,  0x95, 4,    CPU_6502 },
+    { "STA", OP_STA, AM_ABS,  0x8d, 4,    CPU_6502 },
+    { "STA", OP_STA, AM_ABSX, 0x9d, 5,    CPU_6502 },
+    { "STA", OP_STA, AM_ABSY, 0x99, 5,    CPU_6502 },
+    { "STA", OP_STA, AM_INDX, 0x81, 6,    CPU_6502 },
+    { "STA", OP_STA, AM_INDY, 0x91, 6,    CPU_6502 },
+    { "STA", OP_STA, AM_ZPI,  0x92, 5,    CPU_65C02 },
+    { "STX", OP_STX, AM_ZP,   0x86, 3,    CPU_6502 },
+    { "STX", OP_STX, AM_ZPY,  0x96, 4,    CPU_6502 },
+    { "STX", OP_STX, AM_ABS,  0x8e, 4,    CPU_6502 },
+    { "STY", OP_STY, AM_ZP,   0x84, 3,    CPU_6502 },
+    { "STY", OP_STY, AM_ZPX,  0x94, 4,    CPU_6502 },
+    { "STY", OP_STY, AM_ABS,  0x8c, 4,    CPU_6502 },
+    { "STZ", OP_STZ, AM_ZP,   0x64, 3,    CPU_65C02 },
+    { "STZ", OP_STZ, AM_ZPX,  0x74, 4,    CPU_65C02 },
+    { "STZ", OP_STZ, AM_ABS,  0x9c, 4,    CPU_65C02 },
+    { "STZ", OP_STZ, AM_ABSX, 0x9e, 5,    CPU_65C02 },
+    { "TAX", OP_TAX, AM_IMP,  0xaa, 2,    CPU_6502 },
+    { "TAY", OP_TAY, AM_IMP,  0xa8, 2,    CPU_6502 },
+    { "TRB", OP_TRB, AM_ZP,   0x14, 5,    CPU_65C02 },
+    { "TRB", OP_TRB, AM_ABS,  0x1c, 6,    CPU_65C02 },
+    { "TSB", OP_TSB, AM_ZP,   0x04, 5,    CPU_65C02 },
+    { "TSB", OP_TSB, AM_ABS,  0x0c, 6,    CPU_65C02 },
+    { "TSX", OP_TSX, AM_IMP,  0xba, 2,    CPU_6502 },
+    { "TXA", OP_TXA, AM_IMP,  0x8a, 2,    CPU_6502 },
+    { "TXS", OP_TXS, AM_IMP,  0x9a, 2,    CPU_6502 },
+    { "TYA", OP_TYA, AM_IMP,  0x98, 2,    CPU_6502 },
+    { "ADC", OP_ADC, AM_ABSL, 0x6f, 5,    CPU_65816 },
+    { "ADC", OP_ADC, AM_ABSLX, 0x7f, 5,    CPU_65816 },
+    { "ADC", OP_ADC, AM_DPIL, 0x67, 6,    CPU_65816 },
+    { "ADC", OP_ADC, AM_DPILY, 0x77, 6,    CPU_65816 },
+    { "ADC", OP_ADC, AM_SR,   0x63, 4,    CPU_65816 },
+    { "ADC", OP_ADC, AM_SRIY, 0x73, 7,    CPU_65816 },
+    { "AND", OP_AND, AM_ABSL, 0x2f, 5,    CPU_65816 },
+    { "AND", OP_AND, AM_ABSLX, 0x3f, 5,    CPU_65816 },
+    { "AND", OP_AND, AM_DPIL, 0x27, 6,    CPU_65816 },
+    { "AND", OP_AND, AM_DPILY, 0x37, 6,    CPU_65816 },
+    { "AND", OP_AND, AM_SR,   0x23, 4,    CPU_65816 },
+    { "AND", OP_AND, AM_SRIY, 0x33, 7,    CPU_65816 },
+    { "CMP", OP_CMP, AM_ABSL, 0xcf, 5,    CPU_65816 },
+    { "CMP", OP_CMP, AM_ABSLX, 0xdf, 5,    CPU_65816 },
+    { "CMP", OP_CMP, AM_DPIL, 0xc7, 6,    CPU_65816 },
+    { "CMP", OP_CMP, AM_DPILY, 0xd7, 6,    CPU_65816 },
+    { "CMP", OP_CMP, AM_SR,   0xc3, 4,    CPU_65816 },
+    { "CMP", OP_CMP, AM_SRIY, 0xd3, 7,    CPU_65816 },
+    { "EOR", OP_EOR, AM_ABSL, 0x4f, 5,    CPU_65816 },
+    { "EOR", OP_EOR, AM_ABSLX, 0x5f, 5,    CPU_65816 },
+    { "EOR", OP_EOR, AM_DPIL, 0x47, 6,    CPU_65816 },
+    { "EOR", OP_EOR, AM_DPILY, 0x57, 6,    CPU_65816 },
+    { "EOR", OP_EOR, AM_SR,   0x43, 4,    CPU_65816 },
+    { "EOR", OP_EOR, AM_SRIY, 0x53, 7,    CPU_65816 },
+    { "LDA", OP_LDA, AM_ABSL, 0xaf, 5,    CPU_65816 },
+    { "LDA", OP_LDA, AM_ABSLX, 0xbf, 5,    CPU_65816 },
+    { "LDA", OP_LDA, AM_DPIL, 0xa7, 6,    CPU_65816 },
+    { "LDA", OP_LDA, AM_DPILY, 0xb7, 6,    CPU_65816 },
+    { "LDA", OP_LDA, AM_SR,   0xa3, 4,    CPU_65816 },
+    { "LDA", OP_LDA, AM_SRIY, 0xb3, 7,    CPU_65816 },
+    { "ORA", OP_ORA, AM_ABSL, 0x0f, 5,    CPU_65816 },
+    { "ORA", OP_ORA, AM_ABSLX, 0x1f, 5,    CPU_65816 },
+    { "ORA", OP_ORA, AM_DPIL, 0x07, 6,    CPU_65816 },
+    { "ORA", OP_ORA, AM_DPILY, 0x17, 6,    CPU_65816 },
+    { "ORA", OP_ORA, AM_SR,   0x03, 4,    CPU_65816 },
+    { "ORA", OP_ORA, AM_SRIY, 0x13, 7,    CPU_65816 },
+    { "SBC", OP_SBC, AM_ABSL, 0xef, 5,    CPU_65816 },
+    { "SBC", OP_SBC, AM_ABSLX, 0xff, 5,    CPU_65816 },
+    { "SBC", OP_SBC, AM_DPIL, 0xe7, 6,    CPU_65816 },
+    { "SBC", OP_SBC, AM_DPILY, 0xf7, 6,    CPU_65816 },
+    { "SBC", OP_SBC, AM_SR,   0xe3, 4,    CPU_65816 },
+    { "SBC", OP_SBC, AM_SRIY, 0xf3, 7,    CPU_65816 },
+    { "STA", OP_STA, AM_ABSL, 0x8f, 5,    CPU_65816 },
+    { "STA", OP_STA, AM_ABSLX, 0x9f, 5,    CPU_65816 },
+    { "STA", OP_STA, AM_DPIL, 0x87, 6,    CPU_65816 },
+    { "STA", OP_STA, AM_DPILY, 0x97, 6,    CPU_65816 },
+    { "STA", OP_STA, AM_SR,   0x83, 4,    CPU_65816 },
+    { "STA", OP_STA, AM_SRIY, 0x93, 7,    CPU_65816 },
+    { "ASL", OP_ASL, AM_ABSX, 0x1e, 7,    CPU_65816 },
+    { "BRL", OP_BRL, AM_RELL, 0x82, 4,    CPU_65816 },
+    { "JML", OP_JML, AM_ABSL, 0x5c, 4,    CPU_65816 },
+    { "JMP", OP_JML, AM_ABSL, 0x5c, 4,    CPU_65816 },
+    { "JMP", OP_JMP, AM_IND,  0x6c, 5,    CPU_65816 },
+    { "JSL", OP_JSL, AM_ABSL, 0x22, 8,    CPU_65816 },
+    { "JSR", OP_JSL, AM_ABSL, 0x22, 8,    CPU_65816 },
+    { "LSR", OP_LSR, AM_ABSX, 0x5e, 7,    CPU_65816 },
+    { "MVN", OP_MVN, AM_BLK,  0x54, 7,    CPU_65816 },
+    { "MVP", OP_MVP, AM_BLK,  0x44, 7,    CPU_65816 },
+    { "PEA", OP_PEA, AM_ABS,  0xf4, 5,    CPU_65816 },
+    { "PHB", OP_PHB, AM_IMP,  0x8b, 3,    CPU_65816 },
+    { "PHD", OP_PHD, AM_IMP,  0x0b, 4,    CPU_65816 },
+    { "PHK", OP_PHK, AM_IMP,  0x4b, 3,    CPU_65816 },
+    { "PLB", OP_PLB, AM_IMP,  0xab, 4,    CPU_65816 },
+    { "PLD", OP_PLD, AM_IMP,  0x2b, 5,    CPU_65816 },
+    { "REP", OP_REP, AM_IMM,  0xc2, 3,    CPU_65816 },
+    { "ROL", OP_ROL, AM_ABSX, 0x3e, 7,    CPU_65816 },
+    { "ROR", OP_ROR, AM_ABSX, 0x7e, 7,    CPU_65816 },
+    { "RTL", OP_RTL, AM_IMP,  0x6b, 6,    CPU_65816 },
+    { "SEP", OP_SEP, AM_IMM,  0xe2, 3,    CPU_65816 },
+    { "TCD", OP_TCD, AM_IMP,  0x5b, 2,    CPU_65816 },
+    { "TCS", OP_TCS, AM_IMP,  0x1b, 2,    CPU_65816 },
+    { "TDC", OP_TDC, AM_IMP,  0x7b, 2,    CPU_65816 },
+    { "TSC", OP_TSC, AM_IMP,  0x3b, 2,    CPU_65816 },
+    { "TXY", OP_TXY, AM_IMP,  0x9b, 2,    CPU_65816 },
+    { "TYX", OP_TYX, AM_IMP,  0xbb, 2,    CPU_65816 },
+    { "XBA", OP_XBA, AM_IMP,  0xeb, 3,    CPU_65816 },
+    { "XCE", OP_XCE, AM_IMP,  0xfb, 2,    CPU_65816 },
+};
+#define NUM_OPS (sizeof(gOpTable) / sizeof(gOpTable[0]))
+
+/*
+ * Merlin's synonyms for the carry-flag branches.
+ */
+static const char* gAliases[][2] = {
+    { "BLT", "BCC" },
+    { "BGE", "BCS" },
+};
+
+/*
+ * Finds the table entry for a mnemonic/mode pair, or NULL if the
+ * combination doesn't exist on the selected CPU.
+ */
+static const OpInfo* findOp(const char* mnemonic, AddrMode mode,
+    CpuType cpu)
+{
+    const OpInfo* found = NULL;
+    for (size_t ii = 0; ii < NUM_OPS; ii++) {
+        const OpInfo* pOp = &gOpTable[ii];
+        if (pOp->mode == mode && pOp->cpu <= cpu &&
+                strcmp(pOp->mnemonic, mnemonic) == 0) {
+            found = pOp;        // keep going, later entries override
+        }
+    }
+    return found;
+}
+
+/*
+ * Returns true if the mnemonic exists on the selected CPU.
+ */
+static bool isMnemonic(const char* mnemonic, CpuType cpu)
+{
+    for (size_t ii = 0; ii < NUM_OPS; ii++) {
+        if (gOpTable[ii].cpu <= cpu &&
+                strcmp(gOpTable[ii].mnemonic, mnemonic) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*
+ * ==========================================================================
+ *      Assembler
+ * ==========================================================================
+ */
+
+struct SourceLine {
+    int lineNum;
+    std::string label;
+    std::string opcode;     // upper-cased
+    std::string operand;
+};
+
+struct Assembler {
+    CpuType cpu;
+    CpuType baseCpu;                    // CPU requested on the command line
+    int xcCount;                        // XC directives seen this pass
+    int mx;                             // MX setting: 2 = 8-bit A, 1 = 8-bit X/Y
+    const char* fileName;
+    std::vector<SourceLine> lines;
+    std::map<std::string, long> symbols;
+    std::vector<AddrMode> lineModes;    // mode chosen for each line in pass 1
+    std::string globalScope;            // most recent global label
+    int pass;
+    long pc;
+    long origin;                        // first ORG, -1 if none yet
+    long lowAddr, highAddr;             // extent of generated code
+    uint8_t* mem;
+    int errors;
+};
+
+/*
+ * Reports an error against the current line.
+ */
+static void asmError(Assembler* pAsm, const SourceLine& line,
+    const char* msg, const std::string& detail)
+{
+    fprintf(stderr, "%s:%d: %s%s%s\n", pAsm->fileName, line.lineNum, msg,
+        detail.empty() ? "" : ": ", detail.c_str());
+    pAsm->errors++;
+}
+
+/*
+ * Reads the source file and splits each line into fields.  Merlin
+ * sources use a leading '*' for full-line comments and ';' for trailing
+ * ones.  Some Apple II editors leave the high bit set, so we strip it.
+ */
+static bool readSource(Assembler* pAsm, const char* fileName)
+{
+    FILE* fp = fopen(fileName, "rb");
+    if (fp == NULL) {
+        perror("Unable to open source file");
+        return false;
+    }
+
+    std::string text;
+    int ic;
+    while ((ic = getc(fp)) != EOF) {
+        ic &= 0x7f;
+        if (ic == '\r') {
+            // Merlin uses CR; a CRLF pair is still one line
+            ic = getc(fp);
+            if (ic != '\n' && ic != EOF) {
+                ungetc(ic, fp);
+            }
+            ic = '\n';
+        }
+        text.push_back((char) ic);
+    }
+    fclose(fp);
+
+    int lineNum = 0;
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        std::string raw = text.substr(start, end - start);
+        start = end + 1;
+        lineNum++;
+
+        if (raw.empty() || raw[0] == '*' || raw[0] == ';') {
+            continue;
+        }
+
+        // Split into label, opcode, operand.  The operand may contain
+        // quoted strings with spaces in them.
+        SourceLine line;
+        line.lineNum = lineNum;
+        size_t posn = 0;
+        while (posn < raw.size() && !isspace(raw[posn])) {
+            line.label.push_back(raw[posn++]);
+        }
+        while (posn < raw.size() && isspace(raw[posn])) {
+            posn++;
+        }
+        while (posn < raw.size() && !isspace(raw[posn]) && raw[posn] != ';') {
+            line.opcode.push_back(toupper(raw[posn++]));
+        }
+        while (posn < raw.size() && isspace(raw[posn])) {
+            posn++;
+        }
+        char quote = '\0';
+        while (posn < raw.size()) {
+            char ch = raw[posn];
+            if (quote != '\0') {
+                if (ch == quote) {
+                    quote = '\0';
+                }
+            } else if (ch == '"' || ch == '\'') {
+                quote = ch;
+            } else if (isspace(ch) || ch == ';') {
+                break;
+            }
+            line.operand.push_back(ch);
+            posn++;
+        }
+
+        if (line.label.empty() && line.opcode.empty()) {
+            continue;
+        }
+        pAsm->lines.push_back(line);
+    }
+    return true;
+}
+
+/*
+ * Converts a label reference to a symbol table key.  Local labels are
+ * qualified with the global label that precedes them.
+ */
+static std::string symbolKey(const Assembler* pAsm, const std::string& name)
+{
+    if (!name.empty() && name[0] == ':') {
+        return pAsm->globalScope + name;
+    }
+    return name;
+}
+
+/*
+ * Evaluates an expression.  Merlin evaluates strictly left to right,
+ * so "1+2*3" is 9.  Sets "*pKnown" to false if the expression refers to
+ * a symbol that hasn't been defined yet.
+ *
+ * Returns false on a syntax error.
+ */
+static bool evalExpr(const Assembler* pAsm, const std::string& expr,
+    long* pValue, bool* pKnown)
+{
+    const char* cp = expr.c_str();
+    long result = 0;
+    char op = '+';
+    bool known = true;
+
+    if (*cp == '\0') {
+        return false;
+    }
+    while (true) {
+        // Parse a term.
+        long term;
+        bool negate = false;
+        if (*cp == '-') {
+            negate = true;
+            cp++;
+        }
+        if (*cp == '$') {
+            cp++;
+            if (!isxdigit(*cp)) {
+                return false;
+            }
+            term = strtol(cp, (char**) &cp, 16);
+        } else if (*cp == '%') {
+            cp++;
+            if (*cp != '0' && *cp != '1') {
+                return false;
+            }
+            term = strtol(cp, (char**) &cp, 2);
+        } else if (isdigit(*cp)) {
+            term = strtol(cp, (char**) &cp, 10);
+        } else if ((*cp == '\'' || *cp == '"') && cp[1] != '\0') {
+            // Merlin sets the high bit for double-quoted chars
+            term = cp[1] | (*cp == '"' ? 0x80 : 0x00);
+            cp += 2;
+            if (*cp == '\'' || *cp == '"') {
+                cp++;
+            }
+        } else if (*cp == '*') {
+            term = pAsm->pc;
+            cp++;
+        } else if (isalpha(*cp) || *cp == '_' || *cp == ':' || *cp == ']') {
+            std::string name;
+            name.push_back(*cp++);
+            while (isalnum(*cp) || *cp == '_' || *cp == '.') {
+                name.push_back(*cp++);
+            }
+            std::map<std::string, long>::const_iterator it =
+                pAsm->symbols.find(symbolKey(pAsm, name));
+            if (it == pAsm->symbols.end()) {
+                known = false;
+                term = 0;
+            } else {
+                term = it->second;
+            }
+        } else {
+            return false;
+        }
+        if (negate) {
+            term = -term;
+        }
+
+        switch (op) {
+        case '+':   result += term;     break;
+        case '-':   result -= term;     break;
+        case '*':   result *= term;     break;
+        case '/':   result = term != 0 ? result / term : 0;  break;
+        case '&':   result &= term;     break;
+        case '.':   result |= term;     break;
+        case '!':   result ^= term;     break;
+        default:    return false;
+        }
+
+        if (*cp == '\0') {
+            break;
+        }
+        op = *cp++;
+    }
+
+    *pValue = result;
+    *pKnown = known;
+    return true;
+}
+
+/*
+ * Determines the addressing mode and operand expression for an
+ * instruction.  "pImmPrefix" receives the '<', '>', or '^' byte
+ * selector for immediate operands.
+ *
+ * Returns false if the operand can't be parsed.
+ */
+static bool parseOperand(const std::string& mnemonic,
+    const std::string& operand, CpuType cpu, AddrMode* pMode,
+    std::string* pExpr, char* pImmPrefix)
+{
+    std::string upper;
+    for (size_t ii = 0; ii < operand.size(); ii++) {
+        upper.push_back(toupper(operand[ii]));
+    }
+    size_t len = operand.size();
+
+    *pImmPrefix = '\0';
+    if (findOp(mnemonic.c_str(), AM_REL, cpu) != NULL) {
+        *pMode = AM_REL;
+        *pExpr = operand;
+    } else if (findOp(mnemonic.c_str(), AM_RELL, cpu) != NULL) {
+        *pMode = AM_RELL;
+        *pExpr = operand;
+    } else if (findOp(mnemonic.c_str(), AM_BLK, cpu) != NULL) {
+        *pMode = AM_BLK;        // "srcbank,dstbank", split by caller
+        *pExpr = operand;
+    } else if (operand.empty() || upper == "A") {
+        if (findOp(mnemonic.c_str(), AM_ACC, cpu) != NULL) {
+            *pMode = AM_ACC;
+        } else {
+            *pMode = AM_IMP;
+        }
+        if (!operand.empty() && *pMode != AM_ACC) {
+            return false;
+        }
+    } else if (operand[0] == '#') {
+        *pMode = AM_IMM;
+        size_t start = 1;
+        if (operand[1] == '<' || operand[1] == '>' || operand[1] == '^') {
+            *pImmPrefix = operand[1];
+            start = 2;
+        }
+        *pExpr = operand.substr(start);
+    } else if (operand[0] == '[') {
+        if (len > 4 && upper.compare(len - 3, 3, "],Y") == 0) {
+            *pMode = AM_DPILY;
+            *pExpr = operand.substr(1, len - 4);
+        } else if (operand[len - 1] == ']') {
+            *pMode = AM_DPIL;
+            *pExpr = operand.substr(1, len - 2);
+        } else {
+            return false;
+        }
+    } else if (operand[0] == '(') {
+        if (len > 6 && upper.compare(len - 5, 5, ",S),Y") == 0) {
+            *pMode = AM_SRIY;
+            *pExpr = operand.substr(1, len - 6);
+        } else if (len > 4 && upper.compare(len - 3, 3, "),Y") == 0) {
+            *pMode = AM_INDY;
+            *pExpr = operand.substr(1, len - 4);
+        } else if (len > 4 && upper.compare(len - 3, 3, ",X)") == 0) {
+            *pMode = (mnemonic == "JMP") ? AM_ABSIX : AM_INDX;
+            *pExpr = operand.substr(1, len - 4);
+        } else if (operand[len - 1] == ')') {
+            *pMode = (mnemonic == "JMP") ? AM_IND : AM_ZPI;
+            *pExpr = operand.substr(1, len - 2);
+        } else {
+            return false;
+        }
+    } else if (len > 2 && upper.compare(len - 2, 2, ",X") == 0) {
+        *pMode = AM_ABSX;
+        *pExpr = operand.substr(0, len - 2);
+    } else if (len > 2 && upper.compare(len - 2, 2, ",Y") == 0) {
+        *pMode = AM_ABSY;
+        *pExpr = operand.substr(0, len - 2);
+    } else if (len > 2 && upper.compare(len - 2, 2, ",S") == 0) {
+        *pMode = AM_SR;
+        *pExpr = operand.substr(0, len - 2);
+    } else {
+        *pMode = AM_ABS;
+        *pExpr = operand;
+    }
+    return true;
+}
+
+/*
+ * Returns the zero-page form of an absolute mode, or the original mode
+ * if there isn't one.
+ */
+static AddrMode zeroPageMode(AddrMode mode)
+{
+    switch (mode) {
+    case AM_ABS:    return AM_ZP;
+    case AM_ABSX:   return AM_ZPX;
+    case AM_ABSY:   return AM_ZPY;
+    default:        return mode;
+    }
+}
+
+/*
+ * Returns the long form of an absolute mode, or the original mode if
+ * there isn't one.
+ */
+static AddrMode longMode(AddrMode mode)
+{
+    switch (mode) {
+    case AM_ABS:    return AM_ABSL;
+    case AM_ABSX:   return AM_ABSLX;
+    default:        return mode;
+    }
+}
+
+/*
+ * Returns the number of operand bytes for an addressing mode.  On the
+ * 65816, immediate operands may be wider; see immSize().
+ */
+static int operandSize(AddrMode mode)
+{
+    switch (mode) {
+    case AM_IMP:
+    case AM_ACC:
+        return 0;
+    case AM_ABS:
+    case AM_ABSX:
+    case AM_ABSY:
+    case AM_IND:
+    case AM_ABSIX:
+    case AM_RELL:
+    case AM_BLK:
+        return 2;
+    case AM_ABSL:
+    case AM_ABSLX:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+/*
+ * Returns true if the instruction's register width is set by the M flag
+ * (accumulator and memory), false if by X (index registers) or neither.
+ */
+static bool usesAccWidth(Op op)
+{
+    switch (op) {
+    case OP_ADC: case OP_AND: case OP_BIT: case OP_CMP: case OP_EOR:
+    case OP_LDA: case OP_ORA: case OP_SBC: case OP_STA: case OP_STZ:
+    case OP_ASL: case OP_LSR: case OP_ROL: case OP_ROR: case OP_INC:
+    case OP_DEC: case OP_TRB: case OP_TSB: case OP_PHA: case OP_PLA:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool usesIndexWidth(Op op)
+{
+    switch (op) {
+    case OP_CPX: case OP_CPY: case OP_LDX: case OP_LDY: case OP_STX:
+    case OP_STY: case OP_PHX: case OP_PHY: case OP_PLX: case OP_PLY:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Returns the size of an immediate operand, given the MX setting.
+ */
+static int immSize(Op op, int mx)
+{
+    if (usesAccWidth(op)) {
+        return (mx & 0x02) ? 1 : 2;
+    } else if (usesIndexWidth(op)) {
+        return (mx & 0x01) ? 1 : 2;
+    }
+    return 1;
+}
+
+/*
+ * Stores a byte at the current PC, in pass 2.
+ */
+static void emitByte(Assembler* pAsm, long value)
+{
+    if (pAsm->pass == 2) {
+        pAsm->mem[pAsm->pc & 0xffff] = (uint8_t) value;
+        if (pAsm->pc < pAsm->lowAddr) {
+            pAsm->lowAddr = pAsm->pc;
+        }
+        if (pAsm->pc > pAsm->highAddr) {
+            pAsm->highAddr = pAsm->pc;
+        }
+    }
+    pAsm->pc++;
+}
+
+/*
+ * Evaluates an expression that must be resolvable in the current pass.
+ */
+static bool evalRequired(Assembler* pAsm, const SourceLine& line,
+    const std::string& expr, long* pValue)
+{
+    bool known;
+    if (!evalExpr(pAsm, expr, pValue, &known)) {
+        asmError(pAsm, line, "bad expression", expr);
+        return false;
+    }
+    if (!known) {
+        if (pAsm->pass == 2) {
+            asmError(pAsm, line, "undefined symbol in", expr);
+        }
+        *pValue = 0;
+        return pAsm->pass != 2;
+    }
+    return true;
+}
+
+/*
+ * Handles a data or housekeeping directive.  Returns false if "opcode"
+ * isn't a directive we know about.
+ */
+static bool doDirective(Assembler* pAsm, const SourceLine& line)
+{
+    const std::string& opc = line.opcode;
+    long value;
+
+    if (opc == "ORG") {
+        if (evalRequired(pAsm, line, line.operand, &value)) {
+            pAsm->pc = value;
+            if (pAsm->origin < 0) {
+                pAsm->origin = value;
+            }
+        }
+    } else if (opc == "LST" || opc == "SAV" || opc == "DSK" ||
+            opc == "TYP" || opc == "END" ||
+            opc == "LSTDO" || opc == "TR" || opc == "EXP") {
+        // nothing to do
+    } else if (opc == "MX") {
+        // Tells the assembler how wide immediate operands are; it's up
+        // to the code to make REP/SEP agree.
+        if (evalRequired(pAsm, line, line.operand, &value)) {
+            pAsm->mx = value & 0x03;
+        }
+    } else if (opc == "XC") {
+        // Merlin's first XC enables 65C02 opcodes, the second 65816.
+        pAsm->xcCount++;
+        if (pAsm->xcCount == 1 && pAsm->cpu < CPU_65C02) {
+            pAsm->cpu = CPU_65C02;
+        } else if (pAsm->xcCount == 2) {
+            pAsm->cpu = CPU_65816;
+        } else if (pAsm->xcCount > 2) {
+            asmError(pAsm, line, "too many", "XC");
+        }
+    } else if (opc == "DFB" || opc == "DB" || opc == "DA" || opc == "DW" ||
+            opc == "DDB") {
+        size_t start = 0;
+        while (start <= line.operand.size()) {
+            size_t comma = line.operand.find(',', start);
+            if (comma == std::string::npos) {
+                comma = line.operand.size();
+            }
+            std::string item = line.operand.substr(start, comma - start);
+            start = comma + 1;
+
+            char prefix = '\0';
+            if (!item.empty() && (item[0] == '<' || item[0] == '>' ||
+                    item[0] == '^' || item[0] == '#')) {
+                prefix = item[0];
+                item = item.substr(1);
+            }
+            evalRequired(pAsm, line, item, &value);
+            if (prefix == '>') {
+                value >>= 8;
+            } else if (prefix == '^') {
+                value >>= 16;
+            }
+            if (opc == "DFB" || opc == "DB") {
+                emitByte(pAsm, value);
+            } else if (opc == "DDB") {
+                emitByte(pAsm, value >> 8);
+                emitByte(pAsm, value);
+            } else {
+                emitByte(pAsm, value);
+                emitByte(pAsm, value >> 8);
+            }
+        }
+    } else if (opc == "DS") {
+        if (evalRequired(pAsm, line, line.operand, &value)) {
+            for (long ii = 0; ii < value; ii++) {
+                emitByte(pAsm, 0);
+            }
+        }
+    } else if (opc == "HEX") {
+        const std::string& hex = line.operand;
+        for (size_t ii = 0; ii < hex.size(); ) {
+            if (hex[ii] == ',') {
+                ii++;
+                continue;
+            }
+            if (ii + 1 >= hex.size() || !isxdigit(hex[ii]) ||
+                    !isxdigit(hex[ii + 1])) {
+                asmError(pAsm, line, "bad hex data", hex);
+                break;
+            }
+            emitByte(pAsm, strtol(hex.substr(ii, 2).c_str(), NULL, 16));
+            ii += 2;
+        }
+    } else if (opc == "ASC") {
+        const std::string& str = line.operand;
+        if (str.size() < 2) {
+            asmError(pAsm, line, "bad string", str);
+        } else {
+            uint8_t hiBit = (str[0] == '"') ? 0x80 : 0x00;
+            for (size_t ii = 1; ii < str.size() && str[ii] != str[0]; ii++) {
+                emitByte(pAsm, str[ii] | hiBit);
+            }
+        }
+    } else if (opc == "ERR") {
+        if (pAsm->pass == 2 && evalRequired(pAsm, line, line.operand, &value)
+                && value != 0) {
+            asmError(pAsm, line, "ERR condition true", line.operand);
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Assembles one instruction.
+ */
+static void doInstruction(Assembler* pAsm, const SourceLine& line,
+    size_t lineIndex)
+{
+    std::string mnemonic = line.opcode;
+    for (size_t ii = 0; ii < sizeof(gAliases) / sizeof(gAliases[0]); ii++) {
+        if (mnemonic == gAliases[ii][0]) {
+            mnemonic = gAliases[ii][1];
+        }
+    }
+    // Merlin 16 lets you force long addressing with an 'L' suffix,
+    // e.g. "LDAL".
+    bool forceLong = false;
+    if (!isMnemonic(mnemonic.c_str(), pAsm->cpu) &&
+            pAsm->cpu == CPU_65816 && mnemonic.size() == 4 &&
+            mnemonic[3] == 'L' &&
+            isMnemonic(mnemonic.substr(0, 3).c_str(), pAsm->cpu)) {
+        mnemonic = mnemonic.substr(0, 3);
+        forceLong = true;
+    }
+    if (!isMnemonic(mnemonic.c_str(), pAsm->cpu)) {
+        asmError(pAsm, line, "unknown opcode", line.opcode);
+        return;
+    }
+
+    AddrMode mode;
+    std::string expr;
+    char immPrefix;
+    if (!parseOperand(mnemonic, line.operand, pAsm->cpu, &mode, &expr,
+            &immPrefix)) {
+        asmError(pAsm, line, "bad operand", line.operand);
+        return;
+    }
+
+    long value = 0;
+    long srcBank = 0;
+    bool known = true;
+    if (mode == AM_BLK) {
+        // Source bank first, as written; the opcode wants it second.
+        size_t comma = expr.find(',');
+        bool srcKnown;
+        if (comma == std::string::npos ||
+                !evalExpr(pAsm, expr.substr(0, comma), &srcBank, &srcKnown) ||
+                !evalExpr(pAsm, expr.substr(comma + 1), &value, &known)) {
+            asmError(pAsm, line, "bad block move banks", expr);
+            return;
+        }
+        known = known && srcKnown;
+    } else if (operandSize(mode) != 0 &&
+            !evalExpr(pAsm, expr, &value, &known)) {
+        asmError(pAsm, line, "bad expression", expr);
+        return;
+    }
+
+    if (pAsm->pass == 1) {
+        // Use the zero-page form if the value is known to fit, unless
+        // the operand was written out as a full 16-bit hex value.  On
+        // the 65816, a 24-bit hex value or a value past bank 0 selects
+        // the long form.
+        size_t hexDigits = (expr.size() >= 5 && expr[0] == '$') ?
+            strspn(expr.c_str() + 1, "0123456789abcdefABCDEF") : 0;
+        bool forceAbs = (hexDigits >= 4);
+        AddrMode zpMode = zeroPageMode(mode);
+        AddrMode lMode = longMode(mode);
+        if (hexDigits >= 6 || (known && value > 0xffff)) {
+            forceLong = true;
+        }
+        if (lMode != mode && forceLong &&
+                findOp(mnemonic.c_str(), lMode, pAsm->cpu)) {
+            mode = lMode;
+        } else if (zpMode != mode && known && value >= 0 && value < 0x100 &&
+                !forceAbs && findOp(mnemonic.c_str(), zpMode, pAsm->cpu)) {
+            mode = zpMode;
+        }
+        pAsm->lineModes[lineIndex] = mode;
+    } else {
+        mode = pAsm->lineModes[lineIndex];
+        if (!known) {
+            asmError(pAsm, line, "undefined symbol in", expr);
+            return;
+        }
+    }
+
+    const OpInfo* pOp = findOp(mnemonic.c_str(), mode, pAsm->cpu);
+    if (pOp == NULL) {
+        asmError(pAsm, line, "addressing mode not available",
+            line.opcode + " " + line.operand);
+        return;
+    }
+
+    if (mode == AM_IMM) {
+        if (immPrefix == '>') {
+            value >>= 8;
+        } else if (immPrefix == '^') {
+            value >>= 16;
+        }
+    }
+
+    int size = operandSize(mode);
+    if (mode == AM_IMM) {
+        size = immSize(pOp->op, pAsm->mx);
+    }
+
+    long instrAddr = pAsm->pc;
+    emitByte(pAsm, pOp->opcode);
+    if (mode == AM_REL) {
+        long delta = value - (instrAddr + 2);
+        if (pAsm->pass == 2 && (delta < -128 || delta > 127)) {
+            asmError(pAsm, line, "branch out of range", expr);
+        }
+        emitByte(pAsm, delta);
+    } else if (mode == AM_RELL) {
+        long delta = value - (instrAddr + 3);
+        if (pAsm->pass == 2 && (delta < -32768 || delta > 32767)) {
+            asmError(pAsm, line, "branch out of range", expr);
+        }
+        emitByte(pAsm, delta);
+        emitByte(pAsm, delta >> 8);
+    } else if (mode == AM_BLK) {
+        emitByte(pAsm, value);
+        emitByte(pAsm, srcBank);
+    } else if (size == 1) {
+        if (pAsm->pass == 2 && mode != AM_IMM &&
+                (value < 0 || value > 0xff)) {
+            asmError(pAsm, line, "zero-page operand out of range", expr);
+        }
+        emitByte(pAsm, value);
+    } else if (size == 2) {
+        emitByte(pAsm, value);
+        emitByte(pAsm, value >> 8);
+    } else if (size == 3) {
+        emitByte(pAsm, value);
+        emitByte(pAsm, value >> 8);
+        emitByte(pAsm, value >> 16);
+    }
+}
+
+/*
+ * Runs one pass over the source.
+ */
+static void assemblePass(Assembler* pAsm, int pass)
+{
+    pAsm->pass = pass;
+    pAsm->pc = 0x8000;          // Merlin's default origin
+    pAsm->cpu = pAsm->baseCpu;
+    pAsm->xcCount = 0;
+    pAsm->mx = 3;
+    pAsm->globalScope.clear();
+
+    // DO/ELSE/FIN nesting; each entry is "currently assembling"
+    std::vector<bool> condStack;
+    bool active = true;
+
+    for (size_t ii = 0; ii < pAsm->lines.size(); ii++) {
+        const SourceLine& line = pAsm->lines[ii];
+        const std::string& opc = line.opcode;
+
+        if (opc == "DO" || opc == "IF") {
+            long value = 0;
+            if (active) {
+                bool known;
+                if (!evalExpr(pAsm, line.operand, &value, &known) || !known) {
+                    asmError(pAsm, line, "DO needs a defined value",
+                        line.operand);
+                }
+            }
+            condStack.push_back(active);
+            active = active && value != 0;
+            continue;
+        } else if (opc == "ELSE") {
+            if (condStack.empty()) {
+                asmError(pAsm, line, "ELSE without DO", "");
+            } else {
+                active = condStack.back() && !active;
+            }
+            continue;
+        } else if (opc == "FIN") {
+            if (condStack.empty()) {
+                asmError(pAsm, line, "FIN without DO", "");
+            } else {
+                active = condStack.back();
+                condStack.pop_back();
+            }
+            continue;
+        }
+        if (!active) {
+            continue;
+        }
+
+        // Define the label, if any.
+        if (!line.label.empty()) {
+            if (line.label[0] != ':') {
+                pAsm->globalScope = line.label;
+            }
+            std::string key = symbolKey(pAsm, line.label);
+            long value = pAsm->pc;
+            bool haveValue = true;
+            if (opc == "EQU" || opc == "=") {
+                bool known;
+                if (!evalExpr(pAsm, line.operand, &value, &known)) {
+                    asmError(pAsm, line, "bad expression", line.operand);
+                    continue;
+                }
+                haveValue = known;
+            }
+            if (haveValue) {
+                std::map<std::string, long>::iterator it =
+                    pAsm->symbols.find(key);
+                if (pass == 1 && it != pAsm->symbols.end()) {
+                    asmError(pAsm, line, "duplicate label", line.label);
+                } else if (pass == 2 && it != pAsm->symbols.end() &&
+                        it->second != value) {
+                    asmError(pAsm, line, "label value changed in pass 2",
+                        line.label);
+                }
+                pAsm->symbols[key] = value;
+            } else if (pass == 2) {
+                asmError(pAsm, line, "undefined symbol in", line.operand);
+            }
+        }
+        if (opc.empty() || opc == "EQU" || opc == "=") {
+            continue;
+        }
+
+        if (!doDirective(pAsm, line)) {
+            doInstruction(pAsm, line, ii);
+        }
+    }
+
+    if (!condStack.empty()) {
+        fprintf(stderr, "%s: missing FIN\n", pAsm->fileName);
+        pAsm->errors++;
+    }
+}
+
+/*
+ * Assembles "fileName" into "mem".  On success, "*pEntry" is set to the
+ * first ORG address, and "*pLen" to the length of the generated code.
+ * "*pCpu" is raised to 65C02 or 65816 if the source uses XC.
+ *
+ * Returns 0 on success.
+ */
+static int assembleFile(const char* fileName, CpuType* pCpu, uint8_t* mem,
+    long* pEntry, long* pLen)
+{
+    Assembler assembler;
+    assembler.baseCpu = assembler.cpu = *pCpu;
+    assembler.fileName = fileName;
+    assembler.origin = -1;
+    assembler.lowAddr = MEM_SIZE;
+    assembler.highAddr = -1;
+    assembler.mem = mem;
+    assembler.errors = 0;
+
+    if (!readSource(&assembler, fileName)) {
+        return -1;
+    }
+    assembler.lineModes.resize(assembler.lines.size(), AM_IMP);
+
+    assemblePass(&assembler, 1);
+    if (assembler.errors == 0) {
+        assemblePass(&assembler, 2);
+    }
+    if (assembler.errors != 0) {
+        fprintf(stderr, "%s: %d error(s)\n", fileName, assembler.errors);
+        return -1;
+    }
+    if (assembler.highAddr < 0) {
+        fprintf(stderr, "%s: no code generated\n", fileName);
+        return -1;
+    }
+
+    *pEntry = assembler.origin >= 0 ? assembler.origin : assembler.lowAddr;
+    *pLen = assembler.highAddr - assembler.lowAddr + 1;
+    *pCpu = assembler.cpu;
+    DBUG(("Assembled %s: $%04lx-$%04lx\n", fileName, assembler.lowAddr,
+        assembler.highAddr));
+    return 0;
+}
+
+
+/*
+ * ==========================================================================
+ *      CPU
+ * ==========================================================================
+ */
+
+#define FLAG_C  0x01
+#define FLAG_Z  0x02
+#define FLAG_I  0x04
+#define FLAG_D  0x08
+#define FLAG_B  0x10
+#define FLAG_U  0x20
+#define FLAG_V  0x40
+#define FLAG_N  0x80
+
+struct Disk;
+
+struct Cpu {
+    uint8_t a, x, y, s, p;
+    uint16_t pc;
+    uint64_t cycles;
+    uint8_t* mem;
+    Disk* pDisk;            // handles calls to DISK_TRAP_ADDR, if set
+    const OpInfo* decode[256];
+};
+
+/*
+ * Fills out the opcode decode table for the selected CPU.
+ */
+static void initCpu(Cpu* pCpu, CpuType cpu, uint8_t* mem)
+{
+    memset(pCpu, 0, sizeof(*pCpu));
+    pCpu->mem = mem;
+    pCpu->s = 0xff;
+    pCpu->p = FLAG_U | FLAG_I;
+    for (size_t ii = 0; ii < NUM_OPS; ii++) {
+        if (gOpTable[ii].cpu <= cpu) {
+            pCpu->decode[gOpTable[ii].opcode] = &gOpTable[ii];
+        }
+    }
+}
+
+static inline uint16_t read16(const uint8_t* mem, uint16_t addr)
+{
+    return mem[addr] | (mem[(uint16_t) (addr + 1)] << 8);
+}
+
+static inline uint16_t readZp16(const uint8_t* mem, uint8_t addr)
+{
+    return mem[addr] | (mem[(uint8_t) (addr + 1)] << 8);
+}
+
+static inline void setNZ(Cpu* pCpu, uint8_t val)
+{
+    pCpu->p = (pCpu->p & ~(FLAG_N | FLAG_Z)) | (val & FLAG_N) |
+        (val == 0 ? FLAG_Z : 0);
+}
+
+static inline void push(Cpu* pCpu, uint8_t val)
+{
+    pCpu->mem[0x100 + pCpu->s--] = val;
+}
+
+static inline uint8_t pull(Cpu* pCpu)
+{
+    return pCpu->mem[0x100 + ++pCpu->s];
+}
+
+static void doCompare(Cpu* pCpu, uint8_t reg, uint8_t val)
+{
+    uint8_t diff = reg - val;
+    setNZ(pCpu, diff);
+    pCpu->p = (pCpu->p & ~FLAG_C) | (reg >= val ? FLAG_C : 0);
+}
+
+static void doAdc(Cpu* pCpu, uint8_t val)
+{
+    unsigned int sum = pCpu->a + val + (pCpu->p & FLAG_C);
+    pCpu->p &= ~(FLAG_C | FLAG_V);
+    if (sum > 0xff) {
+        pCpu->p |= FLAG_C;
+    }
+    if (~(pCpu->a ^ val) & (pCpu->a ^ sum) & 0x80) {
+        pCpu->p |= FLAG_V;
+    }
+    pCpu->a = (uint8_t) sum;
+    setNZ(pCpu, pCpu->a);
+}
+
+/*
+ * Executes one instruction.  Returns false if the instruction couldn't
+ * be executed (illegal opcode, BRK, decimal mode).
+ */
+static bool step(Cpu* pCpu)
+{
+    uint8_t* mem = pCpu->mem;
+    uint16_t opAddr = pCpu->pc;
+    const OpInfo* pOp = pCpu->decode[mem[opAddr]];
+    if (pOp == NULL) {
+        fprintf(stderr, "Illegal opcode $%02x at $%04x\n", mem[opAddr], opAddr);
+        return false;
+    }
+    pCpu->pc++;
+
+    uint16_t ea = 0;
+    uint16_t base;
+    bool crossed = false;
+    switch (pOp->mode) {
+    case AM_IMP:
+    case AM_ACC:
+        break;
+    case AM_IMM:
+        ea = pCpu->pc++;
+        break;
+    case AM_ZP:
+        ea = mem[pCpu->pc++];
+        break;
+    case AM_ZPX:
+        ea = (uint8_t) (mem[pCpu->pc++] + pCpu->x);
+        break;
+    case AM_ZPY:
+        ea = (uint8_t) (mem[pCpu->pc++] + pCpu->y);
+        break;
+    case AM_ABS:
+        ea = read16(mem, pCpu->pc);
+        pCpu->pc += 2;
+        break;
+    case AM_ABSX:
+        base = read16(mem, pCpu->pc);
+        pCpu->pc += 2;
+        ea = base + pCpu->x;
+        crossed = (base ^ ea) & 0xff00;
+        break;
+    case AM_ABSY:
+        base = read16(mem, pCpu->pc);
+        pCpu->pc += 2;
+        ea = base + pCpu->y;
+        crossed = (base ^ ea) & 0xff00;
+        break;
+    case AM_IND:
+        base = read16(mem, pCpu->pc);
+        pCpu->pc += 2;
+        if (pCpu->decode[0x7c] == NULL) {
+            // NMOS doesn't carry into the high byte of the pointer
+            ea = mem[base] | (mem[(base & 0xff00) | ((base + 1) & 0xff)] << 8);
+        } else {
+            ea = read16(mem, base);
+        }
+        break;
+    case AM_INDX:
+        ea = readZp16(mem, mem[pCpu->pc++] + pCpu->x);
+        break;
+    case AM_INDY:
+        base = readZp16(mem, mem[pCpu->pc++]);
+        ea = base + pCpu->y;
+        crossed = (base ^ ea) & 0xff00;
+        break;
+    case AM_ZPI:
+        ea = readZp16(mem, mem[pCpu->pc++]);
+        break;
+    case AM_ABSIX:
+        base = read16(mem, pCpu->pc) + pCpu->x;
+        pCpu->pc += 2;
+        ea = read16(mem, base);
+        break;
+    case AM_REL:
+        ea = pCpu->pc + 1 + (int8_t) mem[pCpu->pc];
+        pCpu->pc++;
+        break;
+    default:
+        break;          // 65816 modes never make it into the decode table
+    }
+
+    pCpu->cycles += pOp->cycles & ~PX;
+    if (crossed && (pOp->cycles & PX)) {
+        pCpu->cycles++;
+    }
+
+    uint8_t val;
+    bool branch = false;
+    switch (pOp->op) {
+    case OP_ADC:
+    case OP_SBC:
+        if (pCpu->p & FLAG_D) {
+            fprintf(stderr, "Decimal mode not supported ($%04x)\n", opAddr);
+            return false;
+        }
+        val = mem[ea];
+        doAdc(pCpu, pOp->op == OP_ADC ? val : ~val);
+        break;
+    case OP_AND:
+        pCpu->a &= mem[ea];
+        setNZ(pCpu, pCpu->a);
+        break;
+    case OP_ORA:
+        pCpu->a |= mem[ea];
+        setNZ(pCpu, pCpu->a);
+        break;
+    case OP_EOR:
+        pCpu->a ^= mem[ea];
+        setNZ(pCpu, pCpu->a);
+        break;
+    case OP_ASL:
+    case OP_LSR:
+    case OP_ROL:
+    case OP_ROR:
+        {
+            val = (pOp->mode == AM_ACC) ? pCpu->a : mem[ea];
+            uint8_t carryIn = pCpu->p & FLAG_C;
+            uint8_t carryOut;
+            if (pOp->op == OP_ASL || pOp->op == OP_ROL) {
+                carryOut = val >> 7;
+                val <<= 1;
+                if (pOp->op == OP_ROL) {
+                    val |= carryIn;
+                }
+            } else {
+                carryOut = val & 0x01;
+                val >>= 1;
+                if (pOp->op == OP_ROR) {
+                    val |= carryIn << 7;
+                }
+            }
+            pCpu->p = (pCpu->p & ~FLAG_C) | carryOut;
+            setNZ(pCpu, val);
+            if (pOp->mode == AM_ACC) {
+                pCpu->a = val;
+            } else {
+                mem[ea] = val;
+            }
+        }
+        break;
+    case OP_BCC:    branch = !(pCpu->p & FLAG_C);   break;
+    case OP_BCS:    branch = (pCpu->p & FLAG_C);    break;
+    case OP_BEQ:    branch = (pCpu->p & FLAG_Z);    break;
+    case OP_BNE:    branch = !(pCpu->p & FLAG_Z);   break;
+    case OP_BMI:    branch = (pCpu->p & FLAG_N);    break;
+    case OP_BPL:    branch = !(pCpu->p & FLAG_N);   break;
+    case OP_BVC:    branch = !(pCpu->p & FLAG_V);   break;
+    case OP_BVS:    branch = (pCpu->p & FLAG_V);    break;
+    case OP_BRA:    branch = true;                  break;
+    case OP_BIT:
+        val = mem[ea];
+        pCpu->p &= ~FLAG_Z;
+        if ((pCpu->a & val) == 0) {
+            pCpu->p |= FLAG_Z;
+        }
+        if (pOp->mode != AM_IMM) {
+            pCpu->p = (pCpu->p & ~(FLAG_N | FLAG_V)) | (val & 0xc0);
+        }
+        break;
+    case OP_BRK:
+        fprintf(stderr, "Hit BRK at $%04x\n", opAddr);
+        return false;
+    case OP_CLC:    pCpu->p &= ~FLAG_C;     break;
+    case OP_CLD:    pCpu->p &= ~FLAG_D;     break;
+    case OP_CLI:    pCpu->p &= ~FLAG_I;     break;
+    case OP_CLV:    pCpu->p &= ~FLAG_V;     break;
+    case OP_SEC:    pCpu->p |= FLAG_C;      break;
+    case OP_SED:    pCpu->p |= FLAG_D;      break;
+    case OP_SEI:    pCpu->p |= FLAG_I;      break;
+    case OP_CMP:    doCompare(pCpu, pCpu->a, mem[ea]);  break;
+    case OP_CPX:    doCompare(pCpu, pCpu->x, mem[ea]);  break;
+    case OP_CPY:    doCompare(pCpu, pCpu->y, mem[ea]);  break;
+    case OP_DEC:
+        if (pOp->mode == AM_ACC) {
+            setNZ(pCpu, --pCpu->a);
+        } else {
+            setNZ(pCpu, --mem[ea]);
+        }
+        break;
+    case OP_INC:
+        if (pOp->mode == AM_ACC) {
+            setNZ(pCpu, ++pCpu->a);
+        } else {
+            setNZ(pCpu, ++mem[ea]);
+        }
+        break;
+    case OP_DEX:    setNZ(pCpu, --pCpu->x);     break;
+    case OP_DEY:    setNZ(pCpu, --pCpu->y);     break;
+    case OP_INX:    setNZ(pCpu, ++pCpu->x);     break;
+    case OP_INY:    setNZ(pCpu, ++pCpu->y);     break;
+    case OP_JMP:
+        pCpu->pc = ea;
+        break;
+    case OP_JSR:
+        push(pCpu, (pCpu->pc - 1) >> 8);
+        push(pCpu, (pCpu->pc - 1) & 0xff);
+        pCpu->pc = ea;
+        break;
+    case OP_RTS:
+        pCpu->pc = pull(pCpu);
+        pCpu->pc |= pull(pCpu) << 8;
+        pCpu->pc++;
+        break;
+    case OP_RTI:
+        pCpu->p = pull(pCpu) | FLAG_U;
+        pCpu->pc = pull(pCpu);
+        pCpu->pc |= pull(pCpu) << 8;
+        break;
+    case OP_LDA:    pCpu->a = mem[ea];  setNZ(pCpu, pCpu->a);   break;
+    case OP_LDX:    pCpu->x = mem[ea];  setNZ(pCpu, pCpu->x);   break;
+    case OP_LDY:    pCpu->y = mem[ea];  setNZ(pCpu, pCpu->y);   break;
+    case OP_STA:    mem[ea] = pCpu->a;  break;
+    case OP_STX:    mem[ea] = pCpu->x;  break;
+    case OP_STY:    mem[ea] = pCpu->y;  break;
+    case OP_STZ:    mem[ea] = 0;        break;
+    case OP_NOP:    break;
+    case OP_PHA:    push(pCpu, pCpu->a);    break;
+    case OP_PHX:    push(pCpu, pCpu->x);    break;
+    case OP_PHY:    push(pCpu, pCpu->y);    break;
+    case OP_PHP:    push(pCpu, pCpu->p | FLAG_B | FLAG_U);  break;
+    case OP_PLA:    pCpu->a = pull(pCpu);   setNZ(pCpu, pCpu->a);   break;
+    case OP_PLX:    pCpu->x = pull(pCpu);   setNZ(pCpu, pCpu->x);   break;
+    case OP_PLY:    pCpu->y = pull(pCpu);   setNZ(pCpu, pCpu->y);   break;
+    case OP_PLP:    pCpu->p = pull(pCpu) | FLAG_U;  break;
+    case OP_TRB:
+    case OP_TSB:
+        val = mem[ea];
+        pCpu->p &= ~FLAG_Z;
+        if ((pCpu->a & val) == 0) {
+            pCpu->p |= FLAG_Z;
+        }
+        mem[ea] = (pOp->op == OP_TSB) ? (val | pCpu->a) : (val & ~pCpu->a);
+        break;
+    case OP_TAX:    pCpu->x = pCpu->a;  setNZ(pCpu, pCpu->x);   break;
+    case OP_TAY:    pCpu->y = pCpu->a;  setNZ(pCpu, pCpu->y);   break;
+    case OP_TSX:    pCpu->x = pCpu->s;  setNZ(pCpu, pCpu->x);   break;
+    case OP_TXA:    pCpu->a = pCpu->x;  setNZ(pCpu, pCpu->a);   break;
+    case OP_TXS:    pCpu->s = pCpu->x;  break;
+    case OP_TYA:    pCpu->a = pCpu->y;  setNZ(pCpu, pCpu->a);   break;
+    default:        break;      // 65816 only, see step816()
+    }
+
+    if (branch) {
+        pCpu->cycles++;
+        if ((pCpu->pc ^ ea) & 0xff00) {
+            pCpu->cycles++;
+        }
+        pCpu->pc = ea;
+    }
+    return true;
+}
+
+static void diskTrap(Cpu* pCpu);
+
+/*
+ * Calls the routine at "entry" as if with JSR, and runs until it
+ * returns.
+ *
+ * Returns 0 on success.
+ */
+static int runRoutine(Cpu* pCpu, uint16_t entry)
+{
+    pCpu->cycles = 0;
+    pCpu->s = 0xff;
+    push(pCpu, (HALT_ADDR - 1) >> 8);
+    push(pCpu, (HALT_ADDR - 1) & 0xff);
+    pCpu->pc = entry;
+
+    while (pCpu->pc != HALT_ADDR) {
+        if (pCpu->pc == DISK_TRAP_ADDR && pCpu->pDisk != NULL) {
+            diskTrap(pCpu);
+            continue;
+        }
+        if (pCpu->pc >= ROM_ADDR) {
+            fprintf(stderr, "Routine called ROM at $%04x\n", pCpu->pc);
+            return -1;
+        }
+        if (pCpu->cycles > MAX_CYCLES) {
+            fprintf(stderr, "Routine still running after %llu cycles\n",
+                (unsigned long long) pCpu->cycles);
+            return -1;
+        }
+        if (!step(pCpu)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * ==========================================================================
+ *      65816 CPU
+ * ==========================================================================
+ */
+
+/*
+ * The 65816 gets its own core rather than teaching step() about register
+ * widths and banks.  It decodes with the same opcode table, so the
+ * assembler and the emulator agree about encodings.
+ *
+ * Memory is a flat 16MB, with the assembled image in bank $00.  A IIgs
+ * runs most of memory at 2.8MHz but banks $E0/$E1 (and anything
+ * shadowed into them) at 1MHz; we count plain CPU cycles, as we do for
+ * the 8-bit parts, and leave the clock speed out of it.  Only the
+ * instructions the decoders might reasonably use are implemented:
+ * no COP, WAI, STP, PEI, PER, or JML/JSR through an indirect pointer.
+ */
+#define LONG_MEM_SIZE       (MEM_SIZE * 256)
+
+#define FLAG_X  0x10        // native mode: 8-bit index registers
+#define FLAG_M  0x20        // native mode: 8-bit accumulator/memory
+
+struct Cpu816 {
+    uint16_t a, x, y, s, d, pc;     // "a" is all 16 bits (B:A)
+    uint8_t p, dbr, pbr;
+    bool e;                         // emulation mode
+    uint64_t cycles;
+    uint8_t* mem;                   // LONG_MEM_SIZE bytes
+    const OpInfo* decode[256];
+};
+
+/*
+ * Resets the CPU to emulation mode, as a 6502 program would call us.
+ */
+static void initCpu816(Cpu816* pCpu, uint8_t* mem)
+{
+    memset(pCpu, 0, sizeof(*pCpu));
+    pCpu->mem = mem;
+    pCpu->s = 0x01ff;
+    pCpu->p = FLAG_M | FLAG_X | FLAG_I;     // B/U in emulation mode
+    pCpu->e = true;
+    for (size_t ii = 0; ii < NUM_OPS; ii++) {
+        pCpu->decode[gOpTable[ii].opcode] = &gOpTable[ii];
+    }
+}
+
+static inline bool accIs8(const Cpu816* pCpu)
+{
+    return pCpu->e || (pCpu->p & FLAG_M);
+}
+
+static inline bool idxIs8(const Cpu816* pCpu)
+{
+    return pCpu->e || (pCpu->p & FLAG_X);
+}
+
+static inline uint8_t read8L(const Cpu816* pCpu, uint32_t addr)
+{
+    return pCpu->mem[addr & (LONG_MEM_SIZE - 1)];
+}
+
+static inline uint16_t readWidth(const Cpu816* pCpu, uint32_t addr, bool wide)
+{
+    uint16_t val = read8L(pCpu, addr);
+    if (wide) {
+        val |= read8L(pCpu, addr + 1) << 8;
+    }
+    return val;
+}
+
+static inline void writeWidth(Cpu816* pCpu, uint32_t addr, uint16_t val,
+    bool wide)
+{
+    pCpu->mem[addr & (LONG_MEM_SIZE - 1)] = (uint8_t) val;
+    if (wide) {
+        pCpu->mem[(addr + 1) & (LONG_MEM_SIZE - 1)] = val >> 8;
+    }
+}
+
+static inline uint8_t fetch(Cpu816* pCpu)
+{
+    uint8_t val = pCpu->mem[(pCpu->pbr << 16) | pCpu->pc];
+    pCpu->pc++;
+    return val;
+}
+
+static inline uint16_t fetch16(Cpu816* pCpu)
+{
+    uint16_t val = fetch(pCpu);
+    return val | (fetch(pCpu) << 8);
+}
+
+/*
+ * Returns the bank 0 address of a direct page location.  In emulation
+ * mode with a page-aligned D, indexing wraps within the page.
+ */
+static inline uint32_t dpAddr(const Cpu816* pCpu, uint16_t offset)
+{
+    if (pCpu->e && (pCpu->d & 0xff) == 0) {
+        return pCpu->d | (offset & 0xff);
+    }
+    return (uint16_t) (pCpu->d + offset);
+}
+
+static inline uint16_t dpPtr(const Cpu816* pCpu, uint16_t offset)
+{
+    return read8L(pCpu, dpAddr(pCpu, offset)) |
+        (read8L(pCpu, dpAddr(pCpu, offset + 1)) << 8);
+}
+
+static inline void setNZ816(Cpu816* pCpu, uint16_t val, bool wide)
+{
+    uint16_t sign = wide ? 0x8000 : 0x80;
+    uint16_t mask = wide ? 0xffff : 0xff;
+    pCpu->p = (pCpu->p & ~(FLAG_N | FLAG_Z)) | ((val & sign) ? FLAG_N : 0) |
+        ((val & mask) == 0 ? FLAG_Z : 0);
+}
+
+static inline void push816(Cpu816* pCpu, uint8_t val)
+{
+    pCpu->mem[pCpu->s] = val;
+    pCpu->s = pCpu->e ? (0x0100 | ((pCpu->s - 1) & 0xff)) : pCpu->s - 1;
+}
+
+static inline uint8_t pull816(Cpu816* pCpu)
+{
+    pCpu->s = pCpu->e ? (0x0100 | ((pCpu->s + 1) & 0xff)) : pCpu->s + 1;
+    return pCpu->mem[pCpu->s];
+}
+
+static void pushWidth(Cpu816* pCpu, uint16_t val, bool wide)
+{
+    if (wide) {
+        push816(pCpu, val >> 8);
+    }
+    push816(pCpu, (uint8_t) val);
+}
+
+static uint16_t pullWidth(Cpu816* pCpu, bool wide)
+{
+    uint16_t val = pull816(pCpu);
+    if (wide) {
+        val |= pull816(pCpu) << 8;
+    }
+    return val;
+}
+
+/*
+ * Sets the accumulator; in 8-bit mode the high byte (B) is untouched.
+ */
+static inline void setAcc(Cpu816* pCpu, uint16_t val)
+{
+    if (accIs8(pCpu)) {
+        pCpu->a = (pCpu->a & 0xff00) | (val & 0xff);
+    } else {
+        pCpu->a = val;
+    }
+}
+
+/*
+ * Called after anything that changes P or E.  Going to 8-bit index
+ * registers clears their high bytes.
+ */
+static void updateWidths(Cpu816* pCpu)
+{
+    if (pCpu->e) {
+        pCpu->p |= FLAG_M | FLAG_X;
+        pCpu->s = 0x0100 | (pCpu->s & 0xff);
+    }
+    if (pCpu->p & FLAG_X) {
+        pCpu->x &= 0xff;
+        pCpu->y &= 0xff;
+    }
+}
+
+/*
+ * Executes one instruction.  Returns false if the instruction couldn't
+ * be executed (unimplemented opcode, BRK, decimal mode).
+ *
+ * Beyond the table's base count, 16-bit data costs a cycle per extra
+ * byte (two for read-modify-write), indexed reads cost a cycle when they
+ * cross a page or the index registers are 16 bits wide, direct page
+ * modes cost a cycle when D isn't page-aligned, and taken branches cost
+ * one more when they cross a page in emulation mode.
+ */
+static bool step816(Cpu816* pCpu)
+{
+    uint32_t opAddr = (pCpu->pbr << 16) | pCpu->pc;
+    const OpInfo* pOp = pCpu->decode[read8L(pCpu, opAddr)];
+    if (pOp == NULL) {
+        fprintf(stderr, "Unimplemented opcode $%02x at $%02x/%04x\n",
+            read8L(pCpu, opAddr), pCpu->pbr, pCpu->pc);
+        return false;
+    }
+    pCpu->pc++;
+
+    bool acc8 = accIs8(pCpu);
+    bool idx8 = idxIs8(pCpu);
+    bool wide = usesAccWidth(pOp->op) ? !acc8 :
+        usesIndexWidth(pOp->op) ? !idx8 : false;
+    uint16_t mask = wide ? 0xffff : 0xff;
+    uint16_t sign = wide ? 0x8000 : 0x80;
+    uint32_t dbank = pCpu->dbr << 16;
+    uint32_t ea = 0;
+    uint32_t base;
+    bool crossed = false;
+    bool direct = false;
+
+    switch (pOp->mode) {
+    case AM_IMP:
+    case AM_ACC:
+    case AM_BLK:
+        break;
+    case AM_IMM:
+        ea = (pCpu->pbr << 16) | pCpu->pc;
+        pCpu->pc += wide ? 2 : 1;
+        break;
+    case AM_ZP:
+        ea = dpAddr(pCpu, fetch(pCpu));
+        direct = true;
+        break;
+    case AM_ZPX:
+        ea = dpAddr(pCpu, fetch(pCpu) + pCpu->x);
+        direct = true;
+        break;
+    case AM_ZPY:
+        ea = dpAddr(pCpu, fetch(pCpu) + pCpu->y);
+        direct = true;
+        break;
+    case AM_ABS:
+        ea = dbank | fetch16(pCpu);
+        break;
+    case AM_ABSX:
+    case AM_ABSY:
+        base = dbank | fetch16(pCpu);
+        ea = (base + (pOp->mode == AM_ABSX ? pCpu->x : pCpu->y)) &
+            (LONG_MEM_SIZE - 1);
+        crossed = (base ^ ea) & ~0xff;
+        break;
+    case AM_IND:
+        ea = readWidth(pCpu, fetch16(pCpu), true);
+        break;
+    case AM_INDX:
+        ea = dbank | dpPtr(pCpu, fetch(pCpu) + pCpu->x);
+        direct = true;
+        break;
+    case AM_INDY:
+        base = dbank | dpPtr(pCpu, fetch(pCpu));
+        ea = (base + pCpu->y) & (LONG_MEM_SIZE - 1);
+        crossed = (base ^ ea) & ~0xff;
+        direct = true;
+        break;
+    case AM_ZPI:
+        ea = dbank | dpPtr(pCpu, fetch(pCpu));
+        direct = true;
+        break;
+    case AM_ABSIX:
+        base = (uint16_t) (fetch16(pCpu) + pCpu->x);
+        ea = readWidth(pCpu, (pCpu->pbr << 16) | base, true);
+        break;
+    case AM_REL:
+        base = (int8_t) fetch(pCpu);
+        ea = (uint16_t) (pCpu->pc + base);
+        break;
+    case AM_RELL:
+        base = (int16_t) fetch16(pCpu);
+        ea = (uint16_t) (pCpu->pc + base);
+        break;
+    case AM_ABSL:
+    case AM_ABSLX:
+        ea = fetch16(pCpu);
+        ea |= fetch(pCpu) << 16;
+        if (pOp->mode == AM_ABSLX) {
+            ea = (ea + pCpu->x) & (LONG_MEM_SIZE - 1);
+        }
+        break;
+    case AM_DPIL:
+    case AM_DPILY:
+        {
+            uint16_t offset = fetch(pCpu);
+            ea = dpPtr(pCpu, offset) |
+                (read8L(pCpu, dpAddr(pCpu, offset + 2)) << 16);
+            if (pOp->mode == AM_DPILY) {
+                ea = (ea + pCpu->y) & (LONG_MEM_SIZE - 1);
+            }
+            direct = true;
+        }
+        break;
+    case AM_SR:
+        ea = (uint16_t) (pCpu->s + fetch(pCpu));
+        break;
+    case AM_SRIY:
+        base = (uint16_t) (pCpu->s + fetch(pCpu));
+        ea = ((dbank | readWidth(pCpu, base, true)) + pCpu->y) &
+            (LONG_MEM_SIZE - 1);
+        break;
+    }
+
+    pCpu->cycles += pOp->cycles & ~PX;
+    if ((pOp->cycles & PX) && (crossed || !idx8)) {
+        pCpu->cycles++;
+    }
+    if (direct && (pCpu->d & 0xff) != 0) {
+        pCpu->cycles++;
+    }
+    bool rmw = (pOp->op == OP_ASL || pOp->op == OP_LSR ||
+        pOp->op == OP_ROL || pOp->op == OP_ROR || pOp->op == OP_INC ||
+        pOp->op == OP_DEC || pOp->op == OP_TRB || pOp->op == OP_TSB);
+    if (wide && pOp->mode != AM_ACC) {
+        pCpu->cycles += rmw ? 2 : 1;
+    }
+
+    uint16_t acc = acc8 ? (pCpu->a & 0xff) : pCpu->a;
+    uint16_t val;
+    bool branch = false;
+    switch (pOp->op) {
+    case OP_ADC:
+    case OP_SBC:
+        if (pCpu->p & FLAG_D) {
+            fprintf(stderr, "Decimal mode not supported ($%02x/%04x)\n",
+                opAddr >> 16, opAddr & 0xffff);
+            return false;
+        }
+        val = readWidth(pCpu, ea, wide);
+        if (pOp->op == OP_SBC) {
+            val = ~val & mask;
+        }
+        {
+            uint32_t sum = acc + val + (pCpu->p & FLAG_C);
+            pCpu->p &= ~(FLAG_C | FLAG_V);
+            if (sum > mask) {
+                pCpu->p |= FLAG_C;
+            }
+            if (~(acc ^ val) & (acc ^ sum) & sign) {
+                pCpu->p |= FLAG_V;
+            }
+            setAcc(pCpu, sum);
+            setNZ816(pCpu, sum, wide);
+        }
+        break;
+    case OP_AND:
+        setAcc(pCpu, acc & readWidth(pCpu, ea, wide));
+        setNZ816(pCpu, pCpu->a, wide);
+        break;
+    case OP_ORA:
+        setAcc(pCpu, acc | readWidth(pCpu, ea, wide));
+        setNZ816(pCpu, pCpu->a, wide);
+        break;
+    case OP_EOR:
+        setAcc(pCpu, acc ^ readWidth(pCpu, ea, wide));
+        setNZ816(pCpu, pCpu->a, wide);
+        break;
+    case OP_ASL:
+    case OP_LSR:
+    case OP_ROL:
+    case OP_ROR:
+        {
+            val = (pOp->mode == AM_ACC) ? acc : readWidth(pCpu, ea, wide);
+            uint16_t carryIn = pCpu->p & FLAG_C;
+            uint8_t carryOut;
+            if (pOp->op == OP_ASL || pOp->op == OP_ROL) {
+                carryOut = (val & sign) != 0;
+                val = (val << 1) & mask;
+                if (pOp->op == OP_ROL) {
+                    val |= carryIn;
+                }
+            } else {
+                carryOut = val & 0x01;
+                val >>= 1;
+                if (pOp->op == OP_ROR && carryIn) {
+                    val |= sign;
+                }
+            }
+            pCpu->p = (pCpu->p & ~FLAG_C) | carryOut;
+            setNZ816(pCpu, val, wide);
+            if (pOp->mode == AM_ACC) {
+                setAcc(pCpu, val);
+            } else {
+                writeWidth(pCpu, ea, val, wide);
+            }
+        }
+        break;
+    case OP_BCC:    branch = !(pCpu->p & FLAG_C);   break;
+    case OP_BCS:    branch = (pCpu->p & FLAG_C);    break;
+    case OP_BEQ:    branch = (pCpu->p & FLAG_Z);    break;
+    case OP_BNE:    branch = !(pCpu->p & FLAG_Z);   break;
+    case OP_BMI:    branch = (pCpu->p & FLAG_N);    break;
+    case OP_BPL:    branch = !(pCpu->p & FLAG_N);   break;
+    case OP_BVC:    branch = !(pCpu->p & FLAG_V);   break;
+    case OP_BVS:    branch = (pCpu->p & FLAG_V);    break;
+    case OP_BRA:    branch = true;                  break;
+    case OP_BRL:    pCpu->pc = ea;                  break;
+    case OP_BIT:
+        val = readWidth(pCpu, ea, wide);
+        pCpu->p &= ~FLAG_Z;
+        if ((acc & val) == 0) {
+            pCpu->p |= FLAG_Z;
+        }
+        if (pOp->mode != AM_IMM) {
+            pCpu->p = (pCpu->p & ~(FLAG_N | FLAG_V)) |
+                ((val & sign) ? FLAG_N : 0) |
+                ((val & (sign >> 1)) ? FLAG_V : 0);
+        }
+        break;
+    case OP_BRK:
+        fprintf(stderr, "Hit BRK at $%02x/%04x\n", opAddr >> 16,
+            opAddr & 0xffff);
+        return false;
+    case OP_CLC:    pCpu->p &= ~FLAG_C;     break;
+    case OP_CLD:    pCpu->p &= ~FLAG_D;     break;
+    case OP_CLI:    pCpu->p &= ~FLAG_I;     break;
+    case OP_CLV:    pCpu->p &= ~FLAG_V;     break;
+    case OP_SEC:    pCpu->p |= FLAG_C;      break;
+    case OP_SED:    pCpu->p |= FLAG_D;      break;
+    case OP_SEI:    pCpu->p |= FLAG_I;      break;
+    case OP_CMP:
+    case OP_CPX:
+    case OP_CPY:
+        {
+            uint16_t reg = (pOp->op == OP_CMP) ? acc :
+                (pOp->op == OP_CPX) ? pCpu->x : pCpu->y;
+            val = readWidth(pCpu, ea, wide);
+            setNZ816(pCpu, reg - val, wide);
+            pCpu->p = (pCpu->p & ~FLAG_C) | (reg >= val ? FLAG_C : 0);
+        }
+        break;
+    case OP_DEC:
+    case OP_INC:
+        val = (pOp->mode == AM_ACC) ? acc : readWidth(pCpu, ea, wide);
+        val = (val + (pOp->op == OP_INC ? 1 : -1)) & mask;
+        if (pOp->mode == AM_ACC) {
+            setAcc(pCpu, val);
+        } else {
+            writeWidth(pCpu, ea, val, wide);
+        }
+        setNZ816(pCpu, val, wide);
+        break;
+    case OP_DEX:
+    case OP_INX:
+        pCpu->x = (pCpu->x + (pOp->op == OP_INX ? 1 : -1)) &
+            (idx8 ? 0xff : 0xffff);
+        setNZ816(pCpu, pCpu->x, !idx8);
+        break;
+    case OP_DEY:
+    case OP_INY:
+        pCpu->y = (pCpu->y + (pOp->op == OP_INY ? 1 : -1)) &
+            (idx8 ? 0xff : 0xffff);
+        setNZ816(pCpu, pCpu->y, !idx8);
+        break;
+    case OP_JMP:
+        pCpu->pc = ea;
+        break;
+    case OP_JML:
+        pCpu->pbr = ea >> 16;
+        pCpu->pc = ea;
+        break;
+    case OP_JSR:
+        pushWidth(pCpu, pCpu->pc - 1, true);
+        pCpu->pc = ea;
+        break;
+    case OP_JSL:
+        push816(pCpu, pCpu->pbr);
+        pushWidth(pCpu, pCpu->pc - 1, true);
+        pCpu->pbr = ea >> 16;
+        pCpu->pc = ea;
+        break;
+    case OP_RTS:
+        pCpu->pc = pullWidth(pCpu, true) + 1;
+        break;
+    case OP_RTL:
+        pCpu->pc = pullWidth(pCpu, true) + 1;
+        pCpu->pbr = pull816(pCpu);
+        break;
+    case OP_RTI:
+        pCpu->p = pull816(pCpu);
+        pCpu->pc = pullWidth(pCpu, true);
+        if (!pCpu->e) {
+            pCpu->pbr = pull816(pCpu);
+            pCpu->cycles++;
+        }
+        updateWidths(pCpu);
+        break;
+    case OP_LDA:
+        setAcc(pCpu, readWidth(pCpu, ea, wide));
+        setNZ816(pCpu, pCpu->a, wide);
+        break;
+    case OP_LDX:
+        pCpu->x = readWidth(pCpu, ea, wide);
+        setNZ816(pCpu, pCpu->x, wide);
+        break;
+    case OP_LDY:
+        pCpu->y = readWidth(pCpu, ea, wide);
+        setNZ816(pCpu, pCpu->y, wide);
+        break;
+    case OP_STA:    writeWidth(pCpu, ea, acc, wide);        break;
+    case OP_STX:    writeWidth(pCpu, ea, pCpu->x, wide);    break;
+    case OP_STY:    writeWidth(pCpu, ea, pCpu->y, wide);    break;
+    case OP_STZ:    writeWidth(pCpu, ea, 0, wide);          break;
+    case OP_NOP:    break;
+    case OP_PHA:    pushWidth(pCpu, acc, wide);             break;
+    case OP_PHX:    pushWidth(pCpu, pCpu->x, wide);         break;
+    case OP_PHY:    pushWidth(pCpu, pCpu->y, wide);         break;
+    case OP_PHP:    push816(pCpu, pCpu->p);                 break;
+    case OP_PHB:    push816(pCpu, pCpu->dbr);               break;
+    case OP_PHK:    push816(pCpu, pCpu->pbr);               break;
+    case OP_PHD:    pushWidth(pCpu, pCpu->d, true);         break;
+    case OP_PEA:    pushWidth(pCpu, ea, true);              break;
+    case OP_PLA:
+        setAcc(pCpu, pullWidth(pCpu, wide));
+        setNZ816(pCpu, pCpu->a, wide);
+        break;
+    case OP_PLX:
+        pCpu->x = pullWidth(pCpu, wide);
+        setNZ816(pCpu, pCpu->x, wide);
+        break;
+    case OP_PLY:
+        pCpu->y = pullWidth(pCpu, wide);
+        setNZ816(pCpu, pCpu->y, wide);
+        break;
+    case OP_PLP:
+        pCpu->p = pull816(pCpu);
+        updateWidths(pCpu);
+        break;
+    case OP_PLB:
+        pCpu->dbr = pull816(pCpu);
+        setNZ816(pCpu, pCpu->dbr, false);
+        break;
+    case OP_PLD:
+        pCpu->d = pullWidth(pCpu, true);
+        setNZ816(pCpu, pCpu->d, true);
+        break;
+    case OP_REP:
+        pCpu->p &= ~read8L(pCpu, ea);
+        updateWidths(pCpu);
+        break;
+    case OP_SEP:
+        pCpu->p |= read8L(pCpu, ea);
+        updateWidths(pCpu);
+        break;
+    case OP_TRB:
+    case OP_TSB:
+        val = readWidth(pCpu, ea, wide);
+        pCpu->p &= ~FLAG_Z;
+        if ((acc & val) == 0) {
+            pCpu->p |= FLAG_Z;
+        }
+        writeWidth(pCpu, ea,
+            (pOp->op == OP_TSB) ? (val | acc) : (val & ~acc), wide);
+        break;
+    case OP_TAX:
+    case OP_TAY:
+        val = idx8 ? (pCpu->a & 0xff) : pCpu->a;
+        if (pOp->op == OP_TAX) {
+            pCpu->x = val;
+        } else {
+            pCpu->y = val;
+        }
+        setNZ816(pCpu, val, !idx8);
+        break;
+    case OP_TXA:
+    case OP_TYA:
+        setAcc(pCpu, pOp->op == OP_TXA ? pCpu->x : pCpu->y);
+        setNZ816(pCpu, pCpu->a, !acc8);
+        break;
+    case OP_TXY:
+        pCpu->y = pCpu->x;
+        setNZ816(pCpu, pCpu->y, !idx8);
+        break;
+    case OP_TYX:
+        pCpu->x = pCpu->y;
+        setNZ816(pCpu, pCpu->x, !idx8);
+        break;
+    case OP_TSX:
+        pCpu->x = idx8 ? (pCpu->s & 0xff) : pCpu->s;
+        setNZ816(pCpu, pCpu->x, !idx8);
+        break;
+    case OP_TXS:
+        pCpu->s = pCpu->e ? (0x0100 | (pCpu->x & 0xff)) : pCpu->x;
+        break;
+    case OP_TCS:
+        pCpu->s = pCpu->e ? (0x0100 | (pCpu->a & 0xff)) : pCpu->a;
+        break;
+    case OP_TSC:
+        pCpu->a = pCpu->s;
+        setNZ816(pCpu, pCpu->a, true);
+        break;
+    case OP_TCD:
+        pCpu->d = pCpu->a;
+        setNZ816(pCpu, pCpu->d, true);
+        break;
+    case OP_TDC:
+        pCpu->a = pCpu->d;
+        setNZ816(pCpu, pCpu->a, true);
+        break;
+    case OP_XBA:
+        pCpu->a = (pCpu->a >> 8) | (pCpu->a << 8);
+        setNZ816(pCpu, pCpu->a, false);
+        break;
+    case OP_XCE:
+        {
+            bool carry = (pCpu->p & FLAG_C) != 0;
+            pCpu->p = (pCpu->p & ~FLAG_C) | (pCpu->e ? FLAG_C : 0);
+            pCpu->e = carry;
+            updateWidths(pCpu);
+        }
+        break;
+    case OP_MVN:
+    case OP_MVP:
+        {
+            // The real thing re-executes itself for each byte, 7 cycles
+            // a time; we just do the whole move here.
+            uint8_t dstBank = fetch(pCpu);
+            uint8_t srcBank = fetch(pCpu);
+            uint16_t idxMask = idx8 ? 0xff : 0xffff;
+            int delta = (pOp->op == OP_MVN) ? 1 : -1;
+            pCpu->dbr = dstBank;
+            while (true) {
+                pCpu->mem[(dstBank << 16) | pCpu->y] =
+                    pCpu->mem[(srcBank << 16) | pCpu->x];
+                pCpu->x = (pCpu->x + delta) & idxMask;
+                pCpu->y = (pCpu->y + delta) & idxMask;
+                if (pCpu->a-- == 0) {
+                    break;
+                }
+                pCpu->cycles += 7;
+            }
+        }
+        break;
+    default:
+        fprintf(stderr, "Unimplemented op at $%02x/%04x\n", opAddr >> 16,
+            opAddr & 0xffff);
+        return false;
+    }
+
+    if (branch) {
+        pCpu->cycles++;
+        if (pCpu->e && ((pCpu->pc ^ ea) & 0xff00)) {
+            pCpu->cycles++;
+        }
+        pCpu->pc = ea;
+    }
+    return true;
+}
+
+/*
+ * Calls the routine at "entry" in bank 0 as if with JSR from emulation
+ * mode, and runs until it returns.  The routine must hand back the
+ * processor the way it found it: emulation mode, data bank 0.
+ *
+ * Returns 0 on success.
+ */
+static int runRoutine816(Cpu816* pCpu, uint16_t entry)
+{
+    pCpu->cycles = 0;
+    pushWidth(pCpu, HALT_ADDR - 1, true);
+    pCpu->pc = entry;
+
+    while (pCpu->pbr != 0 || pCpu->pc != HALT_ADDR) {
+        if (pCpu->pbr == 0 && pCpu->pc >= ROM_ADDR) {
+            fprintf(stderr, "Routine called ROM at $%04x\n", pCpu->pc);
+            return -1;
+        }
+        if (pCpu->cycles > MAX_CYCLES) {
+            fprintf(stderr, "Routine still running after %llu cycles\n",
+                (unsigned long long) pCpu->cycles);
+            return -1;
+        }
+        if (!step816(pCpu)) {
+            return -1;
+        }
+    }
+    if (!pCpu->e || pCpu->dbr != 0) {
+        fprintf(stderr, "Routine returned in %s mode with data bank $%02x\n",
+            pCpu->e ? "emulation" : "native", pCpu->dbr);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * ==========================================================================
+ *      Disk model
+ * ==========================================================================
+ */
+
+/*
+ * A 5.25" floppy, read one 256-byte sector at a time, for timing the
+ * streaming decoder.  The file starts at the first sector of a track
+ * and runs through consecutive logical sectors, which sit on the disk
+ * with a 2:1 interleave.  When the first read is issued, the head is on
+ * the right track, at the start of physical sector 0.  A read waits for the sector to come
+ * around, then takes one sector time; moving to the next track costs
+ * STEP_CYCLES, during which the disk keeps turning.  The software
+ * overhead of a real RWTS is ignored.
+ */
+struct Disk {
+    const uint8_t* data;
+    long len;
+    uint16_t bufAddr;       // where sector 0 goes
+    bool preload;           // first read delivers the whole file, free
+    int nextSector;
+    int track;
+    uint64_t startCycles;   // when the first read was issued
+};
+
+/*
+ * Returns the number of sectors in a file of "len" bytes.
+ */
+static int sectorCount(long len)
+{
+    return (int) ((len + SECTOR_LEN - 1) / SECTOR_LEN);
+}
+
+/*
+ * Reads the next sector of the file into "mem", advancing "*pCycles" by
+ * the time it takes.  Returns the page after the last one loaded, or 0
+ * if that was the end of the file.
+ */
+static uint8_t diskReadSector(Disk* pDisk, uint8_t* mem, uint64_t* pCycles)
+{
+    int numSectors = sectorCount(pDisk->len);
+    if (pDisk->preload) {
+        memcpy(mem + pDisk->bufAddr, pDisk->data, pDisk->len);
+        pDisk->nextSector = numSectors;
+        return 0;
+    }
+    if (pDisk->nextSector >= numSectors) {
+        return 0;
+    }
+
+    if (pDisk->nextSector == 0) {
+        pDisk->startCycles = *pCycles;
+    }
+    int sector = pDisk->nextSector++;
+    int track = sector / SECTORS_PER_TRACK;
+    if (track != pDisk->track) {
+        *pCycles += STEP_CYCLES * (track - pDisk->track);
+        pDisk->track = track;
+    }
+    int logical = sector % SECTORS_PER_TRACK;
+    int physical = (logical * 2) % SECTORS_PER_TRACK +
+        (logical * 2) / SECTORS_PER_TRACK;
+    uint64_t start = physical * SECTOR_CYCLES;
+    uint64_t posn = (*pCycles - pDisk->startCycles) % REV_CYCLES;
+    *pCycles += (start + REV_CYCLES - posn) % REV_CYCLES + SECTOR_CYCLES;
+
+    long offset = (long) sector * SECTOR_LEN;
+    long count = pDisk->len - offset;
+    if (count > SECTOR_LEN) {
+        count = SECTOR_LEN;
+    }
+    memcpy(mem + pDisk->bufAddr + offset, pDisk->data + offset, count);
+    if (pDisk->nextSector == numSectors) {
+        return 0;
+    }
+    return (pDisk->bufAddr + offset + SECTOR_LEN) >> 8;
+}
+
+/*
+ * Returns the cycles needed to read all of a "len"-byte file, one
+ * sector right after another.
+ */
+static uint64_t serialLoadCycles(long len)
+{
+    static uint8_t scratch[MEM_SIZE];
+    static uint8_t zeroes[MEM_SIZE];
+    Disk disk = { zeroes, len, 0, false, 0, 0, 0 };
+    uint64_t cycles = 0;
+    while (disk.nextSector < sectorCount(len)) {
+        diskReadSector(&disk, scratch, &cycles);
+    }
+    return cycles;
+}
+
+/*
+ * Handles a JSR to DISK_TRAP_ADDR: reads a sector, puts the result in A,
+ * and returns.
+ */
+static void diskTrap(Cpu* pCpu)
+{
+    pCpu->a = diskReadSector(pCpu->pDisk, pCpu->mem, &pCpu->cycles);
+    setNZ(pCpu, pCpu->a);
+    pCpu->pc = pull(pCpu);
+    pCpu->pc |= pull(pCpu) << 8;
+    pCpu->pc++;
+    pCpu->cycles += 6;      // RTS
+}
+
+
+/*
+ * ==========================================================================
+ *      Test harness
+ * ==========================================================================
+ */
+
+/*
+ * Print usage info.
+ */
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+        "fhemu v1.0 -*- Copyright 2026 by the fhpack contributors\n");
+    fprintf(stderr,
+        "Source code available from https://github.com/fadden/fhpack\n\n");
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "  %s -a [-c] source.S outfile\n", argv0);
+    fprintf(stderr, "  %s {-d|-e|-s} [-c] [-i] [-x ext] source.S file1 [file2...]\n",
+        argv0);
+    fprintf(stderr, "  %s -d [-b src,dst] [-o addr] [-i] [-x ext] source.S file1 [...]\n",
+        argv0);
+    fprintf(stderr, "  %s -d -m model.txt [-i] [-x ext] source.S file1 [...]\n\n",
+        argv0);
+    fprintf(stderr, "Use -a to assemble, -d to run a decoder on compressed files,\n");
+    fprintf(stderr, "-e to run an encoder on uncompressed files, -s to run a\n");
+    fprintf(stderr, "streaming decoder on compressed files read from a simulated floppy\n");
+    fprintf(stderr, " -b: 65816 source and output banks, in hex (default 00,00)\n");
+    fprintf(stderr, " -c: emulate a 65C02 (automatic if the source uses XC)\n");
+    fprintf(stderr, " -o: output address, in hex (default 2000)\n");
+    fprintf(stderr, " -i: ignore the screen holes when comparing output\n");
+    fprintf(stderr, " -x: compare output to file with this suffix appended\n");
+    fprintf(stderr, " -m: fail if the cycles are more than %.1f%% off fhpack's model,\n",
+        MODEL_TOLERANCE);
+    fprintf(stderr, "     as listed by \"fhpack -n\" in this file\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Example: fhemu -d -x .pic LZ4FH6502.S foo.lz4fh\n");
+}
+
+/*
+ * Reads an entire file into "buf".  Returns the length, or -1 on failure.
+ */
+static long readFile(const char* fileName, uint8_t* buf, long maxLen)
+{
+    FILE* fp = fopen(fileName, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Unable to open '%s'\n", fileName);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long fileLen = ftell(fp);
+    rewind(fp);
+    if (fileLen > maxLen) {
+        fprintf(stderr, "ERROR: %s is %ld bytes, max is %ld\n",
+            fileName, fileLen, maxLen);
+        fclose(fp);
+        return -1;
+    }
+    if (fread(buf, 1, fileLen, fp) != (size_t) fileLen) {
+        perror("Failed while reading data");
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return fileLen;
+}
+
+/*
+ * Compares the output at "data" to the reference file named by
+ * appending "suffix" to "fileName".  When "useRefLen" is set, the output
+ * length is unknown (a decoder could legitimately write our 0xcc fill
+ * value at the end), so we take it from the reference file and update
+ * "*pLen".  When "ignoreHoles" is set, the hi-res screen holes aren't
+ * compared.
+ *
+ * Returns 0 if they match.
+ */
+static int compareToReference(const char* fileName, const char* suffix,
+    const uint8_t* data, bool useRefLen, bool ignoreHoles, long* pLen)
+{
+    std::string refName = std::string(fileName) + suffix;
+    static uint8_t refBuf[MEM_SIZE];
+    long refLen = readFile(refName.c_str(), refBuf, sizeof(refBuf));
+    if (refLen < 0) {
+        return -1;
+    }
+    long len = *pLen;
+    if (useRefLen && refLen >= len && refLen <= 0x2000) {
+        len = *pLen = refLen;
+    }
+    if (refLen != len) {
+        fprintf(stderr, "  ERROR: output is %ld bytes, %s is %ld\n",
+            len, refName.c_str(), refLen);
+        return -1;
+    }
+    for (long ii = 0; ii < len; ii++) {
+        if (ignoreHoles && (ii & 0x7f) >= 120) {
+            continue;
+        }
+        if (data[ii] != refBuf[ii]) {
+            fprintf(stderr, "  ERROR: mismatch at +$%04lx (0x%02x vs. 0x%02x)\n",
+                ii, data[ii], refBuf[ii]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reads the modelled cycle counts from "fileName", the saved output of
+ * "fhpack -n", which has lines like:
+ *
+ *   foo.lz4fh: LZ4FH (6502 215847 cycles), no metadata header
+ *
+ * Returns 0 on success.
+ */
+static int loadModel(const char* fileName, std::map<std::string, long>* pModel)
+{
+    static const char kTag[] = ": LZ4FH (6502 ";
+    FILE* fp = fopen(fileName, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Unable to open '%s'\n", fileName);
+        return -1;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char* tag = strstr(line, kTag);
+        long cycles;
+        if (tag != NULL &&
+                sscanf(tag + sizeof(kTag) - 1, "%ld cycles)", &cycles) == 1) {
+            (*pModel)[std::string(line, tag - line)] = cycles;
+        }
+    }
+    fclose(fp);
+    if (pModel->empty()) {
+        fprintf(stderr, "ERROR: no cycle counts in '%s' (want fhpack -n)\n",
+            fileName);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Runs the routine against one file.  "*pCycles" receives the cycle
+ * count, "*pOutLen" the length of the output.
+ *
+ * Returns 0 on success.
+ */
+static int runOneFile(ProgramMode mode, CpuType cpuType, const uint8_t* image,
+    long entry, const char* fileName, const char* refSuffix, bool ignoreHoles,
+    bool preload, int srcBank, int dstBank, uint16_t outAddr,
+    uint64_t* pCycles, long* pInLen, long* pOutLen)
+{
+    static uint8_t* mem = NULL;
+    static uint8_t fileBuf[MEM_SIZE];
+    Cpu cpu;
+    Cpu816 cpu816;
+
+    long fileLen = readFile(fileName, fileBuf, MAX_DATA_LEN);
+    if (fileLen < 0) {
+        return -1;
+    }
+    if (mem == NULL) {
+        // Room for every bank the 65816 can reach; the 8-bit parts
+        // just use bank 0.
+        mem = (uint8_t*) calloc(1, LONG_MEM_SIZE);
+        if (mem == NULL) {
+            fprintf(stderr, "ERROR: unable to allocate emulated memory\n");
+            return -1;
+        }
+    }
+
+    // Start from the freshly-assembled image each time, with the output
+    // area filled with junk so we notice bytes that don't get written.
+    memcpy(mem, image, MEM_SIZE);
+    if (cpuType == CPU_65816) {
+        initCpu816(&cpu816, mem);
+    } else {
+        initCpu(&cpu, cpuType, mem);
+    }
+
+    uint16_t src, dst;
+    uint8_t* outPtr;
+    if (mode == MODE_DECODE || mode == MODE_STREAM) {
+        src = DATA_ADDR;
+        dst = outAddr;
+        outPtr = mem + (dstBank << 16) + dst;
+        memset(outPtr, 0xcc, 0x2000);
+        mem[PARAM_BANKS] = srcBank;
+        mem[PARAM_BANKS + 1] = dstBank;
+    } else {
+        if (fileLen > 0x2000) {
+            fprintf(stderr, "ERROR: %s is %ld bytes, max is %d\n",
+                fileName, fileLen, 0x2000);
+            return -1;
+        }
+        src = HIRES_ADDR;
+        dst = DATA_ADDR;
+        memset(mem + DATA_ADDR, 0xcc, MAX_ENC_OUT);     // encoder may follow
+        outPtr = mem + dst;
+        mem[PARAM_LEN] = fileLen & 0xff;
+        mem[PARAM_LEN + 1] = fileLen >> 8;
+    }
+    Disk disk = { fileBuf, fileLen, src, preload, 0, 0, 0 };
+    if (mode == MODE_STREAM) {
+        // The decoder asks for the file a sector at a time.
+        cpu.pDisk = &disk;
+        mem[PARAM_MORE] = DISK_TRAP_ADDR & 0xff;
+        mem[PARAM_MORE + 1] = DISK_TRAP_ADDR >> 8;
+    } else {
+        uint8_t* srcPtr = mem + (srcBank << 16) + src;
+        if (srcBank != 0) {
+            memset(srcPtr, 0x00, MAX_DATA_LEN);     // no leftovers
+        }
+        memcpy(srcPtr, fileBuf, fileLen);
+    }
+    mem[PARAM_SRC] = src & 0xff;
+    mem[PARAM_SRC + 1] = src >> 8;
+    mem[PARAM_DST] = dst & 0xff;
+    mem[PARAM_DST + 1] = dst >> 8;
+
+    int result;
+    uint64_t cycles;
+    if (cpuType == CPU_65816) {
+        result = runRoutine816(&cpu816, entry);
+        cycles = cpu816.cycles;
+    } else {
+        result = runRoutine(&cpu, entry);
+        cycles = cpu.cycles;
+    }
+    if (result != 0) {
+        fprintf(stderr, "  %s: failed after %llu cycles\n", fileName,
+            (unsigned long long) cycles);
+        return -1;
+    }
+
+    long outLen;
+    if (mode != MODE_ENCODE) {
+        // Output length is implied; find the last byte written.
+        outLen = 0x2000;
+        while (outLen > 0 && outPtr[outLen - 1] == 0xcc) {
+            outLen--;
+        }
+    } else {
+        outLen = mem[PARAM_LEN] | (mem[PARAM_LEN + 1] << 8);
+    }
+
+    *pCycles = cycles;
+    *pInLen = fileLen;
+    *pOutLen = outLen;
+
+    if (refSuffix != NULL &&
+            compareToReference(fileName, refSuffix, outPtr, mode != MODE_ENCODE,
+                ignoreHoles, pOutLen) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Process args.
+ */
+int main(int argc, char* argv[])
+{
+    ProgramMode mode = MODE_UNKNOWN;
+    CpuType cpuType = CPU_6502;
+    const char* refSuffix = NULL;
+    const char* modelFileName = NULL;
+    bool ignoreHoles = false;
+    bool wantUsage = false;
+    unsigned int srcBank = 0, dstBank = 0;
+    unsigned long outAddr = HIRES_ADDR;
+    char* endp;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ab:cdeim:o:sx:")) != -1) {
+        switch (opt) {
+        case 'a':
+        case 'd':
+        case 'e':
+        case 's':
+            if (mode == MODE_UNKNOWN) {
+                mode = (opt == 'a') ? MODE_ASSEMBLE :
+                    (opt == 'd') ? MODE_DECODE :
+                    (opt == 's') ? MODE_STREAM : MODE_ENCODE;
+            } else {
+                wantUsage = true;
+            }
+            break;
+        case 'b':
+            if (sscanf(optarg, "%x,%x", &srcBank, &dstBank) != 2 ||
+                    srcBank > 0xff || dstBank > 0xff) {
+                fprintf(stderr, "ERROR: -b wants two hex bank numbers, "
+                    "e.g. 02,e1\n");
+                return 2;
+            }
+            break;
+        case 'c':
+            cpuType = CPU_65C02;
+            break;
+        case 'o':
+            outAddr = strtoul(optarg, &endp, 16);
+            if (*endp != '\0' || outAddr + 0x2000 > MEM_SIZE) {
+                fprintf(stderr, "ERROR: bad output address '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'i':
+            ignoreHoles = true;
+            break;
+        case 'm':
+            modelFileName = optarg;
+            break;
+        case 'x':
+            refSuffix = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (argc - optind < 2 || (mode == MODE_ASSEMBLE && argc - optind != 2)) {
+        wantUsage = true;
+    }
+    if (mode == MODE_UNKNOWN || wantUsage) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    static uint8_t image[MEM_SIZE];
+    long entry, codeLen;
+    const char* srcFileName = argv[optind++];
+    if (assembleFile(srcFileName, &cpuType, image, &entry, &codeLen) != 0) {
+        return 1;
+    }
+
+    if (mode == MODE_ASSEMBLE) {
+        const char* outFileName = argv[optind];
+        FILE* fp = fopen(outFileName, "wb");
+        if (fp == NULL) {
+            perror("Unable to open output file");
+            return 1;
+        }
+        if (fwrite(image + entry, 1, codeLen, fp) != (size_t) codeLen) {
+            perror("Failed while writing data");
+            fclose(fp);
+            unlink(outFileName);
+            return 1;
+        }
+        fclose(fp);
+        printf("Assembled %s: %ld bytes at $%04lx\n", srcFileName, codeLen,
+            entry);
+        return 0;
+    }
+
+    if (cpuType != CPU_65816 && (srcBank != 0 || dstBank != 0)) {
+        fprintf(stderr, "ERROR: -b needs a 65816 decoder\n");
+        return 2;
+    }
+    if (cpuType == CPU_65816 && mode == MODE_STREAM) {
+        fprintf(stderr, "ERROR: streaming isn't supported on the 65816\n");
+        return 2;
+    }
+    if ((srcBank != 0 || dstBank != 0 || outAddr != HIRES_ADDR) &&
+            mode != MODE_DECODE) {
+        fprintf(stderr, "ERROR: -b and -o only apply to -d\n");
+        return 2;
+    }
+    if (modelFileName != NULL && mode != MODE_DECODE) {
+        fprintf(stderr, "ERROR: -m only applies to -d\n");
+        return 2;
+    }
+    std::map<std::string, long> model;
+    if (modelFileName != NULL && loadModel(modelFileName, &model) != 0) {
+        return 1;
+    }
+    if (srcBank == dstBank && outAddr + 0x2000 > DATA_ADDR &&
+            outAddr < DATA_ADDR + MAX_DATA_LEN) {
+        fprintf(stderr, "ERROR: output at $%04lx overlaps the input\n",
+            outAddr);
+        return 2;
+    }
+
+    printf("Running %s ($%04lx, %ld bytes) on %s\n", srcFileName, entry,
+        codeLen, cpuType == CPU_65816 ? "65816" :
+        cpuType == CPU_65C02 ? "65C02" : "6502");
+    if (srcBank != 0 || dstBank != 0 || outAddr != HIRES_ADDR) {
+        printf("Input at $%02x/%04x, output at $%02x/%04lx\n", srcBank,
+            DATA_ADDR, dstBank, outAddr);
+    }
+
+    int result = 0;
+    int numFiles = 0;
+    uint64_t totalCycles = 0, totalSerial = 0, totalModel = 0;
+    long totalIn = 0, totalOut = 0;
+    while (optind < argc) {
+        const char* fileName = argv[optind++];
+        uint64_t cycles;
+        long inLen, outLen;
+        if (mode == MODE_STREAM) {
+            // Time the decode alone with the file already in memory, so
+            // we can compare against loading it all first.
+            uint64_t decodeCycles;
+            if (runOneFile(mode, cpuType, image, entry, fileName, refSuffix,
+                    ignoreHoles, true, 0, 0, HIRES_ADDR, &decodeCycles,
+                    &inLen, &outLen) != 0 ||
+                runOneFile(mode, cpuType, image, entry, fileName, refSuffix,
+                    ignoreHoles, false, 0, 0, HIRES_ADDR, &cycles,
+                    &inLen, &outLen) != 0) {
+                result = 1;
+                continue;
+            }
+            uint64_t loadCycles = serialLoadCycles(inLen);
+            uint64_t serial = loadCycles + decodeCycles;
+            printf("  %s: %d sectors, load %llu + decode %llu = %llu cycles, "
+                "streamed %llu (%.1f%% less)%s\n",
+                fileName, sectorCount(inLen), (unsigned long long) loadCycles,
+                (unsigned long long) decodeCycles, (unsigned long long) serial,
+                (unsigned long long) cycles,
+                100.0 * (1.0 - (double) cycles / serial),
+                refSuffix != NULL ? ", verified" : "");
+            totalSerial += serial;
+        } else {
+            if (runOneFile(mode, cpuType, image, entry, fileName, refSuffix,
+                    ignoreHoles, false, srcBank, dstBank, outAddr, &cycles,
+                    &inLen, &outLen) != 0) {
+                result = 1;
+                continue;
+            }
+            printf("  %s: %ld -> %ld bytes, %llu cycles (%.3f sec)%s\n",
+                fileName, inLen, outLen, (unsigned long long) cycles,
+                (double) cycles / CLOCK_HZ,
+                refSuffix != NULL ? ", verified" : "");
+            if (modelFileName != NULL) {
+                std::map<std::string, long>::const_iterator it =
+                    model.find(fileName);
+                if (it == model.end()) {
+                    fprintf(stderr, "  ERROR: %s isn't in %s\n", fileName,
+                        modelFileName);
+                    result = 1;
+                } else {
+                    double off = 100.0 * (it->second - (double) cycles) /
+                        cycles;
+                    if (off < -MODEL_TOLERANCE || off > MODEL_TOLERANCE) {
+                        fprintf(stderr, "  ERROR: model says %ld cycles, "
+                            "%+.2f%% off\n", it->second, off);
+                        result = 1;
+                    }
+                    totalModel += it->second;
+                }
+            }
+        }
+        numFiles++;
+        totalCycles += cycles;
+        totalIn += inLen;
+        totalOut += outLen;
+    }
+
+    if (numFiles > 1 && mode == MODE_STREAM) {
+        double serialSecs = (double) totalSerial / numFiles / CLOCK_HZ;
+        double streamSecs = (double) totalCycles / numFiles / CLOCK_HZ;
+        printf("Total: %d files, %ld -> %ld bytes, load+decode %llu cycles "
+            "(avg %.3f sec), streamed %llu (avg %.3f sec)\n",
+            numFiles, totalIn, totalOut, (unsigned long long) totalSerial,
+            serialSecs, (unsigned long long) totalCycles, streamSecs);
+    } else if (numFiles > 1) {
+        double avgSecs = (double) totalCycles / numFiles / CLOCK_HZ;
+        printf("Total: %d files, %ld -> %ld bytes, %llu cycles "
+            "(avg %.3f sec, %.2f per sec)\n",
+            numFiles, totalIn, totalOut, (unsigned long long) totalCycles,
+            avgSecs, 1.0 / avgSecs);
+    }
+    if (numFiles > 0 && modelFileName != NULL) {
+        printf("Model: %llu cycles, %+.2f%% off\n",
+            (unsigned long long) totalModel,
+            100.0 * ((double) totalModel - totalCycles) / totalCycles);
+    }
+    return result;
+}
@@ -7,7 +7,7 @@
  * See the LICENSE.txt file for distribution terms (Apache 2.0).
  *
  * Under Linux, you can build it with just:
- *   g++ -O2 fhpack.cpp -o fhpack
+ *   g++ -O2 -pthread fhpack.cpp -o fhpack
  */
 // TODO: prompt before overwriting output file (add "-f" to force)
 
@@ -88,6 +88,68 @@ every 255 literals (4/4 byte, 1 for literal len extension, 1 for match
 len extension that holds the "no match" symbol).  Globally we add +1 for
 the magic number.  The "end-of-data" symbol replaces the "no match"
 symbol, so overall it's int(ceil(8192/255)) * 33 + 1 = 100 bytes.
+
+Version 2 of the format uses a different magic number, and adds a byte
+of flags that enable optional features.  A decoder must reject a file
+with flags it doesn't understand.  With no flags set, the data is
+identical to version 1.
+
+ file:
+  1 byte : 0x67 - format magic number for version 2
+  1 byte : flags
+  [ ...one or more chunks follow... ]
+
+ flags:
+  0x01 ROWS: the output is written one screen row at a time, from the
+    top of the screen to the bottom, rather than in memory order.  Each
+    row is 40 contiguous bytes, but consecutive rows are not adjacent in
+    memory, so the chunk that ends a row uses a match length extension
+    of 252 ("set destination"), followed by the 2-byte offset of the
+    start of the next row.  The first row starts at offset 0, and the
+    last row ends with the usual end-of-data symbol.  The screen holes
+    are never written, and matches may only copy bytes that have already
+    been written.  When decoding straight to the visible hi-res page, the
+    picture appears from the top down instead of in venetian-blind order.
+    Changing rows costs 3 or 4 bytes, and matches can't cross from one
+    row to the next, so the output is quite a bit larger.  In the worst
+    case (no matches at all), each 40-byte row takes 45 bytes.
+  0x02 REPOFF: match offsets are stored high byte first, and a high byte
+    of 0xff (which can't be a real offset) means "copy from the same
+    distance back as the previous match", with no low byte.  Hi-res
+    images often copy from exactly one scan line or one row group back
+    many times in a row, and this saves a byte each time.  The distance
+    carries across literals-follow-literals and set-destination chunks.
+    The first match in the file can't use it.
+  0x04 STRIDE: match offsets are stored high byte first, and a high byte
+    of 0xf0-0xf7 means "copy from a fixed distance back", with no low
+    byte.  The distances are the ones hi-res images use most: 1 and 2
+    bytes (solid colors), 0x28 (the next third of the screen), 0x80
+    (the next row group), and 0x400, 0x800, 0xc00, 0x1000 (one to four
+    scan lines down within a row).  With REPOFF, a stride match counts
+    as the previous match.
+  0x08 XOR: match offsets are stored high byte first, and a high byte of
+    0x40-0x5f means "copy with the high bit of each byte flipped", with
+    the real high byte in the low 5 bits and the low byte after it.  A
+    shape drawn in the other hi-res color group differs only in bit 7,
+    so it can be copied from the original.  With REPOFF, an XOR match
+    counts as the previous match, but a repeated offset never flips the
+    high bit.
+  0x10 PLANES: the image is split into two planes, each compressed as a
+    separate stream with its own end-of-data token.  The first holds the
+    high (palette) bits, packed 8 to a byte with the first image byte in
+    bit 7.  The second holds the image bytes with the high bit cleared.
+    The other flags apply to both streams.
+
+Either version may be preceded by a metadata header, so that tools can
+identify and check a file without expanding it.  Decoders skip it; the
+contents are described with MetaHeader.
+
+ header:
+  1 byte : 0x68 - metadata header magic number
+  1 byte : N, the number of header bytes that follow
+  N bytes: uncompressed length, hole handling, encoder settings, and a
+           64-bit hash of the uncompressed data
+  [ ...0x66 or 0x67 file follows... ]
 */
 /*
 Implementation notes:
@@ -99,6 +161,12 @@ time to run on an Apple II.  On the bright side, with "greedy" parsing
 it uses very little memory, and an optimized 6502/65816 implementation
 might run in a reasonable amount of time.
 
+The "device" mode is greedy parsing with a hash table, and generates
+exactly the same output as the 6502 implementation in LZ4FHENC6502.S.
+It's a good deal worse than regular greedy parsing (about 20% larger
+output on the test set), but an Apple II can compress an image in a
+couple of seconds.
+
 Unrelated to the compression is the handling of the "screen holes".
 Of the hi-res screens 8192 bytes, 512 are invisible.  We can teach the
 compression code to skip over them, but that will require additional
@@ -125,15 +193,82 @@ works best.
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fhpack.h"
 
 enum ProgramMode {
-    MODE_UNKNOWN, MODE_COMPRESS, MODE_UNCOMPRESS, MODE_TEST
+    MODE_UNKNOWN, MODE_COMPRESS, MODE_UNCOMPRESS, MODE_TEST, MODE_BENCHMARK,
+    MODE_SWEEP, MODE_SIMULATE, MODE_CHECK, MODE_INFO, MODE_VIEW,
+    MODE_SHARD
+};
+
+enum ReportFormat {
+    REPORT_TEXT, REPORT_JSON, REPORT_CSV
+};
+
+/*
+ * What the autotuner ("-u") looks for: the smallest output, or the
+ * fastest decode under the 6502 cycle model.
+ */
+enum TuneGoal {
+    TUNE_SIZE, TUNE_TIME
+};
+struct TuneOptions {
+    TuneGoal goal;
+    double budgetSecs;          // wall-clock limit per image; 0 for none
+};
+
+/*
+ * One combination of settings for the autotuner to try.
+ */
+struct TuneSetting {
+    ParseMode parseMode;
+    unsigned int formatFlags;
+    bool doFill;                // fill the holes, rather than zero them
+};
+
+/*
+ * Results from compressing one file, for the structured test output.
+ * Sizes are zero for hole variants that weren't tried.
+ */
+struct CompressReport {
+    long inputSize;
+    size_t zeroHolesSize;
+    size_t fillHolesSize;
+    size_t outputSize;
+    const char* holes;          // "zero", "fill", "preserve", "none"
+    double readSecs;
+    double compressSecs;        // all variants
+    double zeroHolesSecs;       // per variant
+    double fillHolesSecs;
+    double verifySecs;
+    double writeSecs;
+    bool verified;
+    TuneSetting tuned;          // autotune only: the winner,
+    long cycles;                //  its modelled decode time,
+    int numTried;               //  and how many settings were tried
+    int numSettings;
 };
 
 #define MAX_SIZE            8192
-#define MIN_SIZE            (MAX_SIZE - 8)  // without final screen hole
+#define HOLE_LEN            8               // unseen bytes in every 128
+#define MIN_SIZE            (MAX_SIZE - HOLE_LEN) // without final screen hole
 #define MAX_EXPANSION       100             // ((MAX_SIZE/255)+1) * 3 + 1
+#define MAX_OUT_SIZE        (MAX_SIZE + 512)    // v2 row order is worse
 
 #define MIN_MATCH_LEN       4
 #define MAX_MATCH_LEN       255
@@ -143,7 +278,46 @@ enum ProgramMode {
 #define EMPTY_MATCH_TOKEN   253
 #define EOD_MATCH_TOKEN     254
 
+#define SETDST_MATCH_TOKEN  252             // v2 ROWS only
+
 #define LZ4FH_MAGIC         0x66
+#define LZ4FH_MAGIC_V2      0x67
+#define LZ4FH_MAGIC_META    0x68            // metadata header, then data
+#define META_HEADER_LEN     16
+
+#define KNOWN_FLAGS         (FLAG_ROWS | FLAG_REPOFF | FLAG_STRIDE | \
+                             FLAG_XOR | FLAG_PLANES)
+#define HI_FIRST_FLAGS      (FLAG_REPOFF | FLAG_STRIDE | FLAG_XOR)
+                                            // ^ offset hi byte first
+#define OPT_SHORT_TOKENS    0x100           // encoder only, never stored
+
+#define STREAM_MAX_LITERAL  251             // 1+1+251+1+2 = 256 per token
+
+#define REPEAT_OFFSET_CODE  0xff            // REPOFF: reuse last distance
+#define STRIDE_CODE         0xf0            // STRIDE: 0xf0-0xf7
+#define NUM_STRIDES         8
+#define XOR_OFFSET_CODE     0x40            // XOR: 0x40 | offset high byte
+#define XOR_OFFSET_MASK     0xe0
+#define XOR_VALUE           0x80            // bit flipped by XOR matches
+
+static const uint16_t gStrideDist[NUM_STRIDES] = {
+    0x0001, 0x0002, 0x0028, 0x0080, 0x0400, 0x0800, 0x0c00, 0x1000
+};
+
+#define NUM_ROWS            192
+#define ROW_WIDTH           40
+
+#define DEVICE_HASH_SIZE    2048            // buckets in 6502 hash table
+#define DEVICE_EMPTY        0xffff          // unused hash table slot
+
+#define APPLE2_CLOCK_HZ     1020484         // for cycle counts
+
+#define FAST_HASH_BITS      12              // 4096 single-slot buckets
+#define FAST_SKIP_TRIGGER   6               // step grows every 64 misses
+
+#define VIEW_DWELL_MSEC     10              // time on screen, per image
+#define VIEW_CACHE_KB       256             // default for "-z"
+#define SHARD_FILES         16              // default files per shard
 
 //#define DEBUG_MSGS
 #ifdef DEBUG_MSGS
@@ -152,6 +326,7 @@ enum ProgramMode {
 # define DBUG(x)
 #endif
 
+#ifndef FHPACK_NO_MAIN
 /*
  * Print usage info.
  */
@@ -162,32 +337,350 @@ static void usage(const char* argv0)
     fprintf(stderr,
         "Source code available from https://github.com/fadden/fhpack\n\n");
     fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "  fhpack {-c|-d} [-h] [-1|-9] infile outfile\n\n");
-    fprintf(stderr, "  fhpack {-t} [-h] [-1|-9] infile1 [infile2...] \n\n");
-    fprintf(stderr, "Use -c to compress, -d to decompress, -t to test\n");
+    fprintf(stderr, "  fhpack {-c|-d} [-h|-p|-o|-k|-x|-l|-f|-i] [-0|-1|-9|-a] infile outfile\n\n");
+    fprintf(stderr, "  fhpack {-c|-t} -u goal [-w secs] [-h|-p|-o|-k|-x|-l|-f|-i] [-j N] infile [...]\n\n");
+    fprintf(stderr, "  fhpack {-t} [-h|-p|-o|-k|-x|-l|-f] [-0|-1|-9|-a] [-j N] [-r fmt] [-y file] infile1 [infile2...] \n\n");
+    fprintf(stderr, "  fhpack {-b} [-h|-p|-o|-k|-x|-l|-f] [-0|-1|-9|-a] [-j N] [-r fmt] infile1 [infile2...] \n\n");
+    fprintf(stderr, "  fhpack {-s} [-h] [-j N] [-r fmt] infile1 [infile2...] \n\n");
+    fprintf(stderr, "  fhpack {-m disk} [-h] [-j N] [-r fmt] infile1 [infile2...] \n\n");
+    fprintf(stderr, "  fhpack {-e secs} [-h] infile1 [infile2...] \n\n");
+    fprintf(stderr, "  fhpack {-n} infile1 [infile2...] \n\n");
+    fprintf(stderr, "  fhpack {-v N} [-z KB] infile1 [infile2...] \n\n");
+    fprintf(stderr, "  fhpack {-q dir} [-g N] [-h|-p|-o|-k|-x|-l|-f|-i] [-0|-1|-9|-a] [-j N] [-y file] [infile1...]\n\n");
+    fprintf(stderr, "Input files are hi-res (8KB), text/lo-res (1KB), or double lo-res (2KB)\n");
+    fprintf(stderr, "screens.  Use -c to compress, -d to decompress, -t to test, -b to benchmark,\n");
+    fprintf(stderr, "-s to sweep format variations, -m to simulate a slideshow, -e to check\n");
+    fprintf(stderr, "the parsers, -n to show metadata headers, -v to replay a viewer, -q to\n");
+    fprintf(stderr, "compress in shards\n");
     fprintf(stderr, " -h: don't fill or remove hi-res screen holes\n");
     fprintf(stderr, " -9: high compression (default)\n");
     fprintf(stderr, " -1: fast compression\n");
+    fprintf(stderr, " -0: fastest compression, lowest ratio\n");
+    fprintf(stderr, " -a: same output as the Apple II encoder (LZ4FHENC6502)\n");
+    fprintf(stderr, " -p: progressive (top-down row order), not with -h, -0, or -a\n");
+    fprintf(stderr, " -o: allow repeat-offset matches (v2 format), -9 only, not with -p\n");
+    fprintf(stderr, " -k: allow implicit stride matches (v2 format), -9 only, not with -p\n");
+    fprintf(stderr, " -x: allow high-bit-flipped matches (v2 format), -9 only, not with -p\n");
+    fprintf(stderr, " -l: compress palette and pixel bits separately (v2 format), not with -p or -a\n");
+    fprintf(stderr, " -f: with -h, keep tokens within 256 bytes for the streaming decoder, v1 only\n");
+    fprintf(stderr, " -u size|time: try every level, hole strategy, and allowed flag (-o/-k/-x/-l),\n");
+    fprintf(stderr, "    keep the smallest or fastest to decode; -p and -f apply to all\n");
+    fprintf(stderr, " -w secs: with -u, stop starting new settings after this long per image\n");
+    fprintf(stderr, " -i: with -c, start the file with a metadata header (length, holes, hash)\n");
+    fprintf(stderr, " -n: show metadata headers, hashes, and modelled 6502 decode cycles\n");
+    fprintf(stderr, "    without expanding, and find duplicates\n");
+    fprintf(stderr, " -m 525|35|ram: pick raw or compressed for each image, for fastest display\n");
+    fprintf(stderr, " -v N: page through compressed files and back, expanding N ahead\n");
+    fprintf(stderr, " -z KB: with -v, memory for the expanded-image cache (default %d)\n",
+        VIEW_CACHE_KB);
+    fprintf(stderr, " -q dir: split the files into shards, planned in dir, and compress them\n");
+    fprintf(stderr, "    there; with no files, join the work on an existing plan, which sets\n");
+    fprintf(stderr, "    the level and format options\n");
+    fprintf(stderr, " -g N: with -q, the number of shards (default one per %d files)\n",
+        SHARD_FILES);
+    fprintf(stderr, " -e secs: check every parser against its worst-case bounds, and a time budget\n");
+    fprintf(stderr, "    (build with -DFHPACK_COUNT_OPS)\n");
+    fprintf(stderr, " -y file: with -c, -t, or -q, write a Chrome trace of each file's steps\n");
+    fprintf(stderr, " -r json|csv: with -t, -b, -s, or -m, print results in a structured form\n");
+    fprintf(stderr, " -j N: use N threads (with -b, the most to try; with -q, processes)\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Example: fhpack -c foo.pic foo.lz4fh\n");
 }
+#endif /*FHPACK_NO_MAIN*/
+
+
+/*
+ * Returns a timestamp, in seconds, for measuring elapsed time.
+ */
+static double getTimeSecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Timeline tracing ("-y").  When it's on, the batch paths record a span
+ * for each step of each file -- reading, compressing each hole variant,
+ * verifying, and writing -- on whichever thread did it, and the spans
+ * are written out as Chrome trace JSON, for chrome://tracing or
+ * Perfetto.  When it's off, each trace point is a test of a global.
+ */
+struct TraceEvent {
+    const char* name;           // static string
+    char file[64];              // file name, without the path
+    double startSecs;
+    double endSecs;
+};
+
+struct TraceBuffer {
+    int tid;
+    std::vector<TraceEvent> events;
+};
+
+static bool gTraceEnabled = false;
+static std::mutex gTraceLock;           // guards gTraceBuffers
+static std::vector<TraceBuffer*> gTraceBuffers;
+static std::vector<int> gTraceChildren; // processes that left fragments
+static thread_local TraceBuffer* gpTraceBuffer = NULL;
+static thread_local const char* gTraceFile = NULL;  // being compressed
+
+/*
+ * Returns the file name part of a path.
+ */
+static const char* baseName(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    return (slash == NULL) ? path : slash + 1;
+}
+
+/*
+ * Records a span that started at "startSecs" and ends now.  "fileName"
+ * may be NULL.
+ */
+static void traceSpan(const char* name, const char* fileName,
+    double startSecs)
+{
+    if (!gTraceEnabled) {
+        return;
+    }
+
+    TraceEvent event;
+    event.endSecs = getTimeSecs();
+    event.startSecs = startSecs;
+    event.name = name;
+    event.file[0] = '\0';
+    if (fileName != NULL) {
+        snprintf(event.file, sizeof(event.file), "%s", baseName(fileName));
+    }
+
+    if (gpTraceBuffer == NULL) {
+        gpTraceBuffer = new TraceBuffer;
+        std::lock_guard<std::mutex> guard(gTraceLock);
+        gpTraceBuffer->tid = gTraceBuffers.size() + 1;
+        gTraceBuffers.push_back(gpTraceBuffer);
+    }
+    gpTraceBuffer->events.push_back(event);
+}
+
+#ifndef FHPACK_NO_MAIN
+static const char* gTraceFileName;      // set by traceStart()
+static double gTraceOrigin;
+
+/*
+ * Writes a string as a JSON string literal.
+ */
+static void putJsonString(FILE* fp, const char* str)
+{
+    putc('"', fp);
+    for ( ; *str != '\0'; str++) {
+        unsigned char uch = *str;
+        if (uch == '"' || uch == '\\') {
+            fprintf(fp, "\\%c", uch);
+        } else if (uch < 0x20) {
+            fprintf(fp, "\\u%04x", uch);
+        } else {
+            putc(uch, fp);
+        }
+    }
+    putc('"', fp);
+}
+
+/*
+ * Turns tracing on.  The trace is written to "fileName" by traceFinish().
+ */
+static void traceStart(const char* fileName)
+{
+    gTraceFileName = fileName;
+    gTraceOrigin = getTimeSecs();
+    gTraceEnabled = true;
+}
+
+/*
+ * Call in a child process after fork(), so it doesn't write its
+ * parent's spans again.
+ */
+static void traceForked()
+{
+    for (size_t i = 0; i < gTraceBuffers.size(); i++) {
+        gTraceBuffers[i]->events.clear();
+    }
+}
+
+/*
+ * Writes this process's spans, each preceded by a comma.  Call once the
+ * other threads have finished.
+ */
+static void putTraceEvents(FILE* fp)
+{
+    int pid = getpid();
+    for (size_t i = 0; i < gTraceBuffers.size(); i++) {
+        const TraceBuffer* pBuf = gTraceBuffers[i];
+        if (pBuf->events.empty()) {
+            continue;
+        }
+        fprintf(fp, ",\n{\"ph\": \"M\", \"name\": \"thread_name\", "
+            "\"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+            pid, pBuf->tid, pBuf->tid);
+        for (size_t j = 0; j < pBuf->events.size(); j++) {
+            const TraceEvent* pEvent = &pBuf->events[j];
+            fprintf(fp, ",\n{\"ph\": \"X\", \"name\": \"%s\", \"pid\": %d, "
+                "\"tid\": %d, \"ts\": %.1f, \"dur\": %.1f, "
+                "\"args\": {\"file\": ",
+                pEvent->name, pid, pBuf->tid,
+                (pEvent->startSecs - gTraceOrigin) * 1000000.0,
+                (pEvent->endSecs - pEvent->startSecs) * 1000000.0);
+            putJsonString(fp, pEvent->file);
+            fprintf(fp, "}}");
+        }
+    }
+}
+
+static void traceFragmentName(char* buf, size_t bufLen, int pid)
+{
+    snprintf(buf, bufLen, "%s.%d", gTraceFileName, pid);
+}
+
+/*
+ * Writes a child process's spans to a fragment file, which its parent
+ * adds to the trace.  Call traceAddChild() in the parent.
+ */
+static void traceWriteFragment()
+{
+    char path[PATH_MAX + 16];
+
+    traceFragmentName(path, sizeof(path), getpid());
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror("Unable to create trace fragment");
+        return;
+    }
+    fprintf(fp, ",\n{\"ph\": \"M\", \"name\": \"process_name\", "
+        "\"pid\": %d, \"args\": {\"name\": \"fhpack worker\"}}",
+        (int) getpid());
+    putTraceEvents(fp);
+    fclose(fp);
+}
+
+static void traceAddChild(int pid)
+{
+    gTraceChildren.push_back(pid);
+}
+
+/*
+ * Writes the trace file, including the fragments left by child
+ * processes.
+ *
+ * Returns 0 on success.
+ */
+static int traceFinish()
+{
+    if (!gTraceEnabled) {
+        return 0;
+    }
+    FILE* fp = fopen(gTraceFileName, "w");
+    if (fp == NULL) {
+        perror("Unable to create trace file");
+        return -1;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(fp, "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %d, "
+        "\"args\": {\"name\": \"fhpack\"}}", (int) getpid());
+    putTraceEvents(fp);
+    for (size_t i = 0; i < gTraceChildren.size(); i++) {
+        char path[PATH_MAX + 16];
+        char buf[4096];
+        size_t count;
+
+        traceFragmentName(path, sizeof(path), gTraceChildren[i]);
+        FILE* fragfp = fopen(path, "r");
+        if (fragfp == NULL) {
+            continue;                       // worker didn't get that far
+        }
+        while ((count = fread(buf, 1, sizeof(buf), fragfp)) > 0) {
+            fwrite(buf, 1, count, fp);
+        }
+        fclose(fragfp);
+        unlink(path);
+    }
+    fprintf(fp, "\n]}\n");
+
+    if (fclose(fp) != 0) {
+        perror("Failed while writing trace file");
+        return -1;
+    }
+    return 0;
+}
+#endif /*FHPACK_NO_MAIN*/
+
+/*
+ * Screen types we can compress.  They all share one layout, three
+ * 40-byte chunks of visible data followed by 8 bytes of unseen data in
+ * every 128, so they differ only in size.  Text and lo-res use the same
+ * 1KB page.  A double lo-res image is the auxiliary page followed by
+ * the main page.
+ *
+ * A file may omit the final screen hole, so it can be up to HOLE_LEN
+ * bytes shorter than "pageLen".
+ */
+struct ScreenType {
+    const char* name;
+    size_t pageLen;
+};
+static const ScreenType gScreenTypes[] = {
+    { "hi-res",             MAX_SIZE },
+    { "double lo-res",      2048 },
+    { "text/lo-res",        1024 },
+};
+#define NUM_SCREEN_TYPES    (sizeof(gScreenTypes) / sizeof(gScreenTypes[0]))
+
+/*
+ * Returns the screen type for a file of "fileLen" bytes, or NULL if it
+ * isn't a size we know.
+ */
+const ScreenType* findScreenType(long fileLen)
+{
+    for (size_t i = 0; i < NUM_SCREEN_TYPES; i++) {
+        const ScreenType* pScreen = &gScreenTypes[i];
+        if (fileLen >= (long) (pScreen->pageLen - HOLE_LEN) &&
+                fileLen <= (long) pScreen->pageLen) {
+            return pScreen;
+        }
+    }
+    return NULL;
+}
 
+/*
+ * Complains about an input file that isn't any of the screen sizes.
+ */
+static void reportBadSize(const char* fileName, long fileLen)
+{
+    fprintf(stderr, "ERROR: %s is %ld bytes, must be", fileName, fileLen);
+    for (size_t i = 0; i < NUM_SCREEN_TYPES; i++) {
+        const ScreenType* pScreen = &gScreenTypes[i];
+        fprintf(stderr, "%s %zd - %zd (%s)",
+            i == 0 ? "" : (i == NUM_SCREEN_TYPES - 1 ? ", or" : ","),
+            pScreen->pageLen - HOLE_LEN, pScreen->pageLen, pScreen->name);
+    }
+    fprintf(stderr, "\n");
+}
 
 /*
- * Zero out the "screen holes".
+ * Zero out the "screen holes" in a page of "pageLen" bytes.
  */
-void zeroHoles(uint8_t* inBuf)
+void zeroHoles(uint8_t* inBuf, size_t pageLen)
 {
     uint8_t* inPtr = inBuf + 120;
 
-    while (inPtr < inBuf + MAX_SIZE) {
-        memset(inPtr, 0, 8);
+    while (inPtr < inBuf + pageLen) {
+        memset(inPtr, 0, HOLE_LEN);
         inPtr += 128;
     }
 }
 
 /*
- * Fill in the "screen holes" in the image.  The hi-res page has
+ * Fill in the "screen holes" in the image.  Every screen type has
  * three 40-byte chunks of visible data, followed by 8 bytes of unseen
  * data (padding it to 128).
  *
@@ -199,17 +692,17 @@ void zeroHoles(uint8_t* inBuf)
  * We can match the bytes that appear before or after the hole.
  * Ideally we'd use whichever yields the longest run.
  *
- * "inBuf" holds MAX_SIZE bytes.
+ * "inBuf" holds "pageLen" bytes.
  */
-void fillHoles(uint8_t* inBuf)
+void fillHoles(uint8_t* inBuf, size_t pageLen)
 {
     uint8_t* inPtr = inBuf + 120;
-    while (inPtr < inBuf + MAX_SIZE) {
+    while (inPtr < inBuf + pageLen) {
         // check to see if the bytes that follow are a better match
         // ("greedy" parsing can be suboptimal)
         uint8_t* checkp = inPtr + 8;
         bool useAfter = false;
-        if (checkp < inBuf + MAX_SIZE) {
+        if (checkp < inBuf + pageLen) {
             if (checkp[0] == checkp[2] && checkp[1] == checkp[3]) {
                 DBUG(("  bytes-after looks good at +0x%04lx\n",
                         checkp - inBuf));
@@ -238,6 +731,41 @@ void fillHoles(uint8_t* inBuf)
     }
 }
 
+/*
+ * Returns the offset of the start of a hi-res screen row (0-191).
+ */
+static inline size_t rowOffset(int row)
+{
+    return ((row & 0x07) << 10) | (((row >> 3) & 0x07) << 7) |
+        ((row >> 6) * ROW_WIDTH);
+}
+
+/*
+ * Returns true if "offset" is in one of the screen holes.
+ */
+static inline bool isHole(size_t offset)
+{
+    return (offset & 0x7f) >= 120;
+}
+
+/*
+ * Work done by the match searches, for checking the parsers against
+ * their worst-case bounds ("-e").  Each thread counts its own.  This
+ * slows every compression down, so it's only built with
+ * -DFHPACK_COUNT_OPS.
+ */
+#ifdef FHPACK_COUNT_OPS
+struct OpCounts {
+    uint64_t compares;          // candidate positions compared
+    uint64_t bytes;             // bytes compared, counting the mismatch
+};
+static thread_local OpCounts gOpCounts;
+# define COUNT_COMPARE(nbytes) \
+    do { gOpCounts.compares++; gOpCounts.bytes += (nbytes); } while (0)
+#else
+# define COUNT_COMPARE(nbytes)
+#endif
+
 /*
  * Computes the number of characters that match.  Stops when it finds
  * a mismatching byte, or "count" is reached.
@@ -248,6 +776,20 @@ size_t getMatchLen(const uint8_t* str1, const uint8_t* str2, size_t count)
     while (count-- && *str1++ == *str2++) {
         matchLen++;
     }
+    COUNT_COMPARE(matchLen + 1);
+    return matchLen;
+}
+
+/*
+ * Like getMatchLen(), but "str2" has the high bit of every byte flipped.
+ */
+size_t getXorMatchLen(const uint8_t* str1, const uint8_t* str2, size_t count)
+{
+    size_t matchLen = 0;
+    while (count-- && *str1++ == (*str2++ ^ XOR_VALUE)) {
+        matchLen++;
+    }
+    COUNT_COMPARE(matchLen + 1);
     return matchLen;
 }
 
@@ -311,102 +853,493 @@ size_t findLongestMatch(const uint8_t* matchPtr, const uint8_t* inBuf,
 }
 
 /*
- * Compress a buffer, from "inBuf" to "outBuf".
- *
- * The input buffer holds between MIN_SIZE and MAX_SIZE bytes (inclusive),
- * depending on the length of the source material and whether or not
- * we're attempting to preserve the screen holes.
+ * Finds the longest match for "matchPtr" among the earlier bytes with
+ * their high bit flipped.  Same rules as findLongestMatch().
  *
- * Returns the amount of data in "outBuf" on success, or 0 on failure.
+ * Most candidates fail on the first byte, so we check that before
+ * bothering with the full comparison.  That keeps this from costing
+ * much more than half as much as the plain search.
  */
-size_t compressBufferOptimally(uint8_t* outBuf, const uint8_t* inBuf,
-    size_t inLen)
+size_t findLongestXorMatch(const uint8_t* matchPtr, const uint8_t* inBuf,
+    size_t inLen, size_t* pMatchOffset)
 {
-    // Optimal parsing for data compression is a lot like computing the
-    // shortest distance between two points in a directed graph.  For
-    // each location, there are two possible "paths": a literal at this
-    // point, which advances us one byte forward, or a match at this
-    // point, which takes us several bytes forward.
-    //
-    // We walk through the file backward.  At each position, we compute
-    // whether or not a match exists, and then determine the length from
-    // the current position to the end depending on whether we handle
-    // the value as a literal or the start of a match.  When we reach the
-    // start of the file, we generate output by walking forward, selecting
-    // the path based on whether a literal or match results in the best
-    // outcome.
-    struct OptNode {
-        size_t totalCost;           // running total "best" length
-        size_t matchLength;         // zero if no match or literal is best
-        size_t matchOffset;
-
-        size_t literalLength;       // running total of literal run length
-    };
-    OptNode* optList = (OptNode*) calloc(1, (inLen+1) * sizeof(OptNode));
-
-    //
-    // Pass 1: determine optimal path
-    //
-
-    for (unsigned int i = inLen - 1; i < inLen; i--) {
-        size_t costForMatch, costForLiteral;
+    size_t maxStartOffset = matchPtr - inBuf;
+    size_t longest = 0;
+    size_t longestOffset = 0;
 
-        // First consider the "match" path.  It doesn't matter what
-        // follows the match, as that has no local effect on the output
-        // length.
-        size_t matchOffset;
-        size_t longestMatch = findLongestMatch(inBuf + i, inBuf, inLen,
-                &matchOffset);
-        if (longestMatch < MIN_MATCH_LEN) {
-            // no match to consider; leave optList[] values at zero
-            costForMatch = MAX_SIZE * 2;   // arbitrary large value
-        } else {
-            // 4-14 bytes, fits in mixed-len byte
-            optList[i].matchLength = longestMatch;
-            optList[i].matchOffset = matchOffset;
+    size_t maxMatchLen = inLen - maxStartOffset;
+    if (maxMatchLen > MAX_MATCH_LEN) {
+        maxMatchLen = MAX_MATCH_LEN;
+    }
+    if (maxMatchLen < MIN_MATCH_LEN) {
+        *pMatchOffset = 0;
+        return 0;
+    }
 
-            // total is previous total + 3 for match
-            costForMatch = optList[i + longestMatch].totalCost + 3;
-            if (longestMatch >= INITIAL_LEN) {
-                costForMatch++;
+    uint8_t first = *matchPtr ^ XOR_VALUE;
+    for (size_t ii = 0; ii < maxStartOffset; ii++) {
+        if (inBuf[ii] != first) {
+            continue;
+        }
+        size_t matchLen = getXorMatchLen(matchPtr, inBuf + ii, maxMatchLen);
+        if (matchLen > longest) {
+            longest = matchLen;
+            longestOffset = ii;
+            if (matchLen == maxMatchLen) {
+                break;
             }
         }
+    }
 
-        // Now consider the "literal" path.  If the next node is a
-        // literal, we add on to the existing run.  If it's a match,
-        // we're a length-1 literal.
-        if (i == inLen - 1) {
-            // special-case start (essentially a 1-byte file)
-            optList[i].literalLength = 1;
-            optList[i].totalCost = 2;
-            costForLiteral = 2;        // mixed-len byte + literal
-        } else {
-            if (optList[i+1].matchLength != 0) {
-                // next is match
-                optList[i].literalLength = 1;
-                costForLiteral = 1;    // literal; mixed-len byte in match
-            } else if (optList[i+1].literalLength == MAX_LITERAL_LEN) {
-                // next is max-length literal, start a new one
-                optList[i].literalLength = 1;
-                costForLiteral = 3;    // mixed-len byte + literal + nomatch
-            } else {
-                // next is sub-max-length literal, join it
-                size_t newLiteralLen = optList[i+1].literalLength + 1;
-                optList[i].literalLength = newLiteralLen;
-                costForLiteral = 1;
+    *pMatchOffset = longestOffset;
+    return longest;
+}
 
-                if (newLiteralLen == INITIAL_LEN) {
-                    // just hit 15, now need the extension byte
-                    costForLiteral++;
-                }
-            }
-            costForLiteral += optList[i + 1].totalCost;
-        }
+/*
+ * Bump-pointer allocator for the compressors' scratch space.  Each
+ * worker has its own, allocated once and reset after every image, so a
+ * batch run doesn't go back to malloc() for each one.  "peak" records
+ * the most that has been in use at once.
+ */
+struct Arena {
+    uint8_t* base;
+    size_t size;
+    size_t used;
+    size_t peak;
+};
 
-        if (costForLiteral > costForMatch) {
-            // use the match
+#define ARENA_ALIGN 16
+
+/*
+ * Reserves "size" bytes for the arena.  Returns false on failure.
+ */
+bool arenaInit(Arena* pArena, size_t size)
+{
+    pArena->base = NULL;
+    pArena->size = pArena->used = pArena->peak = 0;
+    if (size != 0) {
+        pArena->base = (uint8_t*) malloc(size);
+        if (pArena->base == NULL) {
+            return false;
+        }
+        pArena->size = size;
+    }
+    return true;
+}
+
+/*
+ * Releases the arena's storage.
+ */
+void arenaFree(Arena* pArena)
+{
+    free(pArena->base);
+    pArena->base = NULL;
+    pArena->size = pArena->used = 0;
+}
+
+/*
+ * Hands out "len" bytes of zeroed memory from the arena.  Returns NULL if
+ * the arena is too small.
+ */
+void* arenaAlloc(Arena* pArena, size_t len)
+{
+    len = (len + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    if (len > pArena->size - pArena->used) {
+        fprintf(stderr, "ERROR: arena exhausted (want %zd, have %zd)\n",
+            len, pArena->size - pArena->used);
+        return NULL;
+    }
+    uint8_t* ptr = pArena->base + pArena->used;
+    pArena->used += len;
+    if (pArena->used > pArena->peak) {
+        pArena->peak = pArena->used;
+    }
+    memset(ptr, 0, len);
+    return ptr;
+}
+
+/*
+ * Returns everything to the arena.
+ */
+void arenaReset(Arena* pArena)
+{
+    pArena->used = 0;
+}
+
+/*
+ * Returns everything allocated since arenaMark() returned "mark".
+ */
+size_t arenaMark(const Arena* pArena)
+{
+    return pArena->used;
+}
+void arenaRelease(Arena* pArena, size_t mark)
+{
+    assert(mark <= pArena->used);
+    pArena->used = mark;
+}
+
+/*
+ * One step of a parse: a run of literals, then a match.  The parsers
+ * produce a list of these, and the emitters turn the list into output,
+ * so a parse can be kept and written out in more than one format.
+ *
+ * A match length of zero means there's no match.  In the last token
+ * that's the end of the data; anywhere else it separates two runs of
+ * literals (an EMPTY match).  A run that's too long for the format is
+ * split up by the emitter.  The match offset is the position the match
+ * copies from, not the distance back.
+ */
+struct ParseToken {
+    uint16_t numLiterals;
+    uint16_t matchLength;
+    uint16_t matchOffset;
+    bool matchXor;              // match flips the high bit
+};
+
+/*
+ * Returns the amount of arena space needed for the tokens from parsing
+ * "inLen" bytes.  Every token but the last covers at least one byte.
+ */
+size_t parseScratchSize(size_t inLen)
+{
+    return ((inLen + 1) * sizeof(ParseToken) + ARENA_ALIGN - 1) &
+            ~((size_t) ARENA_ALIGN - 1);
+}
+
+/*
+ * Fills in a token.
+ */
+static inline void setToken(ParseToken* pToken, size_t numLiterals,
+    size_t matchLength, size_t matchOffset, bool matchXor)
+{
+    pToken->numLiterals = numLiterals;
+    pToken->matchLength = matchLength;
+    pToken->matchOffset = matchOffset;
+    pToken->matchXor = matchXor;
+}
+
+/*
+ * Per-position state for the optimal parser.
+ */
+struct OptNode {
+    size_t totalCost;           // running total "best" length
+    size_t matchLength;         // zero if no match or literal is best
+    size_t matchOffset;
+
+    size_t literalLength;       // running total of literal run length
+    size_t firstDist;           // distance back of next match on the path
+    bool matchXor;              // match flips the high bit
+};
+
+/*
+ * Returns the index of "dist" in the stride table, or -1 if it's not
+ * one of the fixed strides.
+ */
+static int strideIndex(size_t dist)
+{
+    for (int s = 0; s < NUM_STRIDES; s++) {
+        if (gStrideDist[s] == dist) {
+            return s;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Computes the total cost of a match of "len" bytes at "dist" back from
+ * position "i", given the best path from the end of the match.
+ *
+ * The match normally costs 3 bytes, plus the length extension.  A stride
+ * match doesn't need a low byte.  If the next match on the path repeats
+ * our distance, and wasn't already priced as a stride, it gets away with
+ * a single byte too, which we take credit for here.
+ */
+static size_t optimalMatchCost(const OptNode* optList, size_t i, size_t len,
+    size_t dist, bool isXor, unsigned int formatFlags)
+{
+    const OptNode* pNext = &optList[i + len];
+    bool isStride = (formatFlags & FLAG_STRIDE) != 0 && !isXor &&
+            strideIndex(dist) >= 0;
+
+    size_t cost = pNext->totalCost + 3;
+    if (len >= INITIAL_LEN) {
+        cost++;
+    }
+    if (isStride) {
+        cost--;
+    }
+    if ((formatFlags & FLAG_REPOFF) != 0 && pNext->firstDist == dist &&
+            !isStride) {
+        cost--;
+    }
+    return cost;
+}
+
+/*
+ * Longest match found at one position.
+ */
+struct MatchInfo {
+    size_t length;
+    size_t offset;
+    size_t xorLength;           // only filled in for FLAG_XOR
+    size_t xorOffset;
+};
+
+/*
+ * Returns the amount of arena space parseOptimally() needs.
+ */
+size_t optimalScratchSize(size_t inLen)
+{
+    return (((inLen + 1) * sizeof(OptNode) + ARENA_ALIGN - 1) &
+            ~((size_t) ARENA_ALIGN - 1)) +
+        ((inLen * sizeof(MatchInfo) + ARENA_ALIGN - 1) &
+            ~((size_t) ARENA_ALIGN - 1));
+}
+
+/*
+ * Walks forward through the path chosen by a backward walk over
+ * "optList", turning it into tokens.  Because we parsed backwards, a
+ * run of literals can be split in odd places, e.g. 32 literals followed
+ * by 255, rather than the other way around.
+ *
+ * Returns the number of tokens.
+ */
+static size_t tokensFromPath(const OptNode* optList, size_t inLen,
+    ParseToken* tokens)
+{
+    size_t numTokens = 0;
+    size_t numLiterals = 0;
+
+    for (size_t i = 0; i < inLen; ) {
+        if (optList[i].matchLength == 0) {
+            if (numLiterals != 0) {
+                // literals followed by literals
+                setToken(&tokens[numTokens++], numLiterals, 0, 0, false);
+            }
+            numLiterals = optList[i].literalLength;
+            i += numLiterals;
+        } else {
+            setToken(&tokens[numTokens++], numLiterals,
+                optList[i].matchLength, optList[i].matchOffset,
+                optList[i].matchXor);
+            numLiterals = 0;
+            i += optList[i].matchLength;
+        }
+    }
+    setToken(&tokens[numTokens++], numLiterals, 0, 0, false);
+    return numTokens;
+}
+
+/*
+ * Finds the longest match at positions "first", "first + step", and so
+ * on, storing the results in "matches".  If "findXor" is set, also
+ * finds the longest high-bit-flipped match.
+ */
+static void findMatchesWorker(const uint8_t* inBuf, size_t inLen,
+    MatchInfo* matches, size_t first, size_t step, bool findXor)
+{
+    for (size_t i = first; i < inLen; i += step) {
+        matches[i].length = findLongestMatch(inBuf + i, inBuf, inLen,
+                &matches[i].offset);
+        if (findXor) {
+            matches[i].xorLength = findLongestXorMatch(inBuf + i, inBuf,
+                    inLen, &matches[i].xorOffset);
+        }
+    }
+}
+
+/*
+ * Parse a buffer with the smallest output, storing the result in
+ * "tokens".
+ *
+ * The input buffer holds between MIN_SIZE and MAX_SIZE bytes (inclusive),
+ * depending on the length of the source material and whether or not
+ * we're attempting to preserve the screen holes.
+ *
+ * The match search at each position doesn't depend on anything else,
+ * so we do all of them up front, spread across "numThreads" threads.
+ * Positions are dealt out round-robin, because later positions have more
+ * data to search.
+ *
+ * The working storage comes from "pArena", which must have room for
+ * optimalScratchSize(inLen) bytes.
+ *
+ * If "formatFlags" has FLAG_STRIDE, matches at the fixed stride
+ * distances are a byte cheaper, so we try all of them at every position.
+ *
+ * If "formatFlags" has FLAG_XOR, the longest high-bit-flipped match is
+ * a candidate too.  It can't be a stride or a repeat, and a match that
+ * follows it can't be discounted for repeating its distance either.
+ *
+ * If "formatFlags" has FLAG_REPOFF, a match that copies from the same
+ * distance back as the previous one costs a byte less.  We can't know
+ * what the previous match will be while walking backward, so instead
+ * each node remembers the distance of the next match along its path,
+ * and a match gets the discount if the next one repeats its distance.
+ * Besides the longest match, we try matches at the distances used by
+ * the paths from the next position and from the end of the longest
+ * match, since those are the ones that can chain.
+ *
+ * Returns the number of tokens on success, or 0 on failure.
+ */
+size_t parseOptimally(ParseToken* tokens, const uint8_t* inBuf,
+    size_t inLen, int numThreads, Arena* pArena, unsigned int formatFlags)
+{
+    // Optimal parsing for data compression is a lot like computing the
+    // shortest distance between two points in a directed graph.  For
+    // each location, there are two possible "paths": a literal at this
+    // point, which advances us one byte forward, or a match at this
+    // point, which takes us several bytes forward.
+    //
+    // We walk through the file backward.  At each position, we compute
+    // whether or not a match exists, and then determine the length from
+    // the current position to the end depending on whether we handle
+    // the value as a literal or the start of a match.  When we reach the
+    // start of the file, we generate output by walking forward, selecting
+    // the path based on whether a literal or match results in the best
+    // outcome, and leave it to the emitter to produce the output.
+    OptNode* optList =
+        (OptNode*) arenaAlloc(pArena, (inLen+1) * sizeof(OptNode));
+    MatchInfo* matches =
+        (MatchInfo*) arenaAlloc(pArena, inLen * sizeof(MatchInfo));
+    if (optList == NULL || matches == NULL) {
+        return 0;
+    }
+
+    bool findXor = (formatFlags & FLAG_XOR) != 0;
+    if (numThreads > 1) {
+        std::vector<std::thread> workers;
+        for (int t = 1; t < numThreads; t++) {
+            workers.push_back(std::thread(findMatchesWorker, inBuf, inLen,
+                    matches, t, numThreads, findXor));
+        }
+        findMatchesWorker(inBuf, inLen, matches, 0, numThreads, findXor);
+        for (size_t t = 0; t < workers.size(); t++) {
+            workers[t].join();
+        }
+    } else {
+        findMatchesWorker(inBuf, inLen, matches, 0, 1, findXor);
+    }
+
+    //
+    // Pass 1: determine optimal path
+    //
+
+    bool repOff = (formatFlags & FLAG_REPOFF) != 0;
+    bool stride = (formatFlags & FLAG_STRIDE) != 0;
+
+    for (unsigned int i = inLen - 1; i < inLen; i--) {
+        size_t costForMatch, costForLiteral;
+
+        // First consider the "match" path.  It doesn't matter what
+        // follows the match, as that has no local effect on the output
+        // length (except for a repeated offset).
+        size_t matchOffset = matches[i].offset;
+        size_t longestMatch = matches[i].length;
+        if (longestMatch < MIN_MATCH_LEN) {
+            // no match to consider; leave optList[] values at zero
+            costForMatch = MAX_SIZE * 2;   // arbitrary large value
+        } else {
+            // 4-14 bytes, fits in mixed-len byte
+            optList[i].matchLength = longestMatch;
+            optList[i].matchOffset = matchOffset;
+            costForMatch = optimalMatchCost(optList, i, longestMatch,
+                    i - matchOffset, false, formatFlags);
+        }
+        if (repOff || stride) {
+            size_t maxMatchLen = inLen - i;
+            if (maxMatchLen > MAX_MATCH_LEN) {
+                maxMatchLen = MAX_MATCH_LEN;
+            }
+            size_t candDist[2 + NUM_STRIDES];
+            int numCand = 0;
+            if (repOff) {
+                candDist[numCand++] = optList[i + 1].firstDist;
+                if (longestMatch >= MIN_MATCH_LEN) {
+                    candDist[numCand++] = optList[i + longestMatch].firstDist;
+                }
+            }
+            if (stride) {
+                for (int s = 0; s < NUM_STRIDES; s++) {
+                    candDist[numCand++] = gStrideDist[s];
+                }
+            }
+            for (int c = 0; c < numCand; c++) {
+                size_t dist = candDist[c];
+                if (dist == 0 || dist > i) {
+                    continue;
+                }
+                size_t len = getMatchLen(inBuf + i, inBuf + i - dist,
+                        maxMatchLen);
+                if (len < MIN_MATCH_LEN) {
+                    continue;
+                }
+                size_t cost = optimalMatchCost(optList, i, len, dist, false,
+                        formatFlags);
+                if (cost < costForMatch) {
+                    costForMatch = cost;
+                    longestMatch = len;
+                    matchOffset = i - dist;
+                    optList[i].matchLength = longestMatch;
+                    optList[i].matchOffset = matchOffset;
+                }
+            }
+        }
+
+        bool matchXor = false;
+        if (findXor && matches[i].xorLength >= MIN_MATCH_LEN) {
+            size_t len = matches[i].xorLength;
+            size_t cost = optimalMatchCost(optList, i, len,
+                    i - matches[i].xorOffset, true, formatFlags);
+            if (cost < costForMatch) {
+                costForMatch = cost;
+                longestMatch = len;
+                matchOffset = matches[i].xorOffset;
+                matchXor = true;
+                optList[i].matchLength = longestMatch;
+                optList[i].matchOffset = matchOffset;
+            }
+        }
+
+        // Now consider the "literal" path.  If the next node is a
+        // literal, we add on to the existing run.  If it's a match,
+        // we're a length-1 literal.
+        if (i == inLen - 1) {
+            // special-case start (essentially a 1-byte file)
+            optList[i].literalLength = 1;
+            optList[i].totalCost = 2;
+            costForLiteral = 2;        // mixed-len byte + literal
+        } else {
+            if (optList[i+1].matchLength != 0) {
+                // next is match
+                optList[i].literalLength = 1;
+                costForLiteral = 1;    // literal; mixed-len byte in match
+            } else if (optList[i+1].literalLength == MAX_LITERAL_LEN) {
+                // next is max-length literal, start a new one
+                optList[i].literalLength = 1;
+                costForLiteral = 3;    // mixed-len byte + literal + nomatch
+            } else {
+                // next is sub-max-length literal, join it
+                size_t newLiteralLen = optList[i+1].literalLength + 1;
+                optList[i].literalLength = newLiteralLen;
+                costForLiteral = 1;
+
+                if (newLiteralLen == INITIAL_LEN) {
+                    // just hit 15, now need the extension byte
+                    costForLiteral++;
+                }
+            }
+            costForLiteral += optList[i + 1].totalCost;
+        }
+
+        if (costForLiteral > costForMatch) {
+            // use the match
             assert(longestMatch != 0);
             optList[i].totalCost = costForMatch;
+            optList[i].matchXor = matchXor;
+            // nothing can repeat an XOR match's offset more cheaply
+            optList[i].firstDist = matchXor ? 0 : i - matchOffset;
             DBUG(("0x%04x use-mat [l=%zd m=%zd] (len=%zd off=0x%04zx) --> 0x%04zx\n",
                     i, costForLiteral, costForMatch, longestMatch,
                     matchOffset, optList[i].totalCost));
@@ -414,6 +1347,7 @@ size_t compressBufferOptimally(uint8_t* outBuf, const uint8_t* inBuf,
             // use the literal -- zero the matchLength as a flag
             optList[i].matchLength = 0;
             optList[i].totalCost = costForLiteral;
+            optList[i].firstDist = optList[i + 1].firstDist;
             DBUG(("0x%04x use-lit [l=%zd m=%zd] (len=%zd) --> 0x%04zx\n",
                     i, costForLiteral, costForMatch, optList[i].literalLength,
                     optList[i].totalCost));
@@ -422,536 +1356,5409 @@ size_t compressBufferOptimally(uint8_t* outBuf, const uint8_t* inBuf,
 
     // add one for the magic number; does not include end-of-data marker
     // (which will be +1 if the last thing is a literal, +2 if a match)
-    size_t predictedLength = optList[0].totalCost + 1;
-    DBUG(("predicted length is %zd\n", predictedLength));
+    DBUG(("predicted length is %zd\n", optList[0].totalCost + 1));
 
+    return tokensFromPath(optList, inLen, tokens);
+}
 
-    //
-    // Pass 2: generate output from optimal path
-    //
+/*
+ * Parse a buffer by taking the longest match at each position, storing
+ * the result in "tokens".
+ *
+ * The input buffer holds between MIN_SIZE and MAX_SIZE bytes (inclusive),
+ * depending on the length of the source material and whether or not
+ * we're attempting to preserve the screen holes.
+ *
+ * Returns the number of tokens.
+ */
+size_t parseGreedily(ParseToken* tokens, const uint8_t* inBuf,
+    size_t inLen)
+{
+    size_t numTokens = 0;
+    size_t numLiterals = 0;
+
+    // Basic strategy: walk forward, searching for a match.  When we
+    // find one, output the literals then the match.  The emitter breaks
+    // up runs of literals that are too long.
+    for (size_t posn = 0; posn < inLen; ) {
+        DBUG(("Loop: off 0x%08zx\n", posn));
+
+        size_t matchOffset;
+        size_t longestMatch = findLongestMatch(inBuf + posn, inBuf, inLen,
+                &matchOffset);
+        if (longestMatch < MIN_MATCH_LEN) {
+            // No good match found here, emit as literal.
+            numLiterals++;
+            posn++;
+        } else {
+            // Good match found.
+            DBUG(("  match len=%zd off=0x%04zx lits=%zd\n",
+                longestMatch, matchOffset, numLiterals));
+            setToken(&tokens[numTokens++], numLiterals, longestMatch,
+                matchOffset, false);
+            numLiterals = 0;
+            posn += longestMatch;
+        }
+    }
+
+    // Any remaining literals go with the end-of-data indicator.
+    DBUG(("ending with numLiterals=%zd\n", numLiterals));
+    setToken(&tokens[numTokens++], numLiterals, 0, 0, false);
+    return numTokens;
+}
 
-    //const uint8_t* inPtr = inBuf;
+/*
+ * Writes the LZ4FH stream for the "numTokens" tokens in "tokens", which
+ * came from parsing "inBuf".  If "formatFlags" is nonzero this is a
+ * version 2 stream, and the flags say how the match offsets are stored.
+ * Runs of more than "maxLiterals" literals are split up with empty
+ * matches, from the front.
+ *
+ * Returns the amount of data in "outBuf".
+ */
+size_t emitLz4fh(uint8_t* outBuf, const uint8_t* inBuf,
+    const ParseToken* tokens, size_t numTokens, unsigned int formatFlags,
+    size_t maxLiterals)
+{
     uint8_t* outPtr = outBuf;
+    const uint8_t* literalSrcPtr = inBuf;
+    bool repOff = (formatFlags & FLAG_REPOFF) != 0;
+    bool stride = (formatFlags & FLAG_STRIDE) != 0;
+    size_t lastDist = 0;
 
-    *outPtr++ = LZ4FH_MAGIC;
+    if (formatFlags != 0) {
+        *outPtr++ = LZ4FH_MAGIC_V2;
+        *outPtr++ = formatFlags;
+    } else {
+        *outPtr++ = LZ4FH_MAGIC;
+    }
 
-    const uint8_t* literalSrcPtr = NULL;
-    size_t numLiterals = 0;
+    for (size_t t = 0; t < numTokens; t++) {
+        const ParseToken* pToken = &tokens[t];
+        size_t numLiterals = pToken->numLiterals;
+        size_t matchLen = pToken->matchLength;
 
-    for (unsigned int i = 0; i < inLen; ) {
-        if (optList[i].matchLength == 0) {
-            // no match at this point, select literals
-            if (numLiterals != 0) {
-                // Previous entry was literals.  Because we parsed it
-                // backwards, we can end up with 32 literals followed
-                // by 255 literals, rather than the other way around.
-                DBUG(("  output literal-literal (%zd)\n", numLiterals));
-                if (numLiterals < INITIAL_LEN) {
-                    // output 0-14 literals
-                    *outPtr++ = (numLiterals << 4) | 0x0f;
-                } else {
-                    // output 15+(0-240) literals
-                    *outPtr++ = 0xff;
-                    *outPtr++ = numLiterals - INITIAL_LEN;
-                }
-                memcpy(outPtr, literalSrcPtr, numLiterals);
-                outPtr += numLiterals;
-                *outPtr++ = EMPTY_MATCH_TOKEN;
-            }
-            numLiterals = optList[i].literalLength;
-            literalSrcPtr = inBuf + i;
+        while (numLiterals > maxLiterals) {
+            *outPtr++ = 0xff;       // literal-len=15, match-len=15
+            *outPtr++ = maxLiterals - INITIAL_LEN;
+            memcpy(outPtr, literalSrcPtr, maxLiterals);
+            outPtr += maxLiterals;
+            literalSrcPtr += maxLiterals;
+            numLiterals -= maxLiterals;
+            *outPtr++ = EMPTY_MATCH_TOKEN;
+        }
 
-            // advance to next node
-            i += numLiterals;
+        // Start by emitting the 4/4 length byte.
+        uint8_t mixedLengths;
+        if (matchLen == 0 || matchLen - MIN_MATCH_LEN >= INITIAL_LEN) {
+            mixedLengths = INITIAL_LEN;
         } else {
-            // found a match, output previous literals first
-            size_t longestMatch = optList[i].matchLength;
-            size_t matchOffset = optList[i].matchOffset;
-            size_t adjustedMatch = longestMatch - MIN_MATCH_LEN;
-
-            // Start by emitting the 4/4 length byte.
-            uint8_t mixedLengths;
-            if (adjustedMatch <= INITIAL_LEN) {
-                mixedLengths = adjustedMatch;
-            } else {
-                mixedLengths = INITIAL_LEN;
+            mixedLengths = matchLen - MIN_MATCH_LEN;
+        }
+        if (numLiterals <= INITIAL_LEN) {
+            mixedLengths |= numLiterals << 4;
+        } else {
+            mixedLengths |= INITIAL_LEN << 4;
+        }
+        *outPtr++ = mixedLengths;
+
+        // Output the literals, starting with the extended length.
+        if (numLiterals >= INITIAL_LEN) {
+            *outPtr++ = numLiterals - INITIAL_LEN;
+        }
+        memcpy(outPtr, literalSrcPtr, numLiterals);
+        outPtr += numLiterals;
+        literalSrcPtr += numLiterals;
+
+        if (matchLen == 0) {
+            // literals followed by literals, or the end
+            *outPtr++ = (t == numTokens - 1) ?
+                EOD_MATCH_TOKEN : EMPTY_MATCH_TOKEN;
+            continue;
+        }
+
+        // Now output the match, starting with the extended length.
+        if (matchLen - MIN_MATCH_LEN >= INITIAL_LEN) {
+            *outPtr++ = matchLen - MIN_MATCH_LEN - INITIAL_LEN;
+        }
+        size_t posn = literalSrcPtr - inBuf;
+        size_t matchOffset = pToken->matchOffset;
+        int strideIdx = stride ? strideIndex(posn - matchOffset) : -1;
+        if ((formatFlags & HI_FIRST_FLAGS) == 0) {
+            *outPtr++ = matchOffset & 0xff;
+            *outPtr++ = (matchOffset >> 8) & 0xff;
+        } else if (pToken->matchXor) {
+            *outPtr++ = XOR_OFFSET_CODE | ((matchOffset >> 8) & 0xff);
+            *outPtr++ = matchOffset & 0xff;
+        } else if (repOff && posn - matchOffset == lastDist) {
+            *outPtr++ = REPEAT_OFFSET_CODE;
+        } else if (strideIdx >= 0) {
+            *outPtr++ = STRIDE_CODE + strideIdx;
+        } else {
+            *outPtr++ = (matchOffset >> 8) & 0xff;
+            *outPtr++ = matchOffset & 0xff;
+        }
+        lastDist = posn - matchOffset;
+        literalSrcPtr += matchLen;
+    }
+
+    return outPtr - outBuf;
+}
+
+/*
+ * Gathers up runs of literals that are separated only by empty matches,
+ * so the emitter can split them again as it sees fit.  With
+ * STREAM_MAX_LITERAL, that keeps every version 1 token within 256 bytes,
+ * which lets a streaming decoder start on a token as soon as the sector
+ * after the one it begins in has arrived.
+ *
+ * Returns the new number of tokens.
+ */
+static size_t mergeLiteralRuns(ParseToken* tokens, size_t numTokens)
+{
+    size_t numOut = 0;
+    size_t numLiterals = 0;
+
+    for (size_t t = 0; t < numTokens; t++) {
+        numLiterals += tokens[t].numLiterals;
+        if (tokens[t].matchLength == 0 && t != numTokens - 1) {
+            continue;
+        }
+        tokens[numOut] = tokens[t];
+        tokens[numOut].numLiterals = numLiterals;
+        numOut++;
+        numLiterals = 0;
+    }
+    return numOut;
+}
+
+/*
+ * Computes the bucket for the 4 bytes at "ptr" in the -0 hash table.
+ */
+static inline unsigned int fastHash(const uint8_t* ptr)
+{
+    uint32_t val = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) |
+        ((uint32_t) ptr[3] << 24);
+    return (val * 2654435761u) >> (32 - FAST_HASH_BITS);
+}
+
+/*
+ * Parse a buffer as quickly as possible, storing the result in "tokens".
+ *
+ * This is LZ4's "fast" strategy.  The hash table has one slot per
+ * bucket, holding the most recent position whose first four bytes hashed
+ * there, so each position costs one lookup and (usually) one 4-byte
+ * compare.  A match is extended forward, and backward into the pending
+ * literals.  After a match we only hash the position just before the end
+ * of it, not everything it covered.
+ *
+ * Each miss bumps a counter, and every 2^FAST_SKIP_TRIGGER misses in a
+ * row the step between probes grows by one byte, so runs of data that
+ * don't compress are skipped over rather than searched.
+ *
+ * The input buffer holds between MIN_SIZE and MAX_SIZE bytes (inclusive).
+ *
+ * Returns the number of tokens.
+ */
+size_t parseFast(ParseToken* tokens, const uint8_t* inBuf, size_t inLen)
+{
+    uint16_t table[1 << FAST_HASH_BITS];
+    const uint8_t* inEnd = inBuf + inLen;
+    const uint8_t* matchLimit = inEnd - MIN_MATCH_LEN;  // last hashable
+    const uint8_t* inPtr = inBuf;
+    const uint8_t* anchor = inBuf;      // start of pending literals
+    size_t numTokens = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (inPtr <= matchLimit) {
+        // Probe until we find a match or run out of data.
+        unsigned int searchCount = 1 << FAST_SKIP_TRIGGER;
+        const uint8_t* matchPtr = NULL;
+        while (inPtr <= matchLimit) {
+            unsigned int hash = fastHash(inPtr);
+            const uint8_t* candPtr = inBuf + table[hash];
+            table[hash] = inPtr - inBuf;
+            if (candPtr < inPtr) {
+                COUNT_COMPARE(MIN_MATCH_LEN);
+                if (memcmp(candPtr, inPtr, MIN_MATCH_LEN) == 0) {
+                    matchPtr = candPtr;
+                    break;
+                }
+            }
+            inPtr += searchCount++ >> FAST_SKIP_TRIGGER;
+        }
+        if (matchPtr == NULL) {
+            break;
+        }
+
+        // Extend forward, then backward into the literals.
+        size_t maxMatchLen = inEnd - inPtr;
+        if (maxMatchLen > MAX_MATCH_LEN) {
+            maxMatchLen = MAX_MATCH_LEN;
+        }
+        size_t matchLen = getMatchLen(inPtr, matchPtr, maxMatchLen);
+        while (inPtr > anchor && matchPtr > inBuf &&
+                matchLen < MAX_MATCH_LEN && inPtr[-1] == matchPtr[-1]) {
+            inPtr--;
+            matchPtr--;
+            matchLen++;
+        }
+
+        setToken(&tokens[numTokens++], inPtr - anchor, matchLen,
+            matchPtr - inBuf, false);
+        inPtr += matchLen;
+        anchor = inPtr;
+
+        if (inPtr - 2 <= matchLimit) {
+            table[fastHash(inPtr - 2)] = inPtr - 2 - inBuf;
+        }
+    }
+
+    // Whatever is left goes out as literals, with the end-of-data marker.
+    setToken(&tokens[numTokens++], inEnd - anchor, 0, 0, false);
+    return numTokens;
+}
+
+/*
+ * Computes the hash table bucket for the 4 bytes at "ptr".  This is
+ * shaped for the 6502: the low 8 bits become the Y index, the high 3
+ * bits select one of the 8 pages in each table.
+ */
+static inline unsigned int deviceHash(const uint8_t* ptr)
+{
+    unsigned int lo = ptr[0] ^ (uint8_t) (ptr[2] << 1);
+    unsigned int hi = (ptr[1] ^ ptr[3]) & 0x07;
+    return (hi << 8) | lo;
+}
+
+/*
+ * Adds a position to the front of a hash bucket, pushing the older
+ * entry into the second slot.
+ */
+static inline void deviceInsert(uint16_t* slot0, uint16_t* slot1,
+    unsigned int hash, size_t posn)
+{
+    slot1[hash] = slot0[hash];
+    slot0[hash] = posn;
+}
+
+/*
+ * Parse a buffer the same way the 6502 encoder in LZ4FHENC6502.S does,
+ * storing the result in "tokens".  The output is identical byte for byte,
+ * so this serves as the reference when testing that code in fhemu.
+ *
+ * This is greedy parsing, like parseGreedily(), but instead of
+ * scanning the entire buffer for each match we look in a hash table that
+ * fits in 8KB (hi-res page 2 on the Apple II).  It has 2048 buckets, each
+ * holding the two most recent positions whose first four bytes hashed
+ * there.  On the 6502 it's stored as four 2KB arrays (low/high byte of
+ * each slot), so every access is an 8-bit index plus a page number.
+ * Every position is hashed and added, including the ones inside a match.
+ * Compare lengths are capped at 255, so the inner loop is a single
+ * "(zp),Y" pass.
+ *
+ * The input buffer holds between MIN_SIZE and MAX_SIZE bytes (inclusive).
+ *
+ * Returns the number of tokens.
+ */
+size_t parseDevice(ParseToken* tokens, const uint8_t* inBuf, size_t inLen)
+{
+    uint16_t slot0[DEVICE_HASH_SIZE];
+    uint16_t slot1[DEVICE_HASH_SIZE];
+    const uint8_t* inPtr = inBuf;
+    size_t numTokens = 0;
+    size_t numLiterals = 0;
+
+    for (int i = 0; i < DEVICE_HASH_SIZE; i++) {
+        slot0[i] = slot1[i] = DEVICE_EMPTY;
+    }
+
+    while (inPtr < inBuf + inLen) {
+
+        // Check the two candidates in this position's bucket, keeping
+        // the longer match (the more recent one wins a tie).  Positions
+        // too close to the end to hold a match aren't hashed.
+        size_t longestMatch = 0;
+        size_t matchOffset = 0;
+        size_t remaining = inBuf + inLen - inPtr;
+        if (remaining >= MIN_MATCH_LEN) {
+            size_t maxMatchLen = remaining;
+            if (maxMatchLen > MAX_MATCH_LEN) {
+                maxMatchLen = MAX_MATCH_LEN;
+            }
+            unsigned int hash = deviceHash(inPtr);
+            uint16_t cand[2] = { slot0[hash], slot1[hash] };
+            deviceInsert(slot0, slot1, hash, inPtr - inBuf);
+
+            for (int i = 0; i < 2; i++) {
+                if (cand[i] == DEVICE_EMPTY) {
+                    continue;
+                }
+                size_t matchLen = getMatchLen(inPtr, inBuf + cand[i],
+                        maxMatchLen);
+                if (matchLen > longestMatch) {
+                    longestMatch = matchLen;
+                    matchOffset = cand[i];
+                }
+            }
+        }
+
+        if (longestMatch < MIN_MATCH_LEN) {
+            // No good match found here, emit as literal.
+            numLiterals++;
+            inPtr++;
+        } else {
+            DBUG(("  match len=%zd off=0x%04zx lits=%zd\n",
+                longestMatch, matchOffset, numLiterals));
+            setToken(&tokens[numTokens++], numLiterals, longestMatch,
+                matchOffset, false);
+            numLiterals = 0;
+
+            // Hash the positions covered by the match.
+            for (size_t i = 1; i < longestMatch; i++) {
+                const uint8_t* posPtr = inPtr + i;
+                if ((size_t) (inBuf + inLen - posPtr) >= MIN_MATCH_LEN) {
+                    deviceInsert(slot0, slot1, deviceHash(posPtr),
+                        posPtr - inBuf);
+                }
+            }
+            inPtr += longestMatch;
+        }
+    }
+
+    DBUG(("ending with numLiterals=%zd\n", numLiterals));
+    setToken(&tokens[numTokens++], numLiterals, 0, 0, false);
+    return numTokens;
+}
+
+/*
+ * Splits "inBuf" into the PLANES palette and pixel planes.  "palette"
+ * must have room for (inLen + 7) / 8 bytes.
+ */
+void splitPlanes(const uint8_t* inBuf, size_t inLen, uint8_t* pixels,
+    uint8_t* palette)
+{
+    memset(palette, 0, (inLen + 7) / 8);
+    for (size_t i = 0; i < inLen; i++) {
+        pixels[i] = inBuf[i] & 0x7f;
+        if ((inBuf[i] & 0x80) != 0) {
+            palette[i >> 3] |= 0x80 >> (i & 7);
+        }
+    }
+}
+
+/*
+ * Puts the palette bits back into the pixel plane in "buf".
+ */
+void mergePlanes(uint8_t* buf, size_t len, const uint8_t* palette)
+{
+    for (size_t i = 0; i < len; i++) {
+        if ((palette[i >> 3] & (0x80 >> (i & 7))) != 0) {
+            buf[i] |= 0x80;
+        }
+    }
+}
+
+/*
+ * Returns the arena space compressBufferPlanes() needs for itself.
+ */
+size_t planesScratchSize(size_t inLen)
+{
+    return ((inLen + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1)) +
+        ((inLen / 8 + 1 + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1)) +
+        ((MAX_OUT_SIZE + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1));
+}
+
+size_t compressBuffer(uint8_t* outBuf, const uint8_t* inBuf, size_t inLen,
+    ParseMode parseMode, unsigned int formatFlags, int numThreads,
+    Arena* pArena);
+
+/*
+ * Compresses the palette and pixel planes of "inBuf" as two streams,
+ * each with the selected parser.  The planes and a temporary output
+ * buffer come from "pArena", and each stream's scratch space is given
+ * back before the next one starts.
+ */
+static size_t compressBufferPlanes(uint8_t* outBuf, const uint8_t* inBuf,
+    size_t inLen, ParseMode parseMode, unsigned int formatFlags,
+    int numThreads, Arena* pArena)
+{
+    size_t paletteLen = (inLen + 7) / 8;
+    uint8_t* pixels = (uint8_t*) arenaAlloc(pArena, inLen);
+    uint8_t* palette = (uint8_t*) arenaAlloc(pArena, paletteLen);
+    uint8_t* tmpBuf = (uint8_t*) arenaAlloc(pArena, MAX_OUT_SIZE);
+    if (pixels == NULL || palette == NULL || tmpBuf == NULL) {
+        return 0;
+    }
+    splitPlanes(inBuf, inLen, pixels, palette);
+
+    uint8_t* outPtr = outBuf;
+    *outPtr++ = LZ4FH_MAGIC_V2;
+    *outPtr++ = formatFlags;
+
+    // Compress each plane as a normal file, then strip the header.
+    unsigned int streamFlags = formatFlags & ~FLAG_PLANES;
+    const uint8_t* planes[2] = { palette, pixels };
+    size_t planeLens[2] = { paletteLen, inLen };
+    size_t mark = arenaMark(pArena);
+    for (int p = 0; p < 2; p++) {
+        size_t len = compressBuffer(tmpBuf, planes[p], planeLens[p],
+                parseMode, streamFlags, numThreads, pArena);
+        arenaRelease(pArena, mark);
+        if (len == 0) {
+            return 0;
+        }
+        size_t hdrLen = (tmpBuf[0] == LZ4FH_MAGIC_V2) ? 2 : 1;
+        memcpy(outPtr, tmpBuf + hdrLen, len - hdrLen);
+        outPtr += len - hdrLen;
+    }
+    return outPtr - outBuf;
+}
+
+/*
+ * Compress a buffer with the selected parser, and emit the result.  Only
+ * the optimal parser makes use of additional threads, or understands any
+ * of the "formatFlags" other than FLAG_PLANES, which works with all of
+ * them.  OPT_SHORT_TOKENS (version 1 output only) is applied to whatever
+ * the parser produces.  The tokens come from "pArena".
+ *
+ * Returns the amount of data in "outBuf" on success, or 0 on failure.
+ */
+size_t compressBuffer(uint8_t* outBuf, const uint8_t* inBuf, size_t inLen,
+    ParseMode parseMode, unsigned int formatFlags, int numThreads,
+    Arena* pArena)
+{
+    if ((formatFlags & FLAG_PLANES) != 0) {
+        return compressBufferPlanes(outBuf, inBuf, inLen, parseMode,
+                formatFlags, numThreads, pArena);
+    }
+
+    ParseToken* tokens =
+        (ParseToken*) arenaAlloc(pArena, parseScratchSize(inLen));
+    if (tokens == NULL) {
+        return 0;
+    }
+    size_t numTokens;
+    switch (parseMode) {
+    case PARSE_GREEDY:
+        numTokens = parseGreedily(tokens, inBuf, inLen);
+        break;
+    case PARSE_DEVICE:
+        numTokens = parseDevice(tokens, inBuf, inLen);
+        break;
+    case PARSE_FAST:
+        numTokens = parseFast(tokens, inBuf, inLen);
+        break;
+    case PARSE_OPTIMAL:
+    default:
+        numTokens = parseOptimally(tokens, inBuf, inLen, numThreads,
+                pArena, formatFlags);
+        break;
+    }
+    if (numTokens == 0) {
+        return 0;
+    }
+
+    size_t maxLiterals = MAX_LITERAL_LEN;
+    if ((formatFlags & OPT_SHORT_TOKENS) != 0) {
+        numTokens = mergeLiteralRuns(tokens, numTokens);
+        maxLiterals = STREAM_MAX_LITERAL;
+    }
+    return emitLz4fh(outBuf, inBuf, tokens, numTokens,
+            formatFlags & ~OPT_SHORT_TOKENS, maxLiterals);
+}
+
+/*
+ * Finds the longest match for the bytes at "posn" when compressing in
+ * row order.  "posn" is in the row that spans [rowStart, rowEnd).
+ *
+ * The decoder can only copy bytes it has already written.  That means
+ * the previous rows (flagged in "written"), and the part of the current
+ * row that comes before "posn".  As usual, a match that starts before
+ * "posn" may run past it, so once we're in the current row we can keep
+ * going until the end.  The screen holes are never written.
+ *
+ * Returns the length of the longest match found, with the match offset
+ * in "*pMatchOffset".
+ */
+size_t findLongestRowMatch(const uint8_t* inBuf, const bool* written,
+    size_t rowStart, size_t posn, size_t rowEnd, size_t* pMatchOffset)
+{
+    size_t maxMatchLen = rowEnd - posn;
+    size_t longest = 0;
+    size_t longestOffset = 0;
+
+    if (maxMatchLen < MIN_MATCH_LEN) {
+        *pMatchOffset = 0;
+        return 0;
+    }
+
+    for (size_t ii = 0; ii < MAX_SIZE; ii++) {
+        if (!written[ii] && (ii < rowStart || ii >= posn)) {
+            continue;
+        }
+
+        size_t matchLen = 0;
+        while (matchLen < maxMatchLen) {
+            size_t src = ii + matchLen;
+            if (src >= MAX_SIZE ||
+                    (!written[src] && (src < rowStart || src >= rowEnd)) ||
+                    inBuf[src] != inBuf[posn + matchLen]) {
+                break;
+            }
+            matchLen++;
+        }
+        COUNT_COMPARE(matchLen + 1);
+        if (matchLen > longest) {
+            longest = matchLen;
+            longestOffset = ii;
+            if (matchLen == maxMatchLen) {
+                break;
+            }
+        }
+    }
+
+    *pMatchOffset = longestOffset;
+    return longest;
+}
+
+/*
+ * Outputs a chunk with "numLiterals" literals from "literalSrcPtr",
+ * followed by a match of "matchLen" bytes at "matchOffset".  If
+ * "matchLen" is zero, the match length extension is "token" instead,
+ * and "matchOffset" follows it if it's SETDST_MATCH_TOKEN.
+ *
+ * Returns the updated output pointer.
+ */
+static uint8_t* emitRowChunk(uint8_t* outPtr, const uint8_t* literalSrcPtr,
+    size_t numLiterals, size_t matchLen, size_t matchOffset, uint8_t token)
+{
+    assert(numLiterals <= MAX_LITERAL_LEN);
+    size_t adjustedMatch = INITIAL_LEN;
+    if (matchLen != 0) {
+        adjustedMatch = matchLen - MIN_MATCH_LEN;
+    }
+
+    uint8_t mixedLengths;
+    if (adjustedMatch < INITIAL_LEN) {
+        mixedLengths = adjustedMatch;
+    } else {
+        mixedLengths = INITIAL_LEN;
+    }
+    if (numLiterals < INITIAL_LEN) {
+        mixedLengths |= numLiterals << 4;
+    } else {
+        mixedLengths |= INITIAL_LEN << 4;
+    }
+    *outPtr++ = mixedLengths;
+
+    if (numLiterals >= INITIAL_LEN) {
+        *outPtr++ = numLiterals - INITIAL_LEN;
+    }
+    memcpy(outPtr, literalSrcPtr, numLiterals);
+    outPtr += numLiterals;
+
+    if (matchLen == 0) {
+        *outPtr++ = token;
+        if (token != SETDST_MATCH_TOKEN) {
+            return outPtr;
+        }
+    } else if (adjustedMatch >= INITIAL_LEN) {
+        *outPtr++ = adjustedMatch - INITIAL_LEN;
+    }
+    *outPtr++ = matchOffset & 0xff;
+    *outPtr++ = (matchOffset >> 8) & 0xff;
+    return outPtr;
+}
+
+/*
+ * Compress a hi-res image, from "inBuf" to "outBuf", in top-down row
+ * order (format version 2, with FLAG_ROWS).
+ *
+ * Each row is parsed on its own, because a row's literals and matches
+ * can't spill into the next row.  A 40-byte row is small enough that
+ * both parsers are simple: greedy takes the longest match available,
+ * optimal does the usual backward walk, but without having to worry
+ * about literal strings longer than 255 bytes.  Either way the bulk of
+ * the time goes into the brute-force match search.
+ *
+ * The input buffer must hold at least MIN_SIZE bytes.  The holes are
+ * ignored.
+ *
+ * Returns the amount of data in "outBuf" on success, or 0 on failure.
+ */
+size_t compressBufferRows(uint8_t* outBuf, const uint8_t* inBuf,
+    ParseMode parseMode)
+{
+    bool written[MAX_SIZE];
+    uint8_t* outPtr = outBuf;
+
+    if (parseMode == PARSE_DEVICE || parseMode == PARSE_FAST) {
+        fprintf(stderr, "Row order is not supported by the hash parsers\n");
+        return 0;
+    }
+
+    memset(written, 0, sizeof(written));
+
+    *outPtr++ = LZ4FH_MAGIC_V2;
+    *outPtr++ = FLAG_ROWS;
+
+    for (int row = 0; row < NUM_ROWS; row++) {
+        size_t rowStart = rowOffset(row);
+        size_t rowEnd = rowStart + ROW_WIDTH;
+
+        // Match length and offset to use at each position in the row,
+        // relative to rowStart.  Zero length means literal.
+        size_t matchLen[ROW_WIDTH];
+        size_t matchOffset[ROW_WIDTH];
+
+        if (parseMode == PARSE_GREEDY) {
+            for (size_t i = 0; i < ROW_WIDTH; ) {
+                size_t len = findLongestRowMatch(inBuf, written, rowStart,
+                        rowStart + i, rowEnd, &matchOffset[i]);
+                if (len < MIN_MATCH_LEN) {
+                    matchLen[i++] = 0;
+                } else {
+                    matchLen[i] = len;
+                    i += len;
+                }
+            }
+        } else {
+            // Walk backward, computing the cheapest way to get from
+            // each position to the end of the row.  The chunk that ends
+            // the row costs the same no matter how we get there.
+            size_t totalCost[ROW_WIDTH + 1];
+            size_t literalLen[ROW_WIDTH + 1];
+            totalCost[ROW_WIDTH] = 0;
+            literalLen[ROW_WIDTH] = 0;
+
+            for (int i = ROW_WIDTH - 1; i >= 0; i--) {
+                size_t len = findLongestRowMatch(inBuf, written, rowStart,
+                        rowStart + i, rowEnd, &matchOffset[i]);
+                size_t costForMatch = MAX_SIZE * 2;
+                if (len >= MIN_MATCH_LEN) {
+                    costForMatch = totalCost[i + len] + 3;
+                    if (len - MIN_MATCH_LEN >= INITIAL_LEN) {
+                        costForMatch++;
+                    }
+                }
+
+                size_t costForLiteral = totalCost[i + 1] + 1;
+                if (i == ROW_WIDTH - 1 || matchLen[i + 1] != 0) {
+                    literalLen[i] = 1;
+                } else {
+                    literalLen[i] = literalLen[i + 1] + 1;
+                    if (literalLen[i] == INITIAL_LEN) {
+                        costForLiteral++;   // need the extension byte
+                    }
+                }
+
+                if (costForLiteral > costForMatch) {
+                    matchLen[i] = len;
+                    totalCost[i] = costForMatch;
+                } else {
+                    matchLen[i] = 0;
+                    totalCost[i] = costForLiteral;
+                }
+            }
+        }
+
+        // Generate output for the row.
+        const uint8_t* literalSrcPtr = inBuf + rowStart;
+        size_t numLiterals = 0;
+        for (size_t i = 0; i < ROW_WIDTH; ) {
+            if (matchLen[i] == 0) {
+                numLiterals++;
+                i++;
+            } else {
+                DBUG(("  row %d +%zd: lits=%zd match len=%zd off=0x%04zx\n",
+                    row, i, numLiterals, matchLen[i], matchOffset[i]));
+                outPtr = emitRowChunk(outPtr, literalSrcPtr, numLiterals,
+                        matchLen[i], matchOffset[i], 0);
+                i += matchLen[i];
+                literalSrcPtr = inBuf + rowStart + i;
+                numLiterals = 0;
+            }
+        }
+        if (row != NUM_ROWS - 1) {
+            outPtr = emitRowChunk(outPtr, literalSrcPtr, numLiterals,
+                    0, rowOffset(row + 1), SETDST_MATCH_TOKEN);
+        } else {
+            outPtr = emitRowChunk(outPtr, literalSrcPtr, numLiterals,
+                    0, 0, EOD_MATCH_TOKEN);
+        }
+        assert(outPtr - outBuf <= MAX_OUT_SIZE);
+
+        memset(written + rowStart, 1, ROW_WIDTH);
+    }
+
+    return outPtr - outBuf;
+}
+
+/*
+ * Returns true, after complaining, if fewer than "need" bytes are left
+ * between "inPtr" and "inEnd".
+ */
+static bool inputShort(const uint8_t* inPtr, const uint8_t* inEnd, int need)
+{
+    if (inEnd - inPtr < need) {
+        fprintf(stderr, "Truncated LZ4FH data: inRemain=%zd, need %d\n",
+            inEnd - inPtr, need);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Uncompress one stream of tokens from "*pInPtr" to "outBuf", up to the
+ * end-of-data token.  "inEnd" and "outMax" bound the input and output.
+ * On return, "*pInPtr" points just past the end-of-data token.
+ *
+ * Returns the uncompressed length on success, 0 on failure.  For row
+ * order this is the offset just past the last byte written.
+ */
+static size_t uncompressStream(uint8_t* outBuf, size_t outMax,
+    const uint8_t** pInPtr, const uint8_t* inEnd, uint8_t flags)
+{
+    uint8_t* outPtr = outBuf;
+    uint8_t* outEnd = outBuf;
+    const uint8_t* inPtr = *pInPtr;
+    int lastDist = 0;
+
+    while (true) {
+        // Every chunk has at least two bytes: either a length extension,
+        // or a match offset.
+        if (inputShort(inPtr, inEnd, 2)) {
+            return 0;
+        }
+        uint8_t mixedLen = *inPtr++;
+
+        int literalLen = mixedLen >> 4;
+        if (literalLen != 0) {
+            if (literalLen == INITIAL_LEN) {
+                literalLen += *inPtr++;
+            }
+            DBUG(("Literals: %d\n", literalLen));
+            if ((outPtr - outBuf) + literalLen > (long) outMax ||
+                    inPtr + literalLen > inEnd) {
+                fprintf(stderr,
+                    "Buffer overrun L: outPosn=%zd inRemain=%zd len=%d\n",
+                    outPtr - outBuf, inEnd - inPtr, literalLen);
+                return 0;
+            }
+            memcpy(outPtr, inPtr, literalLen);
+            outPtr += literalLen;
+            inPtr += literalLen;
+        } else {
+            DBUG(("Literals: none\n"));
+        }
+
+        int matchLen = mixedLen & 0x0f;
+        if (matchLen == INITIAL_LEN) {
+            if (inputShort(inPtr, inEnd, 1)) {
+                return 0;
+            }
+            uint8_t addon = *inPtr++;
+            if (addon == EMPTY_MATCH_TOKEN) {
+                DBUG(("Match: none\n"));
+                matchLen = - MIN_MATCH_LEN;
+            } else if (addon == SETDST_MATCH_TOKEN &&
+                    (flags & FLAG_ROWS) != 0) {
+                if (inputShort(inPtr, inEnd, 2)) {
+                    return 0;
+                }
+                int dstOffset = *inPtr++;
+                dstOffset |= (*inPtr++) << 8;
+                DBUG(("Set destination: 0x%04x\n", dstOffset));
+                if (dstOffset >= (int) outMax) {
+                    fprintf(stderr, "Bad destination offset 0x%04x\n",
+                        dstOffset);
+                    return 0;
+                }
+                if (outPtr > outEnd) {
+                    outEnd = outPtr;
+                }
+                outPtr = outBuf + dstOffset;
+                matchLen = - MIN_MATCH_LEN;
+            } else if (addon == EOD_MATCH_TOKEN) {
+                DBUG(("Hit end-of-data at 0x%04lx\n", outPtr - outBuf));
+                break;      // out of while
+            } else {
+                matchLen += addon;
+            }
+        }
+
+        matchLen += MIN_MATCH_LEN;
+        if (matchLen != 0) {
+            int matchOffset;
+            uint8_t xorValue = 0;
+            // Stride and repeated offsets are one byte, the others two.
+            if (inputShort(inPtr, inEnd, 1)) {
+                return 0;
+            }
+            bool oneByte = ((flags & FLAG_STRIDE) != 0 &&
+                        *inPtr >= STRIDE_CODE &&
+                        *inPtr < STRIDE_CODE + NUM_STRIDES) ||
+                    ((flags & FLAG_REPOFF) != 0 &&
+                        *inPtr == REPEAT_OFFSET_CODE);
+            if ((!oneByte || (flags & HI_FIRST_FLAGS) == 0) &&
+                    inputShort(inPtr, inEnd, 2)) {
+                return 0;
+            }
+            if ((flags & HI_FIRST_FLAGS) == 0) {
+                matchOffset = *inPtr++;
+                matchOffset |= (*inPtr++) << 8;
+            } else if ((flags & FLAG_STRIDE) != 0 &&
+                    *inPtr >= STRIDE_CODE &&
+                    *inPtr < STRIDE_CODE + NUM_STRIDES) {
+                matchOffset = (outPtr - outBuf) -
+                        gStrideDist[*inPtr++ - STRIDE_CODE];
+            } else if ((flags & FLAG_XOR) != 0 &&
+                    (*inPtr & XOR_OFFSET_MASK) == XOR_OFFSET_CODE) {
+                matchOffset = (*inPtr++ & ~XOR_OFFSET_MASK) << 8;
+                matchOffset |= *inPtr++;
+                xorValue = XOR_VALUE;
+            } else if ((flags & FLAG_REPOFF) != 0 &&
+                    *inPtr == REPEAT_OFFSET_CODE) {
+                inPtr++;
+                if (lastDist == 0) {
+                    fprintf(stderr, "Repeated offset with no previous match\n");
+                    return 0;
+                }
+                matchOffset = (outPtr - outBuf) - lastDist;
+            } else {
+                matchOffset = (*inPtr++) << 8;
+                matchOffset |= *inPtr++;
+            }
+            lastDist = (outPtr - outBuf) - matchOffset;
+            DBUG(("Match: %d at %d\n", matchLen, matchOffset));
+            // Can't use memcpy() here, because we need to guarantee
+            // that the match is overlapping.
+            uint8_t* srcPtr = outBuf + matchOffset;
+            if (matchOffset < 0 || (outPtr - outBuf) + matchLen > (long) outMax ||
+                    (srcPtr - outBuf) + matchLen > (long) outMax) {
+                fprintf(stderr,
+                    "Buffer overrun M: outPosn=%zd srcPosn=%zd len=%d\n",
+                    outPtr - outBuf, srcPtr - outBuf, matchLen);
+                return 0;
+            }
+            while (matchLen-- != 0) {
+                *outPtr++ = *srcPtr++ ^ xorValue;
+            }
+        }
+    }
+
+    *pInPtr = inPtr;
+    if (outPtr > outEnd) {
+        outEnd = outPtr;
+    }
+    return outEnd - outBuf;
+}
+
+/*
+ * Uncompress from "inBuf" to "outBuf".
+ *
+ * Reads stop at "inLen" bytes, and writes at MAX_SIZE, so corrupt or
+ * truncated data fails rather than running past either buffer.
+ *
+ * Data in row order doesn't write the screen holes, so the caller
+ * should initialize "outBuf" if it cares what ends up there.  A metadata
+ * header, if there is one, is skipped.
+ *
+ * Returns the uncompressed length on success, 0 on failure.  For row
+ * order this is the offset just past the last byte written.
+ */
+size_t uncompressBuffer(uint8_t* outBuf, const uint8_t* inBuf, size_t inLen)
+{
+    const uint8_t* inPtr = inBuf;
+    const uint8_t* inEnd = inBuf + inLen;
+    uint8_t flags = 0;
+
+    if (inputShort(inPtr, inEnd, 1)) {
+        return 0;
+    }
+    if (*inPtr == LZ4FH_MAGIC_META) {
+        // Skip the metadata header; it's only for tools.
+        if (inLen < 2 || inLen <= 2 + (size_t) inPtr[1]) {
+            fprintf(stderr, "Truncated LZ4FH metadata header\n");
+            return 0;
+        }
+        inPtr += 2 + inPtr[1];
+    }
+    if (*inPtr == LZ4FH_MAGIC_V2) {
+        if (inputShort(inPtr, inEnd, 2)) {
+            return 0;
+        }
+        inPtr++;
+        flags = *inPtr++;
+        if ((flags & ~KNOWN_FLAGS) != 0) {
+            fprintf(stderr, "Unsupported LZ4FH flags 0x%02x\n", flags);
+            return 0;
+        }
+    } else if (*inPtr++ != LZ4FH_MAGIC) {
+        fprintf(stderr, "Missing LZ4FH magic\n");
+        return 0;
+    }
+
+    size_t outLen;
+    if ((flags & FLAG_PLANES) != 0) {
+        uint8_t palette[MAX_SIZE / 8];
+        uint8_t streamFlags = flags & ~FLAG_PLANES;
+        size_t paletteLen = uncompressStream(palette, sizeof(palette),
+                &inPtr, inEnd, streamFlags);
+        if (paletteLen == 0) {
+            return 0;
+        }
+        outLen = uncompressStream(outBuf, MAX_SIZE, &inPtr, inEnd,
+                streamFlags);
+        if (outLen == 0) {
+            return 0;
+        }
+        if (paletteLen != (outLen + 7) / 8) {
+            fprintf(stderr, "Palette plane is %zd bytes, expected %zd\n",
+                paletteLen, (outLen + 7) / 8);
+            return 0;
+        }
+        mergePlanes(outBuf, outLen, palette);
+    } else {
+        outLen = uncompressStream(outBuf, MAX_SIZE, &inPtr, inEnd, flags);
+        if (outLen == 0) {
+            return 0;
+        }
+    }
+
+    if (inPtr - inBuf != (long) inLen) {
+        fprintf(stderr, "Warning: uncompress used only %ld of %zd bytes\n",
+                inPtr - inBuf, inLen);
+    }
+    return outLen;
+}
+
+/*
+ * Returns the command-line flag for the parser, without the '-', for
+ * the "level" field in the reports.
+ */
+static const char* parseModeName(ParseMode parseMode)
+{
+    switch (parseMode) {
+    case PARSE_FAST:    return "0";
+    case PARSE_GREEDY:  return "1";
+    case PARSE_DEVICE:  return "a";
+    case PARSE_OPTIMAL:
+    default:            return "9";
+    }
+}
+
+/*
+ * How the screen holes were handled, for the metadata header.
+ */
+enum HoleMode {
+    HOLES_ZERO, HOLES_FILL, HOLES_PRESERVE, HOLES_NONE
+};
+static const char* gHoleModeNames[] = {     // matches CompressReport.holes
+    "zero", "fill", "preserve", "none"
+};
+#define NUM_HOLE_MODES      (sizeof(gHoleModeNames) / sizeof(gHoleModeNames[0]))
+
+/*
+ * Optional metadata header ("-i"), which goes in front of the LZ4FH
+ * data so that build tools can identify and check a compressed image
+ * without expanding it:
+ *
+ *  +00 LZ4FH_MAGIC_META
+ *  +01 number of header bytes that follow, so decoders can skip them
+ *  +02 uncompressed length, 2 bytes
+ *  +04 HoleMode
+ *  +05 parser, as its option letter ('0', '1', '9', 'a')
+ *  +06 format flags and encoder options (e.g. OPT_SHORT_TOKENS), 2 bytes
+ *  +08 content hash, 8 bytes
+ *
+ * Multi-byte values are little-endian.  The regular magic byte follows.
+ * Fields added later go on the end, and readers ignore what they don't
+ * know about.
+ *
+ * The hash is 64-bit FNV-1a over the uncompressed data, skipping the
+ * screen holes unless they were preserved.  An image hashes the same
+ * whether its holes were zeroed, filled, or left out, so it can be
+ * compared with the original file, or with a copy made with different
+ * options.
+ */
+struct MetaHeader {
+    uint16_t uncompressedLen;
+    uint8_t holeMode;
+    char level;
+    uint16_t formatFlags;
+    uint64_t hash;
+};
+
+/*
+ * Computes the content hash for the metadata header.
+ */
+static uint64_t contentHash(const uint8_t* buf, size_t len, bool withHoles)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;      // FNV-1a offset basis
+
+    for (size_t i = 0; i < len; i++) {
+        if (!withHoles && isHole(i)) {
+            continue;
+        }
+        hash = (hash ^ buf[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Writes a metadata header to "outBuf", which must have room for
+ * META_HEADER_LEN bytes.
+ */
+static void putMetaHeader(uint8_t* outBuf, const MetaHeader* pMeta)
+{
+    outBuf[0] = LZ4FH_MAGIC_META;
+    outBuf[1] = META_HEADER_LEN - 2;
+    outBuf[2] = pMeta->uncompressedLen & 0xff;
+    outBuf[3] = pMeta->uncompressedLen >> 8;
+    outBuf[4] = pMeta->holeMode;
+    outBuf[5] = pMeta->level;
+    outBuf[6] = pMeta->formatFlags & 0xff;
+    outBuf[7] = pMeta->formatFlags >> 8;
+    for (int i = 0; i < 8; i++) {
+        outBuf[8 + i] = (uint8_t) (pMeta->hash >> (i * 8));
+    }
+}
+
+/*
+ * Reads the metadata header from the start of "inBuf", if there is one.
+ *
+ * Returns false if the data doesn't start with a complete header.
+ */
+static bool getMetaHeader(const uint8_t* inBuf, size_t inLen,
+    MetaHeader* pMeta)
+{
+    if (inLen < META_HEADER_LEN || inBuf[0] != LZ4FH_MAGIC_META ||
+            inBuf[1] < META_HEADER_LEN - 2 || inLen < 2 + (size_t) inBuf[1]) {
+        return false;
+    }
+    pMeta->uncompressedLen = inBuf[2] | (inBuf[3] << 8);
+    pMeta->holeMode = inBuf[4];
+    pMeta->level = inBuf[5];
+    pMeta->formatFlags = inBuf[6] | (inBuf[7] << 8);
+    pMeta->hash = 0;
+    for (int i = 7; i >= 0; i--) {
+        pMeta->hash = (pMeta->hash << 8) | inBuf[8 + i];
+    }
+    return true;
+}
+
+/*
+ * Checks expanded data against the metadata header of the compressed
+ * data it came from.  Returns true if it matches, or if there's no
+ * header.
+ */
+static bool matchesMetaHeader(const uint8_t* inBuf, size_t inLen,
+    const uint8_t* outBuf, size_t outLen)
+{
+    MetaHeader meta;
+    if (!getMetaHeader(inBuf, inLen, &meta)) {
+        return true;
+    }
+    return meta.uncompressedLen == outLen &&
+        meta.hash == contentHash(outBuf, outLen,
+                meta.holeMode == HOLES_PRESERVE);
+}
+
+/*
+ * Fills out a metadata header for "inLen" bytes of compressed data.  The
+ * length and hash come from expanding it again, so they describe what a
+ * decoder will actually produce.  "holes" is the CompressReport string.
+ *
+ * Returns false if the data doesn't expand.
+ */
+static bool buildMetaHeader(MetaHeader* pMeta, const uint8_t* inBuf,
+    size_t inLen, const char* holes, ParseMode parseMode,
+    unsigned int formatFlags)
+{
+    uint8_t expandBuf[MAX_SIZE];
+
+    memset(expandBuf, 0, sizeof(expandBuf));    // holes aren't always written
+    size_t outLen = uncompressBuffer(expandBuf, inBuf, inLen);
+    if (outLen == 0) {
+        return false;
+    }
+
+    pMeta->holeMode = HOLES_NONE;
+    for (size_t i = 0; i < NUM_HOLE_MODES; i++) {
+        if (strcmp(holes, gHoleModeNames[i]) == 0) {
+            pMeta->holeMode = i;
+        }
+    }
+    pMeta->uncompressedLen = outLen;
+    pMeta->level = parseModeName(parseMode)[0];
+    pMeta->formatFlags = formatFlags;
+    pMeta->hash = contentHash(expandBuf, outLen,
+            pMeta->holeMode == HOLES_PRESERVE);
+    return true;
+}
+
+/*
+ * How a match offset is stored, for the format sweep.
+ */
+enum OffsetMode {
+    OFFSET_ABS16,           // 2-byte absolute, as in LZ4FH
+    OFFSET_REL              // distance back: 1 byte for 1-128, else 2
+};
+
+/*
+ * Describes one member of the LZ4FH format family, for the format sweep
+ * ("-s").  LZ4FH itself is { 4, 4, 255, 255, OFFSET_ABS16 }.
+ *
+ * The mixed-length byte holds the literal length in the high "litBits"
+ * bits and the adjusted match length in the rest.  A field with all bits
+ * set means an extension byte follows.  EMPTY and EOD stay at 253/254 in
+ * the match extension byte.  Lengths are limited to 255 so a 6502 decoder
+ * can count them in an index register.
+ */
+struct FormatDesc {
+    int litBits;
+    size_t minMatch;
+    size_t maxLiteral;
+    size_t maxMatch;
+    OffsetMode offsetMode;
+};
+
+// 6502 cycle model for the sweep and the autotuner, counted from the paths
+// through LZ4FH6502.V2.S, which match LZ4FH6502.S for version 1 files.
+// The REL offsets are what the obvious subtract-from-dstptr code costs.
+// The compressed data and the output are taken to start on a page
+// boundary, as they do in fhemu, so we know where the pointers cross.
+#define CYC_ENTRY           70      // copy the parameters, check the magic
+#define CYC_ENTRY_V2        39      // check the flags, skip them
+#define CYC_PATCH_OFFSET    17      // patch the offset fetch for HI_FIRST
+#define CYC_META_SKIP       47      // skip the metadata header
+#define CYC_TOKEN           10      // LDY/LDA/STA mixed-length byte
+#define CYC_SHIFT           2       // per LSR to extract literal length
+#define CYC_NO_LITERAL      3       // BEQ taken
+#define CYC_LITERAL_SETUP   11      // BEQ/CMP/BNE, TAX/TAY
+#define CYC_LITERAL_EXT     13
+#define CYC_LITERAL_BYTE    16
+#define CYC_LITERAL_DONE    23      // advance srcptr and dstptr
+#define CYC_MATCH_SETUP     17      // mask/compare length, ADC/STA/TAX
+#define CYC_MATCH_EXT       12
+#define CYC_OFFSET_ABS16    22
+#define CYC_OFFSET_REL1     31
+#define CYC_OFFSET_REL2     45
+#define CYC_MATCH_BYTE      18
+#define CYC_MATCH_DONE      25      // advance srcptr, copy setup, dstptr
+#define CYC_SPECIAL         36      // whole match half of EMPTY or EOD
+#define CYC_SETDST          72      // whole match half of SETDST (ROWS)
+#define CYC_OFFSET_HI_FIRST 58      // through hiofs, remembering the distance
+#define CYC_OFFSET_REPEAT   43      // REPOFF
+#define CYC_OFFSET_STRIDE   63      // STRIDE, table lookup
+#define CYC_OFFSET_XOR      63      // XOR, which has its own copy loop
+#define CYC_XOR_BYTE        20      // XOR copy loop
+#define CYC_PLANE_MERGE_BYTE 20     // PLANES, no 6502 decoder does this
+#define CYC_PAGE_CROSS      1       // (zp),Y read into the next page
+#define CYC_HI_LITERAL_EXT  9       // srcptr+1 bumped past the length ext
+#define CYC_HI_LITERAL_SRC  11      // srcptr+1 bumped past the literals
+#define CYC_HI_LITERAL_DST  9       // dstptr+1 bumped past the literals
+#define CYC_HI_MATCH_SRC    11      // srcptr+1 bumped past the offset
+#define CYC_HI_MATCH_DST    7       // dstptr+1 bumped past the match
+#define CYC_HI_SPECIAL      7       // srcptr+1 bumped past EMPTY or SETDST
+#define CYC_HI_XOR          4       // srcptr+1 or dstptr+1, in the XOR path
+
+/*
+ * Returns the cycles lost to (zp),Y reads that cross a page, for a
+ * pointer with low byte "ptr" and Y running from "first" for "count"
+ * reads.  Y never exceeds 255, so only one crossing is possible.
+ */
+static inline long pageCrossCycles(size_t ptr, size_t first, size_t count)
+{
+    size_t start = (ptr & 0xff) + first;
+    size_t end = start + count;
+    if (end <= 0x100) {
+        return 0;
+    }
+    return (end - (start > 0x100 ? start : 0x100)) * CYC_PAGE_CROSS;
+}
+
+/*
+ * Returns "cycles" if advancing a pointer with low byte "ptr" by "dist"
+ * carries into the high byte, 0 otherwise.
+ */
+static inline long carryCycles(size_t ptr, size_t dist, long cycles)
+{
+    return ((ptr & 0xff) + dist >= 0x100) ? cycles : 0;
+}
+
+/*
+ * Returns the number of bytes needed to encode a match at "posn" that
+ * copies from "offset".
+ */
+static inline size_t paramOffsetLen(const FormatDesc* pDesc, size_t posn,
+    size_t offset)
+{
+    if (pDesc->offsetMode == OFFSET_REL && posn - offset <= 128) {
+        return 1;
+    }
+    return 2;
+}
+
+/*
+ * Outputs literals and a match in the "pDesc" format.  If "matchLen" is
+ * zero, "token" (EMPTY or EOD) goes in the match extension byte instead.
+ * "posn" is where the match starts.  Returns the updated output pointer.
+ */
+static uint8_t* emitParamSequence(const FormatDesc* pDesc, uint8_t* outPtr,
+    const uint8_t* literalSrcPtr, size_t numLiterals, size_t matchLen,
+    size_t posn, size_t matchOffset, uint8_t token)
+{
+    size_t litFieldMax = (1 << pDesc->litBits) - 1;
+    size_t matchFieldMax = (1 << (8 - pDesc->litBits)) - 1;
+    size_t adjustedMatch = 0;
+
+    uint8_t mixedLengths;
+    if (matchLen == 0) {
+        mixedLengths = matchFieldMax;
+    } else {
+        adjustedMatch = matchLen - pDesc->minMatch;
+        mixedLengths = (adjustedMatch < matchFieldMax) ?
+            adjustedMatch : matchFieldMax;
+    }
+    if (numLiterals < litFieldMax) {
+        mixedLengths |= numLiterals << (8 - pDesc->litBits);
+    } else {
+        mixedLengths |= litFieldMax << (8 - pDesc->litBits);
+    }
+    *outPtr++ = mixedLengths;
+
+    if (numLiterals >= litFieldMax) {
+        *outPtr++ = numLiterals - litFieldMax;
+    }
+    memcpy(outPtr, literalSrcPtr, numLiterals);
+    outPtr += numLiterals;
+
+    if (matchLen == 0) {
+        *outPtr++ = token;
+        return outPtr;
+    }
+    if (adjustedMatch >= matchFieldMax) {
+        *outPtr++ = adjustedMatch - matchFieldMax;
+    }
+    if (pDesc->offsetMode == OFFSET_ABS16) {
+        *outPtr++ = matchOffset & 0xff;
+        *outPtr++ = (matchOffset >> 8) & 0xff;
+    } else {
+        size_t dist = posn - matchOffset - 1;
+        if (dist < 128) {
+            *outPtr++ = dist;
+        } else {
+            *outPtr++ = 0x80 | (dist >> 8);
+            *outPtr++ = dist & 0xff;
+        }
+    }
+    return outPtr;
+}
+
+/*
+ * Finds the longest match for every position, preferring the nearest
+ * one when there's a tie (which only matters for OFFSET_REL).  Lengths
+ * are capped at MAX_MATCH_LEN, and can be as short as 1.
+ */
+void findNearestMatches(const uint8_t* inBuf, size_t inLen,
+    MatchInfo* matches)
+{
+    for (size_t posn = 0; posn < inLen; posn++) {
+        size_t maxMatchLen = inLen - posn;
+        if (maxMatchLen > MAX_MATCH_LEN) {
+            maxMatchLen = MAX_MATCH_LEN;
+        }
+        size_t longest = 0;
+        size_t longestOffset = 0;
+        for (size_t ii = posn - 1; ii < posn; ii--) {
+            size_t matchLen = getMatchLen(inBuf + posn, inBuf + ii,
+                    maxMatchLen);
+            if (matchLen > longest) {
+                longest = matchLen;
+                longestOffset = ii;
+                if (matchLen == maxMatchLen) {
+                    break;
+                }
+            }
+        }
+        matches[posn].length = longest;
+        matches[posn].offset = longestOffset;
+    }
+}
+
+/*
+ * Returns the cost of "bytes" of output that take "cycles" to decode.
+ * If "byteCycles" is zero we're only after size, so the cycles don't
+ * count; otherwise each byte costs that many cycles to load.
+ */
+static inline size_t paramCost(size_t bytes, long cycles, long byteCycles)
+{
+    if (byteCycles == 0) {
+        return bytes;
+    }
+    return bytes * byteCycles + cycles;
+}
+
+/*
+ * Parse a buffer for the "pDesc" format, using the matches from
+ * findNearestMatches(), and store the result in "tokens".  This is the
+ * same backward walk as parseOptimally(), with the costs taken from the
+ * descriptor.  "optList" must have room for inLen+1 entries.
+ *
+ * If "byteCycles" is nonzero, the walk minimizes the time to load and
+ * decode the output instead of its size, using the cycle model above and
+ * "byteCycles" per byte loaded.  On a fast medium that favors literals,
+ * which the 6502 copies a little faster than matches.
+ *
+ * Returns the number of tokens.
+ */
+size_t parseParametric(const FormatDesc* pDesc, ParseToken* tokens,
+    size_t inLen, const MatchInfo* matches, OptNode* optList,
+    long byteCycles)
+{
+    size_t litFieldMax = (1 << pDesc->litBits) - 1;
+    size_t matchFieldMax = (1 << (8 - pDesc->litBits)) - 1;
+
+    // Decode cycles for the parts of a token that don't depend on the
+    // lengths.  A literal run that ends in a match shares its token.
+    long tokenCycles = CYC_TOKEN + CYC_SHIFT * (8 - pDesc->litBits);
+    long runCycles = CYC_LITERAL_SETUP + CYC_LITERAL_DONE - CYC_NO_LITERAL;
+    long soloCycles = tokenCycles + CYC_LITERAL_SETUP + CYC_LITERAL_DONE +
+            CYC_SPECIAL;
+
+    memset(optList, 0, (inLen + 1) * sizeof(OptNode));
+
+    for (size_t i = inLen - 1; i < inLen; i--) {
+        size_t costForMatch = (size_t) -1 / 2;  // arbitrary large value
+        size_t matchLen = matches[i].length;
+        if (matchLen > pDesc->maxMatch) {
+            matchLen = pDesc->maxMatch;
+        }
+        if (matchLen >= pDesc->minMatch) {
+            size_t offsetLen = paramOffsetLen(pDesc, i, matches[i].offset);
+            size_t bytes = 1 + offsetLen;
+            long cycles = tokenCycles + CYC_NO_LITERAL + CYC_MATCH_SETUP +
+                CYC_MATCH_BYTE * matchLen + CYC_MATCH_DONE;
+            if (pDesc->offsetMode == OFFSET_ABS16) {
+                cycles += CYC_OFFSET_ABS16;
+            } else {
+                cycles += (offsetLen == 1) ? CYC_OFFSET_REL1 : CYC_OFFSET_REL2;
+            }
+            if (matchLen - pDesc->minMatch >= matchFieldMax) {
+                bytes++;
+                cycles += CYC_MATCH_EXT;
+            }
+            costForMatch = optList[i + matchLen].totalCost +
+                paramCost(bytes, cycles, byteCycles);
+        }
+
+        size_t costForLiteral;
+        if (i == inLen - 1) {
+            optList[i].literalLength = 1;
+            // mixed-len byte + literal
+            costForLiteral = paramCost(2, soloCycles + CYC_LITERAL_BYTE,
+                    byteCycles);
+        } else {
+            if (optList[i+1].matchLength != 0) {
+                optList[i].literalLength = 1;
+                costForLiteral = paramCost(1, runCycles + CYC_LITERAL_BYTE,
+                        byteCycles);
+            } else if (optList[i+1].literalLength == pDesc->maxLiteral) {
+                optList[i].literalLength = 1;
+                // mixed-len byte + literal + EMPTY
+                costForLiteral = paramCost(3, soloCycles + CYC_LITERAL_BYTE,
+                        byteCycles);
+            } else {
+                optList[i].literalLength = optList[i+1].literalLength + 1;
+                if (optList[i].literalLength == litFieldMax) {
+                    costForLiteral = paramCost(2,
+                            CYC_LITERAL_EXT + CYC_LITERAL_BYTE, byteCycles);
+                } else {
+                    costForLiteral = paramCost(1, CYC_LITERAL_BYTE,
+                            byteCycles);
+                }
+            }
+            costForLiteral += optList[i+1].totalCost;
+        }
+
+        if (costForLiteral > costForMatch) {
+            optList[i].matchLength = matchLen;
+            optList[i].matchOffset = matches[i].offset;
+            optList[i].totalCost = costForMatch;
+        } else {
+            optList[i].matchLength = 0;
+            optList[i].totalCost = costForLiteral;
+        }
+    }
+
+    return tokensFromPath(optList, inLen, tokens);
+}
+
+/*
+ * Writes the tokens from parsing "inBuf" in the "pDesc" format.  The
+ * match lengths and literal runs must fit the format.
+ *
+ * Returns the amount of data in "outBuf".
+ */
+size_t emitParametric(const FormatDesc* pDesc, uint8_t* outBuf,
+    const uint8_t* inBuf, const ParseToken* tokens, size_t numTokens)
+{
+    uint8_t* outPtr = outBuf;
+    *outPtr++ = LZ4FH_MAGIC;
+
+    const uint8_t* literalSrcPtr = inBuf;
+    for (size_t t = 0; t < numTokens; t++) {
+        const ParseToken* pToken = &tokens[t];
+        size_t posn = literalSrcPtr - inBuf + pToken->numLiterals;
+        uint8_t token = 0;
+        if (pToken->matchLength == 0) {
+            token = (t == numTokens - 1) ? EOD_MATCH_TOKEN : EMPTY_MATCH_TOKEN;
+        }
+        outPtr = emitParamSequence(pDesc, outPtr, literalSrcPtr,
+                pToken->numLiterals, pToken->matchLength, posn,
+                pToken->matchOffset, token);
+        literalSrcPtr += pToken->numLiterals + pToken->matchLength;
+    }
+    return outPtr - outBuf;
+}
+
+/*
+ * Uncompress a buffer in the "pDesc" format, adding up the number of
+ * cycles a 6502 decoder would take, according to the model above.
+ *
+ * Returns the amount of data in "outBuf", or 0 on failure.
+ */
+size_t uncompressBufferParametric(const FormatDesc* pDesc, uint8_t* outBuf,
+    const uint8_t* inBuf, size_t inLen, long* pCycles)
+{
+    size_t litFieldMax = (1 << pDesc->litBits) - 1;
+    size_t matchFieldMax = (1 << (8 - pDesc->litBits)) - 1;
+    const uint8_t* inPtr = inBuf;
+    const uint8_t* inEnd = inBuf + inLen;
+    uint8_t* outPtr = outBuf;
+    long cycles = CYC_ENTRY;
+
+    if (*inPtr++ != LZ4FH_MAGIC) {
+        return 0;
+    }
+
+    while (inPtr < inEnd) {
+        // Where srcptr points, and the Y of the next read through it.
+        size_t srcPosn = inPtr - inBuf;
+        size_t idx = 1;
+
+        uint8_t mixedLengths = *inPtr++;
+        size_t numLiterals = mixedLengths >> (8 - pDesc->litBits);
+        size_t adjustedMatch = mixedLengths & matchFieldMax;
+        cycles += CYC_TOKEN + CYC_SHIFT * (8 - pDesc->litBits);
+
+        if (numLiterals == 0) {
+            cycles += CYC_NO_LITERAL;
+        } else {
+            cycles += CYC_LITERAL_SETUP;
+            if (numLiterals == litFieldMax) {
+                cycles += carryCycles(srcPosn, 1, CYC_HI_LITERAL_EXT);
+                srcPosn++;
+                numLiterals += *inPtr++;
+                cycles += CYC_LITERAL_EXT;
+            }
+            if (inPtr + numLiterals > inEnd ||
+                    outPtr + numLiterals > outBuf + MAX_SIZE) {
+                return 0;
+            }
+            cycles += pageCrossCycles(srcPosn, 1, numLiterals);
+            cycles += carryCycles(srcPosn, numLiterals + 1,
+                    CYC_HI_LITERAL_SRC);
+            cycles += carryCycles(outPtr - outBuf, numLiterals,
+                    CYC_HI_LITERAL_DST);
+            srcPosn += numLiterals + 1;
+            idx = 0;
+            memcpy(outPtr, inPtr, numLiterals);
+            inPtr += numLiterals;
+            outPtr += numLiterals;
+            cycles += CYC_LITERAL_BYTE * numLiterals + CYC_LITERAL_DONE;
+        }
+
+        if (adjustedMatch == matchFieldMax) {
+            if (inPtr >= inEnd) {
+                return 0;
+            }
+            cycles += pageCrossCycles(srcPosn, idx++, 1);
+            uint8_t ext = *inPtr++;
+            if (ext == EOD_MATCH_TOKEN) {
+                cycles += CYC_SPECIAL;
+                break;
+            } else if (ext == EMPTY_MATCH_TOKEN) {
+                cycles += CYC_SPECIAL + carryCycles(srcPosn, idx,
+                        CYC_HI_SPECIAL);
+                continue;
+            }
+            adjustedMatch += ext;
+            cycles += CYC_MATCH_EXT;
+        }
+        size_t matchLen = adjustedMatch + pDesc->minMatch;
+        cycles += CYC_MATCH_SETUP;
+
+        size_t matchOffset;
+        size_t numOffset = 2;
+        if (pDesc->offsetMode == OFFSET_ABS16) {
+            matchOffset = inPtr[0] | (inPtr[1] << 8);
+            cycles += CYC_OFFSET_ABS16;
+        } else {
+            size_t dist = inPtr[0];
+            if (dist < 128) {
+                numOffset = 1;
+                cycles += CYC_OFFSET_REL1;
+            } else {
+                dist = ((dist & 0x7f) << 8) | inPtr[1];
+                cycles += CYC_OFFSET_REL2;
+            }
+            matchOffset = (outPtr - outBuf) - dist - 1;
+        }
+        cycles += pageCrossCycles(srcPosn, idx, numOffset);
+        cycles += carryCycles(srcPosn, idx + numOffset, CYC_HI_MATCH_SRC);
+        inPtr += numOffset;
+        if (matchOffset >= (size_t) (outPtr - outBuf) ||
+                outPtr + matchLen > outBuf + MAX_SIZE) {
+            return 0;
+        }
+
+        cycles += pageCrossCycles(matchOffset, 0, matchLen);
+        cycles += carryCycles(outPtr - outBuf, matchLen, CYC_HI_MATCH_DST);
+
+        // forward copy, so overlapping matches work
+        const uint8_t* srcPtr = outBuf + matchOffset;
+        for (size_t ii = 0; ii < matchLen; ii++) {
+            *outPtr++ = *srcPtr++;
+        }
+        cycles += CYC_MATCH_BYTE * matchLen + CYC_MATCH_DONE;
+    }
+
+    *pCycles = cycles;
+    return outPtr - outBuf;
+}
+
+/*
+ * Estimates the 6502 cycles needed to unpack "inLen" bytes of LZ4FH data
+ * with LZ4FH6502.V2.S, by walking the chunks with the sweep's cycle model.
+ * This covers the version 2 flags, so the autotuner can compare the
+ * decode time of anything fhpack writes.  The data should be valid, e.g.
+ * just verified, but we don't read past the end if it isn't.
+ *
+ * No 6502 decoder handles PLANES; we charge what a pass putting the
+ * palette bits back would cost.
+ */
+static long estimateDecodeCycles(const uint8_t* inBuf, size_t inLen)
+{
+    const uint8_t* inPtr = inBuf;
+    const uint8_t* inEnd = inBuf + inLen;
+    uint8_t flags = 0;
+    long cycles = CYC_ENTRY;
+
+    if (inLen >= 2 && *inPtr == LZ4FH_MAGIC_META) {
+        inPtr += 2 + inPtr[1];
+        cycles += CYC_META_SKIP;
+    }
+    if (inPtr + 2 > inEnd) {
+        return cycles;
+    }
+    if (*inPtr++ == LZ4FH_MAGIC_V2) {
+        flags = *inPtr++;
+        cycles += CYC_ENTRY_V2;
+        if ((flags & HI_FIRST_FLAGS) != 0) {
+            cycles += CYC_PATCH_OFFSET;
+        }
+    }
+
+    int numStreams = (flags & FLAG_PLANES) != 0 ? 2 : 1;
+    size_t streamLen = 0;
+    size_t dstPosn = 0;
+    size_t lastDist = 0;
+    while (inPtr < inEnd) {
+        // Where srcptr points, and the Y of the next read through it.
+        size_t srcPosn = inPtr - inBuf;
+        size_t idx = 1;
+
+        uint8_t mixedLen = *inPtr++;
+        size_t numLiterals = mixedLen >> 4;
+        size_t matchLen = mixedLen & 0x0f;
+        cycles += CYC_TOKEN + CYC_SHIFT * 4;
+
+        if (numLiterals == 0) {
+            cycles += CYC_NO_LITERAL;
+        } else {
+            cycles += CYC_LITERAL_SETUP;
+            if (numLiterals == INITIAL_LEN) {
+                if (inPtr >= inEnd) {
+                    break;
+                }
+                cycles += carryCycles(srcPosn, 1, CYC_HI_LITERAL_EXT);
+                srcPosn++;
+                numLiterals += *inPtr++;
+                cycles += CYC_LITERAL_EXT;
+            }
+            cycles += pageCrossCycles(srcPosn, 1, numLiterals);
+            cycles += carryCycles(srcPosn, numLiterals + 1,
+                    CYC_HI_LITERAL_SRC);
+            cycles += carryCycles(dstPosn, numLiterals, CYC_HI_LITERAL_DST);
+            srcPosn += numLiterals + 1;
+            dstPosn += numLiterals;
+            idx = 0;
+            inPtr += numLiterals;
+            streamLen += numLiterals;
+            cycles += CYC_LITERAL_BYTE * numLiterals + CYC_LITERAL_DONE;
+        }
+
+        if (matchLen == INITIAL_LEN) {
+            if (inPtr >= inEnd) {
+                break;
+            }
+            cycles += pageCrossCycles(srcPosn, idx++, 1);
+            uint8_t ext = *inPtr++;
+            if (ext == EOD_MATCH_TOKEN) {
+                cycles += CYC_SPECIAL;
+                if (--numStreams == 0) {
+                    break;
+                }
+                streamLen = dstPosn = 0;
+                continue;
+            } else if (ext == EMPTY_MATCH_TOKEN) {
+                cycles += CYC_SPECIAL + carryCycles(srcPosn, idx,
+                        CYC_HI_SPECIAL);
+                continue;
+            } else if (ext == SETDST_MATCH_TOKEN &&
+                    (flags & FLAG_ROWS) != 0) {
+                if (inPtr + 2 > inEnd) {
+                    break;
+                }
+                cycles += pageCrossCycles(srcPosn, idx, 2);
+                cycles += CYC_SETDST + carryCycles(srcPosn, idx + 2,
+                        CYC_HI_SPECIAL);
+                dstPosn = inPtr[0] | (inPtr[1] << 8);
+                inPtr += 2;
+                continue;
+            }
+            matchLen += ext;
+            cycles += CYC_MATCH_EXT;
+        }
+        if (inPtr + 2 > inEnd) {
+            break;
+        }
+        matchLen += MIN_MATCH_LEN;
+        streamLen += matchLen;
+        cycles += CYC_MATCH_SETUP;
+
+        // Same order of checks as uncompressStream().
+        long byteCycles = CYC_MATCH_BYTE;
+        long srcCarry = CYC_HI_MATCH_SRC;
+        long dstCarry = CYC_HI_MATCH_DST;
+        size_t numOffset = 2;
+        size_t copyFrom;
+        if ((flags & HI_FIRST_FLAGS) == 0) {
+            copyFrom = inPtr[0] | (inPtr[1] << 8);
+            cycles += CYC_OFFSET_ABS16;
+        } else if ((flags & FLAG_STRIDE) != 0 && *inPtr >= STRIDE_CODE &&
+                *inPtr < STRIDE_CODE + NUM_STRIDES) {
+            lastDist = gStrideDist[*inPtr - STRIDE_CODE];
+            copyFrom = dstPosn - lastDist;
+            numOffset = 1;
+            cycles += CYC_OFFSET_STRIDE;
+        } else if ((flags & FLAG_XOR) != 0 &&
+                (*inPtr & XOR_OFFSET_MASK) == XOR_OFFSET_CODE) {
+            copyFrom = ((inPtr[0] & ~XOR_OFFSET_MASK) << 8) | inPtr[1];
+            lastDist = dstPosn - copyFrom;
+            cycles += CYC_OFFSET_XOR;
+            byteCycles = CYC_XOR_BYTE;
+            srcCarry = dstCarry = CYC_HI_XOR;
+        } else if ((flags & FLAG_REPOFF) != 0 &&
+                *inPtr == REPEAT_OFFSET_CODE) {
+            copyFrom = dstPosn - lastDist;
+            numOffset = 1;
+            cycles += CYC_OFFSET_REPEAT;
+        } else {
+            copyFrom = (inPtr[0] << 8) | inPtr[1];
+            lastDist = dstPosn - copyFrom;
+            cycles += CYC_OFFSET_HI_FIRST;
+        }
+        cycles += pageCrossCycles(srcPosn, idx, numOffset);
+        cycles += carryCycles(srcPosn, idx + numOffset, srcCarry);
+        inPtr += numOffset;
+
+        cycles += pageCrossCycles(copyFrom, 0, matchLen);
+        cycles += carryCycles(dstPosn, matchLen, dstCarry);
+        dstPosn += matchLen;
+        cycles += byteCycles * matchLen + CYC_MATCH_DONE;
+    }
+
+    if ((flags & FLAG_PLANES) != 0) {
+        cycles += CYC_PLANE_MERGE_BYTE * streamLen;
+    }
+    return cycles;
+}
+
+#ifndef FHPACK_NO_MAIN
+/*
+ * Shows the metadata headers of a set of compressed files, without
+ * expanding them ("-n"), along with the modelled 6502 decode time, which
+ * "fhemu -m" checks against the real thing.  Uncompressed images are
+ * hashed the same way, so a compressed file can be checked against its
+ * source, and files holding the same image are pointed out.
+ *
+ * Returns 0 if every file was recognized.
+ */
+static int showMetaHeaders(char* const* fileNames, int numFiles)
+{
+    std::vector<uint64_t> hashes(numFiles);
+    std::vector<bool> haveHash(numFiles, false);
+    uint8_t buf[MAX_OUT_SIZE];
+    int numBad = 0;
+
+    for (int i = 0; i < numFiles; i++) {
+        FILE* fp = fopen(fileNames[i], "rb");
+        if (fp == NULL) {
+            perror("Unable to open input file");
+            numBad++;
+            continue;
+        }
+        size_t len = fread(buf, 1, sizeof(buf), fp);
+        fclose(fp);
+
+        MetaHeader meta;
+        printf("%s: ", fileNames[i]);
+        if (getMetaHeader(buf, len, &meta)) {
+            const char* holes = meta.holeMode < NUM_HOLE_MODES ?
+                    gHoleModeNames[meta.holeMode] : "?";
+            printf("LZ4FH (6502 %ld cycles), %u bytes, holes %s, -%c, "
+                    "flags 0x%02x, hash %016llx",
+                estimateDecodeCycles(buf, len), meta.uncompressedLen, holes,
+                meta.level, meta.formatFlags, (unsigned long long) meta.hash);
+            hashes[i] = meta.hash;
+            haveHash[i] = true;
+        } else if (findScreenType(len) != NULL) {
+            // Hash it both ways; a preserved-holes copy includes them.
+            printf("image, %zd bytes, hash %016llx (with holes %016llx)",
+                len, (unsigned long long) contentHash(buf, len, false),
+                (unsigned long long) contentHash(buf, len, true));
+            hashes[i] = contentHash(buf, len, false);
+            haveHash[i] = true;
+        } else if (len != 0 &&
+                (buf[0] == LZ4FH_MAGIC || buf[0] == LZ4FH_MAGIC_V2)) {
+            printf("LZ4FH (6502 %ld cycles), no metadata header",
+                estimateDecodeCycles(buf, len));
+        } else {
+            printf("not LZ4FH or an image");
+            numBad++;
+        }
+
+        for (int j = 0; j < i && haveHash[i]; j++) {
+            if (haveHash[j] && hashes[j] == hashes[i]) {
+                printf(" (same as %s)", fileNames[j]);
+                break;
+            }
+        }
+        putchar('\n');
+    }
+    return numBad == 0 ? 0 : -1;
+}
+#endif /*FHPACK_NO_MAIN*/
+
+/*
+ * Working storage for compressing one image.  Each worker thread in a
+ * batch run gets its own, and reuses it for every image.  The arenas
+ * hold the parser's scratch space for the two hole variants, which may
+ * be compressed at the same time.
+ */
+struct CompressBuffers {
+    uint8_t inBuf1[MAX_SIZE];
+    uint8_t inBuf2[MAX_SIZE];
+    uint8_t verifyBuf[MAX_SIZE];
+    uint8_t outBuf1[MAX_OUT_SIZE];
+    uint8_t outBuf2[MAX_OUT_SIZE];
+    Arena arena1;
+    Arena arena2;
+};
+
+/*
+ * Returns the arena size needed for each hole variant.  Every parser but
+ * the row-order one puts its tokens there.  The other parsers keep their
+ * (small) tables on the stack.
+ */
+static size_t arenaSizeFor(ParseMode parseMode, unsigned int formatFlags)
+{
+    size_t size = 0;
+    if ((formatFlags & FLAG_ROWS) == 0) {
+        size = parseScratchSize(MAX_SIZE);
+        if (parseMode == PARSE_OPTIMAL) {
+            size += optimalScratchSize(MAX_SIZE);
+        }
+    }
+    if ((formatFlags & FLAG_PLANES) != 0) {
+        size += planesScratchSize(MAX_SIZE);
+    }
+    return size;
+}
+
+/*
+ * Returns the amount of memory a worker allocates, not counting its
+ * stack.
+ */
+size_t compressMemoryUsage(ParseMode parseMode, unsigned int formatFlags)
+{
+    return sizeof(CompressBuffers) + 2 * arenaSizeFor(parseMode, formatFlags);
+}
+
+/*
+ * Allocates a worker's buffers, with arenas sized for "parseMode".
+ * Returns NULL on failure.
+ */
+CompressBuffers* allocCompressBuffers(ParseMode parseMode,
+    unsigned int formatFlags)
+{
+    CompressBuffers* pBufs = (CompressBuffers*) malloc(sizeof(*pBufs));
+    if (pBufs == NULL) {
+        return NULL;
+    }
+    size_t arenaSize = arenaSizeFor(parseMode, formatFlags);
+    if (!arenaInit(&pBufs->arena1, arenaSize) ||
+        !arenaInit(&pBufs->arena2, arenaSize))
+    {
+        fprintf(stderr, "ERROR: unable to allocate %zd bytes\n", arenaSize);
+        arenaFree(&pBufs->arena1);
+        free(pBufs);
+        return NULL;
+    }
+    return pBufs;
+}
+
+/*
+ * Frees the buffers allocated by allocCompressBuffers().
+ */
+void freeCompressBuffers(CompressBuffers* pBufs)
+{
+    if (pBufs != NULL) {
+        arenaFree(&pBufs->arena1);
+        arenaFree(&pBufs->arena2);
+        free(pBufs);
+    }
+}
+
+/*
+ * Returns the peak arena use, across both variants.
+ */
+size_t compressArenaPeak(const CompressBuffers* pBufs)
+{
+    return pBufs->arena1.peak + pBufs->arena2.peak;
+}
+
+/*
+ * Applies one of the hole-filling strategies to "inBuf", and compresses
+ * it.  The compressed length and the time it took are stored in
+ * "*pOutSize" and "*pSecs".
+ */
+static void compressHoleVariant(uint8_t* outBuf, uint8_t* inBuf, size_t inLen,
+    bool doFill, ParseMode parseMode, unsigned int formatFlags,
+    int numThreads, Arena* pArena, const char* traceFile, size_t* pOutSize,
+    double* pSecs)
+{
+    double startWhen = getTimeSecs();
+    if (doFill) {
+        fillHoles(inBuf, inLen + HOLE_LEN);
+    } else {
+        zeroHoles(inBuf, inLen + HOLE_LEN);
+    }
+    *pOutSize = compressBuffer(outBuf, inBuf, inLen, parseMode, formatFlags,
+            numThreads, pArena);
+    *pSecs = getTimeSecs() - startWhen;
+    traceSpan(doFill ? "compress fill holes" : "compress zero holes",
+        traceFile, startWhen);
+}
+
+/*
+ * Compress an image, which has been loaded into pBufs->inBuf1, and
+ * verify the result.  "fileLen" must be valid for one of the screen
+ * types.  Unless we're preserving the holes, we compress it twice, with
+ * zero-filled holes and content-filled holes, and keep the smaller one.
+ *
+ * With more than one thread, the two hole variants are compressed at
+ * the same time, and the threads are split between them.
+ *
+ * The sizes and timings are stored in "*pReport".  Returns a pointer to
+ * the compressed data (in one of the output buffers), or NULL on failure.
+ */
+const uint8_t* compressImage(CompressBuffers* pBufs, long fileLen,
+    bool doPreserveHoles, ParseMode parseMode, unsigned int formatFlags,
+    int numThreads, CompressReport* pReport)
+{
+    uint8_t* outBuf = NULL;
+    uint8_t* inBuf = NULL;
+    size_t outSize, sourceLen, uncompressedLen;
+    const ScreenType* pScreen = findScreenType(fileLen);
+    assert(pScreen != NULL);
+
+    if ((formatFlags & FLAG_ROWS) != 0 && pScreen->pageLen != MAX_SIZE) {
+        fprintf(stderr, "ERROR: row order is only for hi-res images\n");
+        return NULL;
+    }
+
+    // Nothing from the previous image is still in use.
+    arenaReset(&pBufs->arena1);
+    arenaReset(&pBufs->arena2);
+
+    pReport->inputSize = fileLen;
+    double startWhen = getTimeSecs();
+    if ((formatFlags & FLAG_ROWS) != 0) {
+        // The holes aren't stored, so there's nothing to try.
+        sourceLen = MIN_SIZE;
+        outSize = compressBufferRows(pBufs->outBuf1, pBufs->inBuf1,
+                parseMode);
+        traceSpan("compress rows", gTraceFile, startWhen);
+        inBuf = pBufs->inBuf1;
+        outBuf = pBufs->outBuf1;
+        pReport->holes = "none";
+    } else if (doPreserveHoles) {
+        // Don't modify the input.
+        sourceLen = fileLen;        // retain original file length
+        outSize = compressBuffer(pBufs->outBuf1, pBufs->inBuf1, sourceLen,
+                parseMode, formatFlags, numThreads, &pBufs->arena1);
+        traceSpan("compress preserve holes", gTraceFile, startWhen);
+        inBuf = pBufs->inBuf1;
+        outBuf = pBufs->outBuf1;
+        pReport->holes = "preserve";
+    } else {
+        // always drop the last 8 bytes
+        sourceLen = pScreen->pageLen - HOLE_LEN;
+        memcpy(pBufs->inBuf2, pBufs->inBuf1, sourceLen);
+
+        // try it twice, with zero-filled holes and content-filled holes
+        if (numThreads > 1) {
+            std::thread fillThread(compressHoleVariant, pBufs->outBuf2,
+                    pBufs->inBuf2, sourceLen, true, parseMode, formatFlags,
+                    numThreads - numThreads / 2, &pBufs->arena2, gTraceFile,
+                    &pReport->fillHolesSize, &pReport->fillHolesSecs);
+            compressHoleVariant(pBufs->outBuf1, pBufs->inBuf1, sourceLen,
+                    false, parseMode, formatFlags, numThreads / 2,
+                    &pBufs->arena1, gTraceFile,
+                    &pReport->zeroHolesSize, &pReport->zeroHolesSecs);
+            fillThread.join();
+        } else {
+            compressHoleVariant(pBufs->outBuf1, pBufs->inBuf1, sourceLen,
+                    false, parseMode, formatFlags, 1, &pBufs->arena1,
+                    gTraceFile,
+                    &pReport->zeroHolesSize, &pReport->zeroHolesSecs);
+            compressHoleVariant(pBufs->outBuf2, pBufs->inBuf2, sourceLen,
+                    true, parseMode, formatFlags, 1, &pBufs->arena2,
+                    gTraceFile,
+                    &pReport->fillHolesSize, &pReport->fillHolesSecs);
+        }
+
+        if (false) {     // save hole-punched output for examination
+            FILE* foo = fopen("HOLES", "wb");
+            fwrite(pBufs->inBuf2, 1, sourceLen, foo);
+            fclose(foo);
+        }
+
+        if (pReport->zeroHolesSize <= pReport->fillHolesSize) {
+            outSize = pReport->zeroHolesSize;
+            inBuf = pBufs->inBuf1;
+            outBuf = pBufs->outBuf1;
+            pReport->holes = "zero";
+        } else {
+            outSize = pReport->fillHolesSize;
+            inBuf = pBufs->inBuf2;
+            outBuf = pBufs->outBuf2;
+            pReport->holes = "fill";
+        }
+    }
+    pReport->outputSize = outSize;
+    pReport->compressSecs = getTimeSecs() - startWhen;
+
+    if (outSize == 0) {
+        fprintf(stderr, "Compression failed\n");
+        return NULL;
+    }
+    DBUG(("*** outSize is %zd\n", outSize));
+
+    // uncompress the data we just compressed
+    startWhen = getTimeSecs();
+    uint8_t* verifyBuf = pBufs->verifyBuf;
+    memset(verifyBuf, 0xcc, MAX_SIZE);
+    uncompressedLen = uncompressBuffer(verifyBuf, outBuf, outSize);
+    if (uncompressedLen != sourceLen) {
+        fprintf(stderr, "ERROR: verify expanded %zd of expected %zd bytes\n",
+            uncompressedLen, sourceLen);
+        return NULL;
+    }
+
+    // byte-for-byte comparison
+    for (size_t ii = 0; ii < sourceLen; ii++) {
+        if ((formatFlags & FLAG_ROWS) != 0 && isHole(ii)) {
+            continue;
+        }
+        if (inBuf[ii] != verifyBuf[ii]) {
+            fprintf(stderr,
+                "ERROR: expansion mismatch (byte %zd, 0x%02x 0x%02x)\n",
+                ii, inBuf[ii], verifyBuf[ii]);
+            return NULL;
+        }
+    }
+    DBUG(("Verification succeeded\n"));
+    pReport->verified = true;
+    pReport->verifySecs = getTimeSecs() - startWhen;
+    traceSpan("verify", gTraceFile, startWhen);
+
+    return outBuf;
+}
+
+/*
+ * Prints which hole variant was chosen, if there was a choice.
+ */
+static void printHoleChoice(const CompressReport* pReport)
+{
+    if (strcmp(pReport->holes, "zero") == 0) {
+        printf("  using zeroed-out holes (%zd vs. %zd)\n",
+            pReport->zeroHolesSize, pReport->fillHolesSize);
+    } else if (strcmp(pReport->holes, "fill") == 0) {
+        printf("  using filled-in holes (%zd vs. %zd)\n",
+            pReport->fillHolesSize, pReport->zeroHolesSize);
+    }
+}
+
+/*
+ * Returns true if "pSetting" is a combination main() would accept.
+ * Row order is only for hi-res images, and never stores the holes.
+ */
+static bool tuneSettingValid(const TuneSetting* pSetting, size_t pageLen,
+    bool doPreserveHoles)
+{
+    ParseMode parseMode = pSetting->parseMode;
+    unsigned int formatFlags = pSetting->formatFlags;
+
+    if ((formatFlags & FLAG_ROWS) != 0 &&
+            (pageLen != MAX_SIZE || doPreserveHoles ||
+             parseMode == PARSE_DEVICE || parseMode == PARSE_FAST)) {
+        return false;
+    }
+    if ((formatFlags & FLAG_PLANES) != 0 &&
+            ((formatFlags & FLAG_ROWS) != 0 || parseMode == PARSE_DEVICE)) {
+        return false;
+    }
+    if ((formatFlags & HI_FIRST_FLAGS) != 0 &&
+            (parseMode != PARSE_OPTIMAL || (formatFlags & FLAG_ROWS) != 0)) {
+        return false;
+    }
+    if ((formatFlags & OPT_SHORT_TOKENS) != 0 &&
+            (formatFlags & KNOWN_FLAGS) != 0) {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Lists the settings the autotuner tries for an image of "pageLen"
+ * bytes.  Every level is tried, with both hole strategies.  Of the flags
+ * in "formatFlags", row order and short tokens are requirements, applied
+ * to everything, while repeat offsets, strides, XOR, and bit planes are
+ * what the caller's decoder can handle, so every combination of them is
+ * tried.
+ *
+ * The cheap levels come first, so that a time budget cuts off the slow
+ * searches rather than the fast ones.
+ */
+static std::vector<TuneSetting> buildTuneSpace(size_t pageLen,
+    bool doPreserveHoles, unsigned int formatFlags)
+{
+    static const ParseMode kLevels[] = {
+        PARSE_FAST, PARSE_DEVICE, PARSE_GREEDY, PARSE_OPTIMAL
+    };
+    static const unsigned int kOptional[] = {
+        FLAG_REPOFF, FLAG_STRIDE, FLAG_XOR, FLAG_PLANES
+    };
+    const int numOptional = sizeof(kOptional) / sizeof(kOptional[0]);
+    unsigned int required = formatFlags & (FLAG_ROWS | OPT_SHORT_TOKENS);
+    bool holesApply = !doPreserveHoles && (required & FLAG_ROWS) == 0;
+    std::vector<TuneSetting> settings;
+
+    for (size_t lv = 0; lv < sizeof(kLevels) / sizeof(kLevels[0]); lv++) {
+        for (int combo = 0; combo < (1 << numOptional); combo++) {
+            TuneSetting setting;
+            setting.parseMode = kLevels[lv];
+            setting.formatFlags = required;
+            bool allowed = true;
+            for (int b = 0; b < numOptional; b++) {
+                if ((combo & (1 << b)) != 0) {
+                    setting.formatFlags |= kOptional[b];
+                    allowed &= (formatFlags & kOptional[b]) != 0;
+                }
+            }
+            if (!allowed) {
+                continue;
+            }
+            for (int fill = 0; fill < (holesApply ? 2 : 1); fill++) {
+                setting.doFill = (fill != 0);
+                if (tuneSettingValid(&setting, pageLen, doPreserveHoles)) {
+                    settings.push_back(setting);
+                }
+            }
+        }
+    }
+    return settings;
+}
+
+/*
+ * Formats a setting the way it would be given on the command line,
+ * e.g. "-9 -o -k, holes fill".
+ */
+static void formatTuneSetting(char* buf, size_t bufLen,
+    const TuneSetting* pSetting, const char* holes)
+{
+    static const struct { unsigned int flag; const char* opt; } kOpts[] = {
+        { FLAG_ROWS, " -p" }, { FLAG_REPOFF, " -o" }, { FLAG_STRIDE, " -k" },
+        { FLAG_XOR, " -x" }, { FLAG_PLANES, " -l" },
+        { OPT_SHORT_TOKENS, " -f" },
+    };
+    size_t len = snprintf(buf, bufLen, "-%s",
+            parseModeName(pSetting->parseMode));
+    for (size_t i = 0; i < sizeof(kOpts) / sizeof(kOpts[0]); i++) {
+        if ((pSetting->formatFlags & kOpts[i].flag) != 0 && len < bufLen) {
+            len += snprintf(buf + len, bufLen - len, "%s", kOpts[i].opt);
+        }
+    }
+    if (len < bufLen) {
+        snprintf(buf + len, bufLen - len, ", holes %s", holes);
+    }
+}
+
+/*
+ * Compresses "image" with one setting, into pBufs->outBuf1, and checks
+ * the result.  The modelled decode time goes in "*pCycles".
+ *
+ * Returns the compressed length, or 0 if it failed or didn't verify.
+ */
+static size_t compressTuneSetting(CompressBuffers* pBufs,
+    const uint8_t* image, long fileLen, bool doPreserveHoles,
+    const TuneSetting* pSetting, long* pCycles)
+{
+    size_t pageLen = findScreenType(fileLen)->pageLen;
+    bool isRows = (pSetting->formatFlags & FLAG_ROWS) != 0;
+    size_t sourceLen, outLen;
+
+    memcpy(pBufs->inBuf1, image, fileLen);
+    arenaReset(&pBufs->arena1);
+    if (isRows) {
+        sourceLen = MIN_SIZE;
+        outLen = compressBufferRows(pBufs->outBuf1, pBufs->inBuf1,
+                pSetting->parseMode);
+    } else {
+        if (doPreserveHoles) {
+            sourceLen = fileLen;
+        } else {
+            sourceLen = pageLen - HOLE_LEN;
+            if (pSetting->doFill) {
+                fillHoles(pBufs->inBuf1, pageLen);
+            } else {
+                zeroHoles(pBufs->inBuf1, pageLen);
+            }
+        }
+        outLen = compressBuffer(pBufs->outBuf1, pBufs->inBuf1, sourceLen,
+                pSetting->parseMode, pSetting->formatFlags, 1,
+                &pBufs->arena1);
+    }
+    if (outLen == 0) {
+        return 0;
+    }
+
+    memset(pBufs->verifyBuf, 0xcc, MAX_SIZE);
+    if (uncompressBuffer(pBufs->verifyBuf, pBufs->outBuf1, outLen) !=
+            sourceLen) {
+        return 0;
+    }
+    for (size_t ii = 0; ii < sourceLen; ii++) {
+        if (isRows && isHole(ii)) {
+            continue;
+        }
+        if (pBufs->inBuf1[ii] != pBufs->verifyBuf[ii]) {
+            return 0;
+        }
+    }
+    *pCycles = estimateDecodeCycles(pBufs->outBuf1, outLen);
+    return outLen;
+}
+
+/*
+ * Result of trying one autotune setting.  "outputSize" is zero if it
+ * failed, or wasn't tried before the budget ran out.
+ */
+struct TuneResult {
+    size_t outputSize;
+    long cycles;
+};
+
+/*
+ * Compresses the image with settings from the list until there are none
+ * left, or the deadline passes.  The first setting is always tried, so
+ * there's something to show for it.
+ */
+static void tuneWorker(const TuneSetting* settings, int numSettings,
+    std::atomic<int>* pNext, const uint8_t* image, long fileLen,
+    bool doPreserveHoles, double deadline, TuneResult* results)
+{
+    CompressBuffers* pBufs = allocCompressBuffers(PARSE_OPTIMAL, FLAG_PLANES);
+    if (pBufs == NULL) {
+        return;
+    }
+
+    while (true) {
+        int idx = (*pNext)++;
+        if (idx >= numSettings ||
+                (idx != 0 && deadline != 0.0 && getTimeSecs() >= deadline)) {
+            break;
+        }
+        results[idx].outputSize = compressTuneSetting(pBufs, image, fileLen,
+                doPreserveHoles, &settings[idx], &results[idx].cycles);
+    }
+    freeCompressBuffers(pBufs);
+}
+
+/*
+ * Returns true if result "a" beats result "b" for "goal".  Ties go to
+ * the other measure; if that's a tie too, the earlier (cheaper) setting
+ * wins, so the choice doesn't depend on the thread count.
+ */
+static bool tuneResultBetter(const TuneResult* a, const TuneResult* b,
+    TuneGoal goal)
+{
+    if (goal == TUNE_TIME && a->cycles != b->cycles) {
+        return a->cycles < b->cycles;
+    }
+    if (a->outputSize != b->outputSize) {
+        return a->outputSize < b->outputSize;
+    }
+    return a->cycles < b->cycles;
+}
+
+/*
+ * Searches for the best way to compress an image, which has been loaded
+ * into pBufs->inBuf1, instead of using one level and both hole variants
+ * like compressImage().  The settings are spread across "numThreads"
+ * threads, each with its own buffers.  With a budget, settings that
+ * haven't started when it runs out are skipped.
+ *
+ * The winner is compressed again into pBufs->outBuf1, and it and the
+ * sizes and timings are stored in "*pReport".  Returns a pointer to the
+ * compressed data, or NULL on failure.
+ */
+const uint8_t* autotuneImage(CompressBuffers* pBufs, long fileLen,
+    bool doPreserveHoles, unsigned int formatFlags, int numThreads,
+    const TuneOptions* pTune, CompressReport* pReport)
+{
+    const ScreenType* pScreen = findScreenType(fileLen);
+    assert(pScreen != NULL);
+    std::vector<TuneSetting> settings =
+            buildTuneSpace(pScreen->pageLen, doPreserveHoles, formatFlags);
+    if (settings.empty()) {
+        fprintf(stderr, "ERROR: no settings to try (row order is only "
+            "for hi-res images)\n");
+        return NULL;
+    }
+
+    uint8_t image[MAX_SIZE];
+    memcpy(image, pBufs->inBuf1, fileLen);
+    pReport->inputSize = fileLen;
+    double startWhen = getTimeSecs();
+    double deadline = 0.0;
+    if (pTune->budgetSecs > 0.0) {
+        deadline = startWhen + pTune->budgetSecs;
+    }
+
+    int numSettings = settings.size();
+    std::vector<TuneResult> results(numSettings);
+    for (int i = 0; i < numSettings; i++) {
+        results[i].outputSize = 0;
+        results[i].cycles = 0;
+    }
+    std::atomic<int> next(0);
+    std::vector<std::thread> workers;
+    int numWorkers = (numThreads < numSettings) ? numThreads : numSettings;
+    for (int t = 1; t < numWorkers; t++) {
+        workers.push_back(std::thread(tuneWorker, &settings[0], numSettings,
+                &next, image, fileLen, doPreserveHoles, deadline,
+                &results[0]));
+    }
+    tuneWorker(&settings[0], numSettings, &next, image, fileLen,
+            doPreserveHoles, deadline, &results[0]);
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+
+    int bestIdx = -1;
+    pReport->numTried = 0;
+    for (int i = 0; i < numSettings; i++) {
+        if (results[i].outputSize == 0) {
+            continue;
+        }
+        pReport->numTried++;
+        if (bestIdx < 0 ||
+                tuneResultBetter(&results[i], &results[bestIdx], pTune->goal)) {
+            bestIdx = i;
+        }
+    }
+    pReport->numSettings = numSettings;
+    if (bestIdx < 0) {
+        fprintf(stderr, "Compression failed\n");
+        return NULL;
+    }
+
+    // Do the winner again, so it ends up in the caller's buffers.
+    long cycles;
+    size_t outSize = compressTuneSetting(pBufs, image, fileLen,
+            doPreserveHoles, &settings[bestIdx], &cycles);
+    pReport->compressSecs = getTimeSecs() - startWhen;
+    if (outSize != results[bestIdx].outputSize) {
+        fprintf(stderr, "ERROR: autotune result changed on the second pass\n");
+        return NULL;
+    }
+
+    pReport->tuned = settings[bestIdx];
+    pReport->cycles = cycles;
+    pReport->outputSize = outSize;
+    pReport->verified = true;
+    if ((settings[bestIdx].formatFlags & FLAG_ROWS) != 0) {
+        pReport->holes = "none";
+    } else if (doPreserveHoles) {
+        pReport->holes = "preserve";
+    } else {
+        pReport->holes = settings[bestIdx].doFill ? "fill" : "zero";
+    }
+    return pBufs->outBuf1;
+}
+
+/*
+ * Prints the setting the autotuner picked.
+ */
+static void printTuneChoice(const CompressReport* pReport)
+{
+    char name[64];
+    formatTuneSetting(name, sizeof(name), &pReport->tuned, pReport->holes);
+    printf("  autotune picked %s: %zd bytes, %.3f sec to decode "
+            "(%d of %d settings, %.3f sec)\n",
+        name, pReport->outputSize,
+        (double) pReport->cycles / APPLE2_CLOCK_HZ,
+        pReport->numTried, pReport->numSettings, pReport->compressSecs);
+}
+
+#ifndef FHPACK_NO_MAIN
+/*
+ * How many times one setting won, across a set of files.
+ */
+struct TuneTally {
+    char name[64];
+    int count;
+    size_t outputSize;
+    long cycles;
+};
+
+/*
+ * Counts the setting the autotuner picked for one file.
+ */
+static void addTuneTally(std::vector<TuneTally>* pTally,
+    const CompressReport* pReport)
+{
+    char name[64];
+    formatTuneSetting(name, sizeof(name), &pReport->tuned, pReport->holes);
+    for (size_t i = 0; i < pTally->size(); i++) {
+        TuneTally* pEntry = &(*pTally)[i];
+        if (strcmp(pEntry->name, name) == 0) {
+            pEntry->count++;
+            pEntry->outputSize += pReport->outputSize;
+            pEntry->cycles += pReport->cycles;
+            return;
+        }
+    }
+    TuneTally entry;
+    strcpy(entry.name, name);
+    entry.count = 1;
+    entry.outputSize = pReport->outputSize;
+    entry.cycles = pReport->cycles;
+    pTally->push_back(entry);
+}
+
+/*
+ * qsort() comparison function: most wins first, then by name.
+ */
+static int compareTuneTally(const void* vp1, const void* vp2)
+{
+    const TuneTally* p1 = (const TuneTally*) vp1;
+    const TuneTally* p2 = (const TuneTally*) vp2;
+    if (p1->count != p2->count) {
+        return p2->count - p1->count;
+    }
+    return strcmp(p1->name, p2->name);
+}
+
+/*
+ * Prints how often each setting won, most often first.  If one setting
+ * wins nearly everywhere, it's a good preset for files like these.
+ */
+static void printTuneTally(std::vector<TuneTally>& tally)
+{
+    if (!tally.empty()) {
+        qsort(&tally[0], tally.size(), sizeof(TuneTally), compareTuneTally);
+    }
+
+    printf("Winning settings:\n");
+    for (size_t i = 0; i < tally.size(); i++) {
+        printf("  %4d  %-32s %8zd bytes  %.3f sec avg decode\n",
+            tally[i].count, tally[i].name, tally[i].outputSize,
+            (double) tally[i].cycles / tally[i].count / APPLE2_CLOCK_HZ);
+    }
+}
+#endif /*FHPACK_NO_MAIN*/
+
+/*
+ * Compress a file, from "inFileName" to "outFileName".  If "outFileName"
+ * is NULL, we're in test mode, and the output is discarded.  The work is
+ * done in "pBufs", from allocCompressBuffers().
+ *
+ * If "pReport" is non-NULL, the sizes and timings are stored there, and
+ * nothing is printed on stdout.
+ *
+ * If "doMetaHeader" is set, the output file starts with a metadata header.
+ * If "pTune" is non-NULL, the autotuner picks the settings, and
+ * "parseMode" is ignored.
+ *
+ * Returns 0 on success.
+ */
+int compressFile(const char* outFileName, const char* inFileName,
+    bool doPreserveHoles, bool doMetaHeader, ParseMode parseMode,
+    unsigned int formatFlags, int numThreads, const TuneOptions* pTune,
+    CompressBuffers* pBufs, CompressReport* pReport)
+{
+    CompressReport report;
+    memset(&report, 0, sizeof(report));
+    report.holes = "none";
+    double startWhen = getTimeSecs();
+    double fileStart = startWhen;
+    gTraceFile = inFileName;
+
+    int result = -1;
+    const uint8_t* outBuf;
+    FILE* outfp = NULL;
+    FILE* infp;
+
+    infp = fopen(inFileName, "rb");
+    if (infp == NULL) {
+        perror("Unable to open input file");
+        return -1;
+    }
+
+    if (outFileName != NULL) {
+        outfp = fopen(outFileName, "wb");
+        if (outfp == NULL) {
+            perror("Unable to open output file");
+            fclose(infp);
+            return -1;
+        }
+    }
+
+    fseek(infp, 0, SEEK_END);
+    long fileLen = ftell(infp);
+    rewind(infp);
+    if (findScreenType(fileLen) == NULL) {
+        reportBadSize(inFileName, fileLen);
+        goto bail;
+    }
+
+    // Read data into buffer.
+    if (fread(pBufs->inBuf1, 1, fileLen, infp) != (size_t) fileLen) {
+        perror("Failed while reading data");
+        goto bail;
+    }
+    report.readSecs = getTimeSecs() - startWhen;
+    traceSpan("read", inFileName, startWhen);
+
+    if (pTune != NULL) {
+        startWhen = getTimeSecs();
+        outBuf = autotuneImage(pBufs, fileLen, doPreserveHoles, formatFlags,
+                numThreads, pTune, &report);
+        traceSpan("tune", inFileName, startWhen);
+    } else {
+        outBuf = compressImage(pBufs, fileLen, doPreserveHoles, parseMode,
+                formatFlags, numThreads, &report);
+    }
+    if (outBuf == NULL) {
+        goto bail;
+    }
+    if (pTune != NULL) {
+        // the metadata header records what was actually used
+        parseMode = report.tuned.parseMode;
+        formatFlags = report.tuned.formatFlags;
+        if (pReport == NULL) {
+            printTuneChoice(&report);
+        }
+    } else if (pReport == NULL) {
+        printHoleChoice(&report);
+    }
+
+    if (outfp != NULL) {
+        if (doMetaHeader) {
+            MetaHeader meta;
+            uint8_t hdrBuf[META_HEADER_LEN];
+            if (!buildMetaHeader(&meta, outBuf, report.outputSize,
+                    report.holes, parseMode, formatFlags)) {
+                goto bail;
+            }
+            putMetaHeader(hdrBuf, &meta);
+            if (fwrite(hdrBuf, 1, sizeof(hdrBuf), outfp) != sizeof(hdrBuf)) {
+                perror("Failed while writing data");
+                goto bail;
+            }
+        }
+
+        /* write the data */
+        startWhen = getTimeSecs();
+        if (fwrite(outBuf, 1, report.outputSize, outfp) !=
+                report.outputSize) {
+            perror("Failed while writing data");
+            goto bail;
+        }
+        report.writeSecs = getTimeSecs() - startWhen;
+        traceSpan("write", inFileName, startWhen);
+    } else if (pReport == NULL) {
+        // must be in test mode
+        printf("  success -- compressed len is %zd\n", report.outputSize);
+    }
+
+    result = 0;
+
+bail:
+    if (pReport != NULL) {
+        *pReport = report;
+    }
+    traceSpan("file", inFileName, fileStart);
+    gTraceFile = NULL;
+    fclose(infp);
+    if (outfp != NULL) {
+        fclose(outfp);
+    }
+    if (result != 0 && outFileName != NULL) {
+        unlink(outFileName);
+    }
+    return result;
+}
+
+/*
+ * Uncompress data from one file to another.
+ *
+ * Returns 0 on success.
+ */
+int uncompressFile(const char* outFileName, const char* inFileName)
+{
+    int result = -1;
+    uint8_t inBuf[MAX_OUT_SIZE];
+    uint8_t outBuf[MAX_SIZE];
+    size_t outSize;
+    FILE* outfp = NULL;
+    FILE* infp;
+
+    infp = fopen(inFileName, "rb");
+    if (infp == NULL) {
+        perror("Unable to open input file");
+        return -1;
+    }
+
+    outfp = fopen(outFileName, "wb");
+    if (outfp == NULL) {
+        perror("Unable to open output file");
+        fclose(infp);
+        return -1;
+    }
+
+    fseek(infp, 0, SEEK_END);
+    long fileLen = ftell(infp);
+    rewind(infp);
+    if (fileLen < 10 || fileLen > MAX_OUT_SIZE) {
+        // 10 just ensures we have enough for magic number, chunk, eod
+        fprintf(stderr, "ERROR: input file is %ld bytes, must be < %d\n",
+            fileLen, MAX_OUT_SIZE);
+        goto bail;
+    }
+
+    // Read data into buffer.
+    if (fread(inBuf, 1, fileLen, infp) != (size_t) fileLen) {
+        perror("Failed while reading data");
+        goto bail;
+    }
+
+    memset(outBuf, 0, sizeof(outBuf));     // holes aren't always written
+    outSize = uncompressBuffer(outBuf, inBuf, fileLen);
+    if (outSize == 0) {
+        goto bail;
+    }
+    DBUG(("*** outSize is %zd\n", outSize));
+
+    // If there's a metadata header, make sure we got what it describes.
+    if (!matchesMetaHeader(inBuf, fileLen, outBuf, outSize)) {
+        fprintf(stderr, "ERROR: output doesn't match the metadata header\n");
+        goto bail;
+    }
+
+    /* write the data */
+    if (fwrite(outBuf, 1, outSize, outfp) != outSize) {
+        perror("Failed while writing data");
+        goto bail;
+    }
+
+    result = 0;
+
+bail:
+    fclose(infp);
+    fclose(outfp);
+    if (result != 0) {
+        unlink(outFileName);
+    }
+    return result;
+}
+
+/*
+ * Asynchronous interface, for embedding in a server built around an
+ * event loop.  See fhpack.h for how it's used.
+ */
+
+enum AsyncKind { ASYNC_COMPRESS, ASYNC_DECOMPRESS };
+
+/*
+ * One compression or expansion.  The callback can get the status and
+ * the output, but the job belongs to the executor.
+ */
+struct AsyncJob {
+    AsyncKind kind;
+    AsyncOptions options;
+    uint8_t inBuf[META_HEADER_LEN + MAX_OUT_SIZE];
+    size_t inLen;
+    uint8_t outBuf[META_HEADER_LEN + MAX_OUT_SIZE];
+    size_t outLen;
+    char* outFileName;          // written on completion, if non-NULL
+    AsyncStatus status;
+    bool cancelled;             // guarded by the executor's lock
+    AsyncDoneFunc doneFunc;
+    void* userData;
+};
+
+struct AsyncExecutor {
+    std::mutex lock;
+    std::condition_variable workReady;
+    std::deque<AsyncJob*> pending;
+    std::vector<AsyncJob*> finished;
+    std::vector<std::thread> threads;
+    bool stopping;
+    int wakePipe[2];
+};
+
+/*
+ * Tells the loop that a job has finished.  If the pipe is full, the loop
+ * has plenty of wakeups waiting already.
+ */
+static void asyncWake(AsyncExecutor* pExec)
+{
+    uint8_t val = 0;
+    if (write(pExec->wakePipe[1], &val, 1) < 0) {
+        DBUG(("wake pipe full\n"));
+    }
+}
+
+/*
+ * Compresses or expands a job's data into its output buffer.
+ */
+static AsyncStatus runAsyncJob(CompressBuffers* pBufs, AsyncJob* pJob)
+{
+    const AsyncOptions* pOpts = &pJob->options;
+
+    if (pJob->kind == ASYNC_DECOMPRESS) {
+        memset(pJob->outBuf, 0, MAX_SIZE);      // holes aren't always written
+        pJob->outLen = uncompressBuffer(pJob->outBuf, pJob->inBuf,
+                pJob->inLen);
+        if (pJob->outLen == 0 || !matchesMetaHeader(pJob->inBuf,
+                pJob->inLen, pJob->outBuf, pJob->outLen)) {
+            return ASYNC_FAILED;
+        }
+        return ASYNC_OK;
+    }
+
+    CompressReport report;
+    memset(&report, 0, sizeof(report));
+    report.holes = "none";
+    memcpy(pBufs->inBuf1, pJob->inBuf, pJob->inLen);
+    const uint8_t* outBuf = compressImage(pBufs, pJob->inLen,
+            pOpts->doPreserveHoles, pOpts->parseMode, pOpts->formatFlags, 1,
+            &report);
+    if (outBuf == NULL) {
+        return ASYNC_FAILED;
+    }
+
+    size_t hdrLen = 0;
+    if (pOpts->doMetaHeader) {
+        MetaHeader meta;
+        if (!buildMetaHeader(&meta, outBuf, report.outputSize, report.holes,
+                pOpts->parseMode, pOpts->formatFlags)) {
+            return ASYNC_FAILED;
+        }
+        putMetaHeader(pJob->outBuf, &meta);
+        hdrLen = META_HEADER_LEN;
+    }
+    memcpy(pJob->outBuf + hdrLen, outBuf, report.outputSize);
+    pJob->outLen = hdrLen + report.outputSize;
+    return ASYNC_OK;
+}
+
+/*
+ * Executor thread.  Runs jobs until the executor is stopped.
+ */
+static void asyncWorker(AsyncExecutor* pExec)
+{
+    // Sized for the most demanding settings, so any job can run here.
+    CompressBuffers* pBufs = allocCompressBuffers(PARSE_OPTIMAL, FLAG_PLANES);
+
+    while (true) {
+        AsyncJob* pJob;
+        {
+            std::unique_lock<std::mutex> guard(pExec->lock);
+            while (!pExec->stopping && pExec->pending.empty()) {
+                pExec->workReady.wait(guard);
+            }
+            if (pExec->stopping) {
+                break;
+            }
+            pJob = pExec->pending.front();
+            pExec->pending.pop_front();
+        }
+
+        AsyncStatus status = ASYNC_FAILED;
+        if (pBufs != NULL) {
+            status = runAsyncJob(pBufs, pJob);
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(pExec->lock);
+            pJob->status = pJob->cancelled ? ASYNC_CANCELLED : status;
+            pExec->finished.push_back(pJob);
+        }
+        asyncWake(pExec);
+    }
+
+    freeCompressBuffers(pBufs);
+}
+
+/*
+ * Starts an executor with "numThreads" threads, which is the number of
+ * jobs that can run at once.
+ *
+ * Returns NULL on failure.
+ */
+AsyncExecutor* asyncStart(int numThreads)
+{
+    AsyncExecutor* pExec = new AsyncExecutor;
+    if (pipe(pExec->wakePipe) != 0) {
+        perror("Unable to create pipe");
+        delete pExec;
+        return NULL;
+    }
+    // Neither the loop nor the workers should ever block on the pipe.
+    fcntl(pExec->wakePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(pExec->wakePipe[1], F_SETFL, O_NONBLOCK);
+
+    pExec->stopping = false;
+    for (int i = 0; i < numThreads; i++) {
+        pExec->threads.push_back(std::thread(asyncWorker, pExec));
+    }
+    return pExec;
+}
+
+/*
+ * Returns the file descriptor the loop should watch for readability.
+ */
+int asyncWakeFd(const AsyncExecutor* pExec)
+{
+    return pExec->wakePipe[0];
+}
+
+/*
+ * Returns true if "pJob" has been cancelled.
+ */
+static bool asyncJobCancelled(AsyncExecutor* pExec, const AsyncJob* pJob)
+{
+    std::lock_guard<std::mutex> guard(pExec->lock);
+    return pJob->cancelled;
+}
+
+/*
+ * Calls the callbacks of the jobs that have finished, on the caller's
+ * thread, and frees the jobs.  Output files are written first.  A job
+ * cancelled before its callback runs gets ASYNC_CANCELLED, and leaves
+ * no output file, even if it had already finished.
+ *
+ * Returns the number of jobs completed.
+ */
+int asyncRunCompletions(AsyncExecutor* pExec)
+{
+    uint8_t drainBuf[64];
+    while (read(pExec->wakePipe[0], drainBuf, sizeof(drainBuf)) > 0)
+        ;
+
+    std::vector<AsyncJob*> finished;
+    {
+        std::lock_guard<std::mutex> guard(pExec->lock);
+        finished.swap(pExec->finished);
+    }
+
+    for (size_t i = 0; i < finished.size(); i++) {
+        AsyncJob* pJob = finished[i];
+        // A job can be cancelled after it finished but before we got
+        // here, so check again before writing anything.
+        if (asyncJobCancelled(pExec, pJob)) {
+            pJob->status = ASYNC_CANCELLED;
+        }
+        if (pJob->status == ASYNC_OK && pJob->outFileName != NULL) {
+            FILE* outfp = fopen(pJob->outFileName, "wb");
+            if (outfp == NULL) {
+                perror("Unable to open output file");
+                pJob->status = ASYNC_FAILED;
+            } else {
+                bool ok = fwrite(pJob->outBuf, 1, pJob->outLen, outfp) ==
+                        pJob->outLen;
+                if (fclose(outfp) != 0 || !ok) {
+                    perror("Failed while writing data");
+                    unlink(pJob->outFileName);
+                    pJob->status = ASYNC_FAILED;
+                }
+            }
+            if (pJob->status == ASYNC_OK && asyncJobCancelled(pExec, pJob)) {
+                unlink(pJob->outFileName);
+                pJob->status = ASYNC_CANCELLED;
+            }
+        }
+        if (pJob->doneFunc != NULL) {
+            pJob->doneFunc(pJob, pJob->userData);
+        }
+        free(pJob->outFileName);
+        delete pJob;
+    }
+    return finished.size();
+}
+
+/*
+ * Cancels a job.  A job that hasn't started is taken out of the queue; a
+ * job that's running can't be interrupted, but its result is thrown
+ * away.  Either way, its callback is called with ASYNC_CANCELLED, and no
+ * output file is written.  "pJob" must not have completed yet, i.e. its
+ * callback must not have been called.
+ *
+ * Returns true if the job hadn't started.
+ */
+bool asyncCancel(AsyncExecutor* pExec, AsyncJob* pJob)
+{
+    bool wasPending = false;
+    {
+        std::lock_guard<std::mutex> guard(pExec->lock);
+        pJob->cancelled = true;
+        for (size_t i = 0; i < pExec->pending.size(); i++) {
+            if (pExec->pending[i] == pJob) {
+                pExec->pending.erase(pExec->pending.begin() + i);
+                pJob->status = ASYNC_CANCELLED;
+                pExec->finished.push_back(pJob);
+                wasPending = true;
+                break;
+            }
+        }
+    }
+    if (wasPending) {
+        asyncWake(pExec);
+    }
+    return wasPending;
+}
+
+/*
+ * Stops the executor.  Jobs that haven't started are cancelled, running
+ * jobs are finished, and all of their callbacks are called before this
+ * returns.
+ */
+void asyncStop(AsyncExecutor* pExec)
+{
+    {
+        std::lock_guard<std::mutex> guard(pExec->lock);
+        pExec->stopping = true;
+        for (size_t i = 0; i < pExec->pending.size(); i++) {
+            pExec->pending[i]->cancelled = true;
+            pExec->pending[i]->status = ASYNC_CANCELLED;
+            pExec->finished.push_back(pExec->pending[i]);
+        }
+        pExec->pending.clear();
+    }
+    pExec->workReady.notify_all();
+    for (size_t i = 0; i < pExec->threads.size(); i++) {
+        pExec->threads[i].join();
+    }
+
+    asyncRunCompletions(pExec);
+    close(pExec->wakePipe[0]);
+    close(pExec->wakePipe[1]);
+    delete pExec;
+}
+
+/*
+ * Returns a finished job's status.  For the callback.
+ */
+AsyncStatus asyncJobStatus(const AsyncJob* pJob)
+{
+    return pJob->status;
+}
+
+/*
+ * Returns a finished job's output, and its length in "*pLen".  The
+ * data goes away when the callback returns.
+ */
+const uint8_t* asyncJobOutput(const AsyncJob* pJob, size_t* pLen)
+{
+    *pLen = pJob->outLen;
+    return pJob->outBuf;
+}
+
+/*
+ * Creates a job for "inLen" bytes of data, without submitting it.
+ *
+ * Returns NULL if the data can't be what the job expects.
+ */
+static AsyncJob* newAsyncJob(AsyncKind kind, const uint8_t* inBuf,
+    size_t inLen, const AsyncOptions* pOpts)
+{
+    if (kind == ASYNC_COMPRESS) {
+        if (findScreenType(inLen) == NULL) {
+            reportBadSize("async input", inLen);
+            return NULL;
+        }
+    } else if (inLen < 10) {
+        // enough for the magic number, a chunk, and the end-of-data mark
+        fprintf(stderr, "ERROR: input is %zd bytes, too short for LZ4FH\n",
+            inLen);
+        return NULL;
+    } else if (inLen > META_HEADER_LEN + MAX_OUT_SIZE) {
+        fprintf(stderr, "ERROR: input is %zd bytes, must be <= %d\n",
+            inLen, META_HEADER_LEN + MAX_OUT_SIZE);
+        return NULL;
+    }
+
+    AsyncJob* pJob = new AsyncJob;
+    pJob->kind = kind;
+    if (pOpts != NULL) {
+        pJob->options = *pOpts;
+    } else {
+        memset(&pJob->options, 0, sizeof(pJob->options));
+    }
+    memcpy(pJob->inBuf, inBuf, inLen);
+    pJob->inLen = inLen;
+    pJob->outLen = 0;
+    pJob->outFileName = NULL;
+    pJob->status = ASYNC_FAILED;
+    pJob->cancelled = false;
+    pJob->doneFunc = NULL;
+    pJob->userData = NULL;
+    return pJob;
+}
+
+/*
+ * Creates a job for the contents of a file, which is read here.  The
+ * result will be written to "outFileName", if it's non-NULL.
+ *
+ * Returns NULL on failure.
+ */
+static AsyncJob* newAsyncFileJob(AsyncKind kind, const char* inFileName,
+    const char* outFileName, const AsyncOptions* pOpts)
+{
+    uint8_t inBuf[META_HEADER_LEN + MAX_OUT_SIZE];
+
+    FILE* infp = fopen(inFileName, "rb");
+    if (infp == NULL) {
+        perror("Unable to open input file");
+        return NULL;
+    }
+    // Read one extra byte, so an oversized file is seen as one.
+    size_t inLen = fread(inBuf, 1, sizeof(inBuf), infp);
+    if (inLen == sizeof(inBuf) && fgetc(infp) != EOF) {
+        inLen++;
+    }
+    bool readFailed = ferror(infp) != 0;
+    fclose(infp);
+    if (readFailed) {
+        perror("Failed while reading data");
+        return NULL;
+    }
+    if (kind == ASYNC_COMPRESS && findScreenType(inLen) == NULL) {
+        reportBadSize(inFileName, inLen);
+        return NULL;
+    }
+
+    AsyncJob* pJob = newAsyncJob(kind, inBuf, inLen, pOpts);
+    if (pJob != NULL && outFileName != NULL) {
+        pJob->outFileName = strdup(outFileName);
+    }
+    return pJob;
+}
+
+/*
+ * Queues a job for the executor.
+ */
+static AsyncJob* submitAsyncJob(AsyncExecutor* pExec, AsyncJob* pJob,
+    AsyncDoneFunc doneFunc, void* userData)
+{
+    if (pJob == NULL) {
+        return NULL;
+    }
+    pJob->doneFunc = doneFunc;
+    pJob->userData = userData;
+    {
+        std::lock_guard<std::mutex> guard(pExec->lock);
+        pExec->pending.push_back(pJob);
+    }
+    pExec->workReady.notify_one();
+    return pJob;
+}
+
+/*
+ * Submits a job to compress an image held in memory.  The data is copied,
+ * so the caller's buffer can be reused right away.  "doneFunc" is called
+ * from asyncRunCompletions() when the job finishes.
+ *
+ * Returns the job, or NULL if it couldn't be submitted.
+ */
+AsyncJob* asyncCompressBuffer(AsyncExecutor* pExec, const uint8_t* inBuf,
+    size_t inLen, const AsyncOptions* pOpts, AsyncDoneFunc doneFunc,
+    void* userData)
+{
+    return submitAsyncJob(pExec,
+            newAsyncJob(ASYNC_COMPRESS, inBuf, inLen, pOpts),
+            doneFunc, userData);
+}
+
+/*
+ * Submits a job to expand compressed data held in memory.
+ */
+AsyncJob* asyncDecompressBuffer(AsyncExecutor* pExec, const uint8_t* inBuf,
+    size_t inLen, AsyncDoneFunc doneFunc, void* userData)
+{
+    return submitAsyncJob(pExec,
+            newAsyncJob(ASYNC_DECOMPRESS, inBuf, inLen, NULL),
+            doneFunc, userData);
+}
+
+/*
+ * Submits a job to compress one file to another.  The output is also
+ * left in the job for the callback.
+ */
+AsyncJob* asyncCompressFile(AsyncExecutor* pExec, const char* inFileName,
+    const char* outFileName, const AsyncOptions* pOpts,
+    AsyncDoneFunc doneFunc, void* userData)
+{
+    return submitAsyncJob(pExec,
+            newAsyncFileJob(ASYNC_COMPRESS, inFileName, outFileName, pOpts),
+            doneFunc, userData);
+}
+
+/*
+ * Submits a job to expand one file to another.
+ */
+AsyncJob* asyncDecompressFile(AsyncExecutor* pExec, const char* inFileName,
+    const char* outFileName, AsyncDoneFunc doneFunc, void* userData)
+{
+    return submitAsyncJob(pExec,
+            newAsyncFileJob(ASYNC_DECOMPRESS, inFileName, outFileName, NULL),
+            doneFunc, userData);
+}
+
+#if defined(__cpp_impl_coroutine)
+/*
+ * Submits the job when the coroutine suspends.
+ */
+void AsyncAwaitable::await_suspend(std::coroutine_handle<> h)
+{
+    handle = h;
+    submitAsyncJob(pExec, pJob, resume, this);
+}
+
+/*
+ * Hands the result to the coroutine.
+ */
+AsyncResult AsyncAwaitable::await_resume()
+{
+    if (pJob == NULL) {
+        result.status = ASYNC_FAILED;
+    }
+    return std::move(result);
+}
+
+/*
+ * Job callback.  Saves the result and resumes the coroutine.  The
+ * awaitable lives in the coroutine's frame, so it can't be touched
+ * after the coroutine resumes.
+ */
+void AsyncAwaitable::resume(AsyncJob* pJob, void* userData)
+{
+    AsyncAwaitable* pSelf = (AsyncAwaitable*) userData;
+    pSelf->result.status = pJob->status;
+    if (pJob->status == ASYNC_OK) {
+        pSelf->result.data.assign(pJob->outBuf, pJob->outBuf + pJob->outLen);
+    }
+    pSelf->handle.resume();
+}
+
+AsyncAwaitable asyncCompress(AsyncExecutor* pExec, const uint8_t* inBuf,
+    size_t inLen, const AsyncOptions* pOpts)
+{
+    return AsyncAwaitable{ pExec,
+            newAsyncJob(ASYNC_COMPRESS, inBuf, inLen, pOpts), {}, {} };
+}
+
+AsyncAwaitable asyncDecompress(AsyncExecutor* pExec, const uint8_t* inBuf,
+    size_t inLen)
+{
+    return AsyncAwaitable{ pExec,
+            newAsyncJob(ASYNC_DECOMPRESS, inBuf, inLen, NULL), {}, {} };
+}
+
+AsyncAwaitable asyncCompress(AsyncExecutor* pExec, const char* inFileName,
+    const char* outFileName, const AsyncOptions* pOpts)
+{
+    return AsyncAwaitable{ pExec,
+            newAsyncFileJob(ASYNC_COMPRESS, inFileName, outFileName, pOpts),
+            {}, {} };
+}
+
+AsyncAwaitable asyncDecompress(AsyncExecutor* pExec, const char* inFileName,
+    const char* outFileName)
+{
+    return AsyncAwaitable{ pExec,
+            newAsyncFileJob(ASYNC_DECOMPRESS, inFileName, outFileName, NULL),
+            {}, {} };
+}
+#endif /*__cpp_impl_coroutine*/
+
+/*
+ * Prefetching reader, for a viewer that shows compressed images in
+ * order.  Expanding an image is quick, but reading the file isn't, and
+ * a viewer that does both on its UI thread stalls.
+ *
+ * The reader takes the list of files, and a background thread reads
+ * and expands the next few, in whichever direction the viewer is going,
+ * into a cache of expanded pages.  The cache holds as many 8KB pages as
+ * fit in its memory cap, and throws out the least recently used page
+ * when it's full.  If the viewer asks for an image that isn't ready, it
+ * waits for the background thread if that's working on it, or expands
+ * it itself.
+ */
+
+/*
+ * What the reader did, for tuning the look-ahead and cache size.
+ */
+struct ReaderStats {
+    long hits;                  // ready in the cache
+    long waits;                 // waited for the background thread
+    long misses;                // expanded by readerGet() itself
+    long failures;              // couldn't be read or expanded
+    std::vector<double> decodeSecs;     // read + expand, each image
+    std::vector<double> getSecs;        // time spent in readerGet()
+};
+
+struct ReaderEntry {
+    int index;                  // file index, or -1 if unused
+    uint64_t lastUsed;
+    size_t len;
+    uint8_t* data;              // MAX_SIZE bytes
+};
+
+struct PrefetchReader {
+    char* const* fileNames;
+    int numFiles;
+    int lookAhead;
+    std::vector<ReaderEntry> cache;
+    std::vector<bool> failed;
+    uint64_t useCount;
+    int current;                // index of the last readerGet()
+    int direction;              // +1 or -1
+    int bgIndex;                // background thread is expanding this
+    int fgIndex;                // readerGet() is expanding this
+    bool stopping;
+    ReaderStats stats;
+    std::mutex lock;
+    std::condition_variable moved;      // wakes the background thread
+    std::condition_variable decoded;    // background thread finished one
+    std::thread thread;
+};
+
+/*
+ * Reads and expands one compressed file into "outBuf", which must hold
+ * MAX_SIZE bytes.  A file too long to be LZ4FH is refused, and the
+ * decode is bounded by the length read, so a corrupt file fails
+ * rather than being cached.
+ *
+ * Returns the expanded length, or 0 on failure.
+ */
+static size_t readerDecode(const char* fileName, uint8_t* outBuf)
+{
+    uint8_t inBuf[META_HEADER_LEN + MAX_OUT_SIZE];
+
+    FILE* infp = fopen(fileName, "rb");
+    if (infp == NULL) {
+        return 0;
+    }
+    size_t inLen = fread(inBuf, 1, sizeof(inBuf), infp);
+    bool tooLong = (inLen == sizeof(inBuf) && fgetc(infp) != EOF);
+    fclose(infp);
+    if (inLen == 0 || tooLong) {
+        fprintf(stderr, "ERROR: %s isn't LZ4FH data\n", fileName);
+        return 0;
+    }
+
+    memset(outBuf, 0, MAX_SIZE);        // holes aren't always written
+    size_t outLen = uncompressBuffer(outBuf, inBuf, inLen);
+    if (outLen == 0 || !matchesMetaHeader(inBuf, inLen, outBuf, outLen)) {
+        return 0;
+    }
+    return outLen;
+}
+
+/*
+ * Finds the cache entry for image "index", or returns NULL.  Call with
+ * the lock held.
+ */
+static ReaderEntry* readerFind(PrefetchReader* pReader, int index)
+{
+    for (size_t i = 0; i < pReader->cache.size(); i++) {
+        if (pReader->cache[i].index == index) {
+            return &pReader->cache[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns true if image "index" is the current one or one of those
+ * ahead of it.  Call with the lock held.
+ */
+static bool readerWanted(const PrefetchReader* pReader, int index)
+{
+    int dist = (index - pReader->current) * pReader->direction;
+    return dist >= 0 && dist <= pReader->lookAhead;
+}
+
+/*
+ * Adds an expanded image to the cache, replacing the least recently used
+ * one.  Images that have been prefetched but not shown yet are older
+ * than the one on screen, so they're only replaced if everything in the
+ * cache is wanted.  Call with the lock held.
+ */
+static void readerInsert(PrefetchReader* pReader, int index,
+    const uint8_t* data, size_t len)
+{
+    ReaderEntry* pVictim = NULL;
+    for (int pass = 0; pass < 2 && pVictim == NULL; pass++) {
+        for (size_t i = 0; i < pReader->cache.size(); i++) {
+            ReaderEntry* pEntry = &pReader->cache[i];
+            if (pass == 0 && pEntry->index >= 0 &&
+                    readerWanted(pReader, pEntry->index)) {
+                continue;
+            }
+            if (pVictim == NULL || pEntry->lastUsed < pVictim->lastUsed) {
+                pVictim = pEntry;
+            }
+        }
+    }
+    pVictim->index = index;
+    pVictim->lastUsed = ++pReader->useCount;
+    pVictim->len = len;
+    memcpy(pVictim->data, data, len);
+}
+
+/*
+ * Background thread.  Expands the images ahead of the current one that
+ * aren't in the cache yet, nearest first, and sleeps when they all are.
+ */
+static void readerWorker(PrefetchReader* pReader)
+{
+    uint8_t decodeBuf[MAX_SIZE];
+    std::unique_lock<std::mutex> guard(pReader->lock);
+
+    while (!pReader->stopping) {
+        int want = -1;
+        for (int i = 1; i <= pReader->lookAhead; i++) {
+            int index = pReader->current + pReader->direction * i;
+            if (index < 0 || index >= pReader->numFiles) {
+                break;
+            }
+            if (!pReader->failed[index] && index != pReader->fgIndex &&
+                    readerFind(pReader, index) == NULL) {
+                want = index;
+                break;
+            }
+        }
+        if (want < 0) {
+            pReader->moved.wait(guard);
+            continue;
+        }
+
+        pReader->bgIndex = want;
+        guard.unlock();
+        double startWhen = getTimeSecs();
+        size_t len = readerDecode(pReader->fileNames[want], decodeBuf);
+        double secs = getTimeSecs() - startWhen;
+        guard.lock();
+
+        pReader->bgIndex = -1;
+        pReader->stats.decodeSecs.push_back(secs);
+        if (len == 0) {
+            pReader->failed[want] = true;
+        } else {
+            readerInsert(pReader, want, decodeBuf, len);
+        }
+        pReader->decoded.notify_all();
+    }
+}
+
+/*
+ * Opens a reader on a list of compressed files, which must stay valid
+ * until the reader is closed.  Up to "lookAhead" images past the current
+ * one are expanded ahead of time, and the cache uses up to "cacheBytes"
+ * of memory.  The look-ahead is trimmed to what fits in the cache.
+ *
+ * Returns NULL on failure.
+ */
+PrefetchReader* readerOpen(char* const* fileNames, int numFiles,
+    int lookAhead, size_t cacheBytes)
+{
+    size_t numPages = cacheBytes / MAX_SIZE;
+    if (numPages < 1) {
+        fprintf(stderr, "ERROR: cache must hold at least one %d-byte page\n",
+            MAX_SIZE);
+        return NULL;
+    }
+
+    PrefetchReader* pReader = new PrefetchReader;
+    pReader->fileNames = fileNames;
+    pReader->numFiles = numFiles;
+    // keep a page for the current image
+    pReader->lookAhead = (lookAhead < (int) numPages) ?
+            lookAhead : (int) numPages - 1;
+    pReader->cache.resize(numPages);
+    for (size_t i = 0; i < numPages; i++) {
+        ReaderEntry* pEntry = &pReader->cache[i];
+        pEntry->index = -1;
+        pEntry->lastUsed = 0;
+        pEntry->len = 0;
+        pEntry->data = (uint8_t*) malloc(MAX_SIZE);
+        if (pEntry->data == NULL) {
+            fprintf(stderr, "ERROR: unable to allocate %zd pages\n",
+                numPages);
+            for (size_t j = 0; j < i; j++) {
+                free(pReader->cache[j].data);
+            }
+            delete pReader;
+            return NULL;
+        }
+    }
+    pReader->failed.resize(numFiles, false);
+    pReader->useCount = 0;
+    pReader->current = -1;      // so the first image is prefetched
+    pReader->direction = 1;
+    pReader->bgIndex = pReader->fgIndex = -1;
+    pReader->stopping = false;
+    pReader->stats.hits = pReader->stats.waits = 0;
+    pReader->stats.misses = pReader->stats.failures = 0;
+    pReader->thread = std::thread(readerWorker, pReader);
+    return pReader;
+}
+
+/*
+ * Gets image "index", expanded, into "outBuf", which must hold MAX_SIZE
+ * bytes.  This also tells the reader where the viewer is, so it can work
+ * ahead from here.
+ *
+ * Returns the expanded length, or 0 on failure.
+ */
+size_t readerGet(PrefetchReader* pReader, int index, uint8_t* outBuf)
+{
+    if (index < 0 || index >= pReader->numFiles) {
+        return 0;
+    }
+
+    double startWhen = getTimeSecs();
+    std::unique_lock<std::mutex> guard(pReader->lock);
+    if (index != pReader->current) {
+        pReader->direction = (index > pReader->current) ? 1 : -1;
+        pReader->current = index;
+        pReader->moved.notify_one();
+    }
+
+    size_t len = 0;
+    bool waited = false;
+    while (true) {
+        ReaderEntry* pEntry = readerFind(pReader, index);
+        if (pEntry != NULL) {
+            pEntry->lastUsed = ++pReader->useCount;
+            memcpy(outBuf, pEntry->data, pEntry->len);
+            len = pEntry->len;
+            if (waited) {
+                pReader->stats.waits++;
+            } else {
+                pReader->stats.hits++;
+            }
+            break;
+        }
+        if (pReader->failed[index]) {
+            pReader->stats.failures++;
+            break;
+        }
+        if (pReader->bgIndex == index) {
+            waited = true;
+            pReader->decoded.wait(guard);
+            continue;
+        }
+
+        // Not ready, and not on its way; do it ourselves.
+        pReader->fgIndex = index;
+        guard.unlock();
+        double decodeStart = getTimeSecs();
+        len = readerDecode(pReader->fileNames[index], outBuf);
+        double decodeSecs = getTimeSecs() - decodeStart;
+        guard.lock();
+        pReader->fgIndex = -1;
+        pReader->stats.decodeSecs.push_back(decodeSecs);
+        if (len == 0) {
+            pReader->failed[index] = true;
+            pReader->stats.failures++;
+        } else {
+            readerInsert(pReader, index, outBuf, len);
+            pReader->stats.misses++;
+        }
+        break;
+    }
+    pReader->stats.getSecs.push_back(getTimeSecs() - startWhen);
+    return len;
+}
+
+/*
+ * Copies the reader's statistics so far.
+ */
+void readerGetStats(PrefetchReader* pReader, ReaderStats* pStats)
+{
+    std::lock_guard<std::mutex> guard(pReader->lock);
+    *pStats = pReader->stats;
+}
+
+/*
+ * Stops the background thread and frees the reader.
+ */
+void readerClose(PrefetchReader* pReader)
+{
+    {
+        std::lock_guard<std::mutex> guard(pReader->lock);
+        pReader->stopping = true;
+    }
+    pReader->moved.notify_one();
+    pReader->thread.join();
+    for (size_t i = 0; i < pReader->cache.size(); i++) {
+        free(pReader->cache[i].data);
+    }
+    delete pReader;
+}
+
+#ifndef FHPACK_NO_MAIN
+/*
+ * Prints a string as a JSON string literal.
+ */
+static void printJsonString(const char* str)
+{
+    putJsonString(stdout, str);
+}
+
+/*
+ * Prints a string as a CSV field, quoting it if necessary.
+ */
+static void printCsvField(const char* str)
+{
+    if (strpbrk(str, ",\"\r\n") == NULL) {
+        fputs(str, stdout);
+        return;
+    }
+    putchar('"');
+    for ( ; *str != '\0'; str++) {
+        if (*str == '"') {
+            putchar('"');
+        }
+        putchar(*str);
+    }
+    putchar('"');
+}
+
+/*
+ * Running totals for the structured test output.
+ */
+struct ReportTotals {
+    int numFiles;
+    int numFailed;
+    long inputSize;
+    size_t outputSize;
+    double compressSecs;
+    double verifySecs;
+};
+
+/*
+ * Prints the start of the structured test output.
+ */
+static void printReportHeader(ReportFormat format)
+{
+    if (format == REPORT_JSON) {
+        printf("{\n  \"files\": [");
+    } else if (format == REPORT_CSV) {
+        printf("file,level,order,input_size,zero_holes_size,"
+            "fill_holes_size,holes,output_size,read_ms,compress_ms,"
+            "zero_holes_ms,fill_holes_ms,verify_ms,status\n");
+    }
+}
+
+/*
+ * Prints the structured test output for one file, and adds it to the
+ * totals.  Sizes of hole variants that weren't tried are left empty.
+ */
+static void printReportFile(ReportFormat format, const char* fileName,
+    const char* level, const char* order, const CompressReport* pReport,
+    ReportTotals* pTotals)
+{
+    const char* status = pReport->verified ? "ok" : "failed";
+
+    if (format == REPORT_TEXT) {
+        printf("Testing %s\n", fileName);
+        if (pReport->verified) {
+            printHoleChoice(pReport);
+            printf("  success -- compressed len is %zd\n",
+                pReport->outputSize);
+        }
+    } else if (format == REPORT_JSON) {
+        printf("%s\n    {\"file\": ", pTotals->numFiles == 0 ? "" : ",");
+        printJsonString(fileName);
+        printf(", \"level\": \"%s\", \"order\": \"%s\", "
+            "\"inputSize\": %ld,\n",
+            level, order, pReport->inputSize);
+        if (pReport->zeroHolesSize != 0) {
+            printf("     \"zeroHolesSize\": %zd, \"fillHolesSize\": %zd, ",
+                pReport->zeroHolesSize, pReport->fillHolesSize);
+        } else {
+            printf("     \"zeroHolesSize\": null, \"fillHolesSize\": null, ");
+        }
+        printf("\"holes\": \"%s\", \"outputSize\": %zd,\n",
+            pReport->holes, pReport->outputSize);
+        printf("     \"readMs\": %.3f, \"compressMs\": %.3f, ",
+            pReport->readSecs * 1000.0, pReport->compressSecs * 1000.0);
+        if (pReport->zeroHolesSize != 0) {
+            printf("\"zeroHolesMs\": %.3f, \"fillHolesMs\": %.3f, ",
+                pReport->zeroHolesSecs * 1000.0,
+                pReport->fillHolesSecs * 1000.0);
+        } else {
+            printf("\"zeroHolesMs\": null, \"fillHolesMs\": null, ");
+        }
+        printf("\"verifyMs\": %.3f, \"status\": \"%s\"}",
+            pReport->verifySecs * 1000.0, status);
+    } else if (format == REPORT_CSV) {
+        printCsvField(fileName);
+        printf(",%s,%s,%ld,", level, order, pReport->inputSize);
+        if (pReport->zeroHolesSize != 0) {
+            printf("%zd,%zd", pReport->zeroHolesSize, pReport->fillHolesSize);
+        } else {
+            putchar(',');
+        }
+        printf(",%s,%zd,%.3f,%.3f,", pReport->holes, pReport->outputSize,
+            pReport->readSecs * 1000.0, pReport->compressSecs * 1000.0);
+        if (pReport->zeroHolesSize != 0) {
+            printf("%.3f,%.3f", pReport->zeroHolesSecs * 1000.0,
+                pReport->fillHolesSecs * 1000.0);
+        } else {
+            putchar(',');
+        }
+        printf(",%.3f,%s\n", pReport->verifySecs * 1000.0, status);
+    }
+
+    pTotals->numFiles++;
+    if (!pReport->verified) {
+        pTotals->numFailed++;
+    }
+    pTotals->inputSize += pReport->inputSize;
+    pTotals->outputSize += pReport->outputSize;
+    pTotals->compressSecs += pReport->compressSecs;
+    pTotals->verifySecs += pReport->verifySecs;
+}
+
+/*
+ * Prints the totals, and the end of the structured test output.
+ */
+static void printReportTotals(ReportFormat format, const ReportTotals* pTotals)
+{
+    double ratio = 0.0;
+    if (pTotals->inputSize != 0) {
+        ratio = (double) pTotals->outputSize / pTotals->inputSize;
+    }
+
+    if (format == REPORT_JSON) {
+        printf("\n  ],\n");
+        printf("  \"totals\": {\"files\": %d, \"failed\": %d, "
+            "\"inputSize\": %ld, \"outputSize\": %zd, \"ratio\": %.4f,\n",
+            pTotals->numFiles, pTotals->numFailed, pTotals->inputSize,
+            pTotals->outputSize, ratio);
+        printf("     \"compressMs\": %.3f, \"verifyMs\": %.3f}\n}\n",
+            pTotals->compressSecs * 1000.0, pTotals->verifySecs * 1000.0);
+    } else if (format == REPORT_CSV) {
+        // Same columns as the per-file lines; "status" holds the number
+        // of failures.
+        printf("TOTAL,,,%ld,,,,%zd,,%.3f,,,%.3f,%d\n",
+            pTotals->inputSize, pTotals->outputSize,
+            pTotals->compressSecs * 1000.0, pTotals->verifySecs * 1000.0,
+            pTotals->numFailed);
+    }
+}
+
+/*
+ * Compresses files from the list until there are none left, for a batch
+ * run in test mode.  Each file is handled by a single thread.
+ */
+static void batchWorker(char* const* fileNames, int numFiles,
+    std::atomic<int>* pNext, bool doPreserveHoles, ParseMode parseMode,
+    unsigned int formatFlags, CompressReport* reports, int* results)
+{
+    CompressBuffers* pBufs = allocCompressBuffers(parseMode, formatFlags);
+
+    while (true) {
+        int idx = (*pNext)++;
+        if (idx >= numFiles) {
+            break;
+        }
+        if (pBufs == NULL) {
+            results[idx] = -1;
+            continue;
+        }
+        results[idx] = compressFile(NULL, fileNames[idx], doPreserveHoles,
+                false, parseMode, formatFlags, 1, NULL, pBufs, &reports[idx]);
+    }
+    if (pBufs != NULL) {
+        DBUG(("Worker arena peak: %zd bytes\n", compressArenaPeak(pBufs)));
+    }
+    freeCompressBuffers(pBufs);
+}
+
+/*
+ * An uncompressed image, held in memory for the benchmark and the sweep.
+ */
+struct BenchImage {
+    uint8_t data[MAX_SIZE];
+    long len;
+};
+
+/*
+ * Reads all of the files into memory.  The total length is stored in
+ * "*pTotalLen".  Returns NULL on failure; otherwise, the caller must
+ * delete[] the result.
+ */
+static BenchImage* loadImages(char* const* fileNames, int numFiles,
+    long* pTotalLen)
+{
+    BenchImage* images = new BenchImage[numFiles];
+    long totalLen = 0;
+
+    for (int i = 0; i < numFiles; i++) {
+        FILE* fp = fopen(fileNames[i], "rb");
+        if (fp == NULL) {
+            perror("Unable to open input file");
+            delete[] images;
+            return NULL;
+        }
+        images[i].len = fread(images[i].data, 1, MAX_SIZE, fp);
+        bool tooLong = (fgetc(fp) != EOF);
+        fclose(fp);
+        if (tooLong || findScreenType(images[i].len) == NULL) {
+            reportBadSize(fileNames[i], images[i].len);
+            delete[] images;
+            return NULL;
+        }
+        totalLen += images[i].len;
+    }
+    *pTotalLen = totalLen;
+    return images;
+}
+
+/*
+ * Results from one benchmark pass.
+ */
+struct BenchResult {
+    const char* mode;           // "batch" or "single"
+    int numThreads;
+    double secs;
+    size_t outputSize;
+    int numFailed;
+    size_t memPerThread;
+    size_t arenaPeak;           // largest peak arena use of any worker
+};
+
+/*
+ * Compresses images from the list until there are none left, using
+ * "numThreads" threads for each one.  The total compressed size and the
+ * number of failures are added to "*pResult".
+ */
+static void benchWorker(const BenchImage* images, int numImages,
+    std::atomic<int>* pNext, bool doPreserveHoles, ParseMode parseMode,
+    unsigned int formatFlags, int numThreads, BenchResult* pResult)
+{
+    CompressBuffers* pBufs = allocCompressBuffers(parseMode, formatFlags);
+    size_t outputSize = 0;
+    int numFailed = 0;
+
+    while (pBufs != NULL) {
+        int idx = (*pNext)++;
+        if (idx >= numImages) {
+            break;
+        }
+        CompressReport report;
+        memset(&report, 0, sizeof(report));
+        memcpy(pBufs->inBuf1, images[idx].data, images[idx].len);
+        if (compressImage(pBufs, images[idx].len, doPreserveHoles, parseMode,
+                formatFlags, numThreads, &report) == NULL) {
+            numFailed++;
+        }
+        outputSize += report.outputSize;
+    }
+    if (pBufs == NULL) {
+        numFailed++;
+    } else {
+        pResult->arenaPeak = compressArenaPeak(pBufs);
+    }
+    freeCompressBuffers(pBufs);
+
+    // Only one thread touches the result in "single" mode, and in
+    // "batch" mode each thread has its own.
+    pResult->outputSize += outputSize;
+    pResult->numFailed += numFailed;
+}
+
+/*
+ * Compresses all of the images, once, and fills in "*pResult".  In
+ * "batch" mode, the images are split across "numThreads" threads.  In
+ * "single" mode, the images are compressed one at a time, and the
+ * threads are used on each image.
+ */
+static void runBenchPass(const BenchImage* images, int numImages,
+    bool batch, int numThreads, bool doPreserveHoles, ParseMode parseMode,
+    unsigned int formatFlags, BenchResult* pResult)
+{
+    std::atomic<int> next(0);
+    memset(pResult, 0, sizeof(*pResult));
+    pResult->mode = batch ? "batch" : "single";
+    pResult->numThreads = numThreads;
+
+    double startWhen = getTimeSecs();
+    if (batch) {
+        std::vector<BenchResult> partials(numThreads);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < numThreads; t++) {
+            memset(&partials[t], 0, sizeof(BenchResult));
+            workers.push_back(std::thread(benchWorker, images, numImages,
+                    &next, doPreserveHoles, parseMode, formatFlags, 1,
+                    &partials[t]));
+        }
+        for (int t = 0; t < numThreads; t++) {
+            workers[t].join();
+            pResult->outputSize += partials[t].outputSize;
+            pResult->numFailed += partials[t].numFailed;
+            if (partials[t].arenaPeak > pResult->arenaPeak) {
+                pResult->arenaPeak = partials[t].arenaPeak;
+            }
+        }
+        pResult->memPerThread = compressMemoryUsage(parseMode, formatFlags);
+    } else {
+        benchWorker(images, numImages, &next, doPreserveHoles, parseMode,
+            formatFlags, numThreads, pResult);
+        pResult->memPerThread =
+            compressMemoryUsage(parseMode, formatFlags) / numThreads;
+    }
+    pResult->secs = getTimeSecs() - startWhen;
+}
+
+/*
+ * Runs the files through the compressor with 1, 2, 4, ... up to
+ * "maxThreads" threads, first as a batch (one image per thread), then
+ * one image at a time (all threads on each image), and reports how the
+ * throughput scales.
+ *
+ * Returns 0 on success.
+ */
+static int runBenchmark(char* const* fileNames, int numFiles,
+    int maxThreads, bool doPreserveHoles, ParseMode parseMode,
+    unsigned int formatFlags, ReportFormat format)
+{
+    long totalLen;
+    int result = 0;
+
+    BenchImage* images = loadImages(fileNames, numFiles, &totalLen);
+    if (images == NULL) {
+        return -1;
+    }
+
+    std::vector<int> threadCounts;
+    for (int t = 1; t < maxThreads; t *= 2) {
+        threadCounts.push_back(t);
+    }
+    threadCounts.push_back(maxThreads);
+
+    const char* level = parseModeName(parseMode);
+    if (format == REPORT_TEXT) {
+        printf("Benchmark: %d files (%ld bytes), level %s, "
+            "%u hardware threads\n",
+            numFiles, totalLen, level, std::thread::hardware_concurrency());
+        printf("  mode    threads   seconds  images/sec    KB/sec  speedup"
+            "  efficiency  KB/thread  arena KB\n");
+    } else if (format == REPORT_CSV) {
+        printf("mode,threads,seconds,images_per_sec,input_kb_per_sec,"
+            "speedup,efficiency,mem_per_thread_kb,arena_peak_kb,output_size,"
+            "failed\n");
+    } else {
+        printf("{\"files\": %d, \"inputSize\": %ld, \"level\": \"%s\", "
+            "\"hardwareThreads\": %u,\n \"results\": [",
+            numFiles, totalLen, level, std::thread::hardware_concurrency());
+    }
+
+    bool first = true;
+    for (int pass = 0; pass < 2; pass++) {
+        bool batch = (pass == 0);
+        double baseSecs = 0.0;
+        size_t baseOutput = 0;
+        for (size_t i = 0; i < threadCounts.size(); i++) {
+            BenchResult res;
+            runBenchPass(images, numFiles, batch, threadCounts[i],
+                doPreserveHoles, parseMode, formatFlags, &res);
+            if (i == 0) {
+                baseSecs = res.secs;
+                baseOutput = res.outputSize;
+            } else if (res.outputSize != baseOutput) {
+                // threads must not change the output
+                fprintf(stderr, "ERROR: output size changed (%zd vs. %zd)\n",
+                    res.outputSize, baseOutput);
+                result = -1;
+            }
+            if (res.numFailed != 0) {
+                result = -1;
+            }
+
+            double imagesPerSec = numFiles / res.secs;
+            double kbPerSec = totalLen / 1024.0 / res.secs;
+            double speedup = baseSecs / res.secs;
+            double efficiency = speedup / res.numThreads;
+            if (format == REPORT_TEXT) {
+                printf("  %-6s  %7d  %8.3f  %10.2f  %8.1f  %6.2fx"
+                    "  %9.1f%%  %9zd  %8zd\n",
+                    res.mode, res.numThreads, res.secs, imagesPerSec,
+                    kbPerSec, speedup, efficiency * 100.0,
+                    res.memPerThread / 1024, res.arenaPeak / 1024);
+            } else if (format == REPORT_CSV) {
+                printf("%s,%d,%.4f,%.3f,%.2f,%.3f,%.3f,%zd,%zd,%zd,%d\n",
+                    res.mode, res.numThreads, res.secs, imagesPerSec,
+                    kbPerSec, speedup, efficiency, res.memPerThread / 1024,
+                    res.arenaPeak / 1024, res.outputSize, res.numFailed);
+            } else {
+                printf("%s\n  {\"mode\": \"%s\", \"threads\": %d, "
+                    "\"seconds\": %.4f, \"imagesPerSec\": %.3f, "
+                    "\"inputKbPerSec\": %.2f,\n   \"speedup\": %.3f, "
+                    "\"efficiency\": %.3f, \"memPerThreadKb\": %zd, "
+                    "\"arenaPeakKb\": %zd,\n   \"outputSize\": %zd, "
+                    "\"failed\": %d}",
+                    first ? "" : ",", res.mode, res.numThreads, res.secs,
+                    imagesPerSec, kbPerSec, speedup, efficiency,
+                    res.memPerThread / 1024, res.arenaPeak / 1024,
+                    res.outputSize, res.numFailed);
+            }
+            fflush(stdout);
+            first = false;
+        }
+    }
+    if (format == REPORT_JSON) {
+        printf("\n ]}\n");
+    }
+
+    delete[] images;
+    return result;
+}
+
+/*
+ * Per-image results from the format sweep, one entry per format.
+ */
+struct SweepResult {
+    size_t outputSize;
+    long cycles;
+    bool failed;
+};
+
+/*
+ * Compresses images from the list in every format until there are none
+ * left.  Results for image N, format F go in results[N * numDescs + F].
+ * If we can't get an arena, the images we claim are marked as failed.
+ */
+static void sweepWorker(const BenchImage* images, int numImages,
+    std::atomic<int>* pNext, bool doPreserveHoles, const FormatDesc* descs,
+    int numDescs, SweepResult* results)
+{
+    Arena arena;
+    bool haveArena = arenaInit(&arena, optimalScratchSize(MAX_SIZE) +
+            parseScratchSize(MAX_SIZE) + MAX_OUT_SIZE + MAX_SIZE +
+            ARENA_ALIGN * 2);
+    if (!haveArena) {
+        fprintf(stderr, "ERROR: unable to allocate sweep arena\n");
+    }
+
+    while (true) {
+        int idx = (*pNext)++;
+        if (idx >= numImages) {
+            break;
+        }
+        if (!haveArena) {
+            for (int d = 0; d < numDescs; d++) {
+                results[idx * numDescs + d].failed = true;
+            }
+            continue;
+        }
+        arenaReset(&arena);
+        OptNode* optList = (OptNode*)
+            arenaAlloc(&arena, (MAX_SIZE + 1) * sizeof(OptNode));
+        MatchInfo* matches = (MatchInfo*)
+            arenaAlloc(&arena, MAX_SIZE * sizeof(MatchInfo));
+        ParseToken* tokens =
+            (ParseToken*) arenaAlloc(&arena, parseScratchSize(MAX_SIZE));
+        uint8_t* outBuf = (uint8_t*) arenaAlloc(&arena, MAX_OUT_SIZE);
+        uint8_t* verifyBuf = (uint8_t*) arenaAlloc(&arena, MAX_SIZE);
+
+        uint8_t inBuf[MAX_SIZE];
+        size_t inLen = images[idx].len;
+        memcpy(inBuf, images[idx].data, inLen);
+        if (!doPreserveHoles) {
+            size_t pageLen = findScreenType(inLen)->pageLen;
+            inLen = pageLen - HOLE_LEN;
+            zeroHoles(inBuf, pageLen);
+        }
+        findNearestMatches(inBuf, inLen, matches);
+
+        for (int d = 0; d < numDescs; d++) {
+            SweepResult* pResult = &results[idx * numDescs + d];
+            size_t numTokens = parseParametric(&descs[d], tokens, inLen,
+                    matches, optList, 0);
+            pResult->outputSize = emitParametric(&descs[d], outBuf, inBuf,
+                    tokens, numTokens);
+            size_t outLen = uncompressBufferParametric(&descs[d], verifyBuf,
+                    outBuf, pResult->outputSize, &pResult->cycles);
+            pResult->failed = (outLen != inLen ||
+                memcmp(verifyBuf, inBuf, inLen) != 0);
+        }
+    }
+    arenaFree(&arena);
+}
+
+/*
+ * Compresses the files in a grid of variations on the LZ4FH format, and
+ * reports the total size and the modelled 6502 decode time for each.
+ * Every image is compressed with the optimal parser, with zeroed holes
+ * unless "doPreserveHoles" is set, and verified with the matching
+ * decoder.
+ *
+ * Returns 0 on success.
+ */
+static int runSweep(char* const* fileNames, int numFiles, int numThreads,
+    bool doPreserveHoles, ReportFormat format)
+{
+    static const int kLitBits[] = { 3, 4, 5 };
+    static const size_t kMinMatch[] = { 3, 4, 5 };
+    static const OffsetMode kOffsetModes[] = { OFFSET_ABS16, OFFSET_REL };
+    std::vector<FormatDesc> descs;
+    int baseDesc = 0;
+
+    for (size_t o = 0; o < sizeof(kOffsetModes) / sizeof(kOffsetModes[0]);
+            o++) {
+        for (size_t l = 0; l < sizeof(kLitBits) / sizeof(kLitBits[0]); l++) {
+            for (size_t m = 0; m < sizeof(kMinMatch) / sizeof(kMinMatch[0]);
+                    m++) {
+                FormatDesc desc = { kLitBits[l], kMinMatch[m],
+                    MAX_LITERAL_LEN, MAX_MATCH_LEN, kOffsetModes[o] };
+                if (desc.litBits == 4 && desc.minMatch == MIN_MATCH_LEN &&
+                        desc.offsetMode == OFFSET_ABS16) {
+                    baseDesc = descs.size();    // this is LZ4FH
+                }
+                descs.push_back(desc);
+            }
+        }
+    }
+    int numDescs = descs.size();
+
+    long totalLen;
+    BenchImage* images = loadImages(fileNames, numFiles, &totalLen);
+    if (images == NULL) {
+        return -1;
+    }
+
+    std::vector<SweepResult> results(numFiles * numDescs);
+    std::atomic<int> next(0);
+    std::vector<std::thread> workers;
+    for (int t = 1; t < numThreads && t < numFiles; t++) {
+        workers.push_back(std::thread(sweepWorker, images, numFiles, &next,
+                doPreserveHoles, &descs[0], numDescs, &results[0]));
+    }
+    sweepWorker(images, numFiles, &next, doPreserveHoles, &descs[0],
+        numDescs, &results[0]);
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+
+    std::vector<size_t> totalSize(numDescs);
+    std::vector<long> totalCycles(numDescs);
+    std::vector<int> numFailed(numDescs);
+    for (int i = 0; i < numFiles; i++) {
+        for (int d = 0; d < numDescs; d++) {
+            const SweepResult* pResult = &results[i * numDescs + d];
+            totalSize[d] += pResult->outputSize;
+            totalCycles[d] += pResult->cycles;
+            numFailed[d] += pResult->failed;
+        }
+    }
+
+    if (format == REPORT_TEXT) {
+        printf("Format sweep: %d files (%ld bytes), %d formats, "
+            "* is LZ4FH\n", numFiles, totalLen, numDescs);
+        printf("   lit  match  min  offset     bytes   size  avg cycles"
+            "  avg sec\n");
+    } else if (format == REPORT_CSV) {
+        printf("lit_bits,match_bits,min_match,offset,output_size,"
+            "relative_size,avg_cycles,avg_secs,failed\n");
+    } else {
+        printf("{\"files\": %d, \"inputSize\": %ld, \"clockHz\": %d,\n"
+            " \"formats\": [", numFiles, totalLen, APPLE2_CLOCK_HZ);
+    }
+    int result = 0;
+    for (int d = 0; d < numDescs; d++) {
+        const FormatDesc* pDesc = &descs[d];
+        const char* offsetName =
+            (pDesc->offsetMode == OFFSET_ABS16) ? "abs16" : "rel";
+        double relSize = (double) totalSize[d] / totalSize[baseDesc];
+        double avgCycles = (double) totalCycles[d] / numFiles;
+        double avgSecs = avgCycles / APPLE2_CLOCK_HZ;
+        if (numFailed[d] != 0) {
+            fprintf(stderr, "ERROR: %d failures in format %d\n",
+                numFailed[d], d);
+            result = -1;
+        }
+
+        if (format == REPORT_TEXT) {
+            printf(" %c %3d  %5d  %3zd  %-6s  %8zd  %5.1f%%  %10.0f  %7.3f\n",
+                d == baseDesc ? '*' : ' ', pDesc->litBits,
+                8 - pDesc->litBits, pDesc->minMatch, offsetName,
+                totalSize[d], relSize * 100.0, avgCycles, avgSecs);
+        } else if (format == REPORT_CSV) {
+            printf("%d,%d,%zd,%s,%zd,%.4f,%.0f,%.4f,%d\n",
+                pDesc->litBits, 8 - pDesc->litBits, pDesc->minMatch,
+                offsetName, totalSize[d], relSize, avgCycles, avgSecs,
+                numFailed[d]);
+        } else {
+            printf("%s\n  {\"litBits\": %d, \"matchBits\": %d, "
+                "\"minMatch\": %zd, \"offset\": \"%s\", \"outputSize\": %zd,\n"
+                "   \"relativeSize\": %.4f, \"avgCycles\": %.0f, "
+                "\"avgSecs\": %.4f, \"failed\": %d}",
+                d == 0 ? "" : ",", pDesc->litBits, 8 - pDesc->litBits,
+                pDesc->minMatch, offsetName, totalSize[d], relSize,
+                avgCycles, avgSecs, numFailed[d]);
+        }
+    }
+    if (format == REPORT_JSON) {
+        printf("\n ]}\n");
+    }
+
+    delete[] images;
+    return result;
+}
+
+/*
+ * How fast a medium hands ProDOS blocks to the slideshow, for the load
+ * simulation ("-m").  Reading the next block on the same track costs
+ * "blockCycles".  Moving on to the next track costs "trackCycles" on top
+ * of that, and going anywhere else costs "seekCycles".
+ *
+ * A 5.25" disk turns at 300 RPM, 204K cycles per revolution.  ProDOS
+ * reads a block as two sectors, and its interleave gets the 8 blocks on
+ * a track in about two revolutions.  A seek is a couple of steps plus
+ * half a revolution of latency, and a step to the next track loses our
+ * place in the rotation too.
+ *
+ * The 3.5" drive spins at 394 RPM on the outer tracks (we ignore the
+ * slower inner zones), with 12 blocks per side and the same 2:1
+ * interleave.  We treat each side as a track.
+ *
+ * /RAM on a 128K Apple //e has no mechanics; each block is a trip through
+ * the MLI and a 512-byte copy out of auxiliary memory.
+ */
+struct DiskModel {
+    const char* name;           // for "-m"
+    const char* desc;
+    long numBlocks;             // volume size
+    long blocksPerTrack;
+    long seekCycles;
+    long blockCycles;
+    long trackCycles;
+};
+
+#define REV_525_CYCLES      (APPLE2_CLOCK_HZ / 5)
+#define REV_35_CYCLES       (APPLE2_CLOCK_HZ * 60 / 394)
+#define MSEC_CYCLES(ms)     (APPLE2_CLOCK_HZ / 1000 * (ms))
+
+static const DiskModel gDiskModels[] = {
+    { "525", "5.25\" disk", 280, 8,
+        MSEC_CYCLES(50) + REV_525_CYCLES / 2, REV_525_CYCLES / 4,
+        MSEC_CYCLES(25) + REV_525_CYCLES / 2 },
+    { "35", "3.5\" disk", 1600, 12,
+        MSEC_CYCLES(30) + REV_35_CYCLES / 2, REV_35_CYCLES / 6,
+        MSEC_CYCLES(12) + REV_35_CYCLES / 2 },
+    { "ram", "/RAM disk", 128, 128, 7000, 7000, 0 },
+};
+#define NUM_DISK_MODELS     (sizeof(gDiskModels) / sizeof(gDiskModels[0]))
+
+#define PRODOS_BLOCK_SIZE   512
+#define PRODOS_FIRST_FREE   7       // after boot, volume dir, and bitmap
+
+/*
+ * Returns the disk model called "name", or NULL if there isn't one.
+ */
+static const DiskModel* findDiskModel(const char* name)
+{
+    for (size_t i = 0; i < NUM_DISK_MODELS; i++) {
+        if (strcmp(gDiskModels[i].name, name) == 0) {
+            return &gDiskModels[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the number of blocks ProDOS needs for a file of "len" bytes.
+ * Files of up to one block are "seedlings", with the data in the key
+ * block.  Anything larger (up to 128KB) is a "sapling", with an index
+ * block as the key block.
+ */
+static long prodosFileBlocks(size_t len)
+{
+    long dataBlocks = (len + PRODOS_BLOCK_SIZE - 1) / PRODOS_BLOCK_SIZE;
+    if (dataBlocks <= 1) {
+        return 1;
+    }
+    return dataBlocks + 1;
+}
+
+/*
+ * Returns the number of cycles needed to read a file of "numBlocks"
+ * blocks that starts at "firstBlock".  Opening the file reads the
+ * directory, then the key block.  We assume the file was written in one
+ * go, so the rest of its blocks follow the key block.
+ */
+static long prodosLoadCycles(const DiskModel* pDisk, long firstBlock,
+    long numBlocks)
+{
+    long cycles = pDisk->seekCycles * 2 + pDisk->blockCycles;
+    for (long b = firstBlock + 1; b < firstBlock + numBlocks; b++) {
+        cycles += pDisk->blockCycles;
+        if (b % pDisk->blocksPerTrack == 0) {
+            cycles += pDisk->trackCycles;
+        }
+    }
+    return cycles;
+}
+
+/*
+ * The ways the simulation can store an image.  "Tuned" is the parametric
+ * parser weighing load time against decode time.
+ */
+enum SimChoice {
+    SIM_RAW, SIM_GREEDY, SIM_OPTIMAL, SIM_TUNED, NUM_SIM_CHOICES
+};
+static const char* gSimChoiceNames[NUM_SIM_CHOICES] = {
+    "raw", "greedy", "optimal", "tuned"
+};
+
+/*
+ * Per-image results from the simulation: the size of each choice, and
+ * the modelled 6502 cycles to decode it.
+ */
+struct SimResult {
+    size_t outputSize[NUM_SIM_CHOICES];
+    long cycles[NUM_SIM_CHOICES];
+    bool failed;
+};
+
+/*
+ * Compresses images from the list every way we can store them, until
+ * there are none left.  Each compressed result is checked with the
+ * LZ4FH cycle model, which also gives its decode time.  "byteCycles" is
+ * the load time per byte, for the tuned parse.  If we can't get an
+ * arena, the images we claim are marked as failed.
+ */
+static void simWorker(const BenchImage* images, int numImages,
+    std::atomic<int>* pNext, bool doPreserveHoles, int numThreads,
+    long byteCycles, SimResult* results)
+{
+    static const FormatDesc kLz4fh = { 4, MIN_MATCH_LEN, MAX_LITERAL_LEN,
+        MAX_MATCH_LEN, OFFSET_ABS16 };
+    Arena arena;
+    bool haveArena = arenaInit(&arena, optimalScratchSize(MAX_SIZE) +
+            parseScratchSize(MAX_SIZE) + MAX_OUT_SIZE + MAX_SIZE +
+            ARENA_ALIGN * 2);
+    if (!haveArena) {
+        fprintf(stderr, "ERROR: unable to allocate simulation arena\n");
+    }
+
+    while (true) {
+        int idx = (*pNext)++;
+        if (idx >= numImages) {
+            break;
+        }
+        SimResult* pResult = &results[idx];
+        if (!haveArena) {
+            pResult->failed = true;
+            continue;
+        }
+        arenaReset(&arena);
+        uint8_t* outBuf = (uint8_t*) arenaAlloc(&arena, MAX_OUT_SIZE);
+        uint8_t* verifyBuf = (uint8_t*) arenaAlloc(&arena, MAX_SIZE);
+        size_t mark = arenaMark(&arena);
+
+        uint8_t inBuf[MAX_SIZE];
+        size_t inLen = images[idx].len;
+        memcpy(inBuf, images[idx].data, inLen);
+        if (!doPreserveHoles) {
+            size_t pageLen = findScreenType(inLen)->pageLen;
+            inLen = pageLen - HOLE_LEN;
+            zeroHoles(inBuf, pageLen);
+        }
+
+        // BLOAD goes straight to the screen, so raw costs no cycles
+        pResult->outputSize[SIM_RAW] = inLen;
+        pResult->cycles[SIM_RAW] = 0;
+        pResult->failed = false;
+
+        for (int c = SIM_GREEDY; c < NUM_SIM_CHOICES; c++) {
+            size_t outLen;
+            if (c == SIM_TUNED) {
+                OptNode* optList = (OptNode*)
+                    arenaAlloc(&arena, (MAX_SIZE + 1) * sizeof(OptNode));
+                MatchInfo* matches = (MatchInfo*)
+                    arenaAlloc(&arena, MAX_SIZE * sizeof(MatchInfo));
+                ParseToken* tokens = (ParseToken*)
+                    arenaAlloc(&arena, parseScratchSize(inLen));
+                findNearestMatches(inBuf, inLen, matches);
+                size_t numTokens = parseParametric(&kLz4fh, tokens, inLen,
+                        matches, optList, byteCycles);
+                outLen = emitLz4fh(outBuf, inBuf, tokens, numTokens, 0,
+                        MAX_LITERAL_LEN);
+            } else {
+                outLen = compressBuffer(outBuf, inBuf, inLen,
+                        c == SIM_GREEDY ? PARSE_GREEDY : PARSE_OPTIMAL, 0,
+                        numThreads, &arena);
+            }
+            arenaRelease(&arena, mark);
+
+            size_t verifyLen = 0;
+            if (outLen != 0) {
+                verifyLen = uncompressBufferParametric(&kLz4fh, verifyBuf,
+                        outBuf, outLen, &pResult->cycles[c]);
+            }
+            pResult->outputSize[c] = outLen;
+            if (verifyLen != inLen || memcmp(verifyBuf, inBuf, inLen) != 0) {
+                pResult->failed = true;
+            }
+        }
+    }
+    arenaFree(&arena);
+}
+
+/*
+ * Simulates a slideshow that loads each of the files from "pDisk" and
+ * shows it, and picks the fastest way to store each image: raw, or
+ * compressed with the greedy, optimal, or tuned parser.  The files are
+ * laid out one after another on an empty ProDOS volume, in the order
+ * given.
+ *
+ * The times cover reading the file and unpacking it with LZ4FH6502.
+ * Program overhead, like the BASIC.SYSTEM command parser, is the same
+ * for every choice, so we leave it out.
+ *
+ * Returns 0 on success.
+ */
+static int runSimulation(char* const* fileNames, int numFiles,
+    int numThreads, bool doPreserveHoles, const DiskModel* pDisk,
+    ReportFormat format)
+{
+    long totalLen;
+    BenchImage* images = loadImages(fileNames, numFiles, &totalLen);
+    if (images == NULL) {
+        return -1;
+    }
+
+    // Compress the images in parallel; the optimal parser gets any
+    // threads that are left over.
+    long byteCycles = pDisk->blockCycles / PRODOS_BLOCK_SIZE;
+    int numWorkers = (numThreads < numFiles) ? numThreads : numFiles;
+    int parserThreads = numThreads / numWorkers;
+    std::vector<SimResult> results(numFiles);
+    std::atomic<int> next(0);
+    std::vector<std::thread> workers;
+    for (int t = 1; t < numWorkers; t++) {
+        workers.push_back(std::thread(simWorker, images, numFiles, &next,
+                doPreserveHoles, parserThreads, byteCycles, &results[0]));
+    }
+    simWorker(images, numFiles, &next, doPreserveHoles, parserThreads,
+        byteCycles, &results[0]);
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+
+    if (format == REPORT_TEXT) {
+        printf("Slideshow simulation: %d files on a %s (%ld blocks), "
+            "seconds per image\n", numFiles, pDisk->desc, pDisk->numBlocks);
+        printf("     raw  greedy optimal   tuned  choice   bytes  blocks"
+            "  file\n");
+    } else if (format == REPORT_CSV) {
+        printf("file,raw_secs,greedy_secs,optimal_secs,tuned_secs,choice,"
+            "output_size,blocks,first_block,secs,failed\n");
+    } else {
+        printf("{\"medium\": \"%s\", \"volumeBlocks\": %ld, "
+            "\"clockHz\": %d,\n \"files\": [",
+            pDisk->name, pDisk->numBlocks, APPLE2_CLOCK_HZ);
+    }
+
+    // Lay the files out as we go, since where a file lands decides how
+    // many track boundaries it crosses.  Each "all the same" layout is
+    // kept separately for the totals.
+    long nextBlock = PRODOS_FIRST_FREE;
+    long totalCycles = 0;
+    long allNext[NUM_SIM_CHOICES];
+    long allCycles[NUM_SIM_CHOICES];
+    int numChosen[NUM_SIM_CHOICES];
+    for (int c = 0; c < NUM_SIM_CHOICES; c++) {
+        allNext[c] = PRODOS_FIRST_FREE;
+        allCycles[c] = 0;
+        numChosen[c] = 0;
+    }
+
+    int result = 0;
+    for (int i = 0; i < numFiles; i++) {
+        const SimResult* pResult = &results[i];
+        if (pResult->failed) {
+            fprintf(stderr, "ERROR: failed on %s\n", fileNames[i]);
+            result = -1;
+        }
+
+        long blocks[NUM_SIM_CHOICES];
+        double secs[NUM_SIM_CHOICES];
+        long best = -1;
+        int choice = SIM_RAW;
+        for (int c = 0; c < NUM_SIM_CHOICES; c++) {
+            blocks[c] = prodosFileBlocks(pResult->outputSize[c]);
+            long cycles = prodosLoadCycles(pDisk, nextBlock, blocks[c]) +
+                pResult->cycles[c];
+            secs[c] = (double) cycles / APPLE2_CLOCK_HZ;
+            if (best < 0 || cycles < best) {
+                best = cycles;
+                choice = c;
+            }
+
+            allCycles[c] += prodosLoadCycles(pDisk, allNext[c], blocks[c]) +
+                pResult->cycles[c];
+            allNext[c] += blocks[c];
+        }
+
+        if (format == REPORT_TEXT) {
+            printf(" %7.3f %7.3f %7.3f %7.3f  %-7s %6zd  %6ld  %s\n",
+                secs[SIM_RAW], secs[SIM_GREEDY], secs[SIM_OPTIMAL],
+                secs[SIM_TUNED], gSimChoiceNames[choice],
+                pResult->outputSize[choice], blocks[choice], fileNames[i]);
+        } else if (format == REPORT_CSV) {
+            printCsvField(fileNames[i]);
+            printf(",%.4f,%.4f,%.4f,%.4f,%s,%zd,%ld,%ld,%.4f,%d\n",
+                secs[SIM_RAW], secs[SIM_GREEDY], secs[SIM_OPTIMAL],
+                secs[SIM_TUNED], gSimChoiceNames[choice],
+                pResult->outputSize[choice], blocks[choice], nextBlock,
+                secs[choice], pResult->failed);
+        } else {
+            printf("%s\n  {\"file\": ", i == 0 ? "" : ",");
+            printJsonString(fileNames[i]);
+            printf(", \"rawSecs\": %.4f, \"greedySecs\": %.4f, "
+                "\"optimalSecs\": %.4f, \"tunedSecs\": %.4f,\n"
+                "   \"choice\": \"%s\", \"outputSize\": %zd, \"blocks\": %ld, "
+                "\"firstBlock\": %ld, \"secs\": %.4f, \"failed\": %d}",
+                secs[SIM_RAW], secs[SIM_GREEDY], secs[SIM_OPTIMAL],
+                secs[SIM_TUNED], gSimChoiceNames[choice],
+                pResult->outputSize[choice], blocks[choice], nextBlock,
+                secs[choice], pResult->failed);
+        }
+
+        totalCycles += best;
+        nextBlock += blocks[choice];
+        numChosen[choice]++;
+    }
+
+    long usedBlocks = nextBlock - PRODOS_FIRST_FREE;
+    double totalSecs = (double) totalCycles / APPLE2_CLOCK_HZ;
+    if (format == REPORT_TEXT) {
+        for (int c = 0; c < NUM_SIM_CHOICES; c++) {
+            double secs = (double) allCycles[c] / APPLE2_CLOCK_HZ;
+            printf("All %-8s %8.2f sec (%.3f per image), %ld blocks\n",
+                gSimChoiceNames[c], secs, secs / numFiles,
+                allNext[c] - PRODOS_FIRST_FREE);
+        }
+        printf("Best mix:    %8.2f sec (%.3f per image), %ld blocks "
+            "(%d raw, %d greedy, %d optimal, %d tuned)\n",
+            totalSecs, totalSecs / numFiles, usedBlocks,
+            numChosen[SIM_RAW], numChosen[SIM_GREEDY],
+            numChosen[SIM_OPTIMAL], numChosen[SIM_TUNED]);
+    } else if (format == REPORT_JSON) {
+        printf("\n ],\n \"totals\": {\"secs\": %.4f, \"blocks\": %ld",
+            totalSecs, usedBlocks);
+        for (int c = 0; c < NUM_SIM_CHOICES; c++) {
+            printf(", \"%sSecs\": %.4f", gSimChoiceNames[c],
+                (double) allCycles[c] / APPLE2_CLOCK_HZ);
+        }
+        printf("}}\n");
+    }
+    if (nextBlock > pDisk->numBlocks) {
+        fprintf(stderr, "Warning: the files need %ld blocks, but a %s "
+            "only has %ld\n", usedBlocks, pDisk->desc,
+            pDisk->numBlocks - PRODOS_FIRST_FREE);
+    }
+
+    delete[] images;
+    return result;
+}
+
+#ifdef FHPACK_COUNT_OPS
+/*
+ * A parser to put through the worst-case check ("-e"), and how its
+ * worst-case operation counts grow with the input length.
+ */
+enum BoundShape {
+    BOUND_LINEAR,           // a few candidates per position
+    BOUND_QUADRATIC,        // every earlier position, at every position
+    BOUND_ROWS              // every position in the buffer, for each one
+};
+struct CheckEngine {
+    const char* name;
+    ParseMode parseMode;
+    unsigned int formatFlags;
+    BoundShape shape;
+};
+static const CheckEngine gCheckEngines[] = {
+    { "-0",     PARSE_FAST,     0, BOUND_LINEAR },
+    { "-a",     PARSE_DEVICE,   0, BOUND_LINEAR },
+    { "-1",     PARSE_GREEDY,   0, BOUND_QUADRATIC },
+    { "-9",     PARSE_OPTIMAL,  0, BOUND_QUADRATIC },
+    { "-9okx",  PARSE_OPTIMAL,  FLAG_REPOFF | FLAG_STRIDE | FLAG_XOR,
+        BOUND_QUADRATIC },
+    { "-1p",    PARSE_GREEDY,   FLAG_ROWS, BOUND_ROWS },
+    { "-9p",    PARSE_OPTIMAL,  FLAG_ROWS, BOUND_ROWS },
+};
+#define NUM_CHECK_ENGINES   (sizeof(gCheckEngines) / sizeof(gCheckEngines[0]))
+
+/*
+ * Computes the most compares and compared bytes "pEngine" may need for
+ * "inLen" bytes of input.
+ *
+ * The hash parsers probe at most once per position, plus one forward
+ * extension per match (-0), or compare two candidates per position (-a).
+ * The brute-force parsers look at every earlier position from each
+ * position they search, which is all of them for -9, and XOR matches
+ * double that; repeat offsets and strides add a few more per position.
+ * Row order looks at the whole screen from each visible byte, with
+ * matches no longer than a row.  A compare examines at most one byte
+ * more than the longest match it can find.
+ */
+static void checkBounds(const CheckEngine* pEngine, size_t inLen,
+    uint64_t* pCompares, uint64_t* pBytes)
+{
+    uint64_t n = inLen;
+    switch (pEngine->shape) {
+    case BOUND_LINEAR:
+        if (pEngine->parseMode == PARSE_FAST) {
+            *pCompares = n * 2;
+            *pBytes = n * (MIN_MATCH_LEN + 2);
+        } else {
+            *pCompares = n * 2;
+            *pBytes = *pCompares * (MAX_MATCH_LEN + 1);
+        }
+        break;
+    case BOUND_QUADRATIC:
+        *pCompares = n * (n - 1) / 2;
+        if ((pEngine->formatFlags & FLAG_XOR) != 0) {
+            *pCompares *= 2;
+        }
+        if ((pEngine->formatFlags & FLAG_REPOFF) != 0) {
+            *pCompares += n * 2;
+        }
+        if ((pEngine->formatFlags & FLAG_STRIDE) != 0) {
+            *pCompares += n * NUM_STRIDES;
+        }
+        *pBytes = *pCompares * (MAX_MATCH_LEN + 1);
+        break;
+    case BOUND_ROWS:
+        *pCompares = (uint64_t) NUM_ROWS * ROW_WIDTH * MAX_SIZE;
+        *pBytes = *pCompares * (ROW_WIDTH + 1);
+        break;
+    }
+}
+
+/*
+ * Runs every parser over each of the files, one thread at a time, and
+ * checks that the match search does no more work than the parser's
+ * worst-case bound allows, and that each parse finishes within
+ * "budgetSecs".  The output is verified too.  This is meant for inputs
+ * built to be as hard as possible, like the "nearmatch" and "debruijn"
+ * images from make-test-pic, so that a change that makes a parser
+ * slower than it should be fails loudly.
+ *
+ * Holes are zeroed, unless "doPreserveHoles" is set.  Row order only
+ * applies to hi-res images.
+ *
+ * Returns 0 if everything passed.
+ */
+static int runEngineCheck(char* const* fileNames, int numFiles,
+    bool doPreserveHoles, double budgetSecs)
+{
+    long totalLen;
+    BenchImage* images = loadImages(fileNames, numFiles, &totalLen);
+    if (images == NULL) {
+        return -1;
+    }
+    CompressBuffers* pBufs = allocCompressBuffers(PARSE_OPTIMAL, 0);
+    if (pBufs == NULL) {
+        delete[] images;
+        return -1;
+    }
+
+    printf("Engine check: %d files, %.3f sec budget per parse\n",
+        numFiles, budgetSecs);
+    printf("  engine     compares  of bound         bytes  of bound"
+        "     secs  result  file\n");
+
+    int numFailed = 0;
+    for (int i = 0; i < numFiles; i++) {
+        const ScreenType* pScreen = findScreenType(images[i].len);
+        for (size_t e = 0; e < NUM_CHECK_ENGINES; e++) {
+            const CheckEngine* pEngine = &gCheckEngines[e];
+            bool isRows = (pEngine->formatFlags & FLAG_ROWS) != 0;
+            if (isRows && pScreen->pageLen != MAX_SIZE) {
+                continue;
             }
-            if (numLiterals <= INITIAL_LEN) {
-                mixedLengths |= numLiterals << 4;
+
+            uint8_t* inBuf = pBufs->inBuf1;
+            size_t inLen = images[i].len;
+            memcpy(inBuf, images[i].data, inLen);
+            if (isRows) {
+                inLen = MIN_SIZE;
+            } else if (!doPreserveHoles) {
+                inLen = pScreen->pageLen - HOLE_LEN;
+                zeroHoles(inBuf, pScreen->pageLen);
+            }
+
+            arenaReset(&pBufs->arena1);
+            memset(&gOpCounts, 0, sizeof(gOpCounts));
+            double startWhen = getTimeSecs();
+            size_t outLen;
+            if (isRows) {
+                outLen = compressBufferRows(pBufs->outBuf1, inBuf,
+                        pEngine->parseMode);
             } else {
-                mixedLengths |= INITIAL_LEN << 4;
+                outLen = compressBuffer(pBufs->outBuf1, inBuf, inLen,
+                        pEngine->parseMode, pEngine->formatFlags, 1,
+                        &pBufs->arena1);
             }
-            DBUG(("  match len=%zd off=0x%04zx lits=%zd mix=0x%02x\n",
-                longestMatch, matchOffset, numLiterals,
-                mixedLengths));
-            *outPtr++ = mixedLengths;
+            double secs = getTimeSecs() - startWhen;
+            OpCounts counts = gOpCounts;
 
-            // Output the literals, starting with the extended length.
-            if (numLiterals >= INITIAL_LEN) {
-                *outPtr++ = numLiterals - INITIAL_LEN;
+            bool verified = false;
+            if (outLen != 0 && uncompressBuffer(pBufs->verifyBuf,
+                    pBufs->outBuf1, outLen) == inLen) {
+                verified = true;
+                for (size_t ii = 0; ii < inLen; ii++) {
+                    if (isRows && isHole(ii)) {
+                        continue;
+                    }
+                    if (inBuf[ii] != pBufs->verifyBuf[ii]) {
+                        verified = false;
+                        break;
+                    }
+                }
             }
-            memcpy(outPtr, literalSrcPtr, numLiterals);
-            outPtr += numLiterals;
-            numLiterals = 0;
-            literalSrcPtr = NULL;       // debug/sanity check
 
-            // Now output the match, starting with the extended length.
-            if (adjustedMatch >= INITIAL_LEN) {
-                *outPtr++ = adjustedMatch - INITIAL_LEN;
+            uint64_t maxCompares = 0, maxBytes = 0;
+            checkBounds(pEngine, inLen, &maxCompares, &maxBytes);
+            const char* result = "ok";
+            if (!verified) {
+                result = "BADDATA";
+            } else if (counts.compares > maxCompares ||
+                    counts.bytes > maxBytes) {
+                result = "BOUND";
+            } else if (secs > budgetSecs) {
+                result = "SLOW";
+            }
+            if (strcmp(result, "ok") != 0) {
+                numFailed++;
             }
-            *outPtr++ = matchOffset & 0xff;
-            *outPtr++ = (matchOffset >> 8) & 0xff;
 
-            i += longestMatch;
+            printf("  %-6s %12llu  %7.2f%%  %12llu  %7.2f%%  %7.3f  %-7s %s\n",
+                pEngine->name, (unsigned long long) counts.compares,
+                counts.compares * 100.0 / maxCompares,
+                (unsigned long long) counts.bytes,
+                counts.bytes * 100.0 / maxBytes, secs, result, fileNames[i]);
+            fflush(stdout);
         }
     }
+    if (numFailed != 0) {
+        fprintf(stderr, "ERROR: %d parses failed the check\n", numFailed);
+    }
+
+    freeCompressBuffers(pBufs);
+    delete[] images;
+    return numFailed == 0 ? 0 : -1;
+}
+#endif /*FHPACK_COUNT_OPS*/
+
+/*
+ * qsort() comparison function for doubles.
+ */
+static int compareDouble(const void* vp1, const void* vp2)
+{
+    double val1 = *(const double*) vp1;
+    double val2 = *(const double*) vp2;
+    return (val1 > val2) - (val1 < val2);
+}
 
-    // housekeeping check -- factor in end-of-data circumstances
-    predictedLength++;
-    if (numLiterals == 0) {
-        predictedLength++;
+/*
+ * Prints the 50th, 90th, and 99th percentiles and the maximum of a set
+ * of times, in milliseconds.
+ */
+static void printLatencies(const char* label, std::vector<double> secs)
+{
+    if (secs.empty()) {
+        printf("  %-7s (none)\n", label);
+        return;
     }
+    qsort(&secs[0], secs.size(), sizeof(double), compareDouble);
+    size_t last = secs.size() - 1;
+    printf("  %-7s p50 %7.3f  p90 %7.3f  p99 %7.3f  max %7.3f ms  (%zd)\n",
+        label, secs[last * 50 / 100] * 1000.0, secs[last * 90 / 100] * 1000.0,
+        secs[last * 99 / 100] * 1000.0, secs[last] * 1000.0, secs.size());
+}
 
-    // Dump any remaining literals, with the end-of-data indicator
-    // in the match len.
-    DBUG(("ending with numLiterals=%zd\n", numLiterals));
-    if (numLiterals < INITIAL_LEN) {
-        // 0-14 literals, only need the nibble
-        *outPtr++ = (numLiterals << 4) | 0x0f;
-    } else {
-        // 15-255 literals, need the extra byte
-        *outPtr++ = 0xff;
-        *outPtr++ = numLiterals - INITIAL_LEN;
+/*
+ * Replays a slideshow of compressed files through the prefetching reader
+ * ("-v"), forward through the list and back again, showing each image
+ * for VIEW_DWELL_MSEC.  Reports how often the image was ready, and how
+ * long expanding and fetching took.
+ *
+ * Returns 0 if every file could be expanded.
+ */
+static int runViewer(char* const* fileNames, int numFiles, int lookAhead,
+    size_t cacheBytes)
+{
+    PrefetchReader* pReader = readerOpen(fileNames, numFiles, lookAhead,
+            cacheBytes);
+    if (pReader == NULL) {
+        return -1;
     }
-    memcpy(outPtr, literalSrcPtr, numLiterals);
-    outPtr += numLiterals;
 
-    *outPtr++ = EOD_MATCH_TOKEN;
+    printf("Viewer replay: %d files forward and back, %d ahead, "
+        "%zdKB cache (%zd pages)\n", numFiles, pReader->lookAhead,
+        cacheBytes / 1024, pReader->cache.size());
 
-    DBUG(("Predicted length %zd, actual %ld\n",
-        predictedLength, outPtr - outBuf));
+    uint8_t page[MAX_SIZE];
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < numFiles; i++) {
+            int index = (pass == 0) ? i : numFiles - 1 - i;
+            if (readerGet(pReader, index, page) == 0 && pass == 0) {
+                fprintf(stderr, "ERROR: unable to expand %s\n",
+                    fileNames[index]);
+            }
+            usleep(VIEW_DWELL_MSEC * 1000);
+        }
+    }
 
-    free(optList);
-    return outPtr - outBuf;
+    ReaderStats stats;
+    readerGetStats(pReader, &stats);
+    readerClose(pReader);
+
+    long total = stats.hits + stats.waits + stats.misses + stats.failures;
+    printf("  ready %ld (%.1f%%), waited %ld, expanded on demand %ld, "
+        "failed %ld\n", stats.hits, stats.hits * 100.0 / total, stats.waits,
+        stats.misses, stats.failures);
+    printLatencies("expand", stats.decodeSecs);
+    printLatencies("get", stats.getSecs);
+    return stats.failures == 0 ? 0 : -1;
 }
 
 /*
- * Compress a buffer, from "inBuf" to "outBuf".
- *
- * The input buffer holds between MIN_SIZE and MAX_SIZE bytes (inclusive),
- * depending on the length of the source material and whether or not
- * we're attempting to preserve the screen holes.
+ * Sharded batch compression ("-q"), for sets too big for one machine.
  *
- * Returns the amount of data in "outBuf" on success, or 0 on failure.
+ * The first run writes a plan into a work directory: the compression
+ * options, the number of shards, and the input files, which are split
+ * into that many contiguous runs.  Any number of worker processes, on
+ * any machines that see the same filesystem, then go through the shards,
+ * claiming each with an flock() on its lock file.  A worker that dies
+ * drops its locks, so another can pick the shard up.  The compressed
+ * files go into the work directory, named after the input files, and
+ * are renamed into place once written, so an output that exists is
+ * complete; a rerun skips any that are newer than their inputs.  When a
+ * shard is finished, its statistics are written to a ".done" file, and
+ * the totals are merged from those.
  */
-size_t compressBufferGreedily(uint8_t* outBuf, const uint8_t* inBuf,
-    size_t inLen)
-{
-    const uint8_t* inPtr = inBuf;
-    uint8_t* outPtr = outBuf;
 
-    const uint8_t* literalSrcPtr = NULL;
-    size_t numLiterals = 0;
+#define SHARD_PLAN_NAME     "plan"
+#define SHARD_PLAN_MAGIC    "fhpack shard plan 2"
+#define SHARD_OUT_SUFFIX    ".lz4fh"
 
-    *outPtr++ = LZ4FH_MAGIC;
+struct ShardPlan {
+    ParseMode parseMode;
+    unsigned int formatFlags;
+    bool doPreserveHoles;
+    bool doMetaHeader;
+    int numShards;
+    std::vector<char*> inFiles;             // absolute paths
+    std::vector<long long> inSizes;         // as of the plan
+    std::vector<long long> inTimes;         //  (st_mtime)
+};
 
-    // Basic strategy: walk forward, searching for a match.  When we
-    // find one, output the literals then the match.
-    //
-    // If the literal would cause us to exceed the maximum literal
-    // length, output the previous literals with a "no match" indicator.
-    while (inPtr < inBuf + inLen) {
-        DBUG(("Loop: off 0x%08lx\n", inPtr - inBuf));
+/*
+ * Per-shard statistics, as kept in the shard's ".done" file.
+ */
+struct ShardStats {
+    long numFiles;
+    long compressed;
+    long skipped;                           // already done by an earlier run
+    long failed;
+    long inBytes;
+    long outBytes;
+    double secs;
+    char worker[80];                        // host:pid
+};
 
-        // sanity-check on MAX_EXPANSION value
-        assert(outPtr - outBuf < MAX_SIZE + MAX_EXPANSION);
+static void freeShardPlan(ShardPlan* pPlan)
+{
+    for (size_t i = 0; i < pPlan->inFiles.size(); i++) {
+        free(pPlan->inFiles[i]);
+    }
+    pPlan->inFiles.clear();
+    pPlan->inSizes.clear();
+    pPlan->inTimes.clear();
+}
 
-        size_t matchOffset;
-        size_t longestMatch = findLongestMatch(inPtr, inBuf, inLen,
-                &matchOffset);
-        if (longestMatch < MIN_MATCH_LEN) {
-            // No good match found here, emit as literal.
-            if (numLiterals == MAX_LITERAL_LEN) {
-                // We've maxed out the literal string length.  Emit
-                // the previously literals with an empty match indicator.
-                DBUG(("  max literals reached\n"));
-                *outPtr++ = 0xff;       // literal-len=15, match-len=15
-                *outPtr++ = MAX_LITERAL_LEN - INITIAL_LEN;  // 240
-                memcpy(outPtr, literalSrcPtr, numLiterals);
-                outPtr += numLiterals;
-
-                // Emit empty match indicator.
-                *outPtr++ = EMPTY_MATCH_TOKEN;
-
-                // Reset literal len, continue.
-                numLiterals = 0;
-            }
-            if (numLiterals == 0) {
-                // Start of run of literals.  Save pointer to data.
-                literalSrcPtr = inPtr;
-            }
-            numLiterals++;
-            inPtr++;
-        } else {
-            // Good match found.
-            size_t adjustedMatch = longestMatch - MIN_MATCH_LEN;
+/*
+ * Gets the size and modification time of "fileName" for the plan.
+ * Returns false if it can't be found.
+ */
+static bool statShardInput(const char* fileName, long long* pSize,
+    long long* pTime)
+{
+    struct stat st;
+    if (stat(fileName, &st) != 0) {
+        return false;
+    }
+    *pSize = st.st_size;
+    *pTime = st.st_mtime;
+    return true;
+}
 
-            // Start by emitting the 4/4 length byte.
-            uint8_t mixedLengths;
-            if (adjustedMatch <= INITIAL_LEN) {
-                mixedLengths = adjustedMatch;
-            } else {
-                mixedLengths = INITIAL_LEN;
-            }
-            if (numLiterals <= INITIAL_LEN) {
-                mixedLengths |= numLiterals << 4;
-            } else {
-                mixedLengths |= INITIAL_LEN << 4;
-            }
-            DBUG(("  match len=%zd off=0x%04zx lits=%zd mix=0x%02x\n",
-                longestMatch, matchOffset, numLiterals,
-                mixedLengths));
-            *outPtr++ = mixedLengths;
+/*
+ * Returns true if input "idx" is missing, or isn't the file the plan
+ * was made with.
+ */
+static bool shardInputChanged(const ShardPlan* pPlan, size_t idx)
+{
+    long long size, mtime;
+    return !statShardInput(pPlan->inFiles[idx], &size, &mtime) ||
+        size != pPlan->inSizes[idx] || mtime != pPlan->inTimes[idx];
+}
 
-            // Output the literals, starting with the extended length.
-            if (numLiterals >= INITIAL_LEN) {
-                *outPtr++ = numLiterals - INITIAL_LEN;
-            }
-            memcpy(outPtr, literalSrcPtr, numLiterals);
-            outPtr += numLiterals;
-            numLiterals = 0;
-            literalSrcPtr = NULL;       // debug/sanity check
+/*
+ * Returns the range of input files in a shard, as [*pFirst, *pLast).
+ */
+static void shardRange(const ShardPlan* pPlan, int shard, size_t* pFirst,
+    size_t* pLast)
+{
+    size_t numFiles = pPlan->inFiles.size();
+    *pFirst = numFiles * shard / pPlan->numShards;
+    *pLast = numFiles * (shard + 1) / pPlan->numShards;
+}
 
-            // Now output the match, starting with the extended length.
-            if (adjustedMatch >= INITIAL_LEN) {
-                *outPtr++ = adjustedMatch - INITIAL_LEN;
+/*
+ * Returns the number of the shard's inputs that have changed since the
+ * plan was made, listing them if "doReport" is set.  If there are any,
+ * the shard's ".done" file can't be trusted, and it shouldn't be
+ * compressed until the plan is updated.
+ */
+static int shardChangedInputs(const ShardPlan* pPlan, int shard,
+    bool doReport)
+{
+    size_t first, last;
+    int numChanged = 0;
+    shardRange(pPlan, shard, &first, &last);
+    for (size_t i = first; i < last; i++) {
+        if (shardInputChanged(pPlan, i)) {
+            if (doReport) {
+                fprintf(stderr, "ERROR: %s has changed since the plan was "
+                    "made; rerun with the input files\n", pPlan->inFiles[i]);
             }
-            *outPtr++ = matchOffset & 0xff;
-            *outPtr++ = (matchOffset >> 8) & 0xff;
-            inPtr += longestMatch;
+            numChanged++;
         }
     }
+    return numChanged;
+}
 
-    // Dump any remaining literals, with the end-of-data indicator
-    // in the match len.
-    DBUG(("ending with numLiterals=%zd\n", numLiterals));
-    if (numLiterals < INITIAL_LEN) {
-        // 0-14 literals, only need the nibble
-        *outPtr++ = (numLiterals << 4) | 0x0f;
-    } else {
-        // 15-255 literals, need the extra byte
-        *outPtr++ = 0xff;
-        *outPtr++ = numLiterals - INITIAL_LEN;
-    }
-    memcpy(outPtr, literalSrcPtr, numLiterals);
-    outPtr += numLiterals;
+/*
+ * Builds the name of a file in the work directory.
+ */
+static void shardPath(char* buf, size_t bufLen, const char* workDir,
+    const char* name)
+{
+    snprintf(buf, bufLen, "%s/%s", workDir, name);
+}
 
-    *outPtr++ = EOD_MATCH_TOKEN;
+static void shardFileName(char* buf, size_t bufLen, const char* workDir,
+    int shard, const char* suffix)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "shard-%04d%s", shard, suffix);
+    shardPath(buf, bufLen, workDir, name);
+}
 
-    return outPtr - outBuf;
+static void shardOutputName(char* buf, size_t bufLen, const char* workDir,
+    const char* inFileName)
+{
+    snprintf(buf, bufLen, "%s/%s%s", workDir, baseName(inFileName),
+        SHARD_OUT_SUFFIX);
 }
 
 /*
- * Uncompress from "inBuf" to "outBuf".
- *
- * Given valid data, "inLen" is not necessary.  It can be used as an
- * error check.
+ * Writes a plan to "fp".
+ */
+static void putShardPlan(FILE* fp, const ShardPlan* pPlan)
+{
+    fprintf(fp, "%s\n", SHARD_PLAN_MAGIC);
+    fprintf(fp, "level %s\n", parseModeName(pPlan->parseMode));
+    fprintf(fp, "flags 0x%x\n", pPlan->formatFlags);
+    fprintf(fp, "preserve %d\n", pPlan->doPreserveHoles);
+    fprintf(fp, "meta %d\n", pPlan->doMetaHeader);
+    fprintf(fp, "shards %d\n", pPlan->numShards);
+    for (size_t i = 0; i < pPlan->inFiles.size(); i++) {
+        fprintf(fp, "file %lld %lld %s\n", pPlan->inSizes[i],
+            pPlan->inTimes[i], pPlan->inFiles[i]);
+    }
+}
+
+/*
+ * Reads the plan from the work directory.
  *
- * Returns the uncompressed length on success, 0 on failure.
+ * Returns false if there isn't one, or it doesn't make sense.
  */
-size_t uncompressBuffer(uint8_t* outBuf, const uint8_t* inBuf, size_t inLen)
+static bool getShardPlan(const char* workDir, ShardPlan* pPlan)
 {
-    uint8_t* outPtr = outBuf;
-    const uint8_t* inPtr = inBuf;
+    char path[PATH_MAX];
+    char line[PATH_MAX + 64];
+    int val;
+    long long size, mtime;
+    int pathStart;
 
-    if (*inPtr++ != LZ4FH_MAGIC) {
-        fprintf(stderr, "Missing LZ4FH magic\n");
-        return 0;
+    shardPath(path, sizeof(path), workDir, SHARD_PLAN_NAME);
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: no plan in %s (give it the input files)\n",
+            workDir);
+        return false;
     }
 
-    while (true) {
-        uint8_t mixedLen = *inPtr++;
-
-        int literalLen = mixedLen >> 4;
-        if (literalLen != 0) {
-            if (literalLen == INITIAL_LEN) {
-                literalLen += *inPtr++;
-            }
-            DBUG(("Literals: %d\n", literalLen));
-            if ((outPtr - outBuf) + literalLen > (long) MAX_SIZE ||
-                    (inPtr - inBuf) + literalLen > (long) inLen) {
-                fprintf(stderr,
-                    "Buffer overrun L: outPosn=%zd inPosn=%zd len=%d inLen=%ld\n",
-                    outPtr - outBuf, inPtr - inBuf, literalLen, inLen);
-                return 0;
+    bool result = false;
+    pPlan->numShards = 0;
+    if (fgets(line, sizeof(line), fp) == NULL ||
+            strncmp(line, SHARD_PLAN_MAGIC, strlen(SHARD_PLAN_MAGIC)) != 0) {
+        goto bail;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "level ", 6) == 0) {
+            pPlan->parseMode = PARSE_OPTIMAL;
+            for (int mode = PARSE_OPTIMAL; mode <= PARSE_FAST; mode++) {
+                if (strcmp(line + 6, parseModeName((ParseMode) mode)) == 0) {
+                    pPlan->parseMode = (ParseMode) mode;
+                }
             }
-            memcpy(outPtr, inPtr, literalLen);
-            outPtr += literalLen;
-            inPtr += literalLen;
+        } else if (sscanf(line, "flags %x", &pPlan->formatFlags) == 1) {
+            // got it
+        } else if (sscanf(line, "preserve %d", &val) == 1) {
+            pPlan->doPreserveHoles = (val != 0);
+        } else if (sscanf(line, "meta %d", &val) == 1) {
+            pPlan->doMetaHeader = (val != 0);
+        } else if (sscanf(line, "shards %d", &val) == 1) {
+            pPlan->numShards = val;
+        } else if (sscanf(line, "file %lld %lld %n", &size, &mtime,
+                    &pathStart) == 2 && line[pathStart] != '\0') {
+            pPlan->inFiles.push_back(strdup(line + pathStart));
+            pPlan->inSizes.push_back(size);
+            pPlan->inTimes.push_back(mtime);
         } else {
-            DBUG(("Literals: none\n"));
+            goto bail;
         }
+    }
+    result = pPlan->numShards > 0 && !pPlan->inFiles.empty();
 
-        int matchLen = mixedLen & 0x0f;
-        if (matchLen == INITIAL_LEN) {
-            uint8_t addon = *inPtr++;
-            if (addon == EMPTY_MATCH_TOKEN) {
-                DBUG(("Match: none\n"));
-                matchLen = - MIN_MATCH_LEN;
-            } else if (addon == EOD_MATCH_TOKEN) {
-                DBUG(("Hit end-of-data at 0x%04lx\n", outPtr - outBuf));
-                break;      // out of while
-            } else {
-                matchLen += addon;
-            }
-        }
+bail:
+    fclose(fp);
+    if (!result) {
+        fprintf(stderr, "ERROR: %s is not a valid plan\n", path);
+        freeShardPlan(pPlan);
+    }
+    return result;
+}
 
-        matchLen += MIN_MATCH_LEN;
-        if (matchLen != 0) {
-            int matchOffset = *inPtr++;
-            matchOffset |= (*inPtr++) << 8;
-            DBUG(("Match: %d at %d\n", matchLen, matchOffset));
-            // Can't use memcpy() here, because we need to guarantee
-            // that the match is overlapping.
-            uint8_t* srcPtr = outBuf + matchOffset;
-            if ((outPtr - outBuf) + matchLen > MAX_SIZE ||
-                    (srcPtr - outBuf) + matchLen > MAX_SIZE) {
-                fprintf(stderr,
-                    "Buffer overrun M: outPosn=%zd srcPosn=%zd len=%d\n",
-                    outPtr - outBuf, srcPtr - outBuf, matchLen);
-                return 0;
-            }
-            while (matchLen-- != 0) {
-                *outPtr++ = *srcPtr++;
+/*
+ * Moves the plan at "tmpPath", which has the same options and files as
+ * the old plan "pOld", into place at "path", if any of the files have
+ * changed.  The outputs of the changed files, and the ".done" files of
+ * their shards, are removed first, so a worker can't take the old
+ * results as current.
+ *
+ * Returns 0 on success.
+ */
+static int refreshShardPlan(const char* workDir, const ShardPlan* pOld,
+    const ShardPlan* pNew, const char* tmpPath, const char* path)
+{
+    char outPath[PATH_MAX];
+    bool changed = false;
+
+    for (int shard = 0; shard < pNew->numShards; shard++) {
+        size_t first, last;
+        bool shardChanged = false;
+        shardRange(pNew, shard, &first, &last);
+        for (size_t i = first; i < last; i++) {
+            if (pOld->inSizes[i] == pNew->inSizes[i] &&
+                    pOld->inTimes[i] == pNew->inTimes[i]) {
+                continue;
             }
+            printf("  %s has changed, redoing it\n", pNew->inFiles[i]);
+            shardOutputName(outPath, sizeof(outPath), workDir,
+                pNew->inFiles[i]);
+            unlink(outPath);
+            shardChanged = true;
+        }
+        if (shardChanged) {
+            shardFileName(outPath, sizeof(outPath), workDir, shard, ".done");
+            unlink(outPath);
+            changed = true;
         }
     }
-
-    if (inPtr - inBuf != (long) inLen) {
-        fprintf(stderr, "Warning: uncompress used only %ld of %zd bytes\n",
-                inPtr - inBuf, inLen);
+    if (changed && rename(tmpPath, path) != 0) {
+        perror("Unable to update plan");
+        return -1;
     }
-
-    return outPtr - outBuf;
+    return 0;
 }
 
 /*
- * Compress a file, from "inFileName" to "outFileName".
+ * Writes the plan to the work directory, unless it already has the same
+ * one.  The plan is written to a temporary file and linked into place,
+ * so if two coordinators start at once, one of them wins and the other
+ * checks against it.
+ *
+ * If the old plan has the same options and files, but some of the files
+ * have changed since, the new plan replaces it, and the outputs and
+ * ".done" files that came from the old versions are removed so they're
+ * redone.
  *
  * Returns 0 on success.
  */
-int compressFile(const char* outFileName, const char* inFileName,
-    bool doPreserveHoles, bool useGreedyParsing)
+static int writeShardPlan(const char* workDir, const ShardPlan* pPlan)
 {
-    int result = -1;
-    uint8_t inBuf1[MAX_SIZE];
-    uint8_t inBuf2[MAX_SIZE];
-    uint8_t verifyBuf[MAX_SIZE];
-    uint8_t outBuf1[MAX_SIZE + MAX_EXPANSION];
-    uint8_t outBuf2[MAX_SIZE + MAX_EXPANSION];
-    uint8_t* outBuf = NULL;
-    uint8_t* inBuf = NULL;
-    size_t outSize, sourceLen, uncompressedLen;
-    FILE* outfp = NULL;
-    FILE* infp;
+    char path[PATH_MAX];
+    char tmpPath[PATH_MAX + 16];
 
-    infp = fopen(inFileName, "rb");
-    if (infp == NULL) {
-        perror("Unable to open input file");
+    if (mkdir(workDir, 0777) != 0 && errno != EEXIST) {
+        perror("Unable to create work directory");
         return -1;
     }
 
-    if (outFileName != NULL) {
-        outfp = fopen(outFileName, "wb");
-        if (outfp == NULL) {
-            perror("Unable to open output file");
-            fclose(infp);
-            return -1;
+    // The outputs are named after the inputs, so they have to differ.
+    for (size_t i = 0; i < pPlan->inFiles.size(); i++) {
+        for (size_t j = 0; j < i; j++) {
+            if (strcmp(baseName(pPlan->inFiles[i]),
+                    baseName(pPlan->inFiles[j])) == 0) {
+                fprintf(stderr, "ERROR: %s and %s have the same name\n",
+                    pPlan->inFiles[j], pPlan->inFiles[i]);
+                return -1;
+            }
         }
     }
 
-    fseek(infp, 0, SEEK_END);
-    long fileLen = ftell(infp);
-    rewind(infp);
-    if (fileLen < MIN_SIZE || fileLen > MAX_SIZE) {
-        fprintf(stderr, "ERROR: input file is %ld bytes, must be %d - %d\n",
-            fileLen, MIN_SIZE, MAX_SIZE);
-        goto bail;
+    shardPath(path, sizeof(path), workDir, SHARD_PLAN_NAME);
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp%d", path, (int) getpid());
+    FILE* fp = fopen(tmpPath, "w");
+    if (fp == NULL) {
+        perror("Unable to create plan");
+        return -1;
     }
-
-    // Read data into buffer.
-    if (fread(inBuf1, 1, fileLen, infp) != (size_t) fileLen) {
-        perror("Failed while reading data");
-        goto bail;
+    putShardPlan(fp, pPlan);
+    if (fclose(fp) != 0) {
+        perror("Failed while writing plan");
+        unlink(tmpPath);
+        return -1;
     }
 
-    if (doPreserveHoles) {
-        // Don't modify the input.
-        sourceLen = fileLen;        // retain original file length
-        if (useGreedyParsing) {
-            outSize = compressBufferGreedily(outBuf1, inBuf1, sourceLen);
+    int result = 0;
+    if (link(tmpPath, path) != 0) {
+        if (errno != EEXIST) {
+            perror("Unable to create plan");
+            result = -1;
         } else {
-            outSize = compressBufferOptimally(outBuf1, inBuf1, sourceLen);
+            // There's a plan already; it had better be this one.
+            ShardPlan oldPlan;
+            if (!getShardPlan(workDir, &oldPlan)) {
+                result = -1;
+            } else {
+                bool same = oldPlan.parseMode == pPlan->parseMode &&
+                    oldPlan.formatFlags == pPlan->formatFlags &&
+                    oldPlan.doPreserveHoles == pPlan->doPreserveHoles &&
+                    oldPlan.doMetaHeader == pPlan->doMetaHeader &&
+                    oldPlan.numShards == pPlan->numShards &&
+                    oldPlan.inFiles.size() == pPlan->inFiles.size();
+                for (size_t i = 0; same && i < pPlan->inFiles.size(); i++) {
+                    same = strcmp(oldPlan.inFiles[i], pPlan->inFiles[i]) == 0;
+                }
+                if (!same) {
+                    fprintf(stderr, "ERROR: %s has a different plan; "
+                        "use a new directory\n", workDir);
+                    result = -1;
+                } else {
+                    result = refreshShardPlan(workDir, &oldPlan, pPlan,
+                            tmpPath, path);
+                }
+                freeShardPlan(&oldPlan);
+            }
         }
-        inBuf = inBuf1;
-        outBuf = outBuf1;
-    } else {
-        sourceLen = MIN_SIZE;       // always drop the last 8 bytes
-        memcpy(inBuf2, inBuf1, sourceLen);
+    }
+    unlink(tmpPath);
+    return result;
+}
 
-        // try it twice, with zero-filled holes and content-filled holes
+/*
+ * Reads a shard's ".done" file.  Returns false if the shard isn't done.
+ */
+static bool getShardStats(const char* workDir, int shard,
+    ShardStats* pStats)
+{
+    char path[PATH_MAX];
 
-        size_t outSize1;
-        zeroHoles(inBuf1);
-        if (useGreedyParsing) {
-            outSize1 = compressBufferGreedily(outBuf1, inBuf1, sourceLen);
-        } else {
-            outSize1 = compressBufferOptimally(outBuf1, inBuf1, sourceLen);
-        }
+    shardFileName(path, sizeof(path), workDir, shard, ".done");
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        return false;
+    }
+    bool result = fscanf(fp, "%ld %ld %ld %ld %ld %ld %lf %79s",
+            &pStats->numFiles, &pStats->compressed, &pStats->skipped,
+            &pStats->failed, &pStats->inBytes, &pStats->outBytes,
+            &pStats->secs, pStats->worker) == 8;
+    fclose(fp);
+    return result;
+}
+
+/*
+ * Writes a shard's ".done" file, by way of a temporary file, so it's
+ * never seen half-written.
+ *
+ * Returns 0 on success.
+ */
+static int putShardStats(const char* workDir, int shard,
+    const ShardStats* pStats)
+{
+    char path[PATH_MAX];
+    char tmpPath[PATH_MAX + 16];
+
+    shardFileName(path, sizeof(path), workDir, shard, ".done");
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp%d", path, (int) getpid());
+    FILE* fp = fopen(tmpPath, "w");
+    if (fp == NULL) {
+        perror("Unable to create shard stats");
+        return -1;
+    }
+    fprintf(fp, "%ld %ld %ld %ld %ld %ld %.3f %s\n",
+        pStats->numFiles, pStats->compressed, pStats->skipped,
+        pStats->failed, pStats->inBytes, pStats->outBytes, pStats->secs,
+        pStats->worker);
+    if (fclose(fp) != 0 || rename(tmpPath, path) != 0) {
+        perror("Failed while writing shard stats");
+        unlink(tmpPath);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Compresses the files in one shard.  Outputs that exist and are at
+ * least as new as their inputs are left alone.
+ */
+static void compressShard(const char* workDir, const ShardPlan* pPlan,
+    int shard, CompressBuffers* pBufs, ShardStats* pStats)
+{
+    size_t first, last;
+    char outPath[PATH_MAX];
+    char tmpPath[PATH_MAX + 16];
+    double startWhen = getTimeSecs();
 
-        size_t outSize2;
-        fillHoles(inBuf2);
-        if (useGreedyParsing) {
-            outSize2 = compressBufferGreedily(outBuf2, inBuf2, sourceLen);
-        } else {
-            outSize2 = compressBufferOptimally(outBuf2, inBuf2, sourceLen);
-        }
+    shardRange(pPlan, shard, &first, &last);
+    for (size_t i = first; i < last; i++) {
+        const char* inFileName = pPlan->inFiles[i];
+        shardOutputName(outPath, sizeof(outPath), workDir, inFileName);
+        pStats->numFiles++;
 
-        if (false) {     // save hole-punched output for examination
-            FILE* foo = fopen("HOLES", "wb");
-            fwrite(inBuf2, 1, MIN_SIZE, foo);
-            fclose(foo);
+        struct stat inSt, outSt;
+        if (stat(inFileName, &inSt) != 0) {
+            fprintf(stderr, "ERROR: unable to find %s\n", inFileName);
+            pStats->failed++;
+            continue;
+        }
+        if (stat(outPath, &outSt) == 0 && outSt.st_mtime >= inSt.st_mtime) {
+            pStats->skipped++;
+            pStats->inBytes += inSt.st_size;
+            pStats->outBytes += outSt.st_size;
+            continue;
         }
 
-        if (outSize1 <= outSize2) {
-            printf("  using zeroed-out holes (%zd vs. %zd)\n",
-                outSize1, outSize2);
-            outSize = outSize1;
-            inBuf = inBuf1;
-            outBuf = outBuf1;
-        } else {
-            printf("  using filled-in holes (%zd vs. %zd)\n",
-                outSize2, outSize1);
-            outSize = outSize2;
-            inBuf = inBuf2;
-            outBuf = outBuf2;
+        CompressReport report;
+        snprintf(tmpPath, sizeof(tmpPath), "%s.tmp%d", outPath,
+            (int) getpid());
+        if (compressFile(tmpPath, inFileName, pPlan->doPreserveHoles,
+                pPlan->doMetaHeader, pPlan->parseMode, pPlan->formatFlags,
+                1, NULL, pBufs, &report) != 0 ||
+                rename(tmpPath, outPath) != 0) {
+            fprintf(stderr, "ERROR: failed on %s\n", inFileName);
+            unlink(tmpPath);
+            pStats->failed++;
+            continue;
         }
+        pStats->compressed++;
+        pStats->inBytes += report.inputSize;
+        pStats->outBytes += report.outputSize +
+            (pPlan->doMetaHeader ? META_HEADER_LEN : 0);
     }
+    pStats->secs = getTimeSecs() - startWhen;
+}
 
-    if (outSize == 0) {
-        fprintf(stderr, "Compression failed\n");
-        goto bail;
-    }
-    DBUG(("*** outSize is %zd\n", outSize));
+/*
+ * Works through the shards in the plan, claiming each one that isn't
+ * done or being worked on, until there aren't any left.  Shards with
+ * inputs that have changed since the plan was made are left alone.
+ *
+ * Returns the number of files that failed.
+ */
+static long shardWorker(const char* workDir, const ShardPlan* pPlan)
+{
+    char lockPath[PATH_MAX];
+    char host[64];
+    long numFailed = 0;
+    int numDone = 0;
 
-    // uncompress the data we just compressed
-    memset(verifyBuf, 0xcc, sizeof(verifyBuf));
-    uncompressedLen = uncompressBuffer(verifyBuf, outBuf, outSize);
-    if (uncompressedLen != sourceLen) {
-        fprintf(stderr, "ERROR: verify expanded %zd of expected %zd bytes\n",
-            uncompressedLen, sourceLen);
-        goto bail;
+    if (gethostname(host, sizeof(host)) != 0) {
+        strcpy(host, "localhost");
     }
-
-    // byte-for-byte comparison
-    for (size_t ii = 0; ii < sourceLen; ii++) {
-        if (inBuf[ii] != verifyBuf[ii]) {
-            fprintf(stderr,
-                "ERROR: expansion mismatch (byte %zd, 0x%02x 0x%02x)\n",
-                ii, inBuf[ii], verifyBuf[ii]);
-            goto bail;
-        }
+    host[sizeof(host) - 1] = '\0';
+    CompressBuffers* pBufs = allocCompressBuffers(pPlan->parseMode,
+            pPlan->formatFlags);
+    if (pBufs == NULL) {
+        return -1;
     }
-    DBUG(("Verification succeeded\n"));
 
-    if (outfp != NULL) {
-        /* write the data */
-        if (fwrite(outBuf, 1, outSize, outfp) != outSize) {
-            perror("Failed while writing data");
-            goto bail;
+    for (int shard = 0; shard < pPlan->numShards; shard++) {
+        ShardStats stats;
+        int numChanged = shardChangedInputs(pPlan, shard, false);
+        if (numChanged != 0) {
+            numFailed += numChanged;
+            continue;
         }
-    } else {
-        // must be in test mode
-        printf("  success -- compressed len is %zd\n", outSize);
+        if (getShardStats(workDir, shard, &stats)) {
+            continue;
+        }
+        shardFileName(lockPath, sizeof(lockPath), workDir, shard, ".lock");
+        int lockFd = open(lockPath, O_RDWR | O_CREAT, 0666);
+        if (lockFd < 0) {
+            perror("Unable to open lock file");
+            numFailed++;
+            break;
+        }
+        if (flock(lockFd, LOCK_EX | LOCK_NB) != 0) {
+            close(lockFd);                  // someone else has it
+            continue;
+        }
+        // It may have been finished while we were getting the lock.
+        if (!getShardStats(workDir, shard, &stats)) {
+            memset(&stats, 0, sizeof(stats));
+            snprintf(stats.worker, sizeof(stats.worker), "%s:%d", host,
+                (int) getpid());
+            compressShard(workDir, pPlan, shard, pBufs, &stats);
+            numFailed += stats.failed;
+            // A shard with failures is left to be retried.
+            if (stats.failed == 0 && putShardStats(workDir, shard, &stats) == 0) {
+                numDone++;
+            }
+        }
+        close(lockFd);                      // releases the lock
     }
 
-    result = 0;
+    DBUG(("worker %d finished %d shards\n", (int) getpid(), numDone));
+    freeCompressBuffers(pBufs);
+    return numFailed;
+}
 
-bail:
-    fclose(infp);
-    if (outfp != NULL) {
-        fclose(outfp);
+/*
+ * Prints the merged statistics of the shards that are done.
+ *
+ * Returns the number of shards that aren't.
+ */
+static int printShardTotals(const char* workDir, const ShardPlan* pPlan)
+{
+    ShardStats total;
+    int numDone = 0;
+
+    memset(&total, 0, sizeof(total));
+    printf("Sharded compression: %zd files in %d shards, %s\n",
+        pPlan->inFiles.size(), pPlan->numShards, workDir);
+    printf("  shard  files  new  skipped   in bytes  out bytes     secs"
+        "  worker\n");
+    for (int shard = 0; shard < pPlan->numShards; shard++) {
+        ShardStats stats;
+        if (!getShardStats(workDir, shard, &stats)) {
+            printf("  %5d  (not done)\n", shard);
+            continue;
+        }
+        if (shardChangedInputs(pPlan, shard, false) != 0) {
+            printf("  %5d  (inputs changed since the plan)\n", shard);
+            continue;
+        }
+        numDone++;
+        printf("  %5d  %5ld %4ld  %7ld  %9ld  %9ld  %7.3f  %s\n",
+            shard, stats.numFiles, stats.compressed, stats.skipped,
+            stats.inBytes, stats.outBytes, stats.secs, stats.worker);
+        total.numFiles += stats.numFiles;
+        total.compressed += stats.compressed;
+        total.skipped += stats.skipped;
+        total.inBytes += stats.inBytes;
+        total.outBytes += stats.outBytes;
+        total.secs += stats.secs;
     }
-    if (result != 0 && outFileName != NULL) {
-        unlink(outFileName);
+    printf("  total  %5ld %4ld  %7ld  %9ld  %9ld  %7.3f  (%.2f%%)\n",
+        total.numFiles, total.compressed, total.skipped, total.inBytes,
+        total.outBytes, total.secs,
+        total.inBytes == 0 ? 0.0 : total.outBytes * 100.0 / total.inBytes);
+    if (numDone != pPlan->numShards) {
+        printf("  %d of %d shards done\n", numDone, pPlan->numShards);
     }
-    return result;
+    return pPlan->numShards - numDone;
 }
 
 /*
- * Uncompress data from one file to another.
+ * Runs sharded compression in "workDir".  If files are given, the plan
+ * is written first, with "numShards" shards (0 picks a count).  Then
+ * "numWorkers" worker processes are started on this machine, and the
+ * merged totals are printed when they're finished.
  *
- * Returns 0 on success.
+ * Returns 0 if every shard is done.
  */
-int uncompressFile(const char* outFileName, const char* inFileName)
+static int runShards(const char* workDir, char* const* fileNames,
+    int numFiles, int numShards, int numWorkers, bool doPreserveHoles,
+    bool doMetaHeader, ParseMode parseMode, unsigned int formatFlags)
 {
-    int result = -1;
-    uint8_t inBuf[MAX_SIZE + MAX_EXPANSION];
-    uint8_t outBuf[MAX_SIZE];
-    size_t outSize;
-    FILE* outfp = NULL;
-    FILE* infp;
+    ShardPlan plan;
 
-    infp = fopen(inFileName, "rb");
-    if (infp == NULL) {
-        perror("Unable to open input file");
-        return -1;
+    if (numFiles > 0) {
+        plan.parseMode = parseMode;
+        plan.formatFlags = formatFlags;
+        plan.doPreserveHoles = doPreserveHoles;
+        plan.doMetaHeader = doMetaHeader;
+        if (numShards == 0) {
+            numShards = (numFiles + SHARD_FILES - 1) / SHARD_FILES;
+        }
+        plan.numShards = (numShards < numFiles) ? numShards : numFiles;
+        for (int i = 0; i < numFiles; i++) {
+            // other machines may be in other directories
+            char* absPath = realpath(fileNames[i], NULL);
+            long long size, mtime;
+            if (absPath == NULL || !statShardInput(absPath, &size, &mtime)) {
+                fprintf(stderr, "ERROR: unable to find %s\n", fileNames[i]);
+                free(absPath);
+                freeShardPlan(&plan);
+                return -1;
+            }
+            plan.inFiles.push_back(absPath);
+            plan.inSizes.push_back(size);
+            plan.inTimes.push_back(mtime);
+        }
+        int result = writeShardPlan(workDir, &plan);
+        freeShardPlan(&plan);
+        if (result != 0) {
+            return -1;
+        }
     }
-
-    outfp = fopen(outFileName, "wb");
-    if (outfp == NULL) {
-        perror("Unable to open output file");
-        fclose(infp);
+    if (!getShardPlan(workDir, &plan)) {
         return -1;
     }
 
-    fseek(infp, 0, SEEK_END);
-    long fileLen = ftell(infp);
-    rewind(infp);
-    if (fileLen < 10 || fileLen > MAX_SIZE + MAX_EXPANSION) {
-        // 10 just ensures we have enough for magic number, chunk, eod
-        fprintf(stderr, "ERROR: input file is %ld bytes, must be < %d\n",
-            fileLen, MAX_SIZE + MAX_EXPANSION);
-        goto bail;
-    }
-
-    // Read data into buffer.
-    if (fread(inBuf, 1, fileLen, infp) != (size_t) fileLen) {
-        perror("Failed while reading data");
-        goto bail;
-    }
-
-    outSize = uncompressBuffer(outBuf, inBuf, fileLen);
-    if (outSize == 0) {
-        goto bail;
+    // Report inputs that changed since the plan once, here, rather than
+    // from every worker.
+    for (int shard = 0; shard < plan.numShards; shard++) {
+        shardChangedInputs(&plan, shard, true);
     }
-    DBUG(("*** outSize is %zd\n", outSize));
 
-    /* write the data */
-    if (fwrite(outBuf, 1, outSize, outfp) != outSize) {
-        perror("Failed while writing data");
-        goto bail;
+    long numFailed = 0;
+    if (numWorkers <= 1) {
+        numFailed = shardWorker(workDir, &plan);
+    } else {
+        fflush(stdout);
+        std::vector<pid_t> pids;
+        for (int i = 0; i < numWorkers; i++) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                traceForked();
+                long childFailed = shardWorker(workDir, &plan);
+                if (gTraceEnabled) {
+                    traceWriteFragment();
+                }
+                _exit(childFailed == 0 ? 0 : 1);
+            } else if (pid < 0) {
+                perror("Unable to start worker");
+                break;
+            }
+            pids.push_back(pid);
+            traceAddChild(pid);
+        }
+        for (size_t i = 0; i < pids.size(); i++) {
+            int status;
+            if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) ||
+                    WEXITSTATUS(status) != 0) {
+                numFailed++;
+            }
+        }
     }
 
-    result = 0;
-
-bail:
-    fclose(infp);
-    fclose(outfp);
-    if (result != 0) {
-        unlink(outFileName);
-    }
-    return result;
+    int notDone = printShardTotals(workDir, &plan);
+    freeShardPlan(&plan);
+    return (numFailed == 0 && notDone == 0) ? 0 : -1;
 }
 
 /*
@@ -961,17 +6768,42 @@ int main(int argc, char* argv[])
 {
     ProgramMode mode = MODE_UNKNOWN;
     bool doPreserveHoles = false;
-    bool useGreedyParsing = false;
+    bool doMetaHeader = false;
+    ParseMode parseMode = PARSE_OPTIMAL;
+    bool haveLevel = false;
+    unsigned int formatFlags = 0;
+    ReportFormat reportFormat = REPORT_TEXT;
+    int numThreads = 0;
+    const DiskModel* pDisk = NULL;
+    double budgetSecs = 0.0;
+    double tuneBudgetSecs = 0.0;
+    int lookAhead = 0;
+    long cacheKB = 0;
+    const char* workDir = NULL;
+    int numShards = 0;
+    const char* traceFileName = NULL;
+    TuneOptions tune;
+    const TuneOptions* pTune = NULL;
     bool wantUsage = false;
     int opt;
 
-    while ((opt = getopt(argc, argv, "19cdth")) != -1) {
+    while ((opt = getopt(argc, argv, "019abcdfsthiklnopxe:g:j:m:q:r:u:v:w:y:z:")) != -1) {
         switch (opt) {
+        case '0':
+            parseMode = PARSE_FAST;
+            haveLevel = true;
+            break;
         case '1':
-            useGreedyParsing = true;
+            parseMode = PARSE_GREEDY;
+            haveLevel = true;
             break;
         case '9':
-            useGreedyParsing = false;
+            parseMode = PARSE_OPTIMAL;
+            haveLevel = true;
+            break;
+        case 'a':
+            parseMode = PARSE_DEVICE;
+            haveLevel = true;
             break;
         case 'c':
             if (mode == MODE_UNKNOWN) {
@@ -994,46 +6826,400 @@ int main(int argc, char* argv[])
                 wantUsage = true;
             }
             break;
+        case 'b':
+            if (mode == MODE_UNKNOWN) {
+                mode = MODE_BENCHMARK;
+            } else {
+                wantUsage = true;
+            }
+            break;
+        case 's':
+            if (mode == MODE_UNKNOWN) {
+                mode = MODE_SWEEP;
+            } else {
+                wantUsage = true;
+            }
+            break;
+        case 'm':
+            if (mode == MODE_UNKNOWN) {
+                mode = MODE_SIMULATE;
+            } else {
+                wantUsage = true;
+            }
+            pDisk = findDiskModel(optarg);
+            if (pDisk == NULL) {
+                wantUsage = true;
+            }
+            break;
+        case 'n':
+            if (mode == MODE_UNKNOWN) {
+                mode = MODE_INFO;
+            } else {
+                wantUsage = true;
+            }
+            break;
+        case 'e':
+            if (mode == MODE_UNKNOWN) {
+                mode = MODE_CHECK;
+            } else {
+                wantUsage = true;
+            }
+            budgetSecs = atof(optarg);
+            if (budgetSecs <= 0.0) {
+                wantUsage = true;
+            }
+            break;
+        case 'v':
+            if (mode == MODE_UNKNOWN) {
+                mode = MODE_VIEW;
+            } else {
+                wantUsage = true;
+            }
+            lookAhead = atoi(optarg);
+            if (lookAhead < 1) {
+                wantUsage = true;
+            }
+            break;
+        case 'q':
+            if (mode == MODE_UNKNOWN) {
+                mode = MODE_SHARD;
+            } else {
+                wantUsage = true;
+            }
+            workDir = optarg;
+            break;
+        case 'g':
+            numShards = atoi(optarg);
+            if (numShards < 1) {
+                wantUsage = true;
+            }
+            break;
+        case 'y':
+            traceFileName = optarg;
+            break;
+        case 'z':
+            cacheKB = atol(optarg);
+            if (cacheKB < 1) {
+                wantUsage = true;
+            }
+            break;
+        case 'u':
+            if (strcmp(optarg, "size") == 0) {
+                tune.goal = TUNE_SIZE;
+            } else if (strcmp(optarg, "time") == 0) {
+                tune.goal = TUNE_TIME;
+            } else {
+                wantUsage = true;
+            }
+            tune.budgetSecs = 0.0;
+            pTune = &tune;
+            break;
+        case 'w':
+            tuneBudgetSecs = atof(optarg);
+            if (tuneBudgetSecs <= 0.0) {
+                wantUsage = true;
+            }
+            break;
+        case 'j':
+            numThreads = atoi(optarg);
+            if (numThreads < 1) {
+                wantUsage = true;
+            }
+            break;
         case 'h':
             doPreserveHoles = true;
             break;
+        case 'i':
+            doMetaHeader = true;
+            break;
+        case 'o':
+            formatFlags |= FLAG_REPOFF;
+            break;
+        case 'l':
+            formatFlags |= FLAG_PLANES;
+            break;
+        case 'x':
+            formatFlags |= FLAG_XOR;
+            break;
+        case 'k':
+            formatFlags |= FLAG_STRIDE;
+            break;
+        case 'p':
+            formatFlags |= FLAG_ROWS;
+            break;
+        case 'f':
+            formatFlags |= OPT_SHORT_TOKENS;
+            break;
+        case 'r':
+            if (strcmp(optarg, "json") == 0) {
+                reportFormat = REPORT_JSON;
+            } else if (strcmp(optarg, "csv") == 0) {
+                reportFormat = REPORT_CSV;
+            } else {
+                wantUsage = true;
+            }
+            break;
         default:
             usage(argv[0]);
             return 2;
         }
     }
 
-    if (argc - optind < 1 ||
-        (mode != MODE_TEST && argc - optind != 2))
+    if ((argc - optind < 1 && mode != MODE_SHARD) ||
+        (mode != MODE_TEST && mode != MODE_BENCHMARK && mode != MODE_SWEEP &&
+         mode != MODE_SIMULATE && mode != MODE_CHECK && mode != MODE_INFO &&
+         mode != MODE_VIEW && mode != MODE_SHARD &&
+         argc - optind != 2))
     {
         wantUsage = true;
     }
 
+    if ((formatFlags & FLAG_ROWS) != 0 &&
+            (doPreserveHoles || parseMode == PARSE_DEVICE ||
+             parseMode == PARSE_FAST)) {
+        // row order never stores the holes, and the hash-based
+        // parsers only do memory order
+        wantUsage = true;
+    }
+    if ((formatFlags & FLAG_PLANES) != 0 &&
+            ((formatFlags & FLAG_ROWS) != 0 || parseMode == PARSE_DEVICE)) {
+        // row order has its own compressor, and the Apple II encoder
+        // doesn't split planes
+        wantUsage = true;
+    }
+    if ((formatFlags & HI_FIRST_FLAGS) != 0 &&
+            (parseMode != PARSE_OPTIMAL || (formatFlags & FLAG_ROWS) != 0)) {
+        // only the optimal parser knows how to use them
+        wantUsage = true;
+    }
+    if ((formatFlags & OPT_SHORT_TOKENS) != 0 &&
+            (formatFlags & KNOWN_FLAGS) != 0) {
+        // the streaming decoder only handles version 1
+        wantUsage = true;
+    }
+    if (reportFormat != REPORT_TEXT &&
+            mode != MODE_TEST && mode != MODE_BENCHMARK &&
+            mode != MODE_SWEEP && mode != MODE_SIMULATE) {
+        wantUsage = true;
+    }
+    if (doMetaHeader && mode != MODE_COMPRESS && mode != MODE_SHARD) {
+        wantUsage = true;
+    }
+    if (pTune != NULL) {
+        if ((mode != MODE_COMPRESS && mode != MODE_TEST) ||
+                reportFormat != REPORT_TEXT) {
+            wantUsage = true;
+        }
+        tune.budgetSecs = tuneBudgetSecs;
+    } else if (tuneBudgetSecs != 0.0) {
+        wantUsage = true;
+    }
+    if (mode == MODE_CHECK && (formatFlags != 0 || numThreads != 0)) {
+        // the check picks its own parsers, and runs them one at a time
+        wantUsage = true;
+    }
+    if (mode == MODE_VIEW) {
+        // the files are already compressed
+        if (formatFlags != 0 || numThreads != 0 || doPreserveHoles) {
+            wantUsage = true;
+        }
+        if (cacheKB == 0) {
+            cacheKB = VIEW_CACHE_KB;
+        }
+    } else if (cacheKB != 0) {
+        wantUsage = true;
+    }
+    if (mode == MODE_SHARD) {
+        // without files, the plan is already in the work directory, and
+        // its options are the ones that apply
+        if (argc == optind && (numShards != 0 || formatFlags != 0 ||
+                doPreserveHoles || doMetaHeader || haveLevel)) {
+            fprintf(stderr, "ERROR: joining a plan takes its options; "
+                "give -g, -0/-1/-9/-a, and the format\n"
+                "options only with the input files\n");
+            wantUsage = true;
+        }
+    } else if (numShards != 0) {
+        wantUsage = true;
+    }
+
+    if (traceFileName != NULL && mode != MODE_COMPRESS &&
+            mode != MODE_TEST && mode != MODE_SHARD) {
+        // the other modes aren't batch runs
+        wantUsage = true;
+    }
+
     if (mode == MODE_UNKNOWN || wantUsage) {
         usage(argv[0]);
         return 2;
     }
 
-    const char* inFileName = argv[optind];
-    const char* outFileName = argv[optind+1];
-
+    int numFiles = argc - optind;
     int result = 0;
+    if (mode == MODE_INFO) {
+        result = showMetaHeaders(argv + optind, numFiles);
+        return (result != 0);
+    }
+    if (traceFileName != NULL) {
+        traceStart(traceFileName);
+    }
+    if (mode == MODE_SHARD) {
+        result = runShards(workDir, argv + optind, numFiles, numShards,
+                numThreads, doPreserveHoles, doMetaHeader, parseMode,
+                formatFlags);
+        result |= traceFinish();
+        return (result != 0);
+    }
+    if (mode == MODE_VIEW) {
+        result = runViewer(argv + optind, numFiles, lookAhead,
+                cacheKB * 1024);
+        return (result != 0);
+    }
+    if (mode == MODE_CHECK) {
+#ifdef FHPACK_COUNT_OPS
+        result = runEngineCheck(argv + optind, numFiles, doPreserveHoles,
+                budgetSecs);
+#else
+        fprintf(stderr, "ERROR: -e needs fhpack built with "
+            "-DFHPACK_COUNT_OPS\n");
+        result = -1;
+#endif
+        return (result != 0);
+    }
+    if (mode == MODE_BENCHMARK) {
+        if (numThreads == 0) {
+            numThreads = std::thread::hardware_concurrency();
+            if (numThreads == 0) {
+                numThreads = 1;
+            }
+        }
+        result = runBenchmark(argv + optind, numFiles, numThreads,
+                doPreserveHoles, parseMode, formatFlags, reportFormat);
+        return (result != 0);
+    }
+    if (numThreads == 0) {
+        numThreads = 1;
+    }
+    if (mode == MODE_SWEEP) {
+        result = runSweep(argv + optind, numFiles, numThreads,
+                doPreserveHoles, reportFormat);
+        return (result != 0);
+    }
+    if (mode == MODE_SIMULATE) {
+        result = runSimulation(argv + optind, numFiles, numThreads,
+                doPreserveHoles, pDisk, reportFormat);
+        return (result != 0);
+    }
+
+    // Buffers for the serial paths.  Batch workers allocate their own.
+    CompressBuffers* pBufs = NULL;
+    if (mode == MODE_COMPRESS || (mode == MODE_TEST && numThreads == 1) ||
+            numFiles == 1 || pTune != NULL) {
+        // the tuner's winner can be any level
+        pBufs = allocCompressBuffers(pTune != NULL ? PARSE_OPTIMAL : parseMode,
+                formatFlags);
+        if (pBufs == NULL) {
+            return 1;
+        }
+    }
+
     if (mode == MODE_COMPRESS) {
+        const char* inFileName = argv[optind];
+        const char* outFileName = argv[optind+1];
         printf("Compressing %s -> %s\n", inFileName, outFileName);
         result = compressFile(outFileName, inFileName, doPreserveHoles,
-                useGreedyParsing);
+                doMetaHeader, parseMode, formatFlags, numThreads, pTune,
+                pBufs, NULL);
     } else if (mode == MODE_UNCOMPRESS) {
+        const char* inFileName = argv[optind];
+        const char* outFileName = argv[optind+1];
         printf("Expanding %s -> %s\n", inFileName, outFileName);
         result = uncompressFile(outFileName, inFileName);
-    } else {
+    } else if (pTune != NULL) {
+        // The tuner's threads work on one image at a time.  Keep track
+        // of which settings win, so a preset can be picked for the set.
+        std::vector<TuneTally> tally;
+        while (optind < argc) {
+            CompressReport report;
+            memset(&report, 0, sizeof(report));
+            report.holes = "none";
+            printf("Tuning %s\n", argv[optind]);
+            int fileResult = compressFile(NULL, argv[optind],
+                    doPreserveHoles, false, parseMode, formatFlags,
+                    numThreads, pTune, pBufs, &report);
+            if (fileResult == 0) {
+                printTuneChoice(&report);
+                addTuneTally(&tally, &report);
+            }
+            result |= fileResult;
+            optind++;
+        }
+        printTuneTally(tally);
+    } else if (numThreads > 1 && numFiles > 1) {
+        // Compress the files in parallel, one per thread, then report
+        // the results in order.
+        const char* level = parseModeName(parseMode);
+        const char* order = (formatFlags & FLAG_ROWS) ? "rows" : "memory";
+        std::vector<CompressReport> reports(numFiles);
+        std::vector<int> results(numFiles);
+        std::atomic<int> next(0);
+        std::vector<std::thread> workers;
+        for (int i = 0; i < numFiles; i++) {
+            memset(&reports[i], 0, sizeof(CompressReport));
+            reports[i].holes = "none";
+        }
+        for (int t = 0; t < numThreads && t < numFiles; t++) {
+            workers.push_back(std::thread(batchWorker, argv + optind,
+                    numFiles, &next, doPreserveHoles, parseMode, formatFlags,
+                    &reports[0], &results[0]));
+        }
+        for (size_t t = 0; t < workers.size(); t++) {
+            workers[t].join();
+        }
+
+        ReportTotals totals;
+        memset(&totals, 0, sizeof(totals));
+        printReportHeader(reportFormat);
+        for (int i = 0; i < numFiles; i++) {
+            result |= results[i];
+            printReportFile(reportFormat, argv[optind + i], level, order,
+                &reports[i], &totals);
+        }
+        printReportTotals(reportFormat, &totals);
+    } else if (reportFormat == REPORT_TEXT) {
         while (optind < argc) {
             printf("Testing %s\n", argv[optind]);
             result |= compressFile(NULL, argv[optind], doPreserveHoles,
-                    useGreedyParsing);
+                    false, parseMode, formatFlags, numThreads, NULL, pBufs,
+                    NULL);
             optind++;
         }
+    } else {
+        const char* level = parseModeName(parseMode);
+        const char* order = (formatFlags & FLAG_ROWS) ? "rows" : "memory";
+        ReportTotals totals;
+        memset(&totals, 0, sizeof(totals));
+
+        printReportHeader(reportFormat);
+        while (optind < argc) {
+            CompressReport report;
+            memset(&report, 0, sizeof(report));
+            report.holes = "none";
+            result |= compressFile(NULL, argv[optind], doPreserveHoles,
+                    false, parseMode, formatFlags, numThreads, NULL, pBufs,
+                    &report);
+            printReportFile(reportFormat, argv[optind], level, order,
+                &report, &totals);
+            optind++;
+        }
+        printReportTotals(reportFormat, &totals);
     }
 
+    if (pBufs != NULL) {
+        DBUG(("Arena peak: %zd bytes\n", compressArenaPeak(pBufs)));
+    }
+    freeCompressBuffers(pBufs);
+    result |= traceFinish();
     return (result != 0);
 }
-
+#endif /*FHPACK_NO_MAIN*/
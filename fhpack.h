@@ -0,0 +1,126 @@
+/*
+ * fhpack, an Apple II hi-res picture compressor.
+ * Interface for embedding the compressor in another program.
+ *
+ * Copyright 2026 by the fhpack contributors.
+ * See the LICENSE.txt file for distribution terms (Apache 2.0).
+ *
+ * Build fhpack.cpp with -DFHPACK_NO_MAIN to leave out the command-line
+ * tool, and link it with the program:
+ *   g++ -O2 -pthread -DFHPACK_NO_MAIN myserver.cpp fhpack.cpp
+ * Use -std=c++20 to get the co_await interface.
+ */
+#ifndef FHPACK_H
+#define FHPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <vector>
+#endif
+
+enum ParseMode {
+    PARSE_OPTIMAL, PARSE_GREEDY, PARSE_DEVICE, PARSE_FAST
+};
+
+#define FLAG_ROWS           0x01            // top-down row order
+#define FLAG_REPOFF         0x02            // repeat-offset matches
+#define FLAG_STRIDE         0x04            // implicit stride matches
+#define FLAG_XOR            0x08            // high-bit-flipped matches
+#define FLAG_PLANES         0x10            // palette/pixel bit planes
+
+/*
+ * Asynchronous compression, for a server built around an event loop.
+ *
+ * Jobs are submitted from the loop's thread, and compressed or expanded
+ * on a fixed set of executor threads.  The number of threads is the
+ * concurrency limit: jobs past it wait in a queue, so any number can be
+ * outstanding without a thread each.  Files are read when a job is
+ * submitted and written when it completes, both on the loop's thread,
+ * so the executor only does CPU work.
+ *
+ * When a job finishes, a byte is written to a pipe.  The loop watches
+ * asyncWakeFd() with poll() or the like, and calls asyncRunCompletions(),
+ * which calls each finished job's callback on the loop's thread.  The
+ * job is freed when its callback returns.
+ *
+ * With C++20 coroutines, "co_await asyncCompress(...)" does the same
+ * thing, resuming the coroutine from asyncRunCompletions().
+ */
+
+enum AsyncStatus { ASYNC_OK, ASYNC_FAILED, ASYNC_CANCELLED };
+
+/*
+ * Compression settings for a job; the same as the command-line options.
+ */
+struct AsyncOptions {
+    ParseMode parseMode;
+    unsigned int formatFlags;
+    bool doPreserveHoles;
+    bool doMetaHeader;
+};
+
+struct AsyncExecutor;
+struct AsyncJob;
+typedef void (*AsyncDoneFunc)(AsyncJob* pJob, void* userData);
+
+AsyncExecutor* asyncStart(int numThreads);
+int asyncWakeFd(const AsyncExecutor* pExec);
+int asyncRunCompletions(AsyncExecutor* pExec);
+bool asyncCancel(AsyncExecutor* pExec, AsyncJob* pJob);
+void asyncStop(AsyncExecutor* pExec);
+
+AsyncStatus asyncJobStatus(const AsyncJob* pJob);
+const uint8_t* asyncJobOutput(const AsyncJob* pJob, size_t* pLen);
+
+AsyncJob* asyncCompressBuffer(AsyncExecutor* pExec, const uint8_t* inBuf,
+    size_t inLen, const AsyncOptions* pOpts, AsyncDoneFunc doneFunc,
+    void* userData);
+AsyncJob* asyncDecompressBuffer(AsyncExecutor* pExec, const uint8_t* inBuf,
+    size_t inLen, AsyncDoneFunc doneFunc, void* userData);
+AsyncJob* asyncCompressFile(AsyncExecutor* pExec, const char* inFileName,
+    const char* outFileName, const AsyncOptions* pOpts,
+    AsyncDoneFunc doneFunc, void* userData);
+AsyncJob* asyncDecompressFile(AsyncExecutor* pExec, const char* inFileName,
+    const char* outFileName, AsyncDoneFunc doneFunc, void* userData);
+
+#if defined(__cpp_impl_coroutine)
+/*
+ * What a co_await on a job produces.
+ */
+struct AsyncResult {
+    AsyncStatus status;
+    std::vector<uint8_t> data;
+};
+
+/*
+ * Awaitable job.  The job is submitted when the coroutine suspends, and
+ * the coroutine is resumed from asyncRunCompletions().  To cancel it,
+ * hold on to the awaitable and pass "pJob" to asyncCancel() while the
+ * coroutine is suspended.
+ */
+struct AsyncAwaitable {
+    AsyncExecutor* pExec;
+    AsyncJob* pJob;             // NULL if it couldn't be created
+    AsyncResult result;
+    std::coroutine_handle<> handle;
+
+    bool await_ready() const { return pJob == NULL; }
+    void await_suspend(std::coroutine_handle<> h);
+    AsyncResult await_resume();
+
+    static void resume(AsyncJob* pJob, void* userData);
+};
+
+AsyncAwaitable asyncCompress(AsyncExecutor* pExec, const uint8_t* inBuf,
+    size_t inLen, const AsyncOptions* pOpts);
+AsyncAwaitable asyncDecompress(AsyncExecutor* pExec, const uint8_t* inBuf,
+    size_t inLen);
+AsyncAwaitable asyncCompress(AsyncExecutor* pExec, const char* inFileName,
+    const char* outFileName, const AsyncOptions* pOpts);
+AsyncAwaitable asyncDecompress(AsyncExecutor* pExec, const char* inFileName,
+    const char* outFileName);
+#endif /*__cpp_impl_coroutine*/
+
+#endif /*FHPACK_H*/
@@ -0,0 +1,390 @@
+/*
+ * Generate a speed-optimized LZ4FH decoder for the 6502.
+ * By the fhpack contributors
+ * Version 1.0, October 2026
+ *
+ * Copyright 2026 by the fhpack contributors.
+ * See the LICENSE.txt file for distribution terms (Apache 2.0).
+ */
+/*
+ * The shipped decoders copy one byte per trip through a short loop,
+ * which costs 16 cycles per literal byte and 18 per match byte.  This
+ * writes Merlin source for a decoder that trades about 1.1KB of memory
+ * for speed:
+ *
+ *  - The literal and match copies are separate blocks of "lda (zp),y /
+ *    sta (dstptr),y / iny", unrolled N times, so a byte costs 13 cycles.
+ *  - Copies enter the block partway through, Duff's-device style.  The
+ *    JMP operand is patched from a table indexed by length, and another
+ *    table holds the number of passes, so there's no per-length math.
+ *  - The match block starts exactly one page after the literal block,
+ *    so the two can share the low bytes of their entry tables.
+ *  - The destination page ORed into match offsets is patched into the
+ *    code on entry, as in the other decoders.
+ *
+ * Like LZ4FH6502.SMA.S, it handles version 1 files, plus version 2
+ * files that use only the row order flag.  It takes the same parameters
+ * at $02FC/$02FE.
+ *
+ * The output is what fhemu runs; LZ4FH6502.FAST.S was generated with
+ * the default settings.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#define DEFAULT_UNROLL  24
+#define MAX_UNROLL      40          // literal block must fit in one page
+#define DEFAULT_ORG     0x8c00
+#define COPY_INSN_LEN   5           // lda (zp),y / sta (zp),y / iny
+#define MAX_BRANCH      127
+
+/*
+ * Writes a table of 256 entries, 8 per line.  The entry for length
+ * "len" is the block entry point, or the pass count when "label" is
+ * NULL.  "prefix" selects the low or high byte of an address.
+ */
+static void writeTable(FILE* fp, const char* name, const char* label,
+    char prefix, int unroll)
+{
+    fprintf(fp, "%-8s", name);
+    for (int len = 0; len < 256; len++) {
+        int skip = (unroll - len % unroll) % unroll;
+        if (len % 8 == 0) {
+            fprintf(fp, "%s dfb   ", len == 0 ? "" : "        ");
+        } else {
+            putc(',', fp);
+        }
+        if (label == NULL) {
+            fprintf(fp, "%d", (len + unroll - 1) / unroll);
+        } else {
+            fprintf(fp, "%c%s+%d", prefix, label, skip * COPY_INSN_LEN);
+        }
+        if (len % 8 == 7) {
+            putc('\n', fp);
+        }
+    }
+}
+
+/*
+ * Writes an unrolled copy block that reads from "srcReg".  The block
+ * ends with the pass counter; if the block is too long for a branch to
+ * reach the top, we use a JMP.
+ */
+static void writeCopyBlock(FILE* fp, const char* label, const char* srcReg,
+    int unroll)
+{
+    fprintf(fp, "%s\n", label);
+    for (int i = 0; i < unroll; i++) {
+        fprintf(fp, "         lda   (%s),y\n", srcReg);
+        fprintf(fp, "         sta   (dstptr),y\n");
+        fprintf(fp, "         iny\n");
+    }
+    fprintf(fp, "         dex\n");
+    if (unroll * COPY_INSN_LEN + 3 <= MAX_BRANCH) {
+        fprintf(fp, "         bne   %s\n", label);
+    } else {
+        fprintf(fp, "         beq   :done\n");
+        fprintf(fp, "         jmp   %s\n", label);
+        fprintf(fp, ":done\n");
+    }
+}
+
+/*
+ * Writes the decoder source.
+ */
+static void writeDecoder(FILE* fp, int unroll, int org)
+{
+    fprintf(fp,
+"********************************\n"
+"*                              *\n"
+"* LZ4FH uncompression for 6502 *\n"
+"* By the fhpack contributors   *\n"
+"* Version 1.0, October 2026    *\n"
+"*                              *\n"
+"* Generated by                 *\n"
+"* make-fast-decoder -u %-3d     *\n"
+"* Edit the generator, not      *\n"
+"* this file.                   *\n"
+"*                              *\n"
+"* Developed with Merlin-16     *\n"
+"*                              *\n"
+"********************************\n", unroll);
+    fprintf(fp,
+"         lst   off\n"
+"         org   $%04X\n"
+"\n"
+"*\n"
+"* Constants\n"
+"*\n"
+"lz4fh_magic equ $66       ;ascii 'f'\n"
+"lz4fh_magic2 equ $67      ;ascii 'g'\n"
+"lz4fh_meta equ $68        ;metadata header, skipped\n"
+"flag_rows equ  $01\n"
+"tok_empty equ  253\n"
+"tok_eod  equ   254\n"
+"tok_setdst equ 252\n"
+"\n"
+"*\n"
+"* Variable storage\n"
+"*\n"
+"srcptr   equ   $3c        ;2b a1l\n"
+"dstptr   equ   $3e        ;2b a1h\n"
+"copyptr  equ   $00        ;2b\n"
+"savmix   equ   $02        ;1b\n"
+"\n"
+"*\n"
+"* ROM routines\n"
+"*\n"
+"bell     equ   $ff3a\n"
+"monitor  equ   $ff69\n"
+"\n"
+"*\n"
+"* Parameters, same as the other decoders.  in_dst must\n"
+"* be a multiple of the image size.\n"
+"*\n"
+"in_src   equ   $2fc       ;2b\n"
+"in_dst   equ   $2fe       ;2b\n"
+"\n", org);
+
+    fprintf(fp,
+"entry\n"
+"         lda   in_src     ;copy source address to zero page\n"
+"         sta   srcptr\n"
+"         lda   in_src+1\n"
+"         sta   srcptr+1\n"
+"         lda   in_dst     ;copy destination address to zero page\n"
+"         sta   dstptr\n"
+"         lda   in_dst+1\n"
+"         sta   dstptr+1\n"
+"         sta   _desthi+1\n"
+"         sta   _setdhi+1\n"
+"\n"
+"* Skip the metadata header, if there is one (\"fhpack -i\").\n"
+"         ldy   #$00\n"
+"         lda   (srcptr),y\n"
+"         cmp   #lz4fh_meta ;metadata header?\n"
+"         bne   :nometa\n"
+"         iny\n"
+"         lda   (srcptr),y ;length of the rest of it\n"
+"         sec              ;+1 for the length byte\n"
+"         adc   srcptr\n"
+"         sta   srcptr\n"
+"         bcc   :meta0\n"
+"         inc   srcptr+1\n"
+":meta0   inc   srcptr     ;+1 for its magic\n"
+"         bne   :meta1\n"
+"         inc   srcptr+1\n"
+":meta1   dey\n"
+"         lda   (srcptr),y ;the real magic\n"
+":nometa\n"
+"         cmp   #lz4fh_magic ;does magic match?\n"
+"         beq   goodmagic\n"
+"         cmp   #lz4fh_magic2\n"
+"         bne   fail\n"
+"         iny\n"
+"         lda   (srcptr),y ;only the row order flag is allowed\n"
+"         and   #$ff-flag_rows\n"
+"         bne   fail\n"
+"         inc   srcptr     ;skip the magic; goodmagic skips flags\n"
+"         bne   goodmagic\n"
+"         inc   srcptr+1\n"
+"goodmagic\n"
+"         inc   srcptr\n"
+"         bne   mainloop\n"
+"         inc   srcptr+1\n"
+"         bne   mainloop   ;(always)\n"
+"\n"
+"fail\n"
+"         jsr   bell\n"
+"         jmp   monitor\n"
+"\n"
+"* handle \"special\" match values (value in A)\n"
+"specialmatch\n"
+"         cmp   #tok_empty\n"
+"         beq   advsrc\n"
+"         cmp   #tok_eod\n"
+"         bne   :notend\n"
+"         rts              ;success!\n"
+":notend\n"
+"         cmp   #tok_setdst\n"
+"         bne   fail\n"
+"         iny              ;new output address follows\n"
+"         lda   (srcptr),y\n"
+"         sta   dstptr\n"
+"         iny\n"
+"         lda   (srcptr),y\n"
+"_setdhi  ora   #$00\n"
+"         sta   dstptr+1\n"
+"advsrc\n"
+"         tya              ;advance srcptr past the token\n"
+"         sec\n"
+"         adc   srcptr\n"
+"         sta   srcptr\n"
+"         bcc   mainloop\n"
+"         inc   srcptr+1\n"
+"         bne   mainloop   ;(always)\n"
+"\n"
+"* Returns here from the match block with Y=length.\n"
+"matdone\n"
+"         tya              ;advance dstptr\n"
+"         clc\n"
+"         adc   dstptr\n"
+"         sta   dstptr\n"
+"         bcc   mainloop\n"
+"         inc   dstptr+1\n"
+"\n"
+"* Y always indexes the last byte consumed from srcptr,\n"
+"* so the next one is read with \"iny / lda (srcptr),y\".\n"
+"mainloop\n"
+"         ldy   #$00\n"
+"         lda   (srcptr),y ;get mixed-length byte\n"
+"         sta   savmix\n"
+"         lsr   A          ;get the literal length\n"
+"         lsr   A\n"
+"         lsr   A\n"
+"         lsr   A\n"
+"         beq   noliteral\n"
+"         cmp   #$0f       ;sets carry for >= 15\n"
+"         bne   shortlit\n"
+"         iny\n"
+"         lda   (srcptr),y ;get length extension\n"
+"         adc   #14        ;(carry set) add 15 - will not exceed 255\n"
+"shortlit\n"
+"         tax              ;advance srcptr to the literals\n"
+"         tya\n"
+"         sec\n"
+"         adc   srcptr\n"
+"         sta   srcptr\n"
+"         bcc   :nohi\n"
+"         inc   srcptr+1\n"
+":nohi\n"
+"         lda   entlo,x    ;patch the block entry point\n"
+"         sta   _litjmp+1\n"
+"         lda   passes,x\n"
+"         tax\n"
+"         ldy   #$00\n"
+"_litjmp  jmp   litblk\n"
+"\n"
+"tospecial\n"
+"         jmp   specialmatch ;too far for a branch\n"
+"\n"
+"* Returns here from the literal block with Y=length.\n"
+"litdone\n"
+"         tya              ;advance srcptr and dstptr\n"
+"         clc\n"
+"         adc   srcptr\n"
+"         sta   srcptr\n"
+"         bcc   :nohi1\n"
+"         inc   srcptr+1\n"
+"         clc\n"
+":nohi1\n"
+"         tya\n"
+"         adc   dstptr\n"
+"         sta   dstptr\n"
+"         bcc   :nohi2\n"
+"         inc   dstptr+1\n"
+":nohi2\n"
+"         ldy   #$ff       ;next byte is at srcptr+0\n"
+"\n"
+"noliteral\n"
+"         lda   savmix\n"
+"         and   #$0f\n"
+"         cmp   #$0f\n"
+"         bcc   shortmatch ;(carry clear)\n"
+"         iny\n"
+"         lda   (srcptr),y ;get length extension\n"
+"         cmp   #237       ;\"special\" values are 237+\n"
+"         bcs   tospecial\n"
+"         adc   #15        ;(carry clear) add 15\n"
+"shortmatch\n"
+"         adc   #4         ;min match; won't exceed 255\n"
+"         tax\n"
+"         iny\n"
+"         lda   (srcptr),y ;get match offset\n"
+"         sta   copyptr\n"
+"         iny\n"
+"         lda   (srcptr),y\n"
+"_desthi  ora   #$00       ;OR in hi-res page\n"
+"         sta   copyptr+1\n"
+"         tya              ;advance srcptr past the match\n"
+"         sec\n"
+"         adc   srcptr\n"
+"         sta   srcptr\n"
+"         bcc   :nohi\n"
+"         inc   srcptr+1\n"
+":nohi\n"
+"         lda   entlo,x    ;patch the block entry point\n"
+"         sta   _matjmp+1\n"
+"         lda   passes,x\n"
+"         tax\n"
+"         ldy   #$00\n"
+"_matjmp  jmp   matblk\n"
+"\n"
+"* The copy blocks are page-aligned, and each fits in a\n"
+"* page, so only the low byte of the entry point needs to\n"
+"* be patched.  The match block starts one page after the\n"
+"* literal block, so both can use the same table.\n"
+"         ds    256-*&255\n");
+
+    writeCopyBlock(fp, "litblk", "srcptr", unroll);
+    fprintf(fp, "         jmp   litdone\n");
+    fprintf(fp, "         ds    litblk+256-*\n");
+    writeCopyBlock(fp, "matblk", "copyptr", unroll);
+    fprintf(fp, "         jmp   matdone\n");
+
+    fprintf(fp, "\n* Block entry points (low byte) and pass counts, indexed\n"
+        "* by length.\n");
+    writeTable(fp, "entlo", "litblk", '<', unroll);
+    writeTable(fp, "passes", NULL, '\0', unroll);
+    fprintf(fp, "\n         lst   on\n");
+    fprintf(fp, "         sav   LZ4FH6502.FAST\n");
+}
+
+/*
+ * Print usage info.
+ */
+static void usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [-u unroll] [-o org] outfile.S\n", argv0);
+    fprintf(stderr, " -u: copy loop unroll count, 1-%d (default %d)\n",
+        MAX_UNROLL, DEFAULT_UNROLL);
+    fprintf(stderr, " -o: origin address, in hex (default %04X)\n",
+        DEFAULT_ORG);
+}
+
+int main(int argc, char** argv)
+{
+    int unroll = DEFAULT_UNROLL;
+    int org = DEFAULT_ORG;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:o:")) != -1) {
+        switch (opt) {
+        case 'u':
+            unroll = atoi(optarg);
+            break;
+        case 'o':
+            org = (int) strtol(optarg, NULL, 16);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (argc - optind != 1 || unroll < 1 || unroll > MAX_UNROLL ||
+            org <= 0 || org > 0xffff) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    FILE* fp = fopen(argv[optind], "w");
+    if (fp == NULL) {
+        perror("Unable to create output file");
+        return 1;
+    }
+    writeDecoder(fp, unroll, org);
+    fclose(fp);
+    return 0;
+}
@@ -15,6 +15,9 @@ const char* TEST_ALL_ZERO = "allzero#060000";
 const char* TEST_ALL_GREEN = "allgreen#060000";
 const char* TEST_NO_MATCH = "nomatch#060000";
 const char* TEST_HALF_HALF = "halfhalf#060000";
+const char* TEST_NEAR_MATCH = "nearmatch#060000";
+const char* TEST_NEAR_XOR = "nearxor#060000";
+const char* TEST_DE_BRUIJN = "debruijn#060000";
 
 // Generates a pattern that foils the matcher.
 static void WriteNoMatch(FILE* fp)
@@ -83,6 +86,70 @@ static void WriteNoMatch(FILE* fp)
     }
 }
 
+// Generates long near-matches everywhere: a zero background with a
+// unique marker every 255 bytes.  Every earlier position matches for up
+// to a couple hundred bytes, but never reaches the longest match length,
+// so the brute-force search can't stop early.  Markers that would land
+// in a screen hole are moved past it, so zeroing the holes doesn't
+// remove them.  With "xorHalf" set, the second half has the high bits
+// set, so that high-bit-flipped matches look just as promising.
+static void WriteNearMatch(FILE* fp, bool xorHalf)
+{
+    uint8_t buf[8192] = { 0 };
+    int marker = 1;
+
+    for (int i = 0; i < 8192; i += 255) {
+        int pos = i;
+        if ((pos & 0x7f) >= 120) {
+            pos = (pos | 0x7f) + 1;
+        }
+        if (pos < 8192) {
+            buf[pos] = marker++;
+        }
+    }
+    if (xorHalf) {
+        for (int i = 4096; i < 8192; i++) {
+            buf[i] |= 0x80;
+        }
+    }
+    fwrite(buf, 1, sizeof(buf), fp);
+}
+
+// Generates the start of a de Bruijn sequence with 4-byte windows over a
+// 10-symbol alphabet.  No 4-byte string appears twice, so there are no
+// matches at all, and every parser has to look at every candidate.
+static void WriteDeBruijn(FILE* fp)
+{
+    const int kAlpha = 10;
+    const int kWindow = 4;
+    int a[kWindow + 1] = { 0 };
+    int count = 0;
+
+    // Lyndon word generation (Fredricksen, Kessler, Maiorana): emit
+    // each Lyndon word whose length divides the window, in order.
+    int t = 1;
+    while (count < 8192) {
+        if (kWindow % t == 0) {
+            for (int j = 1; j <= t && count < 8192; j++) {
+                putc('0' + a[j], fp);
+                count++;
+            }
+        }
+        // advance to the next prenecklace
+        t = kWindow;
+        while (t > 0 && a[t] == kAlpha - 1) {
+            t--;
+        }
+        if (t == 0) {
+            break;
+        }
+        a[t]++;
+        for (int j = t + 1; j <= kWindow; j++) {
+            a[j] = a[j - t];
+        }
+    }
+}
+
 int main()
 {
     FILE* fp;
@@ -128,6 +195,30 @@ int main()
         truncate(TEST_HALF_HALF, 8192);
     }
 
+    if (access(TEST_NEAR_MATCH, F_OK) == 0) {
+        printf("NOT overwriting %s\n", TEST_NEAR_MATCH);
+    } else {
+        fp = fopen(TEST_NEAR_MATCH, "w");
+        WriteNearMatch(fp, false);
+        fclose(fp);
+    }
+
+    if (access(TEST_NEAR_XOR, F_OK) == 0) {
+        printf("NOT overwriting %s\n", TEST_NEAR_XOR);
+    } else {
+        fp = fopen(TEST_NEAR_XOR, "w");
+        WriteNearMatch(fp, true);
+        fclose(fp);
+    }
+
+    if (access(TEST_DE_BRUIJN, F_OK) == 0) {
+        printf("NOT overwriting %s\n", TEST_DE_BRUIJN);
+    } else {
+        fp = fopen(TEST_DE_BRUIJN, "w");
+        WriteDeBruijn(fp);
+        fclose(fp);
+    }
+
 
     return 0;
 }
@@ -0,0 +1,344 @@
+/*
+ * Tests for the fhpack asynchronous interface.
+ *
+ * Copyright 2026 by the fhpack contributors.
+ * See the LICENSE.txt file for distribution terms (Apache 2.0).
+ *
+ * Build with fhpack.cpp, leaving out its main():
+ *   g++ -std=c++20 -O2 -pthread -DFHPACK_NO_MAIN test-async.cpp fhpack.cpp \
+ *     -o test-async
+ * Without -std=c++20, the co_await test is skipped.  Exits with 0 if
+ * everything passed.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <vector>
+
+#include "fhpack.h"
+
+#define IMAGE_SIZE          8192
+#define NUM_IMAGES          6
+
+static int gNumFailed = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "FAILED: %s:%d: %s\n", __FILE__, __LINE__, \
+                #cond); \
+            gNumFailed++; \
+        } \
+    } while (0)
+
+/*
+ * Fills "buf" with a test image: some solid bands and stripes, which
+ * compress well, and some noise, which doesn't.  "seed" picks which.
+ */
+static void makeImage(uint8_t* buf, unsigned int seed)
+{
+    unsigned int rand = seed * 2654435761u + 1;
+    for (int i = 0; i < IMAGE_SIZE; i++) {
+        rand = rand * 1103515245 + 12345;
+        switch ((i / 1024 + seed) % 4) {
+        case 0:
+            buf[i] = 0x00;
+            break;
+        case 1:
+            buf[i] = (i & 1) ? 0x2a : 0x55;
+            break;
+        case 2:
+            buf[i] = (uint8_t) (seed + (i % 40));
+            break;
+        default:
+            buf[i] = (uint8_t) (rand >> 16);
+            break;
+        }
+    }
+}
+
+/*
+ * Calls the completions until "*pCount" reaches "want".
+ */
+static void runUntil(AsyncExecutor* pExec, const int* pCount, int want)
+{
+    while (*pCount < want) {
+        struct pollfd pfd = { asyncWakeFd(pExec), POLLIN, 0 };
+        if (poll(&pfd, 1, 10000) <= 0) {
+            CHECK(!"timed out waiting for the executor");
+            return;
+        }
+        asyncRunCompletions(pExec);
+    }
+}
+
+/*
+ * Waits until the executor signals that a job has finished, without
+ * calling the completions.
+ */
+static bool waitForWake(AsyncExecutor* pExec)
+{
+    struct pollfd pfd = { asyncWakeFd(pExec), POLLIN, 0 };
+    return poll(&pfd, 1, 10000) == 1;
+}
+
+static bool fileExists(const char* fileName)
+{
+    return access(fileName, F_OK) == 0;
+}
+
+/*
+ * Where a callback puts what it got.
+ */
+struct JobResult {
+    int* pNumDone;
+    AsyncStatus status;
+    std::vector<uint8_t> data;
+};
+
+static void saveResult(AsyncJob* pJob, void* userData)
+{
+    JobResult* pResult = (JobResult*) userData;
+    pResult->status = asyncJobStatus(pJob);
+    size_t len;
+    const uint8_t* data = asyncJobOutput(pJob, &len);
+    if (pResult->status == ASYNC_OK) {
+        pResult->data.assign(data, data + len);
+    }
+    (*pResult->pNumDone)++;
+}
+
+/*
+ * Compresses a set of images, expands the results, and checks that
+ * they come back the same.
+ */
+static void testCallbacks(const uint8_t images[][IMAGE_SIZE])
+{
+    AsyncExecutor* pExec = asyncStart(2);
+    CHECK(pExec != NULL);
+    if (pExec == NULL) {
+        return;
+    }
+
+    static const AsyncOptions kOpts[] = {
+        { PARSE_OPTIMAL, 0, true, false },
+        { PARSE_GREEDY, FLAG_REPOFF | FLAG_STRIDE, true, true },
+        { PARSE_FAST, 0, true, false },
+    };
+    int numDone = 0;
+    JobResult packed[NUM_IMAGES];
+    for (int i = 0; i < NUM_IMAGES; i++) {
+        packed[i].pNumDone = &numDone;
+        packed[i].status = ASYNC_FAILED;
+        CHECK(asyncCompressBuffer(pExec, images[i], IMAGE_SIZE,
+                &kOpts[i % 3], saveResult, &packed[i]) != NULL);
+    }
+    runUntil(pExec, &numDone, NUM_IMAGES);
+
+    numDone = 0;
+    JobResult unpacked[NUM_IMAGES];
+    for (int i = 0; i < NUM_IMAGES; i++) {
+        CHECK(packed[i].status == ASYNC_OK);
+        unpacked[i].pNumDone = &numDone;
+        unpacked[i].status = ASYNC_FAILED;
+        CHECK(asyncDecompressBuffer(pExec, packed[i].data.data(),
+                packed[i].data.size(), saveResult, &unpacked[i]) != NULL);
+    }
+    runUntil(pExec, &numDone, NUM_IMAGES);
+
+    for (int i = 0; i < NUM_IMAGES; i++) {
+        CHECK(unpacked[i].status == ASYNC_OK);
+        CHECK(unpacked[i].data.size() == IMAGE_SIZE &&
+            memcmp(unpacked[i].data.data(), images[i], IMAGE_SIZE) == 0);
+    }
+
+    // Bad input is refused up front, or fails in the executor.
+    CHECK(asyncCompressBuffer(pExec, images[0], 100, &kOpts[0],
+            saveResult, &packed[0]) == NULL);
+    uint8_t junk[64];
+    memset(junk, 0xee, sizeof(junk));
+    numDone = 0;
+    CHECK(asyncDecompressBuffer(pExec, junk, sizeof(junk), saveResult,
+            &unpacked[0]) != NULL);
+    runUntil(pExec, &numDone, 1);
+    CHECK(unpacked[0].status == ASYNC_FAILED);
+
+    asyncStop(pExec);
+}
+
+/*
+ * Cancels jobs in the queue, a job that finished but hasn't had its
+ * callback called, and whatever is left when the executor stops.
+ */
+static void testCancel(const uint8_t images[][IMAGE_SIZE], const char* dir)
+{
+    static const AsyncOptions kOpts = { PARSE_OPTIMAL, 0, false, false };
+
+    // One thread, so the later jobs wait in the queue.  Every cancelled
+    // job must report ASYNC_CANCELLED, whether it had started or not.
+    AsyncExecutor* pExec = asyncStart(1);
+    CHECK(pExec != NULL);
+    if (pExec == NULL) {
+        return;
+    }
+    int numDone = 0;
+    JobResult results[NUM_IMAGES];
+    AsyncJob* jobs[NUM_IMAGES];
+    for (int i = 0; i < NUM_IMAGES; i++) {
+        results[i].pNumDone = &numDone;
+        results[i].status = ASYNC_FAILED;
+        jobs[i] = asyncCompressBuffer(pExec, images[i], IMAGE_SIZE, &kOpts,
+                saveResult, &results[i]);
+        CHECK(jobs[i] != NULL);
+    }
+    CHECK(asyncCancel(pExec, jobs[NUM_IMAGES - 1]));
+    for (int i = 1; i < NUM_IMAGES - 1; i += 2) {
+        asyncCancel(pExec, jobs[i]);
+    }
+    runUntil(pExec, &numDone, NUM_IMAGES);
+    for (int i = 0; i < NUM_IMAGES - 1; i++) {
+        CHECK(results[i].status == (i % 2 ? ASYNC_CANCELLED : ASYNC_OK));
+    }
+    CHECK(results[NUM_IMAGES - 1].status == ASYNC_CANCELLED);
+
+    // A job that has finished, but whose completion hasn't run, can
+    // still be cancelled, and must not write its output file.
+    char inName[256], outName[256];
+    snprintf(inName, sizeof(inName), "%s/image", dir);
+    snprintf(outName, sizeof(outName), "%s/image.lz4fh", dir);
+    FILE* fp = fopen(inName, "wb");
+    CHECK(fp != NULL);
+    if (fp == NULL) {
+        asyncStop(pExec);
+        return;
+    }
+    fwrite(images[0], 1, IMAGE_SIZE, fp);
+    fclose(fp);
+
+    // A worker wakes the loop just after it queues a completion, so a
+    // wakeup from the jobs above may still be on its way.  Let it land
+    // and clear it before waiting on this one.
+    usleep(100000);
+    asyncRunCompletions(pExec);
+
+    numDone = 0;
+    AsyncJob* pJob = asyncCompressFile(pExec, inName, outName, &kOpts,
+            saveResult, &results[0]);
+    CHECK(pJob != NULL);
+    CHECK(waitForWake(pExec));
+    CHECK(!asyncCancel(pExec, pJob));
+    runUntil(pExec, &numDone, 1);
+    CHECK(results[0].status == ASYNC_CANCELLED);
+    CHECK(!fileExists(outName));
+
+    // Without the cancel, the file is written.
+    numDone = 0;
+    CHECK(asyncCompressFile(pExec, inName, outName, &kOpts, saveResult,
+            &results[0]) != NULL);
+    runUntil(pExec, &numDone, 1);
+    CHECK(results[0].status == ASYNC_OK);
+    CHECK(fileExists(outName));
+    unlink(outName);
+
+    // Jobs still queued when the executor stops are cancelled.
+    numDone = 0;
+    for (int i = 0; i < NUM_IMAGES; i++) {
+        results[i].status = ASYNC_FAILED;
+        CHECK(asyncCompressBuffer(pExec, images[i], IMAGE_SIZE, &kOpts,
+                saveResult, &results[i]) != NULL);
+    }
+    asyncStop(pExec);
+    CHECK(numDone == NUM_IMAGES);
+    CHECK(results[NUM_IMAGES - 1].status == ASYNC_CANCELLED);
+    unlink(inName);
+}
+
+#if defined(__cpp_impl_coroutine)
+/*
+ * Minimal coroutine type: starts right away, and nothing waits for it.
+ */
+struct TestTask {
+    struct promise_type {
+        TestTask get_return_object() { return TestTask(); }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { abort(); }
+    };
+};
+
+/*
+ * Compresses an image and expands it again with co_await.
+ */
+static TestTask roundTrip(AsyncExecutor* pExec, const uint8_t* image,
+    int* pNumDone)
+{
+    AsyncOptions opts = { PARSE_OPTIMAL, FLAG_XOR, true, true };
+    AsyncResult packed = co_await asyncCompress(pExec, image, IMAGE_SIZE,
+            &opts);
+    CHECK(packed.status == ASYNC_OK);
+    if (packed.status == ASYNC_OK) {
+        AsyncResult unpacked = co_await asyncDecompress(pExec,
+                packed.data.data(), packed.data.size());
+        CHECK(unpacked.status == ASYNC_OK);
+        CHECK(unpacked.data.size() == IMAGE_SIZE &&
+            memcmp(unpacked.data.data(), image, IMAGE_SIZE) == 0);
+    }
+
+    // Data that can't be submitted resumes right away, with a failure.
+    AsyncResult bad = co_await asyncDecompress(pExec, image, 5);
+    CHECK(bad.status == ASYNC_FAILED);
+    (*pNumDone)++;
+}
+
+static void testCoroutines(const uint8_t images[][IMAGE_SIZE])
+{
+    AsyncExecutor* pExec = asyncStart(2);
+    CHECK(pExec != NULL);
+    if (pExec == NULL) {
+        return;
+    }
+    int numDone = 0;
+    for (int i = 0; i < NUM_IMAGES; i++) {
+        roundTrip(pExec, images[i], &numDone);
+    }
+    runUntil(pExec, &numDone, NUM_IMAGES);
+    asyncStop(pExec);
+}
+#endif /*__cpp_impl_coroutine*/
+
+/*
+ * Entry point.
+ */
+int main()
+{
+    static uint8_t images[NUM_IMAGES][IMAGE_SIZE];
+    for (int i = 0; i < NUM_IMAGES; i++) {
+        makeImage(images[i], i);
+    }
+
+    char dir[] = "/tmp/fhpack-test.XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("Unable to create temp dir");
+        return 1;
+    }
+
+    testCallbacks(images);
+    testCancel(images, dir);
+#if defined(__cpp_impl_coroutine)
+    testCoroutines(images);
+#else
+    printf("No coroutine support; skipping the co_await test\n");
+#endif
+    rmdir(dir);
+
+    if (gNumFailed != 0) {
+        printf("%d checks failed\n", gNumFailed);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}